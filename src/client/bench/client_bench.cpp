@@ -0,0 +1,199 @@
+// Throughput and latency of MessageUClient operations against an in-process
+// FakeServer, so that the numbers only move when client-side code does.
+//
+//   client_bench [--iterations N] [--latency-us N] [--clients N]
+//                [--pending N] [--message-size N] [--unix PATH]
+//                [--send-iterations N] [--file-size N]
+//
+// Fetched records are SYMMETRIC_KEY_REQUESTs from table clients, which the
+// client delivers without decrypting. For the send benchmarks every table
+// client is given the same valid RSA public key and a symmetric key up front.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "fake_server.hpp"
+#include "messageu_client.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+void bench(const std::string& name,
+           size_t iterations,
+           const std::function<void()>& op) {
+  std::vector<double> latencies;
+  latencies.reserve(iterations);
+  auto begin = Clock::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    auto start = Clock::now();
+    op();
+    latencies.push_back(
+        std::chrono::duration<double, std::micro>(Clock::now() - start)
+            .count());
+  }
+  double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << std::fixed << std::setprecision(1) << std::left
+            << std::setw(14) << name << std::right << std::setw(10)
+            << iterations / seconds << " ops/s  p50 "
+            << latencies[latencies.size() / 2] << " us  p99 "
+            << latencies[latencies.size() * 99 / 100] << " us\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t iterations = 10000;
+  size_t send_iterations = 10;
+  size_t file_size = 16 * 1024 * 1024;
+  FakeServer::Options options;
+  options.clients = 100;
+  options.pending_messages = 10;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      std::cerr << "usage: client_bench [--iterations N] [--latency-us N] "
+                   "[--clients N] [--pending N] [--message-size N] "
+                   "[--unix PATH] [--send-iterations N] [--file-size N]\n";
+      return 1;
+    }
+    std::string value = argv[++i];
+    if (arg == "--iterations") {
+      iterations = std::stoul(value);
+    } else if (arg == "--latency-us") {
+      options.latency = std::chrono::microseconds(std::stoul(value));
+    } else if (arg == "--clients") {
+      options.clients = std::stoul(value);
+    } else if (arg == "--pending") {
+      options.pending_messages = std::stoul(value);
+    } else if (arg == "--message-size") {
+      options.message_size = std::stoul(value);
+    } else if (arg == "--unix") {
+      options.unix_path = value;
+    } else if (arg == "--send-iterations") {
+      send_iterations = std::stoul(value);
+    } else if (arg == "--file-size") {
+      file_size = std::stoul(value);
+    } else {
+      std::cerr << "Unknown option: " << arg << "\n";
+      return 1;
+    }
+  }
+  if (iterations == 0 || send_iterations == 0 || options.clients == 0) {
+    std::cerr << "iterations and clients must be positive\n";
+    return 1;
+  }
+  options.message_type =
+      static_cast<uint8_t>(ProtocolMessage::MessageType::SYMMETRIC_KEY_REQUEST);
+
+  try {
+    FakeServer server(options);
+    server.start();
+    auto model = std::make_unique<ClientModel>(server.host(), server.port());
+    RSAPrivateWrapper peer_key;
+    std::string peer_public_key = peer_key.getPublicKey();
+    std::vector<ClientListEntry> peers(server.client_ids().size());
+    for (size_t i = 0; i < peers.size(); ++i) {
+      peers[i].id = server.client_ids()[i];
+      peers[i].name = "client" + std::to_string(i);
+      peers[i].public_key.assign(peer_public_key.begin(),
+                                 peer_public_key.end());
+      peers[i].has_valid_public_key = true;
+      peers[i].symmetric_key.assign(ProtocolMessage::SYM_KEY_SIZE, 'k');
+      peers[i].has_valid_symmetric_key = true;
+    }
+    // Keys survive the list refreshes below
+    model->set_client_list(peers);
+    MessageUClient client(std::move(model));
+    client.connect().get();
+
+    std::cout << server.endpoint() << ", " << options.clients
+              << " clients, " << options.pending_messages
+              << " pending records of " << options.message_size
+              << " bytes, " << options.latency.count()
+              << " us server latency\n";
+    bench("list_clients", iterations, [&] { client.list_clients().get(); });
+    bench("public_key", iterations,
+          [&] { client.request_public_key("client0").get(); });
+    bench("fetch_pending", iterations, [&] {
+      std::vector<PendingMessage> messages = client.fetch_pending().get();
+      if (messages.size() != options.pending_messages)
+        throw std::runtime_error("Unexpected pending message count");
+    });
+    // Small frames, where the header is most of the bytes
+    const std::string short_text = "on my way";
+    bench("send_text", iterations,
+          [&] { client.send_text("client1", short_text).get(); });
+
+    // The same with the 23-byte version 1 request headers
+    MessageUClient::Options v1;
+    v1.max_framing_version = framing::V1;
+    auto v1_model =
+        std::make_unique<ClientModel>(server.host(), server.port());
+    v1_model->set_client_list(peers);
+    MessageUClient v1_client(std::move(v1_model), v1);
+    bench("send_text_v1", iterations,
+          [&] { v1_client.send_text("client1", short_text).get(); });
+    bench("list_v1", iterations, [&] { v1_client.list_clients().get(); });
+
+    std::string file_path = "client_bench.tmp";
+    {
+      std::ofstream file(file_path, std::ios::binary);
+      std::vector<char> chunk(1024 * 1024, 'x');
+      for (size_t left = file_size; left > 0;) {
+        size_t n = std::min(left, chunk.size());
+        file.write(chunk.data(), n);
+        left -= n;
+      }
+    }
+    bench("send_file", send_iterations,
+          [&] { client.send_file("client0", file_path).get(); });
+    std::remove(file_path.c_str());
+    bench("sym_key_all", send_iterations, [&] {
+      // public_key above replaced client0's key with the fake, unusable one
+      MessageUClient::SymKeyBroadcast sent =
+          client.send_symmetric_key_to_all().get();
+      if (sent.sent + sent.skipped.size() != options.clients)
+        throw std::runtime_error("Unexpected symmetric key count");
+    });
+
+    // The same backlog in a single reply
+    MessageUClient::Options whole;
+    whole.pending_page_messages = 0;
+    MessageUClient whole_client(
+        std::make_unique<ClientModel>(server.host(), server.port()), whole);
+    whole_client.list_clients().get();
+    bench("fetch_whole", iterations, [&] {
+      if (whole_client.fetch_pending().get().size() !=
+          options.pending_messages)
+        throw std::runtime_error("Unexpected pending message count");
+    });
+
+    // A new client knows none of the senders, so its first fetch looks them
+    // up (CLIENT_LOOKUP_REQUEST); connecting is part of the measurement
+    bench("first_fetch", send_iterations, [&] {
+      MessageUClient fresh(
+          std::make_unique<ClientModel>(server.host(), server.port()));
+      std::vector<PendingMessage> messages = fresh.fetch_pending().get();
+      if (messages.size() != options.pending_messages)
+        throw std::runtime_error("Unexpected pending message count");
+      for (const PendingMessage& message : messages) {
+        if (!message.error.empty() || message.sender_name.empty())
+          throw std::runtime_error("Sender was not looked up");
+      }
+    });
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,459 @@
+#include "fake_server.hpp"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include "protocol_message.hpp"
+#include "protocol_schema.hpp"
+#include "protocol_server_response.hpp"
+
+namespace {
+
+constexpr size_t READ_BUFFER_SIZE = 64 * 1024;
+// Replies are batched while pipelined requests are still buffered
+constexpr size_t WRITE_FLUSH_SIZE = 64 * 1024;
+
+void append_header(std::vector<uint8_t>& out,
+                   uint8_t framing,
+                   uint16_t code,
+                   size_t payload_size) {
+  if (framing == framing::V1) {
+    size_t pos = out.size();
+    out.resize(pos + schema::ResponseHeader::size);
+    schema::ResponseHeader::pack(out.data() + pos, framing::V1, code,
+                                 static_cast<uint32_t>(payload_size));
+    return;
+  }
+  uint8_t header[2 * framing::MAX_VARINT_SIZE];
+  size_t size = framing::put_varint(header, code);
+  size += framing::put_varint(header + size,
+                              static_cast<uint32_t>(payload_size));
+  out.insert(out.end(), header, header + size);
+}
+
+void append_reply(std::vector<uint8_t>& out,
+                  uint8_t framing,
+                  uint16_t code,
+                  const uint8_t* payload,
+                  size_t payload_size) {
+  append_header(out, framing, code, payload_size);
+  out.insert(out.end(), payload, payload + payload_size);
+}
+
+bool write_all(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+}  // namespace
+
+FakeServer::FakeServer(const Options& options) : m_options(options) {}
+
+FakeServer::~FakeServer() {
+  stop();
+}
+
+void FakeServer::start() {
+  // Tables are seeded with a constant so that every run sees the same data
+  std::mt19937 rng(1357);
+  auto random_bytes = [&rng](uint8_t* out, size_t size) {
+    for (size_t i = 0; i < size; ++i)
+      out[i] = static_cast<uint8_t>(rng());
+  };
+
+  m_client_ids.resize(m_options.clients);
+  m_public_keys.assign(m_options.clients,
+                       std::vector<uint8_t>(schema::PUBLIC_KEY_SIZE));
+  m_client_list_reply.assign(m_options.clients * schema::ClientListEntry::size,
+                             0);
+  for (size_t i = 0; i < m_options.clients; ++i) {
+    random_bytes(m_client_ids[i].data(), m_client_ids[i].size());
+    random_bytes(m_public_keys[i].data(), m_public_keys[i].size());
+    std::array<uint8_t, schema::CLIENT_NAME_SIZE> name{};
+    std::string text = "client" + std::to_string(i);
+    std::copy(text.begin(), text.end(), name.begin());
+    schema::ClientListEntry::pack(
+        m_client_list_reply.data() + i * schema::ClientListEntry::size,
+        m_client_ids[i], name);
+  }
+
+  using Record = schema::PendingMessageRecord;
+  m_pending_reply.assign(
+      m_options.pending_messages * (Record::size + m_options.message_size), 0);
+  uint8_t* record = m_pending_reply.data();
+  m_pending_offsets.clear();
+  for (size_t i = 0; i < m_options.pending_messages; ++i) {
+    m_pending_offsets.push_back(record - m_pending_reply.data());
+    Id from{};
+    if (!m_client_ids.empty())
+      from = m_client_ids[i % m_client_ids.size()];
+    Record::pack(record, from, static_cast<uint32_t>(i + 1),
+                 m_options.message_type,
+                 static_cast<uint32_t>(m_options.message_size));
+    random_bytes(record + Record::size, m_options.message_size);
+    record += Record::size + m_options.message_size;
+  }
+  m_pending_offsets.push_back(m_pending_reply.size());
+
+  // Every error path closes the socket it opened
+  auto fail = [this](const std::string& what) {
+    std::string error = what + ": " + std::strerror(errno);
+    if (m_listen_fd >= 0)
+      ::close(m_listen_fd);
+    m_listen_fd = -1;
+    throw std::runtime_error(error);
+  };
+  if (m_options.unix_path.empty()) {
+    m_listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (m_listen_fd < 0)
+      fail("Fake server cannot create a socket");
+    int one = 1;
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(m_options.port);
+    if (::bind(m_listen_fd, reinterpret_cast<sockaddr*>(&addr),
+               sizeof(addr)) != 0)
+      fail("Fake server cannot bind port " + std::to_string(m_options.port));
+    socklen_t len = sizeof(addr);
+    getsockname(m_listen_fd, reinterpret_cast<sockaddr*>(&addr), &len);
+    m_bound_port = ntohs(addr.sin_port);
+  } else {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    // Checked before there is a socket to leak
+    if (m_options.unix_path.size() >= sizeof(addr.sun_path))
+      throw std::runtime_error("Unix socket path too long");
+    std::strcpy(addr.sun_path, m_options.unix_path.c_str());
+    m_listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m_listen_fd < 0)
+      fail("Fake server cannot create a socket");
+    ::unlink(m_options.unix_path.c_str());
+    if (::bind(m_listen_fd, reinterpret_cast<sockaddr*>(&addr),
+               sizeof(addr)) != 0)
+      fail("Fake server cannot bind " + m_options.unix_path);
+  }
+  if (::listen(m_listen_fd, SOMAXCONN) != 0)
+    fail("Fake server cannot listen");
+  m_running = true;
+  m_accept_thread = std::thread(&FakeServer::accept_loop, this);
+}
+
+void FakeServer::stop() {
+  if (!m_running.exchange(false))
+    return;
+  // Unblocks accept() and every connection's recv()
+  ::shutdown(m_listen_fd, SHUT_RDWR);
+  m_accept_thread.join();
+  ::close(m_listen_fd);
+  if (!m_options.unix_path.empty())
+    ::unlink(m_options.unix_path.c_str());
+
+  std::lock_guard<std::mutex> lock(m_connections_mutex);
+  for (int fd : m_connection_fds)
+    ::shutdown(fd, SHUT_RDWR);
+  for (std::thread& thread : m_connection_threads)
+    thread.join();
+  for (int fd : m_connection_fds)
+    ::close(fd);
+  m_connection_fds.clear();
+  m_connection_threads.clear();
+}
+
+std::string FakeServer::endpoint() const {
+  return host() + ":" + port();
+}
+
+std::string FakeServer::host() const {
+  return m_options.unix_path.empty() ? "127.0.0.1" : "unix";
+}
+
+std::string FakeServer::port() const {
+  return m_options.unix_path.empty() ? std::to_string(m_bound_port)
+                                     : m_options.unix_path;
+}
+
+void FakeServer::accept_loop() {
+  while (m_running) {
+    int fd = ::accept(m_listen_fd, nullptr, nullptr);
+    if (fd < 0)
+      return;
+    if (m_options.unix_path.empty()) {
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    std::lock_guard<std::mutex> lock(m_connections_mutex);
+    m_connection_fds.push_back(fd);
+    m_connection_threads.emplace_back(&FakeServer::serve, this, fd);
+  }
+}
+
+void FakeServer::serve(int fd) {
+  // The longest payload prefix any reply looks at
+  constexpr size_t PREFIX_SIZE = schema::SendMessagePrefix::size;
+  uint8_t framing = framing::V1;
+
+  std::vector<uint8_t> in(READ_BUFFER_SIZE);
+  size_t begin = 0;
+  size_t end = 0;
+  size_t page_cursor = 0;
+  std::vector<uint8_t> out;
+  out.reserve(WRITE_FLUSH_SIZE + m_pending_reply.size() +
+              m_client_list_reply.size());
+
+  // Makes `need` bytes available at in[begin], flushing the batched replies
+  // before blocking. False once the client is gone.
+  auto fill = [&](size_t need) {
+    if (end - begin >= need)
+      return true;
+    if (begin > 0) {
+      std::memmove(in.data(), in.data() + begin, end - begin);
+      end -= begin;
+      begin = 0;
+    }
+    if (in.size() < need)
+      in.resize(need);
+    while (end < need) {
+      if (!out.empty()) {
+        if (!write_all(fd, out.data(), out.size()))
+          return false;
+        out.clear();
+      }
+      ssize_t n = ::recv(fd, in.data() + end, in.size() - end, 0);
+      if (n <= 0)
+        return false;
+      end += n;
+    }
+    return true;
+  };
+
+  // Parses the request header at in[begin], reading more as needed. Version
+  // 2 tokens are not checked, no reply depends on the client id.
+  size_t header_size = 0;
+  uint16_t code = 0;
+  uint32_t payload_size = 0;
+  auto read_header = [&] {
+    if (framing == framing::V1) {
+      if (!fill(schema::RequestHeader::size))
+        return false;
+      header_size = schema::RequestHeader::size;
+      code = schema::RequestHeader::get<2>(in.data() + begin);
+      payload_size = schema::RequestHeader::get<3>(in.data() + begin);
+      return true;
+    }
+    // Varints: session, code, payload size, with the client id after a
+    // session that binds one
+    uint32_t fields[3];
+    size_t pos = 0;
+    for (size_t field = 0; field < 3;) {
+      if (end - begin <= pos && !fill(pos + 1))
+        return false;
+      size_t n = framing::get_varint(in.data() + begin + pos,
+                                     end - begin - pos, fields[field]);
+      if (n == 0) {
+        if (!fill(end - begin + 1))
+          return false;
+        continue;
+      }
+      pos += n;
+      if (field == 0 && (fields[0] & 1))
+        pos += schema::UUID_SIZE;
+      ++field;
+    }
+    if (!fill(pos))
+      return false;
+    header_size = pos;
+    code = static_cast<uint16_t>(fields[1]);
+    payload_size = fields[2];
+    return true;
+  };
+
+  while (read_header()) {
+    // A lookup answers every id in it, so it is read whole
+    size_t prefix = code == REQUEST_CODES::CLIENT_LOOKUP_REQUEST
+                        ? payload_size
+                        : std::min<size_t>(payload_size, PREFIX_SIZE);
+    if (!fill(header_size + prefix))
+      return;
+    handle(code, in.data() + begin + header_size, prefix, page_cursor,
+           framing, out);
+    ++m_requests;
+
+    // Drop the rest of the payload without keeping it
+    size_t skip = header_size + payload_size;
+    while (skip > 0) {
+      if (begin == end && !fill(1))
+        return;
+      size_t n = std::min(skip, end - begin);
+      begin += n;
+      skip -= n;
+    }
+    if (out.size() >= WRITE_FLUSH_SIZE) {
+      if (!write_all(fd, out.data(), out.size()))
+        return;
+      out.clear();
+    }
+  }
+}
+
+void FakeServer::handle(uint16_t code,
+                        const uint8_t* payload,
+                        size_t payload_prefix,
+                        size_t& page_cursor,
+                        uint8_t& framing,
+                        std::vector<uint8_t>& out) {
+  wait_latency();
+  switch (code) {
+    case REQUEST_CODES::REGISTER: {
+      Id id{};
+      schema::U32::write(id.data() + id.size() - schema::U32::size,
+                         m_next_client++);
+      append_reply(out, framing, RESPONSE_CODES::REGISTER_REPLY, id.data(), id.size());
+      break;
+    }
+    case REQUEST_CODES::CLIENT_LIST:
+      append_reply(out, framing, RESPONSE_CODES::LIST_CLIENTS_REPLY,
+                   m_client_list_reply.data(), m_client_list_reply.size());
+      break;
+    case REQUEST_CODES::PUBLIC_KEY_REQUEST: {
+      auto it = m_client_ids.end();
+      if (payload_prefix == schema::UUID_SIZE) {
+        it = std::find_if(m_client_ids.begin(), m_client_ids.end(),
+                          [payload](const Id& id) {
+                            return std::equal(id.begin(), id.end(), payload);
+                          });
+      }
+      if (it == m_client_ids.end()) {
+        append_reply(out, framing, RESPONSE_CODES::ERROR_REPLY, nullptr, 0);
+        break;
+      }
+      std::array<uint8_t, schema::PublicKeyReply::size> reply;
+      const std::vector<uint8_t>& key = m_public_keys[it - m_client_ids.begin()];
+      std::array<uint8_t, schema::PUBLIC_KEY_SIZE> key_field;
+      std::copy(key.begin(), key.end(), key_field.begin());
+      schema::PublicKeyReply::pack(reply.data(), *it, key_field);
+      append_reply(out, framing, RESPONSE_CODES::PUBLIC_KEY_REPLY, reply.data(),
+                   reply.size());
+      break;
+    }
+    case REQUEST_CODES::CLIENT_LOOKUP_REQUEST: {
+      if (payload_prefix % schema::ClientLookupId::size != 0) {
+        append_reply(out, framing, RESPONSE_CODES::ERROR_REPLY, nullptr, 0);
+        break;
+      }
+      // Known ids in request order, unknown ones are left out
+      std::vector<size_t> found;
+      for (size_t offset = 0; offset < payload_prefix;
+           offset += schema::ClientLookupId::size) {
+        const uint8_t* wanted = payload + offset;
+        auto it = std::find_if(m_client_ids.begin(), m_client_ids.end(),
+                               [wanted](const Id& id) {
+                                 return std::equal(id.begin(), id.end(),
+                                                   wanted);
+                               });
+        if (it != m_client_ids.end())
+          found.push_back(it - m_client_ids.begin());
+      }
+      using Entry = schema::ClientLookupEntry;
+      append_header(out, framing, RESPONSE_CODES::CLIENT_LOOKUP_REPLY,
+                    found.size() * Entry::size);
+      for (size_t index : found) {
+        std::array<uint8_t, schema::PUBLIC_KEY_SIZE> key_field;
+        std::copy(m_public_keys[index].begin(), m_public_keys[index].end(),
+                  key_field.begin());
+        size_t at = out.size();
+        out.resize(at + Entry::size);
+        Entry::pack(out.data() + at, m_client_ids[index],
+                    schema::ClientListEntry::get<1>(
+                        m_client_list_reply.data() +
+                        index * schema::ClientListEntry::size),
+                    key_field);
+      }
+      break;
+    }
+    case REQUEST_CODES::SEND_MESSAGE: {
+      if (payload_prefix < schema::SendMessagePrefix::size) {
+        append_reply(out, framing, RESPONSE_CODES::ERROR_REPLY, nullptr, 0);
+        break;
+      }
+      std::array<uint8_t, schema::SendMessageReply::size> reply;
+      schema::SendMessageReply::pack(
+          reply.data(), schema::SendMessagePrefix::get<0>(payload),
+          m_next_message++);
+      append_reply(out, framing, RESPONSE_CODES::SEND_MESSAGE_REPLY, reply.data(),
+                   reply.size());
+      break;
+    }
+    case REQUEST_CODES::PENDING_MESSAGE_REQUEST:
+      append_reply(out, framing, RESPONSE_CODES::PENDING_MESSAGES_REPLY,
+                   m_pending_reply.data(), m_pending_reply.size());
+      break;
+    case REQUEST_CODES::SUBSCRIBE:
+      append_reply(out, framing, RESPONSE_CODES::SUBSCRIBE_REPLY, nullptr, 0);
+      break;
+    case REQUEST_CODES::PENDING_MESSAGE_PAGE_REQUEST: {
+      if (payload_prefix < schema::PendingPageRequest::size) {
+        append_reply(out, framing, RESPONSE_CODES::ERROR_REPLY, nullptr, 0);
+        break;
+      }
+      auto [max_messages, max_bytes] =
+          schema::PendingPageRequest::unpack(payload);
+      // At least one record per page, like the real server
+      size_t first = page_cursor;
+      size_t last = std::min(first + 1, m_options.pending_messages);
+      while (last < m_options.pending_messages &&
+             (max_messages == 0 || last - first < max_messages) &&
+             (max_bytes == 0 || m_pending_offsets[last + 1] -
+                                        m_pending_offsets[first] <=
+                                    max_bytes))
+        ++last;
+      uint8_t more = last < m_options.pending_messages;
+      page_cursor = more ? last : 0;
+
+      size_t records = m_pending_offsets[last] - m_pending_offsets[first];
+      append_header(out, framing, RESPONSE_CODES::PENDING_MESSAGES_PAGE_REPLY,
+                    schema::PendingPageReplyPrefix::size + records);
+      out.push_back(more);
+      out.insert(out.end(),
+                 m_pending_reply.begin() + m_pending_offsets[first],
+                 m_pending_reply.begin() + m_pending_offsets[last]);
+      break;
+    }
+    case REQUEST_CODES::FRAMING_REQUEST: {
+      if (payload_prefix < schema::FramingRequest::size ||
+          m_options.max_framing_version <= framing::V1) {
+        append_reply(out, framing, RESPONSE_CODES::ERROR_REPLY, nullptr, 0);
+        break;
+      }
+      uint8_t version = std::min(schema::FramingRequest::get<0>(payload),
+                                 m_options.max_framing_version);
+      append_reply(out, framing, RESPONSE_CODES::FRAMING_REPLY, &version,
+                   sizeof(version));
+      framing = version;
+      break;
+    }
+    default:
+      append_reply(out, framing, RESPONSE_CODES::ERROR_REPLY, nullptr, 0);
+      break;
+  }
+}
+
+void FakeServer::wait_latency() const {
+  if (m_options.latency.count() == 0)
+    return;
+  auto deadline = std::chrono::steady_clock::now() + m_options.latency;
+  while (std::chrono::steady_clock::now() < deadline) {
+  }
+}
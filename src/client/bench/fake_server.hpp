@@ -0,0 +1,105 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "framing.hpp"
+
+// Minimal MessageU server for client benchmarks. Every request code is
+// answered from in-memory tables built at start(), with no logging and no
+// per-request allocation, so client-side costs can be measured without the
+// noise of the Python server.
+//
+// The server runs on its own threads inside the calling process and listens
+// on loopback TCP (an ephemeral port by default) or on a Unix domain socket,
+// so any client, in-process or not, can reach it through endpoint().
+//
+// Replies:
+//   REGISTER            fresh id, counting up from 1
+//   CLIENT_LIST         the `clients` table entries, "client0".."clientN-1"
+//   PUBLIC_KEY_REQUEST  the table entry's key, ERROR_REPLY for unknown ids
+//   SEND_MESSAGE        SEND_MESSAGE_REPLY, the content is discarded
+//   PENDING_MESSAGE     `pending_messages` records from table clients
+//   PENDING_MESSAGE_PAGE  the same records, paged; each connection walks the
+//                       table and starts over once it reported no more
+//   SUBSCRIBE           SUBSCRIBE_REPLY, nothing is pushed afterwards
+//   FRAMING_REQUEST     FRAMING_REPLY up to Options::max_framing_version,
+//                       ERROR_REPLY when that is 1, as from an old server
+//   anything else       ERROR_REPLY
+class FakeServer {
+ public:
+  struct Options {
+    // Added before every reply. Waits are spun, not slept, so that short
+    // latencies are exact.
+    std::chrono::microseconds latency{0};
+    size_t clients = 16;
+    size_t pending_messages = 0;
+    size_t message_size = 64;
+    uint8_t message_type = 1;  // ProtocolMessage::MessageType
+    uint16_t port = 0;         // 0 picks a free port
+    std::string unix_path;     // listen here instead of on TCP when set
+    uint8_t max_framing_version = framing::MAX_VERSION;
+  };
+  using Id = std::array<uint8_t, 16>;
+
+  explicit FakeServer(const Options& options);
+  // Stops the server and closes every connection
+  ~FakeServer();
+  FakeServer(const FakeServer& other) = delete;
+  FakeServer& operator=(const FakeServer& other) = delete;
+
+  // Builds the tables and starts listening. Throws if the address is taken.
+  void start();
+  void stop();
+
+  // server.info style address: "127.0.0.1:PORT" or "unix:PATH"
+  std::string endpoint() const;
+  std::string host() const;
+  std::string port() const;
+
+  // The fake client table, ids in list order
+  const std::vector<Id>& client_ids() const { return m_client_ids; }
+  uint64_t requests_served() const { return m_requests; }
+
+ private:
+  void accept_loop();
+  void serve(int fd);
+  // Appends the reply to one request to `out`. `payload` holds the first
+  // `payload_prefix` bytes of the payload, which is all any reply needs.
+  // `page_cursor` is the connection's next pending record, `framing` its
+  // framing version.
+  void handle(uint16_t code,
+              const uint8_t* payload,
+              size_t payload_prefix,
+              size_t& page_cursor,
+              uint8_t& framing,
+              std::vector<uint8_t>& out);
+  void wait_latency() const;
+
+  Options m_options;
+  int m_listen_fd = -1;
+  uint16_t m_bound_port = 0;
+
+  std::vector<Id> m_client_ids;
+  std::vector<std::vector<uint8_t>> m_public_keys;
+  // Pre-built reply payloads
+  std::vector<uint8_t> m_client_list_reply;
+  std::vector<uint8_t> m_pending_reply;
+  // Offset of every record in m_pending_reply, plus its end
+  std::vector<size_t> m_pending_offsets;
+
+  std::atomic<uint32_t> m_next_client{1};
+  std::atomic<uint32_t> m_next_message{1};
+  std::atomic<uint64_t> m_requests{0};
+  std::atomic<bool> m_running{false};
+
+  std::thread m_accept_thread;
+  std::mutex m_connections_mutex;
+  std::vector<int> m_connection_fds;
+  std::vector<std::thread> m_connection_threads;
+};
@@ -0,0 +1,76 @@
+// Runs FakeServer as a standalone process, for benchmarking clients that do
+// not link it, e.g. tcp_client itself.
+//
+//   fake_server [--port N | --unix PATH] [--latency-us N] [--clients N]
+//               [--pending N] [--message-size N] [--message-type N]
+//
+// Prints the server.info line to use and serves until SIGINT or SIGTERM.
+
+#include <signal.h>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include "fake_server.hpp"
+
+namespace {
+
+void print_usage() {
+  std::cerr << "usage: fake_server [--port N | --unix PATH] [--latency-us N] "
+               "[--clients N]\n"
+               "                   [--pending N] [--message-size N] "
+               "[--message-type N]\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  FakeServer::Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      print_usage();
+      return 1;
+    }
+    std::string value = argv[++i];
+    if (arg == "--port") {
+      options.port = static_cast<uint16_t>(std::stoul(value));
+    } else if (arg == "--unix") {
+      options.unix_path = value;
+    } else if (arg == "--latency-us") {
+      options.latency = std::chrono::microseconds(std::stoul(value));
+    } else if (arg == "--clients") {
+      options.clients = std::stoul(value);
+    } else if (arg == "--pending") {
+      options.pending_messages = std::stoul(value);
+    } else if (arg == "--message-size") {
+      options.message_size = std::stoul(value);
+    } else if (arg == "--message-type") {
+      options.message_type = static_cast<uint8_t>(std::stoul(value));
+    } else {
+      print_usage();
+      return 1;
+    }
+  }
+
+  // Blocked before start() so that the server threads inherit the mask and
+  // the signals are left to sigwait below
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  try {
+    FakeServer server(options);
+    server.start();
+    std::cout << server.endpoint() << std::endl;
+    int signal = 0;
+    sigwait(&signals, &signal);
+    server.stop();
+    std::cerr << server.requests_served() << " requests served\n";
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,567 @@
+// Long-running soak test against a running server. A pool of clients keeps
+// registering, exchanging public and symmetric keys, sending text messages
+// and fetching their pending messages until the duration is up, while the
+// process state is sampled at a fixed interval. Slow leaks and gradual
+// throughput decline show up as drift between the samples.
+//
+//   soak_bench [--server HOST:PORT] [--clients N] [--duration S]
+//              [--interval S] [--churn N] [--message-size N]
+//              [--server-pid PID] [--output FILE]
+//
+// Every client runs on its own thread with its own MessageUClient and
+// identity file in a temporary directory. Every `--churn` rounds a client
+// retires and registers a new identity, so the server keeps gaining clients
+// as it would in production; --churn 0 keeps the first identities.
+//
+// One CSV row per interval goes to stdout or --output: request rate and
+// latency percentiles (all requests, then p99 per request type), RSS and
+// open descriptors of this process and, with --server-pid, of the server,
+// and message counts. The server's queue length is estimated from the client
+// side: messages sent minus messages fetched. Messages that were addressed
+// to a retired client can never be fetched and are counted as orphaned; they
+// stay queued on a server that never drops them. A summary of the first and
+// last interval goes to stderr at the end.
+
+#include <unistd.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "messageu_client.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum Op { REGISTER, LIST_CLIENTS, PUBLIC_KEY, SEND_KEY, SEND_TEXT, FETCH };
+constexpr size_t OP_COUNT = 6;
+const char* const OP_NAMES[OP_COUNT] = {"register",  "list_clients",
+                                        "public_key", "send_key",
+                                        "send_text", "fetch"};
+
+// Client list refresh period, in rounds, besides the refreshes needed to
+// know a new client
+constexpr size_t LIST_EVERY = 20;
+// Consecutive failed rounds after which a client starts over as a new
+// identity on a new connection
+constexpr size_t MAX_FAILED_ROUNDS = 5;
+// Errors printed in full; the rest are only counted
+constexpr size_t PRINTED_ERRORS = 10;
+
+struct Options {
+  std::string host = "127.0.0.1";
+  std::string port = "1357";
+  size_t clients = 8;
+  std::chrono::seconds duration{60};
+  std::chrono::seconds interval{5};
+  size_t churn = 50;
+  size_t message_size = 256;
+  std::string server_pid;
+  std::string output;
+};
+
+// Latencies in log-spaced buckets, eight per power of two, so a run of any
+// length takes constant memory and percentiles are within 9%
+class Histogram {
+ public:
+  void add(double us) {
+    size_t bucket = static_cast<size_t>(std::log2(us + 1) * 8);
+    ++m_buckets[std::min(bucket, m_buckets.size() - 1)];
+    ++m_count;
+    m_max = std::max(m_max, us);
+  }
+  void merge(const Histogram& other) {
+    for (size_t i = 0; i < m_buckets.size(); ++i)
+      m_buckets[i] += other.m_buckets[i];
+    m_count += other.m_count;
+    m_max = std::max(m_max, other.m_max);
+  }
+  // Upper bound of the bucket holding quantile q, 0 when empty
+  double percentile(double q) const {
+    uint64_t rank = static_cast<uint64_t>(std::ceil(q * m_count));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < m_buckets.size(); ++i) {
+      seen += m_buckets[i];
+      if (seen >= rank && seen > 0)
+        return std::min(m_max, std::exp2((i + 1) / 8.0) - 1);
+    }
+    return 0;
+  }
+  uint64_t count() const { return m_count; }
+  double max() const { return m_max; }
+
+ private:
+  std::array<uint64_t, 256> m_buckets{};
+  uint64_t m_count = 0;
+  double m_max = 0;
+};
+
+struct ProcessSample {
+  long rss_kb = -1;
+  long fds = -1;
+};
+
+// -1 for what cannot be read, e.g. after the process exited
+ProcessSample sample_process(const std::string& pid) {
+  ProcessSample sample;
+  std::ifstream status("/proc/" + pid + "/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.rfind("VmRSS:", 0) == 0)
+      sample.rss_kb = std::stol(line.substr(6));
+  }
+  std::error_code error;
+  std::filesystem::directory_iterator it("/proc/" + pid + "/fd", error);
+  if (!error) {
+    sample.fds = 0;
+    for (; !error && it != std::filesystem::directory_iterator();
+         it.increment(error))
+      ++sample.fds;
+  }
+  return sample;
+}
+
+// State shared by the client threads and the sampler
+class SoakState {
+ public:
+  struct Interval {
+    Histogram all;
+    std::array<Histogram, OP_COUNT> ops;
+    uint64_t errors = 0;
+  };
+  struct Counts {
+    uint64_t registered = 0;
+    uint64_t sent = 0;
+    uint64_t fetched = 0;
+    uint64_t queued = 0;
+    uint64_t orphaned = 0;
+  };
+
+  void record(Op op, double us) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_interval.all.add(us);
+    m_interval.ops[op].add(us);
+  }
+
+  void record_error(const std::string& what) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_interval.errors;
+    if (++m_errors <= PRINTED_ERRORS)
+      std::cerr << "soak: " << what << "\n";
+  }
+
+  Interval take_interval() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Interval interval = m_interval;
+    m_interval = Interval();
+    return interval;
+  }
+
+  void enroll(const std::string& name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_mailboxes[name];
+    ++m_counts.registered;
+  }
+
+  void retire(const std::string& name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_mailboxes.find(name);
+    if (it == m_mailboxes.end())
+      return;
+    if (it->second.sent > it->second.fetched)
+      m_counts.orphaned += it->second.sent - it->second.fetched;
+    m_mailboxes.erase(it);
+  }
+
+  std::vector<std::string> live_clients() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<std::string> names;
+    names.reserve(m_mailboxes.size());
+    for (const auto& [name, mailbox] : m_mailboxes)
+      names.push_back(name);
+    return names;
+  }
+
+  // Counted before the request goes out, so that the recipient cannot fetch
+  // a message that is not counted yet; `count` -1 takes a failed one back
+  void sent_to(const std::string& name, int count = 1) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_counts.sent += count;
+    auto it = m_mailboxes.find(name);
+    if (it == m_mailboxes.end())
+      m_counts.orphaned += count;
+    else
+      it->second.sent += count;
+  }
+
+  void fetched(const std::string& name, uint64_t count) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_counts.fetched += count;
+    auto it = m_mailboxes.find(name);
+    if (it != m_mailboxes.end())
+      it->second.fetched += count;
+  }
+
+  Counts counts() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Counts counts = m_counts;
+    counts.queued = 0;
+    for (const auto& [name, mailbox] : m_mailboxes) {
+      if (mailbox.sent > mailbox.fetched)
+        counts.queued += mailbox.sent - mailbox.fetched;
+    }
+    return counts;
+  }
+
+ private:
+  struct Mailbox {
+    uint64_t sent = 0;
+    uint64_t fetched = 0;
+  };
+
+  mutable std::mutex m_mutex;
+  Interval m_interval;
+  uint64_t m_errors = 0;
+  std::map<std::string, Mailbox> m_mailboxes;  // of the live clients
+  Counts m_counts;
+};
+
+// One simulated user, run on its own thread
+class SoakClient {
+ public:
+  SoakClient(SoakState& state,
+             const Options& options,
+             const std::filesystem::path& dir,
+             size_t slot)
+      : m_state(state),
+        m_options(options),
+        m_dir(dir),
+        m_slot(slot),
+        m_rng(static_cast<uint32_t>(getpid() * 1000 + slot)) {}
+
+  void run(Clock::time_point deadline) {
+    size_t failed_rounds = 0;
+    while (Clock::now() < deadline) {
+      try {
+        if (!m_client || (m_options.churn && m_rounds >= m_options.churn)) {
+          retire();
+          enroll();
+        }
+        round();
+        failed_rounds = 0;
+      } catch (const std::exception& e) {
+        m_state.record_error(m_name + ": " + e.what());
+        if (++failed_rounds >= MAX_FAILED_ROUNDS) {
+          retire();
+          failed_rounds = 0;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+    }
+    retire();
+  }
+
+ private:
+  template <typename Future>
+  auto timed(Op op, Future future) {
+    auto start = Clock::now();
+    auto finish = [&] {
+      m_state.record(op, std::chrono::duration<double, std::micro>(
+                             Clock::now() - start)
+                             .count());
+    };
+    if constexpr (std::is_void_v<decltype(future.get())>) {
+      future.get();
+      finish();
+    } else {
+      auto result = future.get();
+      finish();
+      return result;
+    }
+  }
+
+  void enroll() {
+    m_name = "soak" + std::to_string(getpid()) + "-" +
+             std::to_string(m_slot) + "-" + std::to_string(m_generation++);
+    auto model = std::make_unique<ClientModel>(m_options.host, m_options.port);
+    model->set_me_info_path((m_dir / (m_name + ".info")).string());
+    m_client = std::make_unique<MessageUClient>(std::move(model));
+    auto start = Clock::now();
+    m_client->register_user(m_name).get();
+    m_state.record(REGISTER, std::chrono::duration<double, std::micro>(
+                                 Clock::now() - start)
+                                 .count());
+    m_state.enroll(m_name);
+    m_keyed.clear();
+    m_rounds = 0;
+  }
+
+  void retire() {
+    if (!m_client)
+      return;
+    m_state.retire(m_name);
+    m_client.reset();
+    std::filesystem::remove(m_dir / (m_name + ".info"));
+  }
+
+  void send(Op op, const std::string& to, std::future<void> future) {
+    try {
+      timed(op, std::move(future));
+    } catch (...) {
+      m_state.sent_to(to, -1);
+      throw;
+    }
+  }
+
+  void round() {
+    ++m_rounds;
+    std::vector<std::string> peers = m_state.live_clients();
+    peers.erase(std::remove(peers.begin(), peers.end(), m_name), peers.end());
+
+    // Refresh whenever a live client is unknown, so that its messages can
+    // be attributed when they are fetched below
+    bool stale = m_rounds % LIST_EVERY == 1;
+    for (size_t i = 0; i < peers.size() && !stale; ++i)
+      stale = !m_client->find_client(peers[i]);
+    if (stale)
+      timed(LIST_CLIENTS, m_client->list_clients());
+
+    std::shuffle(peers.begin(), peers.end(), m_rng);
+    if (!peers.empty() && m_client->find_client(peers[0])) {
+      const std::string& peer = peers[0];
+      if (!m_client->find_client(peer)->has_valid_public_key)
+        timed(PUBLIC_KEY, m_client->request_public_key(peer));
+      if (m_keyed.insert(peer).second) {
+        m_state.sent_to(peer);
+        send(SEND_KEY, peer, m_client->send_symmetric_key(peer));
+      }
+    }
+    // Text goes to a peer whose symmetric key has arrived
+    for (const std::string& peer : peers) {
+      std::optional<ClientListEntry> entry = m_client->find_client(peer);
+      if (!entry || !entry->has_valid_symmetric_key)
+        continue;
+      m_state.sent_to(peer);
+      send(SEND_TEXT, peer, m_client->send_text(peer, random_text()));
+      break;
+    }
+
+    size_t count = 0;
+    timed(FETCH, m_client->fetch_pending(
+                     [&count](const PendingMessage&) { ++count; }));
+    m_state.fetched(m_name, count);
+  }
+
+  std::string random_text() {
+    std::uniform_int_distribution<int> letter('a', 'z');
+    std::string text(m_options.message_size, ' ');
+    for (char& c : text)
+      c = static_cast<char>(letter(m_rng));
+    return text;
+  }
+
+  SoakState& m_state;
+  const Options& m_options;
+  std::filesystem::path m_dir;
+  size_t m_slot;
+  std::mt19937 m_rng;
+  std::unique_ptr<MessageUClient> m_client;
+  std::string m_name;
+  size_t m_generation = 0;
+  size_t m_rounds = 0;
+  std::set<std::string> m_keyed;  // peers that were sent our symmetric key
+};
+
+struct Row {
+  double seconds;
+  SoakState::Interval interval;
+  double interval_seconds;
+  ProcessSample client;
+  ProcessSample server;
+  SoakState::Counts counts;
+};
+
+void write_header(std::ostream& out) {
+  out << "time_s,requests,requests_per_s,errors,p50_us,p99_us,max_us";
+  for (const char* name : OP_NAMES)
+    out << "," << name << "_p99_us";
+  out << ",client_rss_kb,client_fds,server_rss_kb,server_fds,registered,"
+         "sent,fetched,queued,orphaned\n";
+}
+
+void write_row(std::ostream& out, const Row& row) {
+  const SoakState::Interval& interval = row.interval;
+  out << std::fixed << std::setprecision(1) << row.seconds << ","
+      << interval.all.count() << ","
+      << interval.all.count() / row.interval_seconds << "," << interval.errors
+      << "," << interval.all.percentile(0.5) << ","
+      << interval.all.percentile(0.99) << "," << interval.all.max();
+  for (const Histogram& op : interval.ops)
+    out << "," << op.percentile(0.99);
+  out << "," << row.client.rss_kb << "," << row.client.fds << ","
+      << row.server.rss_kb << "," << row.server.fds << ","
+      << row.counts.registered << "," << row.counts.sent << ","
+      << row.counts.fetched << "," << row.counts.queued << ","
+      << row.counts.orphaned << "\n";
+  out.flush();
+}
+
+// Per request type over the whole run, then drift between the first and
+// the last interval
+void write_summary(std::ostream& out,
+                   const std::array<Histogram, OP_COUNT>& totals,
+                   const Row& first,
+                   const Row& last) {
+  out << std::fixed << std::setprecision(1);
+  for (size_t op = 0; op < OP_COUNT; ++op) {
+    out << std::left << std::setw(14) << OP_NAMES[op] << std::right
+        << std::setw(10) << totals[op].count() << " requests  p50 "
+        << totals[op].percentile(0.5) << " us  p99 "
+        << totals[op].percentile(0.99) << " us  max " << totals[op].max()
+        << " us\n";
+  }
+  auto rate = [](const Row& row) {
+    return row.interval.all.count() / row.interval_seconds;
+  };
+  out << "first -> last interval: " << rate(first) << " -> " << rate(last)
+      << " requests/s, p99 " << first.interval.all.percentile(0.99) << " -> "
+      << last.interval.all.percentile(0.99) << " us, client RSS "
+      << first.client.rss_kb << " -> " << last.client.rss_kb << " KiB, fds "
+      << first.client.fds << " -> " << last.client.fds;
+  if (first.server.rss_kb != -1 || last.server.rss_kb != -1) {
+    out << ", server RSS " << first.server.rss_kb << " -> "
+        << last.server.rss_kb << " KiB, fds " << first.server.fds << " -> "
+        << last.server.fds;
+  }
+  out << ", queued " << first.counts.queued << " -> " << last.counts.queued
+      << ", orphaned " << first.counts.orphaned << " -> "
+      << last.counts.orphaned << "\n";
+}
+
+void print_usage() {
+  std::cerr << "usage: soak_bench [--server HOST:PORT] [--clients N] "
+               "[--duration S] [--interval S]\n"
+               "                  [--churn N] [--message-size N] "
+               "[--server-pid PID] [--output FILE]\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      print_usage();
+      return 1;
+    }
+    std::string value = argv[++i];
+    if (arg == "--server") {
+      size_t colon = value.rfind(':');
+      if (colon == std::string::npos) {
+        print_usage();
+        return 1;
+      }
+      options.host = value.substr(0, colon);
+      options.port = value.substr(colon + 1);
+    } else if (arg == "--clients") {
+      options.clients = std::stoul(value);
+    } else if (arg == "--duration") {
+      options.duration = std::chrono::seconds(std::stoul(value));
+    } else if (arg == "--interval") {
+      options.interval = std::chrono::seconds(std::stoul(value));
+    } else if (arg == "--churn") {
+      options.churn = std::stoul(value);
+    } else if (arg == "--message-size") {
+      options.message_size = std::stoul(value);
+    } else if (arg == "--server-pid") {
+      options.server_pid = value;
+    } else if (arg == "--output") {
+      options.output = value;
+    } else {
+      print_usage();
+      return 1;
+    }
+  }
+  if (options.clients < 2 || options.interval.count() == 0 ||
+      options.message_size == 0) {
+    std::cerr << "need at least 2 clients, a positive interval and message "
+                 "size\n";
+    return 1;
+  }
+
+  std::ofstream file;
+  if (!options.output.empty()) {
+    file.open(options.output);
+    if (!file) {
+      std::cerr << "Cannot write " << options.output << "\n";
+      return 1;
+    }
+  }
+  std::ostream& out = options.output.empty() ? std::cout : file;
+
+  std::filesystem::path dir = std::filesystem::temp_directory_path() /
+                              ("soak_bench_" + std::to_string(getpid()));
+  std::filesystem::create_directories(dir);
+
+  std::cerr << "soak: " << options.clients << " clients against "
+            << options.host << ":" << options.port << " for "
+            << options.duration.count() << " s, sampled every "
+            << options.interval.count() << " s\n";
+  SoakState state;
+  auto begin = Clock::now();
+  auto deadline = begin + options.duration;
+  std::vector<std::unique_ptr<SoakClient>> clients;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < options.clients; ++i) {
+    clients.push_back(std::make_unique<SoakClient>(state, options, dir, i));
+    threads.emplace_back(&SoakClient::run, clients.back().get(), deadline);
+  }
+
+  write_header(out);
+  std::array<Histogram, OP_COUNT> totals;
+  std::vector<Row> rows;
+  auto last_sample = begin;
+  while (last_sample < deadline) {
+    auto next = std::min(last_sample + options.interval, deadline);
+    std::this_thread::sleep_until(next);
+    Row row;
+    row.seconds = std::chrono::duration<double>(next - begin).count();
+    row.interval_seconds = std::chrono::duration<double>(next - last_sample)
+                               .count();
+    row.interval = state.take_interval();
+    row.client = sample_process("self");
+    if (!options.server_pid.empty())
+      row.server = sample_process(options.server_pid);
+    row.counts = state.counts();
+    for (size_t op = 0; op < OP_COUNT; ++op)
+      totals[op].merge(row.interval.ops[op]);
+    write_row(out, row);
+    // Only the first and last rows are needed for the summary
+    if (rows.size() == 2)
+      rows.pop_back();
+    rows.push_back(std::move(row));
+    last_sample = next;
+  }
+
+  for (std::thread& thread : threads)
+    thread.join();
+  std::filesystem::remove_all(dir);
+  if (!rows.empty())
+    write_summary(std::cerr, totals, rows.front(), rows.back());
+  return 0;
+}
@@ -0,0 +1,127 @@
+// Request round-trip latency and client CPU per request for each transport
+// against a running server on this host.
+//
+//   transport_bench iterations endpoint...
+//
+// Endpoints use the server.info syntax, e.g. 127.0.0.1:1357 unix:/tmp/mu.sock
+// shm:/tmp/mu.shm, or "fake" for an in-process FakeServer on loopback TCP,
+// which takes the server's own overhead out of the numbers. Each request is a header with an unassigned code, which
+// the server answers with an empty error reply, so the timing is dominated
+// by the transport and the server's per-request overhead.
+//
+// Requests are then also written PIPELINE_BATCH at a time, in version 1 and
+// version 2 framing (see framing.hpp), for the throughput of small frames.
+
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "fake_server.hpp"
+#include "protocol_message.hpp"
+#include "protocol_server_response.hpp"
+#include "tcp_client.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr uint16_t UNASSIGNED_CODE = 699;
+constexpr size_t PIPELINE_BATCH = 256;
+
+double cpu_seconds() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+void bench_endpoint(std::string endpoint, size_t iterations) {
+  std::unique_ptr<FakeServer> fake;
+  if (endpoint == "fake") {
+    fake = std::make_unique<FakeServer>(FakeServer::Options());
+    fake->start();
+    endpoint = fake->endpoint();
+  }
+  size_t colon = endpoint.find(':');
+  if (colon == std::string::npos)
+    throw std::runtime_error("Invalid endpoint: " + endpoint);
+  TcpClient client(endpoint.substr(0, colon), endpoint.substr(colon + 1));
+  client.connect();
+
+  auto frame = schema::make_request_frame<schema::EmptyPayload>(
+      {}, 1, UNASSIGNED_CODE);
+  std::vector<double> latencies;
+  latencies.reserve(iterations);
+  double cpu_start = cpu_seconds();
+  for (size_t i = 0; i < iterations; ++i) {
+    auto start = Clock::now();
+    client.send(frame.data(), frame.size());
+    ProtocolServerResponse reply = recv_protocol_response(client);
+    latencies.push_back(
+        std::chrono::duration<double, std::micro>(Clock::now() - start)
+            .count());
+  }
+  double cpu_per_request = (cpu_seconds() - cpu_start) / iterations * 1e6;
+
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << std::fixed << std::setprecision(1) << endpoint << ":\n"
+            << "  p50 " << latencies[latencies.size() / 2] << " us, p99 "
+            << latencies[latencies.size() * 99 / 100] << " us\n"
+            << "  client cpu " << cpu_per_request << " us/request\n";
+
+  for (uint8_t version : {framing::V1, framing::V2}) {
+    TcpClient pipelined(endpoint.substr(0, colon), endpoint.substr(colon + 1));
+    pipelined.connect();
+    if (negotiate_framing(pipelined, version) != version) {
+      std::cout << "  framing v" << int(version) << ": not supported\n";
+      continue;
+    }
+    // A registered client's request, so that version 2 sends a token
+    std::array<uint8_t, schema::UUID_SIZE> id;
+    id.fill(0x42);
+    auto request = schema::make_request_frame<schema::EmptyPayload>(
+        id, framing::V1, UNASSIGNED_CODE);
+    std::vector<uint8_t> batch;
+    for (size_t i = 0; i < PIPELINE_BATCH; ++i)
+      batch.insert(batch.end(), request.begin(), request.end());
+
+    size_t rounds = std::max<size_t>(1, iterations / PIPELINE_BATCH);
+    auto start = Clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+      pipelined.send(batch.data(), batch.size());
+      for (size_t i = 0; i < PIPELINE_BATCH; ++i)
+        recv_protocol_response(pipelined);
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << "  framing v" << int(version) << " pipelined "
+              << rounds * PIPELINE_BATCH / seconds << " requests/s\n";
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "usage: transport_bench iterations endpoint...\n";
+    return 1;
+  }
+  size_t iterations = std::strtoul(argv[1], nullptr, 10);
+  if (iterations == 0) {
+    std::cerr << "iterations must be positive\n";
+    return 1;
+  }
+
+  try {
+    for (int i = 2; i < argc; ++i)
+      bench_endpoint(argv[i], iterations);
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,334 @@
+// Replays the server replies of a wire capture (see wire_capture.hpp) through
+// the client's reply handling at full speed, with no server involved:
+// recv_protocol_response, recv_client_list, the public key and client lookup
+// parsers, and the pending-message reader, for whole replies, pages and
+// pushes, with its sender lookup and decryption.
+//
+//   wire_replay CAPTURE [--iterations N]
+//
+// Every captured connection is replayed in order over an in-memory transport;
+// a frame cut short at the end of a connection is dropped. Run it next to the
+// me.info of the capturing client so that received symmetric keys can be
+// decrypted. Text and file contents are encrypted with the capturing
+// process's own session key, which is not captured, so their decryption runs
+// at full cost but ends in an error that is counted, not fatal. Connections
+// that negotiated version 2 framing are split and replayed in it from the
+// frame after FRAMING_REPLY on.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "framing.hpp"
+#include "model/client_model.hpp"
+#include "pending_reader.hpp"
+#include "protocol_message.hpp"
+#include "protocol_schema.hpp"
+#include "protocol_server_response.hpp"
+#include "tcp_client.hpp"
+#include "wire_capture.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Serves a captured byte stream; writes are dropped
+class MemoryTransport : public Transport {
+ public:
+  explicit MemoryTransport(const std::vector<uint8_t>& bytes)
+      : m_bytes(bytes) {}
+
+  void connect() override {}
+  void shutdown() override { m_pos = m_bytes.size(); }
+  void write(const uint8_t*, size_t, const uint8_t*, size_t) override {}
+  size_t read_some(uint8_t* buf, size_t n) override {
+    n = std::min(n, m_bytes.size() - m_pos);
+    std::memcpy(buf, m_bytes.data() + m_pos, n);
+    m_pos += n;
+    return n;
+  }
+
+ private:
+  const std::vector<uint8_t>& m_bytes;
+  size_t m_pos = 0;
+};
+
+// One direction of one captured connection, cut into frames
+struct Stream {
+  uint32_t connection = 0;
+  std::vector<uint8_t> bytes;
+  std::vector<uint16_t> codes;  // of every whole frame, in order
+  std::vector<size_t> sizes;    // of every whole frame, header included
+  // Frames from index framing_from on use framing version `framing`
+  size_t framing_from = SIZE_MAX;
+  uint8_t framing = framing::V1;
+};
+
+// Reads the request or reply header at in[0, n) in framing `version`.
+// Returns false if it is cut short.
+bool parse_header(bool request,
+                  uint8_t version,
+                  const uint8_t* in,
+                  size_t n,
+                  size_t& header_size,
+                  uint16_t& code,
+                  uint32_t& payload_size) {
+  if (version == framing::V1) {
+    if (request) {
+      if (n < schema::RequestHeader::size)
+        return false;
+      header_size = schema::RequestHeader::size;
+      code = schema::RequestHeader::get<2>(in);
+      payload_size = schema::RequestHeader::get<3>(in);
+    } else {
+      if (n < schema::ResponseHeader::size)
+        return false;
+      header_size = schema::ResponseHeader::size;
+      code = schema::ResponseHeader::get<1>(in);
+      payload_size = schema::ResponseHeader::get<2>(in);
+    }
+    return true;
+  }
+  size_t pos = 0;
+  uint32_t value = 0;
+  if (request) {
+    size_t size = framing::get_varint(in, n, value);
+    if (size == 0)
+      return false;
+    // Only the bind flag matters here, not which id a token stands for
+    pos = size + ((value & 1) ? schema::UUID_SIZE : 0);
+    if (pos > n)
+      return false;
+  }
+  size_t size = framing::get_varint(in + pos, n - pos, value);
+  if (size == 0)
+    return false;
+  code = static_cast<uint16_t>(value);
+  pos += size;
+  size = framing::get_varint(in + pos, n - pos, payload_size);
+  if (size == 0)
+    return false;
+  header_size = pos + size;
+  return true;
+}
+
+// Splits `stream.bytes` into request or reply frames and drops a trailing
+// partial frame. A reply stream switches to the version its FRAMING_REPLY
+// names; a request stream to `agreed` after its FRAMING_REQUEST.
+void split_frames(Stream& stream, bool request, uint8_t agreed) {
+  uint8_t version = framing::V1;
+  size_t pos = 0;
+  while (pos < stream.bytes.size()) {
+    const uint8_t* header = stream.bytes.data() + pos;
+    size_t left = stream.bytes.size() - pos;
+    size_t header_size = 0;
+    uint16_t code = 0;
+    uint32_t payload_size = 0;
+    if (!parse_header(request, version, header, left, header_size, code,
+                      payload_size) ||
+        left - header_size < payload_size)
+      break;
+    stream.codes.push_back(code);
+    stream.sizes.push_back(header_size + payload_size);
+    pos += header_size + payload_size;
+
+    if (version != framing::V1)
+      continue;
+    uint8_t next = version;
+    if (request && code == REQUEST_CODES::FRAMING_REQUEST)
+      next = agreed;
+    else if (!request && code == RESPONSE_CODES::FRAMING_REPLY &&
+             payload_size >= schema::FramingReply::size)
+      next = header[header_size];
+    if (next != version) {
+      version = next;
+      stream.framing_from = stream.codes.size();
+      stream.framing = version;
+    }
+  }
+  stream.bytes.resize(pos);
+}
+
+struct CodeStats {
+  size_t frames = 0;
+  size_t bytes = 0;
+  double seconds = 0;
+};
+
+struct ReplayTotals {
+  std::map<uint16_t, CodeStats> by_code;
+  size_t messages = 0;
+  size_t message_errors = 0;
+  size_t frame_errors = 0;
+};
+
+// Handles every frame of `stream` the way MessageUClient handles replies
+void replay_stream(const Stream& stream,
+                   ClientModel& model,
+                   std::mutex& model_mutex,
+                   PendingReader& reader,
+                   ReplayTotals& totals) {
+  TcpClient client(std::make_unique<MemoryTransport>(stream.bytes));
+  client.connect();
+  std::vector<ClientListEntry> client_list;
+  for (size_t i = 0; i < stream.codes.size(); ++i) {
+    uint16_t code = stream.codes[i];
+    auto start = Clock::now();
+    try {
+      if (i == stream.framing_from)
+        client.set_framing_version(stream.framing);
+      if (code == RESPONSE_CODES::PENDING_MESSAGES_REPLY ||
+          code == RESPONSE_CODES::PUSHED_MESSAGE ||
+          code == RESPONSE_CODES::PENDING_MESSAGES_PAGE_REPLY) {
+        ProtocolResponseHeader header = recv_protocol_response_header(client);
+        uint32_t records_size = header.payload_size;
+        if (code == RESPONSE_CODES::PENDING_MESSAGES_PAGE_REPLY) {
+          // The MORE flag only drives the next request, not replayed
+          if (records_size < schema::PendingPageReplyPrefix::size) {
+            client.skip_n_bytes(records_size);
+            throw std::runtime_error("Pending messages page cut short");
+          }
+          std::array<uint8_t, schema::PendingPageReplyPrefix::size> prefix;
+          client.receive_into(prefix.data(), prefix.size());
+          records_size -= prefix.size();
+        }
+        for (const PendingMessage& message :
+             reader.read(client, records_size)) {
+          ++totals.messages;
+          if (!message.error.empty())
+            ++totals.message_errors;
+          else if (message.type == static_cast<uint8_t>(
+                                       ProtocolMessage::MessageType::FILE))
+            std::remove(message.content.c_str());
+        }
+      } else if (code == RESPONSE_CODES::LIST_CLIENTS_REPLY) {
+        client_list.clear();
+        recv_client_list(client, client_list);
+        std::lock_guard<std::mutex> lock(model_mutex);
+        model.set_client_list(client_list);
+      } else {
+        ProtocolServerResponse response = recv_protocol_response(client);
+        if (code == RESPONSE_CODES::PUBLIC_KEY_REPLY) {
+          // The request is not replayed, so the reply is checked against
+          // its own id
+          std::array<uint8_t, UUID_SIZE> id{};
+          if (response.payload().size() >= id.size())
+            std::copy_n(response.payload().begin(), id.size(), id.begin());
+          std::vector<uint8_t> key = response.parse_public_key_reply(id);
+          std::lock_guard<std::mutex> lock(model_mutex);
+          model.update_client_public_key(id, key);
+        } else if (code == RESPONSE_CODES::CLIENT_LOOKUP_REPLY) {
+          // Senders of the messages on later pages
+          std::vector<ClientListEntry> entries = response.parse_client_lookup();
+          std::lock_guard<std::mutex> lock(model_mutex);
+          model.merge_clients(std::move(entries));
+        }
+      }
+    } catch (const std::exception&) {
+      ++totals.frame_errors;
+    }
+    CodeStats& stats = totals.by_code[code];
+    ++stats.frames;
+    stats.bytes += stream.sizes[i];
+    stats.seconds +=
+        std::chrono::duration<double>(Clock::now() - start).count();
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: wire_replay CAPTURE [--iterations N]\n";
+    return 1;
+  }
+  std::string path = argv[1];
+  size_t iterations = 1;
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--iterations" && i + 1 < argc) {
+      iterations = std::stoul(argv[++i]);
+    } else {
+      std::cerr << "usage: wire_replay CAPTURE [--iterations N]\n";
+      return 1;
+    }
+  }
+
+  try {
+    std::map<uint32_t, Stream> sent;
+    std::map<uint32_t, Stream> received;
+    uint64_t duration_ns = 0;
+    for (WireCapture::Record& record : WireCapture::load(path)) {
+      auto& streams = record.direction == WireCapture::Direction::Sent
+                          ? sent
+                          : received;
+      Stream& stream = streams[record.connection];
+      stream.connection = record.connection;
+      stream.bytes.insert(stream.bytes.end(), record.data.begin(),
+                          record.data.end());
+      duration_ns = record.timestamp_ns;
+    }
+    // Replies first: they tell which framing the requests switched to
+    size_t replies = 0;
+    size_t reply_bytes = 0;
+    for (auto& [connection, stream] : received) {
+      split_frames(stream, false, framing::V1);
+      replies += stream.codes.size();
+      reply_bytes += stream.bytes.size();
+    }
+    size_t requests = 0;
+    for (auto& [connection, stream] : sent) {
+      auto it = received.find(connection);
+      split_frames(stream, true,
+                   it != received.end() ? it->second.framing : framing::V1);
+      requests += stream.codes.size();
+    }
+    std::cout << path << ": " << std::max(sent.size(), received.size())
+              << " connections over " << duration_ns / 1000000 << " ms, "
+              << requests << " requests, " << replies << " replies ("
+              << reply_bytes << " bytes)\n";
+
+    ClientModel model("replay", path);
+    if (model.me_info_exists())
+      model.load_my_info();
+    std::mutex model_mutex;
+    PendingReader reader(model, model_mutex);
+
+    ReplayTotals totals;
+    auto begin = Clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+      for (const auto& [connection, stream] : received)
+        replay_stream(stream, model, model_mutex, reader, totals);
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    std::cout << std::fixed << std::setprecision(1) << std::left
+              << std::setw(8) << "code" << std::right << std::setw(10)
+              << "frames" << std::setw(12) << "MB" << std::setw(14)
+              << "frames/s" << std::setw(10) << "MB/s\n";
+    for (const auto& [code, stats] : totals.by_code) {
+      double mb = stats.bytes / 1e6;
+      std::cout << std::left << std::setw(8) << code << std::right
+                << std::setw(10) << stats.frames << std::setw(12) << mb
+                << std::setw(14) << stats.frames / stats.seconds
+                << std::setw(10) << mb / stats.seconds << "\n";
+    }
+    std::cout << iterations << " iterations in " << seconds * 1000
+              << " ms, " << totals.messages << " messages ("
+              << totals.message_errors << " with errors), "
+              << totals.frame_errors << " rejected frames\n";
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
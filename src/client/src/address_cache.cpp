@@ -0,0 +1,115 @@
+#include "address_cache.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+int64_t unix_now() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string default_path() {
+  if (const char* path = std::getenv("MESSAGEU_ADDRESS_CACHE"))
+    return path;
+  std::filesystem::path base;
+  if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+    base = xdg;
+  } else if (const char* home = std::getenv("HOME"); home && *home) {
+    base = std::filesystem::path(home) / ".cache";
+  } else {
+    return "";
+  }
+  return (base / "messageu" / "addresses").string();
+}
+
+}  // namespace
+
+AddressCache& AddressCache::shared() {
+  static AddressCache cache(default_path());
+  return cache;
+}
+
+AddressCache::AddressCache(std::string path) : m_path(std::move(path)) {}
+
+std::vector<std::string> AddressCache::lookup(const std::string& host,
+                                              const std::string& port) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  load();
+  int64_t oldest = unix_now() - MAX_AGE.count() * 3600;
+  for (const Entry& entry : m_entries) {
+    if (entry.host == host && entry.port == port)
+      return entry.stored >= oldest ? entry.addresses
+                                    : std::vector<std::string>();
+  }
+  return {};
+}
+
+void AddressCache::store(const std::string& host,
+                         const std::string& port,
+                         const std::vector<std::string>& addresses) {
+  if (m_path.empty() || addresses.empty())
+    return;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  load();
+  auto it = std::find_if(m_entries.begin(), m_entries.end(),
+                         [&](const Entry& entry) {
+                           return entry.host == host && entry.port == port;
+                         });
+  if (it == m_entries.end())
+    it = m_entries.insert(m_entries.end(), Entry{host, port, 0, {}});
+  it->stored = unix_now();
+  it->addresses = addresses;
+
+  // Written aside and renamed, so a concurrent run never reads half a file
+  std::error_code ec;
+  std::filesystem::path path(m_path);
+  if (path.has_parent_path())
+    std::filesystem::create_directories(path.parent_path(), ec);
+  std::string temp = m_path + "." + std::to_string(getpid());
+  {
+    std::ofstream out(temp, std::ios::trunc);
+    for (const Entry& entry : m_entries) {
+      out << entry.host << ' ' << entry.port << ' ' << entry.stored;
+      for (const std::string& address : entry.addresses)
+        out << ' ' << address;
+      out << '\n';
+    }
+    // The last write error may only show in the final flush
+    out.close();
+    if (!out) {
+      std::remove(temp.c_str());
+      return;
+    }
+  }
+  std::filesystem::rename(temp, path, ec);
+  if (ec)
+    std::remove(temp.c_str());
+}
+
+void AddressCache::load() {
+  if (m_loaded)
+    return;
+  m_loaded = true;
+  if (m_path.empty())
+    return;
+  std::ifstream in(m_path);
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    Entry entry;
+    if (!(fields >> entry.host >> entry.port >> entry.stored))
+      continue;
+    std::string address;
+    while (fields >> address)
+      entry.addresses.push_back(address);
+    if (!entry.addresses.empty())
+      m_entries.push_back(std::move(entry));
+  }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Resolved server addresses, kept across runs so that a cold start connects
+// without waiting for DNS. The file holds one line per host and port:
+//
+//   <host> <port> <unix time stored> <address>...
+//
+// The address that connected last comes first. Entries older than MAX_AGE
+// are ignored. The cache is best effort: a missing or unwritable file only
+// means resolving again.
+//
+// shared() uses $MESSAGEU_ADDRESS_CACHE, or messageu/addresses under
+// $XDG_CACHE_HOME or ~/.cache. MESSAGEU_ADDRESS_CACHE set but empty turns
+// the cache off.
+class AddressCache {
+ public:
+  static constexpr std::chrono::hours MAX_AGE{24};
+
+  static AddressCache& shared();
+
+  // An empty path keeps nothing
+  explicit AddressCache(std::string path);
+
+  // Addresses stored for host and port, empty when unknown or stale
+  std::vector<std::string> lookup(const std::string& host,
+                                  const std::string& port);
+  void store(const std::string& host,
+             const std::string& port,
+             const std::vector<std::string>& addresses);
+
+ private:
+  struct Entry {
+    std::string host;
+    std::string port;
+    int64_t stored = 0;  // unix time
+    std::vector<std::string> addresses;
+  };
+
+  // Reads the file on first use. Requires m_mutex.
+  void load();
+
+  std::string m_path;
+  std::mutex m_mutex;
+  bool m_loaded = false;
+  std::vector<Entry> m_entries;
+};
@@ -0,0 +1,188 @@
+#include "alloc_profile.hpp"
+
+#ifdef MESSAGEU_ALLOC_PROFILE
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <new>
+
+namespace {
+
+// Everything here is constant-initialized, so allocations made during static
+// initialization, before main, are counted correctly
+
+struct Counters {
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> frees{0};
+};
+
+struct CommandStats {
+  std::atomic<const char*> name{nullptr};
+  std::atomic<uint64_t> runs{0};
+  std::atomic<uint64_t> peak_live{0};
+  Counters sites[AllocProfile::SITE_COUNT];
+};
+
+const char* const SITE_NAMES[AllocProfile::SITE_COUNT] = {
+    "other", "protocol", "crypto", "model", "view"};
+
+CommandStats g_commands[AllocProfile::MAX_COMMANDS];
+std::mutex g_commands_mutex;  // guards registering names
+std::atomic<uint32_t> g_command{0};
+std::atomic<uint64_t> g_live{0};
+thread_local AllocProfile::Site t_site = AllocProfile::Site::Other;
+
+// Every block is preceded by its size, keeping the caller's data aligned as
+// malloc would
+constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+
+void raise_to(std::atomic<uint64_t>& peak, uint64_t value) {
+  uint64_t current = peak.load(std::memory_order_relaxed);
+  while (current < value &&
+         !peak.compare_exchange_weak(current, value,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+uint32_t command_index(const char* command) {
+  std::lock_guard<std::mutex> lock(g_commands_mutex);
+  for (uint32_t i = 1; i < AllocProfile::MAX_COMMANDS; ++i) {
+    const char* name = g_commands[i].name.load(std::memory_order_relaxed);
+    if (!name) {
+      g_commands[i].name.store(command, std::memory_order_relaxed);
+      return i;
+    }
+    if (std::strcmp(name, command) == 0)
+      return i;
+  }
+  return AllocProfile::MAX_COMMANDS - 1;
+}
+
+void* counted_alloc(size_t size, bool nothrow) {
+  void* block = std::malloc(HEADER_SIZE + size);
+  if (!block) {
+    if (nothrow)
+      return nullptr;
+    throw std::bad_alloc();
+  }
+  std::memcpy(block, &size, sizeof(size));
+
+  CommandStats& command =
+      g_commands[g_command.load(std::memory_order_relaxed)];
+  Counters& counters = command.sites[static_cast<size_t>(t_site)];
+  counters.allocations.fetch_add(1, std::memory_order_relaxed);
+  counters.bytes.fetch_add(size, std::memory_order_relaxed);
+  uint64_t live = g_live.fetch_add(size, std::memory_order_relaxed) + size;
+  raise_to(command.peak_live, live);
+  return static_cast<char*>(block) + HEADER_SIZE;
+}
+
+void counted_free(void* ptr) {
+  if (!ptr)
+    return;
+  void* block = static_cast<char*>(ptr) - HEADER_SIZE;
+  size_t size;
+  std::memcpy(&size, block, sizeof(size));
+  CommandStats& command =
+      g_commands[g_command.load(std::memory_order_relaxed)];
+  command.sites[static_cast<size_t>(t_site)].frees.fetch_add(
+      1, std::memory_order_relaxed);
+  g_live.fetch_sub(size, std::memory_order_relaxed);
+  std::free(block);
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  return counted_alloc(size, false);
+}
+void* operator new[](size_t size) {
+  return counted_alloc(size, false);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return counted_alloc(size, true);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return counted_alloc(size, true);
+}
+void operator delete(void* ptr) noexcept {
+  counted_free(ptr);
+}
+void operator delete[](void* ptr) noexcept {
+  counted_free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept {
+  counted_free(ptr);
+}
+void operator delete[](void* ptr, size_t) noexcept {
+  counted_free(ptr);
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  counted_free(ptr);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  counted_free(ptr);
+}
+
+AllocProfile::SiteScope::SiteScope(Site site) : m_previous(t_site) {
+  t_site = site;
+}
+
+AllocProfile::SiteScope::~SiteScope() {
+  t_site = m_previous;
+}
+
+AllocProfile::CommandScope::CommandScope(const char* command)
+    : m_previous(g_command.load()) {
+  uint32_t index = command_index(command);
+  CommandStats& stats = g_commands[index];
+  stats.runs.fetch_add(1, std::memory_order_relaxed);
+  raise_to(stats.peak_live, g_live.load());
+  g_command.store(index);
+}
+
+AllocProfile::CommandScope::~CommandScope() {
+  g_command.store(m_previous);
+}
+
+void AllocProfile::write_report(std::ostream& out) {
+  g_commands[0].name.store("(between commands)");
+  out << "allocation profile: allocations, KiB allocated, frees, peak live KiB"
+      << std::fixed << std::setprecision(1) << "\n";
+  for (const CommandStats& command : g_commands) {
+    const char* name = command.name.load();
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+    uint64_t frees = 0;
+    for (const Counters& counters : command.sites) {
+      allocations += counters.allocations.load();
+      bytes += counters.bytes.load();
+      frees += counters.frees.load();
+    }
+    if (!name || (allocations == 0 && frees == 0))
+      continue;
+    uint64_t runs = command.runs.load();
+    out << name;
+    if (runs > 0)
+      out << " (" << runs << (runs == 1 ? " run" : " runs") << ")";
+    out << ": " << allocations << " allocations, " << bytes / 1024.0
+        << " KiB, " << frees << " frees, peak live "
+        << command.peak_live.load() / 1024.0 << " KiB\n";
+    for (size_t site = 0; site < SITE_COUNT; ++site) {
+      const Counters& counters = command.sites[site];
+      if (counters.allocations.load() == 0 && counters.frees.load() == 0)
+        continue;
+      out << "  " << std::left << std::setw(10) << SITE_NAMES[site]
+          << std::right << std::setw(10) << counters.allocations.load()
+          << " allocations " << std::setw(12)
+          << counters.bytes.load() / 1024.0 << " KiB " << std::setw(10)
+          << counters.frees.load() << " frees\n";
+    }
+  }
+}
+
+#endif  // MESSAGEU_ALLOC_PROFILE
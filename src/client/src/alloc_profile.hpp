@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Heap allocation counters for builds configured with
+// -DMESSAGEU_ALLOC_PROFILE=ON, which replace the global operator new and
+// delete. Every allocation is counted, with its size, under the command that
+// is running (process wide, see CommandScope) and the coarse call site of the
+// allocating thread (see MESSAGEU_ALLOC_SITE). Live bytes are tracked too, so
+// the report shows the peak reached while each command ran.
+//
+// Over-aligned allocations (alignas above 16) bypass the counters.
+//
+// In other builds the macros below expand to nothing and the class is not
+// defined, so only use it under #ifdef MESSAGEU_ALLOC_PROFILE.
+class AllocProfile {
+ public:
+  enum class Site : uint8_t { Other, Protocol, Crypto, Model, View };
+  static constexpr size_t SITE_COUNT = 5;
+  // Distinct command names, further ones are counted as the last one
+  static constexpr size_t MAX_COMMANDS = 32;
+
+  // Attributes this thread's allocations to `site` while alive. The
+  // innermost scope wins, so crypto called from protocol code is crypto.
+  class SiteScope {
+   public:
+    explicit SiteScope(Site site);
+    ~SiteScope();
+    SiteScope(const SiteScope& other) = delete;
+    SiteScope& operator=(const SiteScope& other) = delete;
+
+   private:
+    Site m_previous;
+  };
+
+  // Attributes the allocations of every thread to `command` while alive.
+  // `command` must be a string literal. One command runs at a time; what
+  // runs outside any command is reported as "(between commands)".
+  class CommandScope {
+   public:
+    explicit CommandScope(const char* command);
+    ~CommandScope();
+    CommandScope(const CommandScope& other) = delete;
+    CommandScope& operator=(const CommandScope& other) = delete;
+
+   private:
+    uint32_t m_previous;
+  };
+
+  // Per command: runs, allocations, bytes, frees and peak live bytes, then
+  // the same split by site
+  static void write_report(std::ostream& out);
+};
+
+#ifdef MESSAGEU_ALLOC_PROFILE
+#define MESSAGEU_ALLOC_SITE(site) \
+  AllocProfile::SiteScope alloc_site_scope(AllocProfile::Site::site)
+#define MESSAGEU_ALLOC_COMMAND(command) \
+  AllocProfile::CommandScope alloc_command_scope(command)
+#else
+#define MESSAGEU_ALLOC_SITE(site) static_cast<void>(0)
+#define MESSAGEU_ALLOC_COMMAND(command) static_cast<void>(0)
+#endif
@@ -0,0 +1,41 @@
+#include "buffer_pool.hpp"
+#include <utility>
+
+std::vector<uint8_t> BufferPool::acquire(size_t capacity) {
+  std::vector<uint8_t> buf;
+  if (!m_free.empty()) {
+    buf = std::move(m_free.back());
+    m_free.pop_back();
+  }
+  buf.reserve(capacity);
+  return buf;
+}
+
+void BufferPool::release(std::vector<uint8_t>&& buf) {
+  if (buf.capacity() == 0 || buf.capacity() > MAX_POOLED_CAPACITY ||
+      m_free.size() >= MAX_POOLED_BUFFERS)
+    return;
+  buf.clear();
+  m_free.push_back(std::move(buf));
+}
+
+PooledBuffer::~PooledBuffer() {
+  if (m_pool)
+    m_pool->release(std::move(m_buf));
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+    : m_buf(std::move(other.m_buf)), m_pool(other.m_pool) {
+  other.m_pool = nullptr;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+  if (this != &other) {
+    if (m_pool)
+      m_pool->release(std::move(m_buf));
+    m_buf = std::move(other.m_buf);
+    m_pool = other.m_pool;
+    other.m_pool = nullptr;
+  }
+  return *this;
+}
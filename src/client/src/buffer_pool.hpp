@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Free list of byte buffers owned by a single connection. Buffers keep their
+// capacity between uses, so a steady request/response loop stops allocating
+// once the pool is warm. Not thread-safe: one pool per connection/thread.
+class BufferPool {
+ public:
+  BufferPool() { m_free.reserve(MAX_POOLED_BUFFERS); }
+
+  // Buffers above this capacity are freed instead of pooled, so one huge
+  // reply does not pin its memory for the lifetime of the connection
+  static constexpr size_t MAX_POOLED_CAPACITY = 1024 * 1024;
+  static constexpr size_t MAX_POOLED_BUFFERS = 8;
+
+  // Returns an empty buffer with at least `capacity` bytes reserved
+  std::vector<uint8_t> acquire(size_t capacity);
+  void release(std::vector<uint8_t>&& buf);
+
+ private:
+  std::vector<std::vector<uint8_t>> m_free;
+};
+
+// Move-only owner of a pooled buffer, hands it back to the pool on destruction.
+// A buffer without a pool behaves like a plain vector.
+class PooledBuffer {
+ public:
+  PooledBuffer() = default;
+  PooledBuffer(std::vector<uint8_t> buf, BufferPool* pool)
+      : m_buf(std::move(buf)), m_pool(pool) {}
+  ~PooledBuffer();
+  PooledBuffer(const PooledBuffer& other) = delete;
+  PooledBuffer& operator=(const PooledBuffer& other) = delete;
+  PooledBuffer(PooledBuffer&& other) noexcept;
+  PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+
+  const std::vector<uint8_t>& get() const { return m_buf; }
+
+ private:
+  std::vector<uint8_t> m_buf;
+  BufferPool* m_pool = nullptr;
+};
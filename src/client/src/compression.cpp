@@ -0,0 +1,55 @@
+#include "compression.hpp"
+#include <arpa/inet.h>
+#include <zlib.h>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+bool Compression::compress_if_smaller(const std::vector<uint8_t>& plain,
+                                      std::vector<uint8_t>& out) {
+  out.clear();
+  if (plain.size() < MIN_COMPRESS_SIZE || plain.size() > MAX_DECOMPRESSED_SIZE)
+    return false;
+
+  uLongf deflate_size = compressBound(plain.size());
+  out.resize(ORIGINAL_SIZE_SIZE + deflate_size);
+  uint32_t original_size_n = htonl(static_cast<uint32_t>(plain.size()));
+  std::memcpy(out.data(), &original_size_n, ORIGINAL_SIZE_SIZE);
+
+  if (compress2(out.data() + ORIGINAL_SIZE_SIZE, &deflate_size, plain.data(),
+                plain.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+    out.clear();
+    return false;
+  }
+  out.resize(ORIGINAL_SIZE_SIZE + deflate_size);
+
+  // Only worth it if the result is smaller than what we started with
+  if (out.size() >= plain.size()) {
+    out.clear();
+    return false;
+  }
+  return true;
+}
+
+std::vector<uint8_t> Compression::decompress(const uint8_t* data,
+                                             size_t length) {
+  if (length < ORIGINAL_SIZE_SIZE)
+    throw std::runtime_error("Compressed content too short");
+
+  uint32_t original_size = 0;
+  std::memcpy(&original_size, data, ORIGINAL_SIZE_SIZE);
+  original_size = ntohl(original_size);
+  if (original_size > MAX_DECOMPRESSED_SIZE) {
+    throw std::runtime_error("Compressed content declares size " +
+                             std::to_string(original_size) +
+                             " above the allowed maximum");
+  }
+
+  std::vector<uint8_t> plain(original_size);
+  uLongf plain_size = original_size;
+  int rc = uncompress(plain.data(), &plain_size, data + ORIGINAL_SIZE_SIZE,
+                      length - ORIGINAL_SIZE_SIZE);
+  if (rc != Z_OK || plain_size != original_size)
+    throw std::runtime_error("Failed to decompress message content");
+  return plain;
+}
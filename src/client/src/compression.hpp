@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// zlib-backed helpers for the TEXT_COMPRESSED message type.
+// Compressed content layout: [ORIGINAL_SIZE (4 bytes, network order)][DEFLATE]
+class Compression {
+ public:
+  static constexpr size_t ORIGINAL_SIZE_SIZE = sizeof(uint32_t);
+  // Payloads below this size rarely shrink enough to be worth the CPU time
+  static constexpr size_t MIN_COMPRESS_SIZE = 128;
+  // Upper bound on the declared original size, guards against zip bombs
+  static constexpr size_t MAX_DECOMPRESSED_SIZE = 64 * 1024 * 1024;
+
+  // Compresses `plain` into `out`. Returns false (and leaves `out` empty) when
+  // the input is too small or the compressed form is not smaller.
+  static bool compress_if_smaller(const std::vector<uint8_t>& plain,
+                                  std::vector<uint8_t>& out);
+
+  // Inverse of compress_if_smaller. Throws on malformed input.
+  static std::vector<uint8_t> decompress(const uint8_t* data, size_t length);
+};
@@ -0,0 +1,263 @@
+#include "bot_controller.hpp"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "../compression.hpp"
+#include "../protocol_message.hpp"
+#include "../protocol_server_response.hpp"
+#include "../tcp_client.hpp"
+
+BotController::BotController(const std::string& ip,
+                             const std::string& port,
+                             std::vector<std::unique_ptr<Identity>> identities,
+                             std::unique_ptr<ClientView> view,
+                             const Options& options)
+    : m_ip(ip),
+      m_port(port),
+      m_identities(std::move(identities)),
+      m_view(std::move(view)),
+      m_options(options) {
+  m_options.connections = std::max<size_t>(
+      1, std::min(m_options.connections, m_identities.size()));
+}
+
+void BotController::run() {
+  if (m_identities.empty()) {
+    m_view->show_error("No identities to serve.");
+    return;
+  }
+  {
+    TcpClient client(m_ip, m_port);
+    client.connect();
+    load_client_names(client);
+  }
+  m_view->show_message("Serving " + std::to_string(m_identities.size()) +
+                       " identities over " +
+                       std::to_string(m_options.connections) +
+                       " connections.");
+
+  std::vector<std::thread> shards;
+  for (size_t shard = 1; shard < m_options.connections; ++shard)
+    shards.emplace_back(&BotController::serve_shard, this, shard);
+  serve_shard(0);
+  for (std::thread& thread : shards)
+    thread.join();
+}
+
+void BotController::serve_shard(size_t shard) {
+  // Identity i belongs to shard i % connections
+  std::vector<Identity*> identities;
+  for (size_t i = shard; i < m_identities.size(); i += m_options.connections)
+    identities.push_back(m_identities[i].get());
+
+  try {
+    TcpClient client(m_ip, m_port);
+    client.connect();
+    // Tokens replace the ids of all the shard's identities after their
+    // first request
+    negotiate_framing(client, framing::MAX_VERSION);
+    std::vector<KeyRequest> key_requests;
+    for (size_t round = 0;
+         m_options.rounds == 0 || round < m_options.rounds; ++round) {
+      auto next_round = std::chrono::steady_clock::now() +
+                        m_options.poll_interval;
+      for (size_t begin = 0; begin < identities.size();
+           begin += PIPELINE_WINDOW) {
+        size_t count = std::min(PIPELINE_WINDOW, identities.size() - begin);
+        poll_window(client, identities.data() + begin, count, key_requests);
+        // Key answers need their own round trips, so they run after the
+        // window's replies have all been read
+        for (const KeyRequest& request : key_requests)
+          answer_key_request(client, request);
+        key_requests.clear();
+      }
+      if (m_options.rounds == 0 || round + 1 < m_options.rounds)
+        std::this_thread::sleep_until(next_round);
+    }
+  } catch (const std::exception& e) {
+    std::lock_guard<std::mutex> lock(m_view_mutex);
+    m_view->show_error("Connection " + std::to_string(shard) +
+                       " stopped: " + e.what());
+  }
+}
+
+void BotController::poll_window(TcpClient& client,
+                                 Identity* const* identities,
+                                 size_t count,
+                                 std::vector<KeyRequest>& key_requests) {
+  using Frame = ProtocolMessage::EmptyRequestFrame;
+  std::vector<uint8_t> frames(count * std::tuple_size<Frame>::value);
+  for (size_t i = 0; i < count; ++i) {
+    const Frame& frame = identities[i]->pending_messages_frame();
+    std::copy(frame.begin(), frame.end(), frames.begin() + i * frame.size());
+  }
+  client.send(frames.data(), frames.size());
+
+  for (size_t i = 0; i < count; ++i) {
+    ProtocolResponseHeader header = recv_protocol_response_header(client);
+    if (header.code != RESPONSE_CODES::PENDING_MESSAGES_REPLY) {
+      client.skip_n_bytes(header.payload_size);
+      show_error(*identities[i], "Invalid pending messages response. Code: " +
+                                     std::to_string(header.code));
+      continue;
+    }
+    process_pending_records(client, *identities[i], header.payload_size,
+                            key_requests);
+  }
+}
+
+void BotController::process_pending_records(
+    TcpClient& client,
+    Identity& identity,
+    size_t payload_size,
+    std::vector<KeyRequest>& key_requests) {
+  using Record = schema::PendingMessageRecord;
+  using MessageType = ProtocolMessage::MessageType;
+  size_t remaining = payload_size;
+  while (remaining >= Record::size) {
+    std::array<uint8_t, Record::size> record;
+    client.receive_into(record.data(), record.size());
+    remaining -= record.size();
+    auto [from_id, msg_id, msg_type, msg_size] = Record::unpack(record.data());
+    (void)msg_id;
+    if (msg_size > remaining) {
+      show_error(identity, "Message content exceeds payload bounds");
+      break;
+    }
+    remaining -= msg_size;
+
+    // Bots keep no files, the content is only drained
+    if (msg_type == static_cast<uint8_t>(MessageType::FILE)) {
+      client.skip_n_bytes(msg_size);
+      show(identity, "From: " + sender_name(from_id) + "\nFile of " +
+                         std::to_string(msg_size) + " bytes ignored");
+      continue;
+    }
+
+    if (msg_size > client.frame_limits().max_record_content()) {
+      client.skip_n_bytes(msg_size);
+      show_error(identity, "Message of " + std::to_string(msg_size) +
+                               " bytes exceeds the size limit, skipped");
+      continue;
+    }
+
+    PooledBuffer content_buf = client.receive_pooled(msg_size);
+    const std::vector<uint8_t>& content = content_buf.get();
+    try {
+      switch (static_cast<MessageType>(msg_type)) {
+        case MessageType::SYMMETRIC_KEY_REQUEST:
+          key_requests.push_back({&identity, from_id});
+          break;
+        case MessageType::SYMMETRIC_KEY_SEND:
+          identity.set_and_decrypt_symmetric_key_for_peer(
+              from_id, std::string(content.begin(), content.end()));
+          show(identity,
+               "From: " + sender_name(from_id) + "\nReceived symmetric key");
+          break;
+        case MessageType::TEXT:
+        case MessageType::TEXT_COMPRESSED: {
+          std::string text = identity.decrypt_with_aes(
+              reinterpret_cast<const char*>(content.data()), content.size());
+          if (msg_type == static_cast<uint8_t>(MessageType::TEXT_COMPRESSED)) {
+            auto plain = Compression::decompress(
+                reinterpret_cast<const uint8_t*>(text.data()), text.size());
+            text.assign(plain.begin(), plain.end());
+          }
+          show(identity, "From: " + sender_name(from_id) + "\nContent:\n" +
+                             text);
+          break;
+        }
+        default:
+          show_error(identity,
+                     "Invalid message type: " + std::to_string(msg_type));
+          break;
+      }
+    } catch (const std::exception& e) {
+      // Content is fully consumed, so the rest of the reply is still valid
+      show_error(identity, e.what());
+    }
+  }
+  client.skip_n_bytes(remaining);
+}
+
+void BotController::answer_key_request(TcpClient& client,
+                                       const KeyRequest& request) {
+  Identity& identity = *request.identity;
+  try {
+    std::vector<uint8_t> public_key =
+        get_peer_public_key(client, identity, request.requester);
+    RSAPublicWrapper rsaPublic(std::string(public_key.begin(), public_key.end()));
+    std::string sym_key = identity.get_symmetric_key();
+    std::string encrypted_key = rsaPublic.encrypt(sym_key);
+
+    auto msg = ProtocolMessage::create_send_sym_key_message_request(
+        identity.id(), request.requester, encrypted_key);
+    send_protocol_message(client, msg);
+    ProtocolServerResponse server_msg = recv_protocol_response(client);
+    if (server_msg.code() != RESPONSE_CODES::SEND_MESSAGE_REPLY) {
+      throw std::runtime_error(
+          "Invalid server response after sending symmetric key. Code: " +
+          std::to_string(server_msg.code()));
+    }
+    show(identity, "Sent symmetric key to " + sender_name(request.requester));
+  } catch (const std::exception& e) {
+    show_error(identity, std::string("Symmetric key request not answered: ") +
+                             e.what());
+  }
+}
+
+std::vector<uint8_t> BotController::get_peer_public_key(
+    TcpClient& client,
+    const Identity& identity,
+    const Identity::Id& peer) {
+  {
+    std::lock_guard<std::mutex> lock(m_public_keys_mutex);
+    auto it = m_public_keys.find(peer);
+    if (it != m_public_keys.end())
+      return it->second;
+  }
+  auto msg = ProtocolMessage::create_public_key_request(identity.id(), peer);
+  send_protocol_message(client, msg);
+  ProtocolServerResponse server_msg = recv_protocol_response(client);
+  std::vector<uint8_t> public_key = server_msg.parse_public_key_reply(peer);
+
+  std::lock_guard<std::mutex> lock(m_public_keys_mutex);
+  m_public_keys.emplace(peer, public_key);
+  return public_key;
+}
+
+void BotController::load_client_names(TcpClient& client) {
+  // The list omits the requester, whose name is known locally anyway
+  const Identity& first = *m_identities.front();
+  m_names.emplace(first.id(), first.name());
+  auto frame = ProtocolMessage::create_list_clients_frame(first.id());
+  client.send(frame.data(), frame.size());
+  std::vector<ClientListEntry> entries;
+  recv_client_list(client, entries);
+  for (ClientListEntry& entry : entries)
+    m_names.emplace(entry.id, std::move(entry.name));
+}
+
+std::string BotController::sender_name(const Identity::Id& id) const {
+  auto it = m_names.find(id);
+  if (it != m_names.end())
+    return it->second;
+  // Registered after startup, show the id instead
+  std::ostringstream hex;
+  for (uint8_t byte : id)
+    hex << std::hex << std::setw(2) << std::setfill('0') << int(byte);
+  return hex.str();
+}
+
+void BotController::show(const Identity& identity, const std::string& msg) {
+  std::lock_guard<std::mutex> lock(m_view_mutex);
+  m_view->show_message("[" + identity.name() + "] " + msg);
+}
+
+void BotController::show_error(const Identity& identity,
+                               const std::string& msg) {
+  std::lock_guard<std::mutex> lock(m_view_mutex);
+  m_view->show_error("[" + identity.name() + "] " + msg);
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../model/identity.hpp"
+#include "../view/client_view.hpp"
+
+class TcpClient;
+
+// Hosts many identities in one process over a small shared set of
+// connections. Every request frame names its client id, so one connection
+// can carry requests for any number of identities.
+//
+// Identities are split into one shard per connection, and each shard runs on
+// its own thread and only touches its own identities. Every round polls the
+// shard's pending messages, pipelined PIPELINE_WINDOW identities at a time,
+// and answers symmetric key requests with the identity's key.
+class BotController {
+ public:
+  struct Options {
+    size_t connections = 4;
+    std::chrono::milliseconds poll_interval{1000};
+    size_t rounds = 0;  // 0 polls until the process is stopped
+  };
+
+  BotController(const std::string& ip,
+                const std::string& port,
+                std::vector<std::unique_ptr<Identity>> identities,
+                std::unique_ptr<ClientView> view,
+                const Options& options);
+  BotController(const BotController& other) = delete;
+  BotController& operator=(const BotController& other) = delete;
+
+  void run();
+
+ private:
+  static constexpr size_t PIPELINE_WINDOW = 256;
+
+  struct KeyRequest {
+    Identity* identity;
+    Identity::Id requester;
+  };
+
+  void serve_shard(size_t shard);
+  // Sends the pending-messages frames of `count` identities in one write and
+  // handles the replies in order
+  void poll_window(TcpClient& client,
+                   Identity* const* identities,
+                   size_t count,
+                   std::vector<KeyRequest>& key_requests);
+  void process_pending_records(TcpClient& client,
+                               Identity& identity,
+                               size_t payload_size,
+                               std::vector<KeyRequest>& key_requests);
+  void answer_key_request(TcpClient& client, const KeyRequest& request);
+  // Public keys are the same for every identity, so they are cached once
+  // for the whole process
+  std::vector<uint8_t> get_peer_public_key(TcpClient& client,
+                                           const Identity& identity,
+                                           const Identity::Id& peer);
+  void load_client_names(TcpClient& client);
+  std::string sender_name(const Identity::Id& id) const;
+  void show(const Identity& identity, const std::string& msg);
+  void show_error(const Identity& identity, const std::string& msg);
+
+  std::string m_ip;
+  std::string m_port;
+  std::vector<std::unique_ptr<Identity>> m_identities;
+  std::unique_ptr<ClientView> m_view;
+  Options m_options;
+
+  std::mutex m_view_mutex;
+  // Read-only once the shards start
+  std::unordered_map<Identity::Id, std::string, ClientIdHash> m_names;
+  std::mutex m_public_keys_mutex;
+  std::unordered_map<Identity::Id, std::vector<uint8_t>, ClientIdHash>
+      m_public_keys;
+};
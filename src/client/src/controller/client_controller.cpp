@@ -1,385 +1,155 @@
 
 #include "client_controller.hpp"
-#include <array>
-#include <cstring>
+#include <ctime>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
-#include "../protocol_message.hpp"
-#include "../protocol_server_response.hpp"
-#include "../tcp_client.hpp"
+#include "../alloc_profile.hpp"
 
 ClientController::ClientController(std::unique_ptr<ClientModel> model,
-                                   std::unique_ptr<ClientView> view)
-    : m_model(std::move(model)), m_view(std::move(view)) {}
-
-ClientController::~ClientController() = default;
+                                   std::unique_ptr<ClientView> view,
+                                   const MessageUClient::Options& options)
+    : m_view(std::move(view)),
+      m_client(std::make_unique<MessageUClient>(std::move(model), options)) {}
+
+MessageUClient::Options ClientController::default_options() {
+  MessageUClient::Options options;
+  options.keep_history = true;
+  return options;
+}
 
 void ClientController::run() {
-  TcpClient client(m_model->get_ip(), m_model->get_port());
-  client.connect();
-
-  // first try to load existing user info
-  m_model->load_my_info();
+  if (!m_client->is_registered())
+    std::cerr << "me.info not found, proceeding without loading user info.\n";
+  // Fail fast when the server is unreachable
+  m_client->connect().get();
 
   while (true) {
     try {
+      // This thread only prompts and renders; the work itself runs on the
+      // client's worker threads
+      MESSAGEU_ALLOC_SITE(View);
       ClientCommand cmd = m_view->prompt_command();
+      MESSAGEU_ALLOC_COMMAND(command_name(cmd));
+      // Pushed messages are shown between commands, never during one
+      std::lock_guard<std::mutex> lock(m_state_mutex);
       switch (cmd) {
         case ClientCommand::Register: {
-          if (m_model->me_info_exists()) {
+          if (m_client->is_registered()) {
             throw std::runtime_error(
                 "me.info already exists. Registration aborted.");
           }
           std::string username = m_view->prompt_username();
-          m_model->generate_key_pair();
-          // Get the private key for storage
-          std::string private_key = m_model->get_private_key();
-          std::string private_key_base64 = Base64Wrapper::encode(private_key);
-
-          ProtocolMessage msg = ProtocolMessage::create_register_request(
-              username, m_model->get_public_key());
-          auto bytes = msg.to_bytes();
-          client.send(bytes);
-
-          // Receive and parse reply using utility
-          ProtocolServerResponse server_msg = recv_protocol_response(client);
-
-          if (server_msg.code() != RESPONSE_CODES::REGISTER_REPLY ||
-              server_msg.payload().size() != ProtocolMessage::CLIENT_ID_SIZE) {
-            throw std::runtime_error(
-                "Invalid register response from server. code: " +
-                std::to_string(server_msg.code()) + " payload size: " +
-                std::to_string(server_msg.payload().size()));
-          }
-          std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE> uuid;
-          std::copy(server_msg.payload().begin(), server_msg.payload().end(),
-                    uuid.begin());
-          m_model->set_my_uuid(uuid);
-
-          m_model->save_me_info(username, uuid, private_key_base64);
+          m_client->register_user(username).get();
           m_view->show_message(
               "Registration successful. UUID and private key saved to "
               "me.info.");
           break;
         }
-        case ClientCommand::ListClients: {
-          // Build and send request using protocol API
-          auto msg = ProtocolMessage::create_list_clients_request(
-              m_model->get_my_id());
-          client.send(msg.to_bytes());
-
-          // Receive and parse response in one step
-          ProtocolServerResponse server_msg = recv_protocol_response(client);
-          if (server_msg.code() != RESPONSE_CODES::LIST_CLIENTS_REPLY) {
-            throw std::runtime_error(
-                "Invalid client list response from server.");
-          }
-          auto client_list = server_msg.parse_client_list();
-          m_model->set_client_list(client_list);
-          m_view->show_all_clients(client_list);
+        case ClientCommand::ListClients:
+          m_view->show_all_clients(m_client->list_clients().get());
           break;
-        }
-        case ClientCommand::PublicKey: {
-          m_view->show_message("Enter client name: ");
-          std::string target_name;
-          std::getline(std::cin, target_name);
-          const ClientListEntry* client_entry =
-              m_model->get_client_by_name(target_name);
-          if (!client_entry) {
-            m_view->show_error(
-                "Client name not found in client list. Please refresh the "
-                "client list first.");
-            break;
-          }
-          const auto& req_id = client_entry->id;
-          ProtocolMessage msg = ProtocolMessage::create_public_key_request(
-              m_model->get_my_id(), req_id);
-          client.send(msg.to_bytes());
-          ProtocolServerResponse server_msg = recv_protocol_response(client);
-
-          std::vector<uint8_t> pubkey =
-              server_msg.parse_public_key_reply(req_id);
-          m_model->update_client_public_key(req_id, pubkey);
-
+        case ClientCommand::PublicKey:
+          m_client->request_public_key(prompt_client_name("Enter client name: "))
+              .get();
           break;
-        }
         case ClientCommand::SendText: {
-          // Prompt for recipient username
-          m_view->show_message("Enter recipient client name: ");
-          std::string target_name;
-          std::getline(std::cin, target_name);
-          const ClientListEntry* client_entry =
-              m_model->get_client_by_name(target_name);
-          if (!client_entry) {
-            m_view->show_error(
-                "Client name not found in client list. Please refresh the "
-                "client list first.");
-            break;
-          }
-          const auto& dst_id = client_entry->id;
-          // Prompt for message content
+          std::string name =
+              prompt_client_name("Enter recipient client name: ");
           m_view->show_message("Enter message text: ");
           std::string message_text;
           std::getline(std::cin, message_text);
-          std::vector<uint8_t> content(message_text.begin(),
-                                       message_text.end());
-
-          if (!client_entry->has_valid_symmetric_key) {
-            throw std::runtime_error(
-                "No valid symmetric key for this client. Please request a "
-                "symmetric key first.");
-          }
-          std::string sym_key = client_entry->symmetric_key;
-          // 3. Create AES wrapper
-          AESWrapper aes(
-              reinterpret_cast<const unsigned char*>(sym_key.c_str()),
-              sym_key.size());
-          // 4. Encrypt the content
-          std::string encrypted = aes.encrypt(
-              reinterpret_cast<const char*>(content.data()), content.size());
-          // 5. Update content with encrypted data
-          content = std::vector<uint8_t>(encrypted.begin(), encrypted.end());
-
-          // Build and send request using protocol API
-          auto msg = ProtocolMessage::create_send_message_request(
-              m_model->get_my_id(), dst_id, ProtocolMessage::MessageType::TEXT,
-              content);
-          client.send(msg.to_bytes());
-
-          // Receive and validate the server response
-          ProtocolServerResponse server_msg = recv_protocol_response(client);
-          if (server_msg.code() != RESPONSE_CODES::SEND_MESSAGE_REPLY) {
-            throw std::runtime_error(
-                "Invalid server response after sending text message. Code: " +
-                std::to_string(server_msg.code()));
-          }
-
+          m_client->send_text(name, message_text).get();
           m_view->show_message("Text message sent successfully.");
           break;
         }
-
-        case ClientCommand::RequestSymKey: {
-          // Prompt for recipient username
-          m_view->show_message("Enter recipient client name: ");
-          std::string target_name;
-          std::getline(std::cin, target_name);
-          const ClientListEntry* client_entry =
-              m_model->get_client_by_name(target_name);
-          if (!client_entry) {
-            m_view->show_error(
-                "Client name not found in client list. Please refresh the "
-                "client list first.");
-            break;
-          }
-          const auto& dst_id = client_entry->id;
-          // Build and send request using protocol API (no content)
-          auto msg = ProtocolMessage::create_symmetric_key_request(
-              m_model->get_my_id(), dst_id);
-          client.send(msg.to_bytes());
-
-          // Receive and validate the server response
-          ProtocolServerResponse server_msg = recv_protocol_response(client);
-          if (server_msg.code() != RESPONSE_CODES::SEND_MESSAGE_REPLY) {
-            throw std::runtime_error(
-                "Invalid server response after sending symmetric key "
-                "request. "
-                "Code: " +
-                std::to_string(server_msg.code()));
-          }
-
+        case ClientCommand::RequestSymKey:
+          m_client
+              ->request_symmetric_key(
+                  prompt_client_name("Enter recipient client name: "))
+              .get();
           m_view->show_message("Symmetric key request sent successfully.");
           break;
+        case ClientCommand::SendSymKey:
+          m_client
+              ->send_symmetric_key(
+                  prompt_client_name("Enter recipient client name: "))
+              .get();
+          m_view->show_message("Symmetric key sent successfully.");
+          break;
+        case ClientCommand::SendSymKeyAll: {
+          MessageUClient::SymKeyBroadcast result =
+              m_client->send_symmetric_key_to_all().get();
+          for (const std::string& name : result.skipped)
+            m_view->show_error("Invalid public key, skipped: " + name);
+          m_view->show_message("Symmetric key sent to " +
+                               std::to_string(result.sent) + " clients.");
+          break;
         }
-
-        case ClientCommand::SendSymKey: {
-          // Prompt for recipient username
-          m_view->show_message("Enter recipient client name: ");
-          std::string target_name;
-          std::getline(std::cin, target_name);
-          const ClientListEntry* client_entry =
-              m_model->get_client_by_name(target_name);
-          if (!client_entry) {
-            m_view->show_error(
-                "Client name not found in client list. Please refresh the "
-                "client list first.");
+        case ClientCommand::SendFile: {
+          std::string name =
+              prompt_client_name("Enter recipient client name: ");
+          m_view->show_message("Enter file path: ");
+          std::string file_path;
+          std::getline(std::cin, file_path);
+          m_client->send_file(name, file_path).get();
+          m_view->show_message("File sent successfully.");
+          break;
+        }
+        case ClientCommand::WaitingMessages:
+          // Shown page by page as they arrive. The handler runs on a worker
+          // thread while this one waits holding m_state_mutex, which keeps
+          // the push listener off the view meanwhile.
+          m_client
+              ->fetch_pending([this](const PendingMessage& message) {
+                show_pending_message(message);
+              })
+              .get();
+          break;
+        case ClientCommand::Subscribe:
+          if (m_client->is_subscribed()) {
+            m_view->show_message("Already subscribed.");
             break;
           }
-          if (!client_entry->has_valid_public_key) {
-            m_view->show_error(
-                "No valid public key for this client. Please request a "
-                "public key first.");
+          // The handler runs on the listener thread
+          m_client
+              ->subscribe([this](const PendingMessage& message) {
+                std::lock_guard<std::mutex> lock(m_state_mutex);
+                show_pending_message(message);
+                // No prompt read follows that would flush it
+                m_view->flush();
+              })
+              .get();
+          m_view->show_message(
+              "Subscribed. New messages will be shown as they arrive.");
+          break;
+        case ClientCommand::Poll:
+          if (m_client->is_polling()) {
+            m_view->show_message("Already polling.");
             break;
           }
-          const auto& dst_id = client_entry->id;
-
-          auto sym_key = m_model->get_symmetric_key();
-          // TODO: encrypt the symmetric key with the recipient's public key
-          // 1. Get recipient's public key
-          const auto& recipient_public_key = client_entry->public_key;
-          // 2. Create RSA wrapper with recipient's public key
-          RSAPublicWrapper rsaPublic(std::string(recipient_public_key.begin(),
-                                                 recipient_public_key.end()));
-          // 3. Encrypt the symmetric key
-          std::string encrypted_key = rsaPublic.encrypt(
-              reinterpret_cast<const char*>(sym_key.data()), sym_key.size());
-
-          // Build and send request using protocol API
-          auto msg = ProtocolMessage::create_send_sym_key_message_request(
-              m_model->get_my_id(), dst_id, encrypted_key);
-          client.send(msg.to_bytes());
-
-          // Receive and validate the server response
-          ProtocolServerResponse server_msg = recv_protocol_response(client);
-          if (server_msg.code() != RESPONSE_CODES::SEND_MESSAGE_REPLY) {
-            throw std::runtime_error(
-                "Invalid server response after sending symmetric key. "
-                "Code: " +
-                std::to_string(server_msg.code()));
-          }
-
-          m_view->show_message("Symmetric key sent successfully.");
+          start_polling(MessageUClient::PollOptions());
+          m_view->show_message(
+              "Polling. New messages will be shown as they arrive.");
+          break;
+        case ClientCommand::HistoryByClient: {
+          std::string name = prompt_client_name("Enter client name: ");
+          MessageHistory::Query query;
+          query.peer = m_client->find_client(name)->id;
+          m_view->show_history(m_client->query_history(query));
           break;
         }
-
-        case ClientCommand::WaitingMessages: {
-          // Send pending message request using protocol API
-          auto msg = ProtocolMessage::create_pending_messages_request(
-              m_model->get_my_id());
-          client.send(msg.to_bytes());
-          ProtocolServerResponse server_msg = recv_protocol_response(client);
-
-          // Verify correct response code
-          if (server_msg.code() != RESPONSE_CODES::PENDING_MESSAGES_REPLY) {
-            throw std::runtime_error(
-                "Invalid pending messages response from server. Code: " +
-                std::to_string(server_msg.code()));
-          }
-
-          // Parse all messages from payload
-          const auto& payload = server_msg.payload();
-          size_t offset = 0;
-          // Each message has:
-          // [CLIENT_ID][MSG_ID][MSG_TYPE][MSG_SIZE][CONTENT]
-          const size_t MSG_ID_SIZE = 4;    // uint32_t
-          const size_t MSG_TYPE_SIZE = 1;  // uint8_t
-          const size_t MSG_SIZE_SIZE = 4;  // uint32_t
-          const size_t MSG_HEADER_SIZE = ProtocolMessage::CLIENT_ID_SIZE +
-                                         MSG_ID_SIZE + MSG_TYPE_SIZE +
-                                         MSG_SIZE_SIZE;
-
-          while (offset + MSG_HEADER_SIZE <= payload.size()) {
-            // Parse header
-            std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE> from_id;
-            std::memcpy(from_id.data(), payload.data() + offset,
-                        ProtocolMessage::CLIENT_ID_SIZE);
-            offset += ProtocolMessage::CLIENT_ID_SIZE;
-
-            uint32_t msg_id = ntohl(
-                *reinterpret_cast<const uint32_t*>(payload.data() + offset));
-            offset += MSG_ID_SIZE;
-
-            uint8_t msg_type = payload[offset++];
-
-            // Validate message type before proceeding
-            if (msg_type < 1 || msg_type > 3) {
-              m_view->show_error("Invalid message type: " +
-                                 std::to_string(msg_type));
-              break;  // Skip invalid message
-            }
-
-            // Make sure we have enough bytes for the size field
-            if (offset + MSG_SIZE_SIZE > payload.size()) {
-              m_view->show_error("Incomplete message header at offset " +
-                                 std::to_string(offset));
-              break;
-            }
-
-            // Safely extract message size
-            uint32_t msg_size = 0;
-            std::memcpy(&msg_size, payload.data() + offset, MSG_SIZE_SIZE);
-            msg_size = ntohl(msg_size);
-            offset += MSG_SIZE_SIZE;
-
-            // Validate message size
-            if (offset + msg_size > payload.size()) {
-              m_view->show_error("Message content exceeds payload bounds");
-              break;
-            }
-
-            // Extract message content
-            std::vector<uint8_t> content;
-            try {
-              if (msg_size > 0) {
-                content.assign(payload.begin() + offset,
-                               payload.begin() + offset + msg_size);
-              }
-              offset += msg_size;
-            } catch (const std::exception& e) {
-              m_view->show_error("Error extracting message content: " +
-                                 std::string(e.what()));
-              break;
-            }
-
-            // Find sender name
-            const ClientListEntry* sender = m_model->get_client_by_id(from_id);
-            if (!sender) {
-              m_view->show_error(
-                  "Sender ID not found in client list. Cannot display "
-                  "message.");
-              continue;  // Skip messages from unknown senders
-            }
-            std::string sender_name = sender ? sender->name : "<unknown>";
-
-            // Handle message based on type
-            if (msg_type ==
-                static_cast<uint8_t>(
-                    ProtocolMessage::MessageType::SYMMETRIC_KEY_SEND)) {
-              // std::array<uint8_t, ProtocolMessage::SYM_KEY_SIZE> sym_key;
-              // std::copy_n(content.begin(), ProtocolMessage::SYM_KEY_SIZE,
-              //             sym_key.begin());
-              std::string encrypted_key(content.begin(), content.end());
-
-              // Store the symmetric key for this specific client
-              m_model->set_and_decrypt_symmetric_key_for_client(from_id,
-                                                                encrypted_key);
-            }
-
-            // Nothing to do here but display
-            if (msg_type ==
-                static_cast<uint8_t>(
-                    ProtocolMessage::MessageType::SYMMETRIC_KEY_REQUEST)) {
-            }
-
-            if (sender) {
-              // For TEXT messages, ensure content is not empty and decrypt
-              if (msg_type ==
-                  static_cast<uint8_t>(ProtocolMessage::MessageType::TEXT)) {
-                if (content.empty()) {
-                  m_view->show_error(
-                      "Received TEXT message with empty content. Skipping "
-                      "display.");
-                } else {
-                  // incoming messages should be decrypted by my symmetric key
-                  std::string decrypted = m_model->decrypt_with_aes(
-                      reinterpret_cast<const char*>(content.data()),
-                      content.size());
-                  m_view->show_pending_message(sender_name, msg_type,
-                                               decrypted);
-                }
-
-              } else {
-                // For non-text messages, display as is
-                std::string empty;
-                m_view->show_pending_message(sender_name, msg_type, empty);
-              }
-            } else {
-              m_view->show_error(
-                  "Message from unknown sender - cannot display");
-            }
-          }
+        case ClientCommand::HistoryByTime: {
+          MessageHistory::Query query;
+          query.from_ms = prompt_time_ms(
+              "From (YYYY-MM-DD [HH:MM], empty for the beginning): ",
+              INT64_MIN, false);
+          query.to_ms = prompt_time_ms(
+              "To (YYYY-MM-DD [HH:MM], empty for now): ", INT64_MAX, true);
+          m_view->show_history(m_client->query_history(query));
           break;
         }
-
         case ClientCommand::Exit:
           return;
         case ClientCommand::Invalid:
@@ -394,3 +164,70 @@ void ClientController::run() {
     }
   }
 }
+
+void ClientController::start_polling(
+    const MessageUClient::PollOptions& options) {
+  if (!m_client->is_registered())
+    throw std::runtime_error("me.info not found. Register first.");
+  // The handler runs on the polling thread
+  m_client->start_polling(
+      [this](const PendingMessage& message) {
+        std::lock_guard<std::mutex> lock(m_state_mutex);
+        show_pending_message(message);
+        // No prompt read follows that would flush it
+        m_view->flush();
+      },
+      options);
+}
+
+std::string ClientController::prompt_client_name(const std::string& prompt) {
+  m_view->show_message(prompt);
+  std::string name;
+  std::getline(std::cin, name);
+  if (!m_client->find_client(name)) {
+    throw std::runtime_error(
+        "Client name not found in client list. Please refresh the client "
+        "list first.");
+  }
+  return name;
+}
+
+int64_t ClientController::prompt_time_ms(const std::string& prompt,
+                                         int64_t empty,
+                                         bool end_of_day) {
+  m_view->show_message(prompt);
+  std::string input;
+  std::getline(std::cin, input);
+  if (input.find_first_not_of(" \t") == std::string::npos)
+    return empty;
+
+  std::tm local{};
+  local.tm_isdst = -1;
+  std::istringstream date_time(input);
+  date_time >> std::get_time(&local, "%Y-%m-%d %H:%M");
+  bool date_only = false;
+  if (date_time.fail()) {
+    local = std::tm{};
+    local.tm_isdst = -1;
+    std::istringstream date(input);
+    date >> std::get_time(&local, "%Y-%m-%d");
+    if (date.fail())
+      throw std::runtime_error("Invalid date: " + input);
+    date_only = true;
+  }
+  if (date_only && end_of_day)
+    ++local.tm_mday;  // mktime carries into the next month
+  std::time_t seconds = std::mktime(&local);
+  if (seconds == -1)
+    throw std::runtime_error("Invalid date: " + input);
+  return static_cast<int64_t>(seconds) * 1000;
+}
+
+void ClientController::show_pending_message(const PendingMessage& message) {
+  MESSAGEU_ALLOC_SITE(View);
+  if (!message.error.empty()) {
+    m_view->show_error(message.error);
+    return;
+  }
+  m_view->show_pending_message(message);
+}
@@ -1,21 +1,46 @@
 #pragma once
 #include <memory>
+#include <mutex>
+#include <string>
+#include "../messageu_client.hpp"
 #include "../model/client_model.hpp"
 #include "../view/client_view.hpp"
 
+// Interactive frontend: prompts for commands and shows the results of the
+// MessageUClient calls that carry them out
 class ClientController {
  public:
   ClientController(std::unique_ptr<ClientModel> model,
-                   std::unique_ptr<ClientView> view);
-  ~ClientController();
+                   std::unique_ptr<ClientView> view,
+                   const MessageUClient::Options& options = default_options());
   ClientController(const ClientController& other) = delete;
   ClientController& operator=(const ClientController& other) = delete;
-  ClientController(ClientController&& other) noexcept = default;
-  ClientController& operator=(ClientController&& other) noexcept = default;
+  // Not movable: the subscription handler holds a pointer to this object
+  ClientController(ClientController&& other) = delete;
+  ClientController& operator=(ClientController&& other) = delete;
 
   void run();
+  // Shows incoming messages from a background thread until destroyed, see
+  // MessageUClient::start_polling. Throws when not registered.
+  void start_polling(const MessageUClient::PollOptions& options);
+
+  // Options of the interactive client: it keeps the message history
+  static MessageUClient::Options default_options();
 
  private:
-  std::unique_ptr<ClientModel> m_model;
+  // Prompts for a client name, which must be in the client list
+  std::string prompt_client_name(const std::string& prompt);
+  // Prompts for a local date and time, "YYYY-MM-DD" or "YYYY-MM-DD HH:MM".
+  // Returns its unix time in milliseconds, or `empty` when nothing is
+  // entered. A date alone stands for the end of the day when `end_of_day`.
+  int64_t prompt_time_ms(const std::string& prompt,
+                         int64_t empty,
+                         bool end_of_day);
+  void show_pending_message(const PendingMessage& message);
+
   std::unique_ptr<ClientView> m_view;
-};
\ No newline at end of file
+  // Serializes pushed-message output against user commands
+  std::mutex m_state_mutex;
+  // Last member, so the subscription handler stops before the view goes
+  std::unique_ptr<MessageUClient> m_client;
+};
@@ -0,0 +1,61 @@
+#include "crypto_backend.hpp"
+#include <cstdlib>
+#include <mutex>
+#include <stdexcept>
+
+#ifndef MESSAGEU_DEFAULT_CRYPTO_BACKEND
+#define MESSAGEU_DEFAULT_CRYPTO_BACKEND "cryptopp"
+#endif
+
+#ifdef MESSAGEU_WITH_CRYPTOPP
+std::unique_ptr<CryptoBackend> make_cryptopp_backend();
+#endif
+#ifdef MESSAGEU_WITH_OPENSSL
+std::unique_ptr<CryptoBackend> make_openssl_backend();
+#endif
+
+namespace {
+
+std::unique_ptr<CryptoBackend> g_backend;
+std::once_flag g_backend_once;
+
+void init_default_backend() {
+  const char* env = std::getenv("MESSAGEU_CRYPTO_BACKEND");
+  g_backend = make_crypto_backend(env && *env ? env
+                                              : MESSAGEU_DEFAULT_CRYPTO_BACKEND);
+}
+
+}  // namespace
+
+std::unique_ptr<CryptoBackend> make_crypto_backend(const std::string& name) {
+#ifdef MESSAGEU_WITH_CRYPTOPP
+  if (name == "cryptopp")
+    return make_cryptopp_backend();
+#endif
+#ifdef MESSAGEU_WITH_OPENSSL
+  if (name == "openssl")
+    return make_openssl_backend();
+#endif
+  throw std::runtime_error("Crypto backend not available: " + name);
+}
+
+std::vector<std::string> available_crypto_backends() {
+  std::vector<std::string> names;
+#ifdef MESSAGEU_WITH_CRYPTOPP
+  names.push_back("cryptopp");
+#endif
+#ifdef MESSAGEU_WITH_OPENSSL
+  names.push_back("openssl");
+#endif
+  return names;
+}
+
+CryptoBackend& crypto_backend() {
+  std::call_once(g_backend_once, init_default_backend);
+  return *g_backend;
+}
+
+void select_crypto_backend(const std::string& name) {
+  std::call_once(g_backend_once, [] {});
+  g_backend = make_crypto_backend(name);
+}
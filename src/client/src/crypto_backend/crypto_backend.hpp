@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Library-neutral crypto primitives used by the wrappers in cryptopp_wrapper/.
+// All implementations are wire compatible with each other:
+//  - AES-128-CBC with PKCS#7 padding (the IV is chosen by the caller)
+//  - RSA keys as DER: X.509 SubjectPublicKeyInfo / PKCS#8 PrivateKeyInfo
+//  - RSA-OAEP with SHA-1 and MGF1-SHA-1
+//  - HMAC-SHA-256
+// Backends are shared between threads; every method must be thread-safe.
+
+// Incremental AES-CBC transformation, see AESStreamCipher
+class AesCbcStream {
+ public:
+  virtual ~AesCbcStream() = default;
+  virtual std::string update(const unsigned char* data, size_t length) = 0;
+  virtual std::string finish() = 0;
+};
+
+class RsaPublicKey {
+ public:
+  virtual ~RsaPublicKey() = default;
+  virtual std::string der() const = 0;
+  virtual std::string encrypt(const unsigned char* plain, size_t length) = 0;
+};
+
+class RsaPrivateKey {
+ public:
+  virtual ~RsaPrivateKey() = default;
+  virtual std::string der() const = 0;
+  virtual std::string public_der() const = 0;
+  virtual std::string decrypt(const unsigned char* cipher, size_t length) = 0;
+};
+
+class CryptoBackend {
+ public:
+  virtual ~CryptoBackend() = default;
+
+  virtual const char* name() const = 0;
+
+  virtual void random_bytes(unsigned char* out, size_t length) = 0;
+
+  virtual std::string aes_cbc_encrypt(const unsigned char* key,
+                                      size_t key_length,
+                                      const unsigned char* iv,
+                                      const unsigned char* plain,
+                                      size_t length) = 0;
+  virtual std::string aes_cbc_decrypt(const unsigned char* key,
+                                      size_t key_length,
+                                      const unsigned char* iv,
+                                      const unsigned char* cipher,
+                                      size_t length) = 0;
+  virtual std::unique_ptr<AesCbcStream> aes_cbc_stream(
+      const unsigned char* key,
+      size_t key_length,
+      const unsigned char* iv,
+      bool encrypt) = 0;
+
+  // The 32-byte tag of `data`
+  virtual std::string hmac_sha256(const unsigned char* key,
+                                  size_t key_length,
+                                  const unsigned char* data,
+                                  size_t length) = 0;
+
+  // Public exponent is 17 so a 1024-bit public key DER is exactly 160 bytes
+  virtual std::unique_ptr<RsaPrivateKey> rsa_generate(unsigned int bits) = 0;
+  virtual std::unique_ptr<RsaPrivateKey> rsa_load_private(
+      const std::string& der) = 0;
+  virtual std::unique_ptr<RsaPublicKey> rsa_load_public(
+      const std::string& der) = 0;
+
+  virtual std::string base64_encode(const std::string& data) = 0;
+  virtual std::string base64_decode(const std::string& data) = 0;
+};
+
+// The process-wide backend. Chosen on first use from the
+// MESSAGEU_CRYPTO_BACKEND environment variable, else the build default.
+CryptoBackend& crypto_backend();
+
+// Switches the process-wide backend by name. Throws if it was not built in.
+// Only call while no other thread is using crypto.
+void select_crypto_backend(const std::string& name);
+
+// Names of the backends compiled into this binary
+std::vector<std::string> available_crypto_backends();
+
+// Creates a backend instance by name, independent of the process-wide one.
+// Throws if it was not built in.
+std::unique_ptr<CryptoBackend> make_crypto_backend(const std::string& name);
@@ -0,0 +1,217 @@
+#include <cryptopp/aes.h>
+#include <cryptopp/base64.h>
+#include <cryptopp/filters.h>
+#include <cryptopp/hmac.h>
+#include <cryptopp/modes.h>
+#include <cryptopp/osrng.h>
+#include <cryptopp/rsa.h>
+#include <cryptopp/sha.h>
+
+#include <stdexcept>
+#include "crypto_backend.hpp"
+
+namespace {
+
+// AutoSeededRandomPool is not thread-safe, so every thread gets its own
+CryptoPP::AutoSeededRandomPool& thread_rng() {
+  thread_local CryptoPP::AutoSeededRandomPool rng;
+  return rng;
+}
+
+std::string cbc_transform(CryptoPP::StreamTransformation& mode,
+                          const unsigned char* data,
+                          size_t length) {
+  std::string out;
+  CryptoPP::StreamTransformationFilter filter(mode,
+                                              new CryptoPP::StringSink(out));
+  filter.Put(data, length);
+  filter.MessageEnd();
+  return out;
+}
+
+class CryptoppAesCbcStream : public AesCbcStream {
+ public:
+  CryptoppAesCbcStream(const unsigned char* key,
+                       size_t key_length,
+                       const unsigned char* iv,
+                       bool encrypt) {
+    if (encrypt)
+      m_mode.reset(new CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption(
+          key, key_length, iv));
+    else
+      m_mode.reset(new CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption(
+          key, key_length, iv));
+    m_filter.reset(new CryptoPP::StreamTransformationFilter(
+        *m_mode, new CryptoPP::StringSink(m_out)));
+  }
+
+  std::string update(const unsigned char* data, size_t length) override {
+    m_filter->Put(data, length);
+    std::string chunk;
+    chunk.swap(m_out);
+    return chunk;
+  }
+
+  std::string finish() override {
+    m_filter->MessageEnd();
+    std::string chunk;
+    chunk.swap(m_out);
+    return chunk;
+  }
+
+ private:
+  std::unique_ptr<CryptoPP::StreamTransformation> m_mode;
+  std::string m_out;
+  std::unique_ptr<CryptoPP::StreamTransformationFilter> m_filter;
+};
+
+class CryptoppRsaPublicKey : public RsaPublicKey {
+ public:
+  explicit CryptoppRsaPublicKey(const std::string& der) {
+    CryptoPP::StringSource ss(der, true);
+    m_key.Load(ss);
+  }
+
+  std::string der() const override {
+    std::string key;
+    CryptoPP::StringSink ss(key);
+    m_key.Save(ss);
+    return key;
+  }
+
+  std::string encrypt(const unsigned char* plain, size_t length) override {
+    std::string cipher;
+    CryptoPP::RSAES_OAEP_SHA_Encryptor e(m_key);
+    CryptoPP::StringSource ss(plain, length, true,
+                              new CryptoPP::PK_EncryptorFilter(
+                                  thread_rng(), e,
+                                  new CryptoPP::StringSink(cipher)));
+    return cipher;
+  }
+
+ private:
+  CryptoPP::RSA::PublicKey m_key;
+};
+
+class CryptoppRsaPrivateKey : public RsaPrivateKey {
+ public:
+  explicit CryptoppRsaPrivateKey(unsigned int bits) {
+    // Crypto++ defaults the public exponent to 17
+    m_key.Initialize(thread_rng(), bits);
+  }
+
+  explicit CryptoppRsaPrivateKey(const std::string& der) {
+    CryptoPP::StringSource ss(der, true);
+    m_key.Load(ss);
+  }
+
+  std::string der() const override {
+    std::string key;
+    CryptoPP::StringSink ss(key);
+    m_key.Save(ss);
+    return key;
+  }
+
+  std::string public_der() const override {
+    CryptoPP::RSAFunction public_key(m_key);
+    std::string key;
+    CryptoPP::StringSink ss(key);
+    public_key.Save(ss);
+    return key;
+  }
+
+  std::string decrypt(const unsigned char* cipher, size_t length) override {
+    std::string decrypted;
+    CryptoPP::RSAES_OAEP_SHA_Decryptor d(m_key);
+    CryptoPP::StringSource ss(cipher, length, true,
+                              new CryptoPP::PK_DecryptorFilter(
+                                  thread_rng(), d,
+                                  new CryptoPP::StringSink(decrypted)));
+    return decrypted;
+  }
+
+ private:
+  CryptoPP::RSA::PrivateKey m_key;
+};
+
+class CryptoppBackend : public CryptoBackend {
+ public:
+  const char* name() const override { return "cryptopp"; }
+
+  void random_bytes(unsigned char* out, size_t length) override {
+    thread_rng().GenerateBlock(out, length);
+  }
+
+  std::string aes_cbc_encrypt(const unsigned char* key,
+                              size_t key_length,
+                              const unsigned char* iv,
+                              const unsigned char* plain,
+                              size_t length) override {
+    CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption mode(key, key_length, iv);
+    return cbc_transform(mode, plain, length);
+  }
+
+  std::string aes_cbc_decrypt(const unsigned char* key,
+                              size_t key_length,
+                              const unsigned char* iv,
+                              const unsigned char* cipher,
+                              size_t length) override {
+    CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption mode(key, key_length, iv);
+    return cbc_transform(mode, cipher, length);
+  }
+
+  std::unique_ptr<AesCbcStream> aes_cbc_stream(const unsigned char* key,
+                                               size_t key_length,
+                                               const unsigned char* iv,
+                                               bool encrypt) override {
+    return std::make_unique<CryptoppAesCbcStream>(key, key_length, iv,
+                                                  encrypt);
+  }
+
+  std::string hmac_sha256(const unsigned char* key,
+                          size_t key_length,
+                          const unsigned char* data,
+                          size_t length) override {
+    CryptoPP::HMAC<CryptoPP::SHA256> hmac(key, key_length);
+    std::string tag(CryptoPP::HMAC<CryptoPP::SHA256>::DIGESTSIZE, '\0');
+    hmac.CalculateDigest(reinterpret_cast<unsigned char*>(tag.data()), data,
+                         length);
+    return tag;
+  }
+
+  std::unique_ptr<RsaPrivateKey> rsa_generate(unsigned int bits) override {
+    return std::make_unique<CryptoppRsaPrivateKey>(bits);
+  }
+
+  std::unique_ptr<RsaPrivateKey> rsa_load_private(
+      const std::string& der) override {
+    return std::make_unique<CryptoppRsaPrivateKey>(der);
+  }
+
+  std::unique_ptr<RsaPublicKey> rsa_load_public(
+      const std::string& der) override {
+    return std::make_unique<CryptoppRsaPublicKey>(der);
+  }
+
+  std::string base64_encode(const std::string& data) override {
+    std::string encoded;
+    CryptoPP::StringSource ss(
+        data, true,
+        new CryptoPP::Base64Encoder(new CryptoPP::StringSink(encoded)));
+    return encoded;
+  }
+
+  std::string base64_decode(const std::string& data) override {
+    std::string decoded;
+    CryptoPP::StringSource ss(
+        data, true,
+        new CryptoPP::Base64Decoder(new CryptoPP::StringSink(decoded)));
+    return decoded;
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<CryptoBackend> make_cryptopp_backend() {
+  return std::make_unique<CryptoppBackend>();
+}
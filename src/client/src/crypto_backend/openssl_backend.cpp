@@ -0,0 +1,325 @@
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include "crypto_backend.hpp"
+
+namespace {
+
+void throw_openssl_error(const char* what) {
+  char reason[256] = "unknown error";
+  unsigned long err = ERR_get_error();
+  if (err != 0)
+    ERR_error_string_n(err, reason, sizeof(reason));
+  ERR_clear_error();
+  throw std::runtime_error(std::string(what) + ": " + reason);
+}
+
+struct CipherCtxDeleter {
+  void operator()(EVP_CIPHER_CTX* ctx) const { EVP_CIPHER_CTX_free(ctx); }
+};
+struct PkeyDeleter {
+  void operator()(EVP_PKEY* key) const { EVP_PKEY_free(key); }
+};
+struct PkeyCtxDeleter {
+  void operator()(EVP_PKEY_CTX* ctx) const { EVP_PKEY_CTX_free(ctx); }
+};
+struct BignumDeleter {
+  void operator()(BIGNUM* bn) const { BN_free(bn); }
+};
+struct Pkcs8Deleter {
+  void operator()(PKCS8_PRIV_KEY_INFO* info) const {
+    PKCS8_PRIV_KEY_INFO_free(info);
+  }
+};
+struct EncodeCtxDeleter {
+  void operator()(EVP_ENCODE_CTX* ctx) const { EVP_ENCODE_CTX_free(ctx); }
+};
+
+using CipherCtx = std::unique_ptr<EVP_CIPHER_CTX, CipherCtxDeleter>;
+using Pkey = std::unique_ptr<EVP_PKEY, PkeyDeleter>;
+using PkeyCtx = std::unique_ptr<EVP_PKEY_CTX, PkeyCtxDeleter>;
+
+const EVP_CIPHER* aes_cbc_cipher(size_t key_length) {
+  switch (key_length) {
+    case 16:
+      return EVP_aes_128_cbc();
+    case 24:
+      return EVP_aes_192_cbc();
+    case 32:
+      return EVP_aes_256_cbc();
+  }
+  throw std::runtime_error("Invalid AES key length");
+}
+
+// EVP_*Update takes an int length, feed larger buffers in pieces
+constexpr size_t MAX_UPDATE_SIZE = INT_MAX - 32;
+
+class OpensslAesCbcStream : public AesCbcStream {
+ public:
+  OpensslAesCbcStream(const unsigned char* key,
+                      size_t key_length,
+                      const unsigned char* iv,
+                      bool encrypt)
+      : m_ctx(EVP_CIPHER_CTX_new()) {
+    if (!m_ctx)
+      throw_openssl_error("EVP_CIPHER_CTX_new");
+    if (EVP_CipherInit_ex(m_ctx.get(), aes_cbc_cipher(key_length), nullptr,
+                          key, iv, encrypt ? 1 : 0) != 1)
+      throw_openssl_error("EVP_CipherInit_ex");
+  }
+
+  std::string update(const unsigned char* data, size_t length) override {
+    std::string out;
+    out.resize(length + EVP_MAX_BLOCK_LENGTH);
+    size_t written = 0;
+    while (length > 0) {
+      size_t piece = std::min(length, MAX_UPDATE_SIZE);
+      int n = 0;
+      if (EVP_CipherUpdate(m_ctx.get(),
+                           reinterpret_cast<unsigned char*>(&out[written]), &n,
+                           data, static_cast<int>(piece)) != 1)
+        throw_openssl_error("EVP_CipherUpdate");
+      written += n;
+      data += piece;
+      length -= piece;
+    }
+    out.resize(written);
+    return out;
+  }
+
+  std::string finish() override {
+    std::string out(EVP_MAX_BLOCK_LENGTH, '\0');
+    int n = 0;
+    if (EVP_CipherFinal_ex(m_ctx.get(),
+                           reinterpret_cast<unsigned char*>(&out[0]),
+                           &n) != 1)
+      throw_openssl_error("EVP_CipherFinal_ex");
+    out.resize(n);
+    return out;
+  }
+
+ private:
+  CipherCtx m_ctx;
+};
+
+std::string pkey_public_der(EVP_PKEY* key) {
+  int length = i2d_PUBKEY(key, nullptr);
+  if (length <= 0)
+    throw_openssl_error("i2d_PUBKEY");
+  std::string der(length, '\0');
+  unsigned char* p = reinterpret_cast<unsigned char*>(&der[0]);
+  i2d_PUBKEY(key, &p);
+  return der;
+}
+
+// Runs an EVP_PKEY encrypt/decrypt operation with OAEP SHA-1 padding
+template <typename Init, typename Op>
+std::string rsa_oaep(EVP_PKEY* key,
+                     Init init,
+                     Op op,
+                     const unsigned char* in,
+                     size_t length,
+                     const char* what) {
+  PkeyCtx ctx(EVP_PKEY_CTX_new(key, nullptr));
+  if (!ctx || init(ctx.get()) != 1 ||
+      EVP_PKEY_CTX_set_rsa_padding(ctx.get(), RSA_PKCS1_OAEP_PADDING) != 1 ||
+      EVP_PKEY_CTX_set_rsa_oaep_md(ctx.get(), EVP_sha1()) != 1 ||
+      EVP_PKEY_CTX_set_rsa_mgf1_md(ctx.get(), EVP_sha1()) != 1)
+    throw_openssl_error(what);
+  size_t out_length = 0;
+  if (op(ctx.get(), nullptr, &out_length, in, length) != 1)
+    throw_openssl_error(what);
+  std::string out(out_length, '\0');
+  if (op(ctx.get(), reinterpret_cast<unsigned char*>(&out[0]), &out_length, in,
+         length) != 1)
+    throw_openssl_error(what);
+  out.resize(out_length);
+  return out;
+}
+
+class OpensslRsaPublicKey : public RsaPublicKey {
+ public:
+  explicit OpensslRsaPublicKey(const std::string& der) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(der.data());
+    m_key.reset(d2i_PUBKEY(nullptr, &p, static_cast<long>(der.size())));
+    if (!m_key)
+      throw_openssl_error("Invalid RSA public key");
+  }
+
+  std::string der() const override { return pkey_public_der(m_key.get()); }
+
+  std::string encrypt(const unsigned char* plain, size_t length) override {
+    return rsa_oaep(m_key.get(), EVP_PKEY_encrypt_init, EVP_PKEY_encrypt,
+                    plain, length, "RSA encrypt");
+  }
+
+ private:
+  Pkey m_key;
+};
+
+class OpensslRsaPrivateKey : public RsaPrivateKey {
+ public:
+  explicit OpensslRsaPrivateKey(unsigned int bits) {
+    PkeyCtx ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr));
+    std::unique_ptr<BIGNUM, BignumDeleter> exponent(BN_new());
+    EVP_PKEY* key = nullptr;
+    if (!ctx || !exponent || BN_set_word(exponent.get(), 17) != 1 ||
+        EVP_PKEY_keygen_init(ctx.get()) != 1 ||
+        EVP_PKEY_CTX_set_rsa_keygen_bits(ctx.get(), bits) != 1 ||
+        EVP_PKEY_CTX_set1_rsa_keygen_pubexp(ctx.get(), exponent.get()) != 1 ||
+        EVP_PKEY_keygen(ctx.get(), &key) != 1)
+      throw_openssl_error("RSA key generation");
+    m_key.reset(key);
+  }
+
+  explicit OpensslRsaPrivateKey(const std::string& der) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(der.data());
+    m_key.reset(d2i_AutoPrivateKey(nullptr, &p, static_cast<long>(der.size())));
+    if (!m_key)
+      throw_openssl_error("Invalid RSA private key");
+  }
+
+  std::string der() const override {
+    std::unique_ptr<PKCS8_PRIV_KEY_INFO, Pkcs8Deleter> info(
+        EVP_PKEY2PKCS8(m_key.get()));
+    int length = info ? i2d_PKCS8_PRIV_KEY_INFO(info.get(), nullptr) : 0;
+    if (length <= 0)
+      throw_openssl_error("i2d_PKCS8_PRIV_KEY_INFO");
+    std::string der(length, '\0');
+    unsigned char* p = reinterpret_cast<unsigned char*>(&der[0]);
+    i2d_PKCS8_PRIV_KEY_INFO(info.get(), &p);
+    return der;
+  }
+
+  std::string public_der() const override {
+    return pkey_public_der(m_key.get());
+  }
+
+  std::string decrypt(const unsigned char* cipher, size_t length) override {
+    return rsa_oaep(m_key.get(), EVP_PKEY_decrypt_init, EVP_PKEY_decrypt,
+                    cipher, length, "RSA decrypt");
+  }
+
+ private:
+  Pkey m_key;
+};
+
+class OpensslBackend : public CryptoBackend {
+ public:
+  const char* name() const override { return "openssl"; }
+
+  void random_bytes(unsigned char* out, size_t length) override {
+    while (length > 0) {
+      int piece = static_cast<int>(std::min<size_t>(length, INT_MAX));
+      if (RAND_bytes(out, piece) != 1)
+        throw_openssl_error("RAND_bytes");
+      out += piece;
+      length -= piece;
+    }
+  }
+
+  std::string aes_cbc_encrypt(const unsigned char* key,
+                              size_t key_length,
+                              const unsigned char* iv,
+                              const unsigned char* plain,
+                              size_t length) override {
+    OpensslAesCbcStream stream(key, key_length, iv, true);
+    std::string out = stream.update(plain, length);
+    out += stream.finish();
+    return out;
+  }
+
+  std::string aes_cbc_decrypt(const unsigned char* key,
+                              size_t key_length,
+                              const unsigned char* iv,
+                              const unsigned char* cipher,
+                              size_t length) override {
+    OpensslAesCbcStream stream(key, key_length, iv, false);
+    std::string out = stream.update(cipher, length);
+    out += stream.finish();
+    return out;
+  }
+
+  std::unique_ptr<AesCbcStream> aes_cbc_stream(const unsigned char* key,
+                                               size_t key_length,
+                                               const unsigned char* iv,
+                                               bool encrypt) override {
+    return std::make_unique<OpensslAesCbcStream>(key, key_length, iv,
+                                                 encrypt);
+  }
+
+  std::string hmac_sha256(const unsigned char* key,
+                          size_t key_length,
+                          const unsigned char* data,
+                          size_t length) override {
+    if (key_length > INT_MAX)
+      throw std::runtime_error("HMAC key too long");
+    std::string tag(EVP_MAX_MD_SIZE, '\0');
+    unsigned int tag_length = 0;
+    if (!HMAC(EVP_sha256(), key, static_cast<int>(key_length), data, length,
+              reinterpret_cast<unsigned char*>(tag.data()), &tag_length))
+      throw_openssl_error("HMAC");
+    tag.resize(tag_length);
+    return tag;
+  }
+
+  std::unique_ptr<RsaPrivateKey> rsa_generate(unsigned int bits) override {
+    return std::make_unique<OpensslRsaPrivateKey>(bits);
+  }
+
+  std::unique_ptr<RsaPrivateKey> rsa_load_private(
+      const std::string& der) override {
+    return std::make_unique<OpensslRsaPrivateKey>(der);
+  }
+
+  std::unique_ptr<RsaPublicKey> rsa_load_public(
+      const std::string& der) override {
+    return std::make_unique<OpensslRsaPublicKey>(der);
+  }
+
+  // Single line output; the decoder below also accepts the 72-column
+  // output written by the Crypto++ backend
+  std::string base64_encode(const std::string& data) override {
+    if (data.size() > MAX_UPDATE_SIZE / 4 * 3)
+      throw std::runtime_error("Base64 input too large");
+    std::string encoded(4 * ((data.size() + 2) / 3) + 1, '\0');
+    int n = EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&encoded[0]),
+                            reinterpret_cast<const unsigned char*>(data.data()),
+                            static_cast<int>(data.size()));
+    encoded.resize(n);
+    return encoded;
+  }
+
+  std::string base64_decode(const std::string& data) override {
+    if (data.size() > MAX_UPDATE_SIZE)
+      throw std::runtime_error("Base64 input too large");
+    std::unique_ptr<EVP_ENCODE_CTX, EncodeCtxDeleter> ctx(EVP_ENCODE_CTX_new());
+    if (!ctx)
+      throw_openssl_error("EVP_ENCODE_CTX_new");
+    std::string decoded(data.size() / 4 * 3 + 3, '\0');
+    unsigned char* out = reinterpret_cast<unsigned char*>(&decoded[0]);
+    int n = 0;
+    int tail = 0;
+    EVP_DecodeInit(ctx.get());
+    if (EVP_DecodeUpdate(ctx.get(), out, &n,
+                         reinterpret_cast<const unsigned char*>(data.data()),
+                         static_cast<int>(data.size())) < 0 ||
+        EVP_DecodeFinal(ctx.get(), out + n, &tail) != 1)
+      throw std::runtime_error("Invalid base64 input");
+    decoded.resize(n + tail);
+    return decoded;
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<CryptoBackend> make_openssl_backend() {
+  return std::make_unique<OpensslBackend>();
+}
@@ -1,18 +1,16 @@
 #include "AESWrapper.h"
 
-#include <cryptopp/modes.h>
-#include <cryptopp/aes.h>
-#include <cryptopp/filters.h>
+#include "../alloc_profile.hpp"
+#include "../crypto_backend/crypto_backend.hpp"
 
+#include <cstring>
 #include <stdexcept>
-#include <immintrin.h>	// _rdrand32_step
 
-using namespace CryptoPP;
+static const unsigned int BLOCKSIZE = 16;
 
 unsigned int* AESWrapper::GenerateKey(unsigned int* buffer, unsigned int length)
 {
-	for (size_t i = 0; i < length; i += sizeof(unsigned int))
-		_rdrand32_step(&buffer[i]);
+	crypto_backend().random_bytes(reinterpret_cast<unsigned char*>(buffer), length);
 	return buffer;
 }
 
@@ -25,7 +23,7 @@ AESWrapper::AESWrapper(const unsigned char* key, unsigned int length)
 {
 	if (length != DEFAULT_KEYLENGTH)
 		throw std::length_error("key length must be 16 bytes");
-	memcpy_s(_key, DEFAULT_KEYLENGTH, key, length);
+	memcpy(_key, key, length);
 }
 
 AESWrapper::~AESWrapper()
@@ -39,31 +37,56 @@ const unsigned char* AESWrapper::getKey() const
 
 std::string AESWrapper::encrypt(const char* plain, unsigned int length)
 {
-	byte iv[CryptoPP::AES::BLOCKSIZE] = { 0 };	// for practical use iv should never be a fixed value!
+	MESSAGEU_ALLOC_SITE(Crypto);
+	unsigned char iv[BLOCKSIZE] = { 0 };	// for practical use iv should never be a fixed value!
 
-	CryptoPP::AES::Encryption aesEncryption(_key, DEFAULT_KEYLENGTH);
-	CryptoPP::CBC_Mode_ExternalCipher::Encryption cbcEncryption(aesEncryption, iv);
+	return crypto_backend().aes_cbc_encrypt(_key, DEFAULT_KEYLENGTH, iv, reinterpret_cast<const unsigned char*>(plain), length);
+}
 
-	std::string cipher;
-	CryptoPP::StreamTransformationFilter stfEncryptor(cbcEncryption, new CryptoPP::StringSink(cipher));
-	stfEncryptor.Put(reinterpret_cast<const byte*>(plain), length);
-	stfEncryptor.MessageEnd();
 
-	return cipher;
+std::string AESWrapper::decrypt(const char* cipher, unsigned int length)
+{
+	MESSAGEU_ALLOC_SITE(Crypto);
+	unsigned char iv[BLOCKSIZE] = { 0 };	// for practical use iv should never be a fixed value!
+
+	return crypto_backend().aes_cbc_decrypt(_key, DEFAULT_KEYLENGTH, iv, reinterpret_cast<const unsigned char*>(cipher), length);
 }
 
+unsigned long long AESWrapper::cipherSize(unsigned long long plainLength)
+{
+	// PKCS#7 padding always adds between 1 and BLOCKSIZE bytes
+	return (plainLength / BLOCKSIZE + 1) * BLOCKSIZE;
+}
 
-std::string AESWrapper::decrypt(const char* cipher, unsigned int length)
+
+struct AESStreamCipher::Impl
+{
+	std::unique_ptr<AesCbcStream> stream;
+};
+
+AESStreamCipher::AESStreamCipher(const unsigned char* key, unsigned int length, Direction direction)
+	: _impl(new Impl)
 {
-	byte iv[CryptoPP::AES::BLOCKSIZE] = { 0 };	// for practical use iv should never be a fixed value!
+	MESSAGEU_ALLOC_SITE(Crypto);
+	if (length != AESWrapper::DEFAULT_KEYLENGTH)
+		throw std::length_error("key length must be 16 bytes");
 
-	CryptoPP::AES::Decryption aesDecryption(_key, DEFAULT_KEYLENGTH);
-	CryptoPP::CBC_Mode_ExternalCipher::Decryption cbcDecryption(aesDecryption, iv);
+	unsigned char iv[BLOCKSIZE] = { 0 };	// must match AESWrapper::encrypt/decrypt
+	_impl->stream = crypto_backend().aes_cbc_stream(key, length, iv, direction == Direction::Encrypt);
+}
 
-	std::string decrypted;
-	CryptoPP::StreamTransformationFilter stfDecryptor(cbcDecryption, new CryptoPP::StringSink(decrypted));
-	stfDecryptor.Put(reinterpret_cast<const byte*>(cipher), length);
-	stfDecryptor.MessageEnd();
+AESStreamCipher::~AESStreamCipher()
+{
+}
 
-	return decrypted;
+std::string AESStreamCipher::update(const char* data, unsigned int length)
+{
+	MESSAGEU_ALLOC_SITE(Crypto);
+	return _impl->stream->update(reinterpret_cast<const unsigned char*>(data), length);
+}
+
+std::string AESStreamCipher::finish()
+{
+	MESSAGEU_ALLOC_SITE(Crypto);
+	return _impl->stream->finish();
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <string>
 
 
@@ -21,4 +22,32 @@ public:
 
 	std::string encrypt(const char* plain, unsigned int length);
 	std::string decrypt(const char* cipher, unsigned int length);
+
+	// Size of the ciphertext encrypt() produces for a plaintext of this length
+	static unsigned long long cipherSize(unsigned long long plainLength);
+};
+
+
+// Incremental AES-CBC transformation, compatible with AESWrapper::encrypt/decrypt.
+// Feed input in chunks through update() and collect the output as it is produced,
+// so arbitrarily large inputs are processed with constant memory.
+class AESStreamCipher
+{
+public:
+	enum class Direction { Encrypt, Decrypt };
+
+	AESStreamCipher(const unsigned char* key, unsigned int length, Direction direction);
+	~AESStreamCipher();
+
+	// Returns the output available so far (may be empty while a block is buffered)
+	std::string update(const char* data, unsigned int length);
+	// Flushes the final block (adds or strips padding). Call exactly once.
+	std::string finish();
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> _impl;
+
+	AESStreamCipher(const AESStreamCipher&);
+	AESStreamCipher& operator=(const AESStreamCipher&);
 };
\ No newline at end of file
@@ -1,26 +1,17 @@
 #include "Base64Wrapper.h"
 
+#include "../alloc_profile.hpp"
+#include "../crypto_backend/crypto_backend.hpp"
+
 
 std::string Base64Wrapper::encode(const std::string& str)
 {
-	std::string encoded;
-	CryptoPP::StringSource ss(str, true,
-		new CryptoPP::Base64Encoder(
-			new CryptoPP::StringSink(encoded)
-		) // Base64Encoder
-	); // StringSource
-
-	return encoded;
+	MESSAGEU_ALLOC_SITE(Crypto);
+	return crypto_backend().base64_encode(str);
 }
 
 std::string Base64Wrapper::decode(const std::string& str)
 {
-	std::string decoded;
-	CryptoPP::StringSource ss(str, true,
-		new CryptoPP::Base64Decoder(
-			new CryptoPP::StringSink(decoded)
-		) // Base64Decoder
-	); // StringSource
-
-	return decoded;
+	MESSAGEU_ALLOC_SITE(Crypto);
+	return crypto_backend().base64_decode(str);
 }
@@ -1,7 +1,6 @@
 #pragma once
 
 #include <string>
-#include <cryptopp/base64.h>
 
 
 class Base64Wrapper
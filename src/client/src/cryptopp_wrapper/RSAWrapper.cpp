@@ -1,110 +1,96 @@
 #include "RSAWrapper.h"
 
-RSAPublicWrapper::RSAPublicWrapper(const char* key, unsigned int length) {
-  CryptoPP::StringSource ss(reinterpret_cast<const byte*>(key), length, true);
-  _publicKey.Load(ss);
+#include <cstring>
+#include <stdexcept>
+#include "../alloc_profile.hpp"
+#include "../crypto_backend/crypto_backend.hpp"
+
+// Copies a DER key into a caller buffer, which must be large enough
+static char* copy_key(const std::string& key, char* keyout,
+                      unsigned int length) {
+  if (key.size() > length)
+    throw std::length_error("key buffer too small");
+  memcpy(keyout, key.data(), key.size());
+  return keyout;
+}
+
+// Key loading and generation, counted as crypto allocations
+static std::unique_ptr<RsaPublicKey> load_public(const std::string& key) {
+  MESSAGEU_ALLOC_SITE(Crypto);
+  return crypto_backend().rsa_load_public(key);
 }
 
-RSAPublicWrapper::RSAPublicWrapper(const std::string& key) {
-  CryptoPP::StringSource ss(key, true);
-  _publicKey.Load(ss);
+static std::unique_ptr<RsaPrivateKey> load_private(const std::string& key) {
+  MESSAGEU_ALLOC_SITE(Crypto);
+  return crypto_backend().rsa_load_private(key);
 }
 
+static std::unique_ptr<RsaPrivateKey> generate_private(unsigned int bits) {
+  MESSAGEU_ALLOC_SITE(Crypto);
+  return crypto_backend().rsa_generate(bits);
+}
+
+RSAPublicWrapper::RSAPublicWrapper(const char* key, unsigned int length)
+    : RSAPublicWrapper(std::string(key, length)) {}
+
+RSAPublicWrapper::RSAPublicWrapper(const std::string& key)
+    : _publicKey(load_public(key)) {}
+
 RSAPublicWrapper::~RSAPublicWrapper() {}
 
 std::string RSAPublicWrapper::getPublicKey() const {
-  std::string key;
-  CryptoPP::StringSink ss(key);
-  _publicKey.Save(ss);
-  return key;
+  return _publicKey->der();
 }
 
 char* RSAPublicWrapper::getPublicKey(char* keyout, unsigned int length) const {
-  CryptoPP::ArraySink as(reinterpret_cast<byte*>(keyout), length);
-  _publicKey.Save(as);
-  return keyout;
+  return copy_key(getPublicKey(), keyout, length);
 }
 
 std::string RSAPublicWrapper::encrypt(const std::string& plain) {
-  std::string cipher;
-  CryptoPP::RSAES_OAEP_SHA_Encryptor e(_publicKey);
-  CryptoPP::StringSource ss(plain, true,
-                            new CryptoPP::PK_EncryptorFilter(
-                                _rng, e, new CryptoPP::StringSink(cipher)));
-  return cipher;
+  return encrypt(plain.data(), plain.size());
 }
 
 std::string RSAPublicWrapper::encrypt(const char* plain, unsigned int length) {
-  std::string cipher;
-  CryptoPP::RSAES_OAEP_SHA_Encryptor e(_publicKey);
-  CryptoPP::StringSource ss(reinterpret_cast<const byte*>(plain), length, true,
-                            new CryptoPP::PK_EncryptorFilter(
-                                _rng, e, new CryptoPP::StringSink(cipher)));
-  return cipher;
+  MESSAGEU_ALLOC_SITE(Crypto);
+  return _publicKey->encrypt(reinterpret_cast<const unsigned char*>(plain),
+                             length);
 }
 
-RSAPrivateWrapper::RSAPrivateWrapper() {
-  _privateKey.Initialize(_rng, BITS);
-}
+RSAPrivateWrapper::RSAPrivateWrapper()
+    : _privateKey(generate_private(BITS)) {}
 
-RSAPrivateWrapper::RSAPrivateWrapper(const char* key, unsigned int length) {
-  CryptoPP::StringSource ss(reinterpret_cast<const byte*>(key), length, true);
-  _privateKey.Load(ss);
-}
+RSAPrivateWrapper::RSAPrivateWrapper(const char* key, unsigned int length)
+    : RSAPrivateWrapper(std::string(key, length)) {}
 
-RSAPrivateWrapper::RSAPrivateWrapper(const std::string& key) {
-  CryptoPP::StringSource ss(key, true);
-  _privateKey.Load(ss);
-}
+RSAPrivateWrapper::RSAPrivateWrapper(const std::string& key)
+    : _privateKey(load_private(key)) {}
 
 RSAPrivateWrapper::~RSAPrivateWrapper() {}
 
 std::string RSAPrivateWrapper::getPrivateKey() const {
-  std::string key;
-  CryptoPP::StringSink ss(key);
-  _privateKey.Save(ss);
-  return key;
+  return _privateKey->der();
 }
 
 char* RSAPrivateWrapper::getPrivateKey(char* keyout,
                                        unsigned int length) const {
-  CryptoPP::ArraySink as(reinterpret_cast<byte*>(keyout), length);
-  _privateKey.Save(as);
-  return keyout;
+  return copy_key(getPrivateKey(), keyout, length);
 }
 
 std::string RSAPrivateWrapper::getPublicKey() const {
-  CryptoPP::RSAFunction publicKey(_privateKey);
-  std::string key;
-  CryptoPP::StringSink ss(key);
-  publicKey.Save(ss);
-  return key;
+  return _privateKey->public_der();
 }
 
 char* RSAPrivateWrapper::getPublicKey(char* keyout, unsigned int length) const {
-  CryptoPP::RSAFunction publicKey(_privateKey);
-  CryptoPP::ArraySink as(reinterpret_cast<byte*>(keyout), length);
-  publicKey.Save(as);
-  return keyout;
+  return copy_key(getPublicKey(), keyout, length);
 }
 
 std::string RSAPrivateWrapper::decrypt(const std::string& cipher) {
-  std::string decrypted;
-  CryptoPP::RSAES_OAEP_SHA_Decryptor d(_privateKey);
-  CryptoPP::StringSource ss_cipher(
-      cipher, true,
-      new CryptoPP::PK_DecryptorFilter(_rng, d,
-                                       new CryptoPP::StringSink(decrypted)));
-  return decrypted;
+  return decrypt(cipher.data(), cipher.size());
 }
 
 std::string RSAPrivateWrapper::decrypt(const char* cipher,
                                        unsigned int length) {
-  std::string decrypted;
-  CryptoPP::RSAES_OAEP_SHA_Decryptor d(_privateKey);
-  CryptoPP::StringSource ss_cipher(
-      reinterpret_cast<const byte*>(cipher), length, true,
-      new CryptoPP::PK_DecryptorFilter(_rng, d,
-                                       new CryptoPP::StringSink(decrypted)));
-  return decrypted;
+  MESSAGEU_ALLOC_SITE(Crypto);
+  return _privateKey->decrypt(reinterpret_cast<const unsigned char*>(cipher),
+                              length);
 }
@@ -1,10 +1,10 @@
 #pragma once
 
-#include <cryptopp/osrng.h>
-#include <cryptopp/rsa.h>
-
+#include <memory>
 #include <string>
-using std::byte;
+
+class RsaPublicKey;
+class RsaPrivateKey;
 
 class RSAPublicWrapper {
  public:
@@ -12,8 +12,7 @@ class RSAPublicWrapper {
   static const unsigned int BITS = 1024;
 
  private:
-  CryptoPP::AutoSeededRandomPool _rng;
-  CryptoPP::RSA::PublicKey _publicKey;
+  std::unique_ptr<RsaPublicKey> _publicKey;
 
   RSAPublicWrapper(const RSAPublicWrapper& rsapublic);
   RSAPublicWrapper& operator=(const RSAPublicWrapper& rsapublic);
@@ -35,8 +34,7 @@ class RSAPrivateWrapper {
   static const unsigned int BITS = 1024;
 
  private:
-  CryptoPP::AutoSeededRandomPool _rng;
-  CryptoPP::RSA::PrivateKey _privateKey;
+  std::unique_ptr<RsaPrivateKey> _privateKey;
 
   RSAPrivateWrapper(const RSAPrivateWrapper& rsaprivate);
   RSAPrivateWrapper& operator=(const RSAPrivateWrapper& rsaprivate);
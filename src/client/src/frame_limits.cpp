@@ -0,0 +1,35 @@
+#include "frame_limits.hpp"
+#include "protocol_schema.hpp"
+#include "protocol_server_response.hpp"
+
+FrameLimits::FrameLimits()
+    : m_max_payload{
+          {RESPONSE_CODES::REGISTER_REPLY, schema::RegisterReply::size},
+          {RESPONSE_CODES::PUBLIC_KEY_REPLY, schema::PublicKeyReply::size},
+          {RESPONSE_CODES::SEND_MESSAGE_REPLY, schema::SendMessageReply::size},
+          {RESPONSE_CODES::PENDING_MESSAGES_REPLY, DEFAULT_MAX_LIST_PAYLOAD},
+          {RESPONSE_CODES::SUBSCRIBE_REPLY, 0},
+          {RESPONSE_CODES::PUSHED_MESSAGE, DEFAULT_MAX_LIST_PAYLOAD},
+          {RESPONSE_CODES::PENDING_MESSAGES_PAGE_REPLY,
+           DEFAULT_MAX_LIST_PAYLOAD},
+          {RESPONSE_CODES::CLIENT_LOOKUP_REPLY, DEFAULT_MAX_LIST_PAYLOAD},
+          {RESPONSE_CODES::FRAMING_REPLY, schema::FramingReply::size},
+      } {}
+
+uint32_t FrameLimits::max_payload(uint16_t code) const {
+  for (const auto& [limit_code, max] : m_max_payload) {
+    if (limit_code == code)
+      return max;
+  }
+  return DEFAULT_MAX_PAYLOAD;
+}
+
+void FrameLimits::set_max_payload(uint16_t code, uint32_t max) {
+  for (auto& [limit_code, limit] : m_max_payload) {
+    if (limit_code == code) {
+      limit = max;
+      return;
+    }
+  }
+  m_max_payload.emplace_back(code, max);
+}
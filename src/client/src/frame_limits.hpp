@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Upper bounds on what a connection buffers in memory for one reply. Sizes on
+// the wire come from the peer, so without them a single bad header could make
+// the client allocate up to 4 GiB.
+//
+// max_payload(code) bounds replies read whole by recv_protocol_response;
+// bigger ones are drained and rejected. Client lists and pending and pushed
+// message replies are read record by record instead and need no bound on
+// their size: client list entries are fixed-size, FILE contents stream to
+// disk and any other record content is bounded by max_record_content().
+class FrameLimits {
+ public:
+  // For codes without a limit of their own
+  static constexpr uint32_t DEFAULT_MAX_PAYLOAD = 64 * 1024;
+  static constexpr uint32_t DEFAULT_MAX_LIST_PAYLOAD = 16 * 1024 * 1024;
+  static constexpr uint32_t DEFAULT_MAX_RECORD_CONTENT = 16 * 1024 * 1024;
+
+  // Fixed-size replies are limited to their exact size
+  FrameLimits();
+
+  uint32_t max_payload(uint16_t code) const;
+  void set_max_payload(uint16_t code, uint32_t max);
+
+  uint32_t max_record_content() const { return m_max_record_content; }
+  void set_max_record_content(uint32_t max) { m_max_record_content = max; }
+
+ private:
+  // A handful of codes, a linear scan beats any map
+  std::vector<std::pair<uint16_t, uint32_t>> m_max_payload;
+  uint32_t m_max_record_content = DEFAULT_MAX_RECORD_CONTENT;
+};
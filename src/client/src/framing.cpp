@@ -0,0 +1,110 @@
+#include "framing.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace framing {
+
+size_t get_varint_slow(const uint8_t* in, size_t n, uint32_t& value) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < std::min(n, MAX_VARINT_SIZE); ++i) {
+    result |= static_cast<uint64_t>(in[i] & 0x7f) << (7 * i);
+    if (!(in[i] & 0x80)) {
+      if (result > UINT32_MAX)
+        throw std::runtime_error("Varint does not fit 32 bits");
+      value = static_cast<uint32_t>(result);
+      return i + 1;
+    }
+  }
+  if (n >= MAX_VARINT_SIZE)
+    throw std::runtime_error("Varint longer than 5 bytes");
+  return 0;
+}
+
+const std::vector<RequestEncoder::Segment>& RequestEncoder::encode(
+    const uint8_t* head,
+    size_t head_n,
+    const uint8_t* body,
+    size_t body_n) {
+  m_scratch.clear();
+  m_pieces.clear();
+  feed(head, head_n);
+  feed(body, body_n);
+
+  // m_scratch has stopped growing, its addresses are final now
+  m_segments.clear();
+  for (const Piece& piece : m_pieces) {
+    const uint8_t* data =
+        piece.data ? piece.data : m_scratch.data() + piece.offset;
+    m_segments.push_back({data, piece.size});
+  }
+  return m_segments;
+}
+
+void RequestEncoder::feed(const uint8_t* data, size_t n) {
+  while (n > 0) {
+    if (m_payload_left > 0) {
+      size_t take = std::min<size_t>(n, m_payload_left);
+      m_pieces.push_back({data, 0, take});
+      data += take;
+      n -= take;
+      m_payload_left -= static_cast<uint32_t>(take);
+      continue;
+    }
+    if (m_header_filled == 0 && n >= m_header.size()) {
+      emit_header(data);
+      data += m_header.size();
+      n -= m_header.size();
+      continue;
+    }
+    // A header split across writes is put back together first
+    size_t take = std::min(n, m_header.size() - m_header_filled);
+    std::memcpy(m_header.data() + m_header_filled, data, take);
+    m_header_filled += take;
+    data += take;
+    n -= take;
+    if (m_header_filled == m_header.size()) {
+      m_header_filled = 0;
+      emit_header(m_header.data());
+    }
+  }
+}
+
+void RequestEncoder::emit_header(const uint8_t* header) {
+  uint16_t code = schema::RequestHeader::get<2>(header);
+  uint32_t payload_size = schema::RequestHeader::get<3>(header);
+  m_payload_left = payload_size;
+
+  bool bound = false;
+  if (!m_has_last ||
+      std::memcmp(header, m_last_id.data(), m_last_id.size()) != 0) {
+    ClientId id = schema::RequestHeader::get<0>(header);
+    auto it = m_tokens.find(id);
+    if (it == m_tokens.end()) {
+      it = m_tokens.emplace(id, static_cast<uint32_t>(m_tokens.size())).first;
+      bound = true;
+    }
+    m_last_id = id;
+    m_last_token = it->second;
+    m_has_last = true;
+  }
+
+  // Consecutive headers, e.g. of pipelined empty requests, share a piece
+  size_t pos = m_scratch.size();
+  if (m_pieces.empty() || m_pieces.back().data ||
+      m_pieces.back().offset + m_pieces.back().size != pos)
+    m_pieces.push_back({nullptr, pos, 0});
+  m_scratch.resize(pos + MAX_REQUEST_HEADER_SIZE);
+  uint8_t* out = m_scratch.data() + pos;
+  size_t size = put_varint(out, m_last_token << 1 | (bound ? 1 : 0));
+  if (bound) {
+    std::memcpy(out + size, m_last_id.data(), m_last_id.size());
+    size += m_last_id.size();
+  }
+  size += put_varint(out + size, code);
+  size += put_varint(out + size, payload_size);
+  m_scratch.resize(pos + size);
+  m_pieces.back().size += size;
+}
+
+}  // namespace framing
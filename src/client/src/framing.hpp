@@ -0,0 +1,118 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "protocol_schema.hpp"
+
+// Compact request and reply headers, agreed on per connection.
+//
+// A connection starts in version 1, with the fixed headers of
+// protocol_schema.hpp. The client may then send a version 1
+// FRAMING_REQUEST carrying the highest version it speaks; the server
+// answers FRAMING_REPLY with the version both sides use from the next frame
+// on, or ERROR_REPLY if it only knows version 1. See negotiate_framing().
+//
+// Version 2 headers are made of varints, see put_varint():
+//   request  [SESSION][CLIENT_ID if bound][CODE][PAYLOAD_SIZE]
+//   reply    [CODE][PAYLOAD_SIZE]
+// SESSION is token << 1 | bind. Tokens stand for client ids and are handed
+// out by the client, counting from 0 on every connection. The first request
+// of a client id sets bind and carries the id; the token alone names it
+// afterwards. Payloads are the same as in version 1.
+//
+// A request header thus shrinks from 23 bytes to 4 for a small frame of a
+// bound id, and a reply header from 7 to 3.
+namespace framing {
+
+constexpr uint8_t V1 = 1;
+constexpr uint8_t V2 = 2;
+constexpr uint8_t MAX_VERSION = V2;
+
+// Every 32-bit value fits
+constexpr size_t MAX_VARINT_SIZE = 5;
+constexpr size_t MAX_REQUEST_HEADER_SIZE =
+    3 * MAX_VARINT_SIZE + schema::UUID_SIZE;
+
+// Unsigned LEB128: 7 bits per byte, low bits first, the high bit set on
+// every byte but the last. Returns the number of bytes written to `out`.
+// Inline, as they run a few times per frame.
+inline size_t put_varint(uint8_t* out, uint32_t value) {
+  size_t size = 0;
+  while (value >= 0x80) {
+    out[size++] = static_cast<uint8_t>(value | 0x80);
+    value >>= 7;
+  }
+  out[size++] = static_cast<uint8_t>(value);
+  return size;
+}
+
+// Decodes the varint at in[0, n) into `value` and returns its size, or 0 if
+// it goes on past `n`. Throws if it is longer than MAX_VARINT_SIZE or does
+// not fit 32 bits.
+size_t get_varint_slow(const uint8_t* in, size_t n, uint32_t& value);
+inline size_t get_varint(const uint8_t* in, size_t n, uint32_t& value) {
+  // One and two bytes cover sizes below 16 KiB and every code
+  if (n >= 1 && in[0] < 0x80) {
+    value = in[0];
+    return 1;
+  }
+  if (n >= 2 && in[1] < 0x80) {
+    value = (in[0] & 0x7fu) | static_cast<uint32_t>(in[1]) << 7;
+    return 2;
+  }
+  return get_varint_slow(in, n, value);
+}
+
+// Turns the version 1 request frames written to a connection into version 2
+// frames, so that request builders and everything that batches or streams
+// frames stay oblivious to the framing. Headers may be split across calls;
+// the bytes of an incomplete one are held back until it is whole. Payload
+// bytes are passed through without being copied.
+class RequestEncoder {
+ public:
+  // A piece of the encoded stream
+  struct Segment {
+    const uint8_t* data;
+    size_t size;
+  };
+
+  // Encodes the next head_n + body_n bytes of the version 1 stream. The
+  // segments point into head, body or the encoder, and stay valid until the
+  // next call.
+  const std::vector<Segment>& encode(const uint8_t* head,
+                                     size_t head_n,
+                                     const uint8_t* body,
+                                     size_t body_n);
+
+ private:
+  using ClientId = std::array<uint8_t, schema::UUID_SIZE>;
+  // Segment whose data is still an offset into m_scratch when it is null
+  struct Piece {
+    const uint8_t* data;
+    size_t offset;
+    size_t size;
+  };
+
+  void feed(const uint8_t* data, size_t n);
+  // Appends the version 2 form of a whole version 1 header to m_scratch and
+  // starts on its payload
+  void emit_header(const uint8_t* header);
+
+  std::array<uint8_t, schema::RequestHeader::size> m_header{};
+  size_t m_header_filled = 0;
+  uint32_t m_payload_left = 0;
+  std::unordered_map<ClientId, uint32_t, ClientIdHash> m_tokens;
+  // Most frames are for the same id as the one before
+  ClientId m_last_id{};
+  uint32_t m_last_token = 0;
+  bool m_has_last = false;
+
+  std::vector<uint8_t> m_scratch;
+  std::vector<Piece> m_pieces;
+  std::vector<Segment> m_segments;
+};
+
+}  // namespace framing
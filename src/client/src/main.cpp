@@ -1,18 +1,162 @@
+#include <csignal>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <string>
+#include "alloc_profile.hpp"
 #include "model/client_model.hpp"
+#include "model/identity.hpp"
 #include "view/client_view.hpp"
+#include "view/record_writer.hpp"
+#include "view/structured_view.hpp"
+#include "controller/bot_controller.hpp"
 #include "controller/client_controller.hpp"
 
-int main() {
-    try {
-        auto model = ClientModel::create_from_file("server.info");
-        auto view = std::make_unique<ClientView>();
-        ClientController controller(std::move(model), std::move(view));
+static void print_usage() {
+    std::cerr << "usage: tcp_client [--format jsonl|binary [--output FILE]]\n"
+                 "                  [--poll [--poll-min-ms MS] "
+                 "[--poll-max-ms MS]] [--no-history]\n"
+                 "       tcp_client --identities DIR [--connections N] "
+                 "[--poll-ms MS] [--rounds N]\n";
+}
+
+// Multi-identity mode: serves every *.info identity file in a directory
+static int run_bots(int argc, char** argv) {
+    std::string dir;
+    BotController::Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            print_usage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--identities") {
+            dir = value;
+        } else if (arg == "--connections") {
+            options.connections = std::stoul(value);
+        } else if (arg == "--poll-ms") {
+            options.poll_interval = std::chrono::milliseconds(std::stoul(value));
+        } else if (arg == "--rounds") {
+            options.rounds = std::stoul(value);
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (dir.empty()) {
+        print_usage();
+        return 1;
+    }
+
+    auto model = ClientModel::create_from_file("server.info");
+    auto view = std::make_unique<ClientView>();
+    std::vector<std::string> errors;
+    auto identities = load_identities(dir, errors);
+    for (const std::string& error : errors)
+        view->show_error("Skipped identity " + error);
+    BotController controller(model->get_ip(), model->get_port(),
+                             std::move(identities), std::move(view), options);
+    controller.run();
+    return 0;
+}
+
+// Interactive mode. With --format, clients, messages and errors are written as
+// records to stdout or --output, and the menus move to stderr.
+//
+// With --poll there is no menu: incoming messages are fetched at adaptive
+// intervals and shown until SIGINT or SIGTERM, for running as a daemon.
+//
+// Messages sent and received are kept in the encrypted history next to
+// me.info, unless --no-history.
+static int run_interactive(int argc, char** argv) {
+    std::string format;
+    std::string output;
+    bool poll = false;
+    MessageUClient::PollOptions poll_options;
+    MessageUClient::Options options = ClientController::default_options();
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--poll") {
+            poll = true;
+            continue;
+        }
+        if (arg == "--no-history") {
+            options.keep_history = false;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            print_usage();
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--format") {
+            format = value;
+        } else if (arg == "--output") {
+            output = value;
+        } else if (arg == "--poll-min-ms") {
+            poll_options.min_interval =
+                std::chrono::milliseconds(std::stoul(value));
+        } else if (arg == "--poll-max-ms") {
+            poll_options.max_interval =
+                std::chrono::milliseconds(std::stoul(value));
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (format.empty() && !output.empty()) {
+        print_usage();
+        return 1;
+    }
+
+    auto model = ClientModel::create_from_file("server.info");
+    std::unique_ptr<ClientView> view;
+    if (format.empty()) {
+        view = std::make_unique<ClientView>();
+    } else {
+        view = std::make_unique<StructuredView>(std::make_unique<RecordWriter>(
+            RecordWriter::parse_format(format), output));
+    }
+    if (!poll) {
+        ClientController controller(std::move(model), std::move(view),
+                                    options);
         controller.run();
+        return 0;
+    }
+
+    // Blocked before the client starts its threads, so that they inherit
+    // the mask and the signals are left to sigwait; the controller then
+    // shuts down normally and flushes its output
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+    ClientController controller(std::move(model), std::move(view), options);
+    controller.start_polling(poll_options);
+    int signal = 0;
+    sigwait(&stop_signals, &signal);
+    return 0;
+}
+
+static int run(int argc, char** argv) {
+    try {
+        for (int i = 1; i < argc; ++i) {
+            if (std::string(argv[i]) == "--identities")
+                return run_bots(argc, argv);
+        }
+        return run_interactive(argc, argv);
     } catch (const std::exception& e) {
         std::cerr << "Exception: " << e.what() << std::endl;
         return 1;
     }
-    return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char** argv) {
+    int result = run(argc, argv);
+#ifdef MESSAGEU_ALLOC_PROFILE
+    AllocProfile::write_report(std::cerr);
+#endif
+    return result;
+}
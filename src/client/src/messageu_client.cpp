@@ -0,0 +1,1027 @@
+#include "messageu_client.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include "alloc_profile.hpp"
+#include "compression.hpp"
+#include "protocol_message.hpp"
+#include "protocol_server_response.hpp"
+#include "send_pipeline.hpp"
+#include "tcp_client.hpp"
+
+namespace {
+
+int64_t unix_time_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+MessageUClient::MessageUClient(std::unique_ptr<ClientModel> model)
+    : MessageUClient(std::move(model), Options()) {}
+
+MessageUClient::MessageUClient(std::unique_ptr<ClientModel> model,
+                               const Options& options)
+    : m_model(std::move(model)),
+      m_pending_reader(*m_model, m_model_mutex),
+      m_router(m_model->get_servers()),
+      m_frame_limits(options.frame_limits),
+      m_max_framing_version(options.max_framing_version),
+      m_keep_history(options.keep_history),
+      m_pending_page_messages(options.pending_page_messages),
+      m_pending_page_bytes(options.pending_page_bytes) {
+  // The workers connect while the identity and its key are loaded
+  size_t connections = std::max<size_t>(1, options.connections);
+  for (size_t i = 0; i < connections; ++i) {
+    m_workers.push_back(std::make_unique<Worker>());
+    Worker& worker = *m_workers.back();
+    worker.connections.resize(m_router.shard_count());
+    worker.thread = std::thread(&MessageUClient::worker_loop, this,
+                                std::ref(worker));
+  }
+
+  // first try to load existing user info
+  std::lock_guard<std::mutex> lock(m_model_mutex);
+  m_model->load_my_info();
+  rebuild_identity_frames();
+  open_history();
+}
+
+MessageUClient::~MessageUClient() {
+  // Its fetches need the workers
+  stop_polling();
+  {
+    std::lock_guard<std::mutex> lock(m_push_mutex);
+    stop_push_listener();
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_queue_mutex);
+    m_stopping = true;
+  }
+  m_queue_cv.notify_all();
+  for (auto& worker : m_workers)
+    worker->thread.join();
+}
+
+template <typename Fn>
+auto MessageUClient::submit(Fn fn)
+    -> std::future<decltype(fn(std::declval<Worker&>()))> {
+  // Task bookkeeping on the caller's thread is none of the other sites
+  MESSAGEU_ALLOC_SITE(Other);
+  using Result = decltype(fn(std::declval<Worker&>()));
+  auto task = std::make_shared<std::packaged_task<Result(Worker&)>>(
+      std::move(fn));
+  std::future<Result> result = task->get_future();
+  {
+    std::lock_guard<std::mutex> lock(m_queue_mutex);
+    m_tasks.emplace_back([task](Worker& worker) { (*task)(worker); });
+  }
+  m_queue_cv.notify_one();
+  return result;
+}
+
+void MessageUClient::worker_loop(Worker& worker) {
+  // Warm up, so the first request does not wait for the handshake. A shard
+  // that cannot be reached now is retried, and reported, by the first task
+  // that needs it.
+  for (size_t shard = 0; shard < worker.connections.size(); ++shard) {
+    try {
+      connection(worker, shard);
+    } catch (const std::exception&) {
+    }
+  }
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(m_queue_mutex);
+      m_queue_cv.wait(lock, [this] { return m_stopping || !m_tasks.empty(); });
+      if (m_tasks.empty())
+        return;
+      task = std::move(m_tasks.front());
+      m_tasks.pop_front();
+    }
+    task(worker);
+    // Reopened by the next task that needs it, on another replica if the
+    // server went away
+    for (ShardRouter::Connection& connection : worker.connections) {
+      if (connection.client && !connection.client->is_connected()) {
+        m_router.report_failure(connection);
+        connection.client.reset();
+      }
+    }
+  }
+}
+
+TcpClient& MessageUClient::connection(Worker& worker, size_t shard) {
+  // Transports, their buffers and the framing handshake
+  MESSAGEU_ALLOC_SITE(Protocol);
+  ShardRouter::Connection& connection = worker.connections[shard];
+  if (!connection.client)
+    connection =
+        m_router.connect(shard, m_frame_limits, m_max_framing_version);
+  return *connection.client;
+}
+
+void MessageUClient::drop_connection(Worker& worker, size_t shard) {
+  ShardRouter::Connection& connection = worker.connections[shard];
+  if (!connection.client)
+    return;
+  if (!connection.client->is_connected())
+    m_router.report_failure(connection);
+  connection.client->shutdown();
+  connection.client.reset();
+}
+
+TcpClient& MessageUClient::connection_to(
+    Worker& worker,
+    const std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>& id) {
+  return connection(worker, m_router.shard_of(id));
+}
+
+std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE> MessageUClient::my_id()
+    const {
+  std::lock_guard<std::mutex> lock(m_model_mutex);
+  return m_model->get_my_id();
+}
+
+bool MessageUClient::is_registered() const {
+  std::lock_guard<std::mutex> lock(m_model_mutex);
+  return m_model->me_info_exists();
+}
+
+std::optional<ClientListEntry> MessageUClient::find_client(
+    const std::string& name) const {
+  MESSAGEU_ALLOC_SITE(Model);
+  std::lock_guard<std::mutex> lock(m_model_mutex);
+  const ClientListEntry* entry = m_model->get_client_by_name(name);
+  if (!entry)
+    return std::nullopt;
+  return *entry;
+}
+
+ClientListEntry MessageUClient::lookup_client(const std::string& name) const {
+  std::optional<ClientListEntry> entry = find_client(name);
+  if (!entry) {
+    throw std::runtime_error(
+        "Client name not found in client list. Please refresh the client "
+        "list first.");
+  }
+  return std::move(*entry);
+}
+
+std::future<void> MessageUClient::connect() {
+  return submit([this](Worker& worker) {
+    for (size_t shard = 0; shard < m_router.shard_count(); ++shard)
+      connection(worker, shard);
+  });
+}
+
+std::future<std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>>
+MessageUClient::register_user(const std::string& username) {
+  return submit([this, username](Worker& worker) {
+    // Task bodies run on the workers, outside the caller's site; the model
+    // and crypto work below marks its own
+    MESSAGEU_ALLOC_SITE(Protocol);
+    std::string public_key;
+    std::string private_key_base64;
+    {
+      MESSAGEU_ALLOC_SITE(Crypto);
+      std::lock_guard<std::mutex> lock(m_model_mutex);
+      if (m_model->me_info_exists()) {
+        throw std::runtime_error(
+            "me.info already exists. Registration aborted.");
+      }
+      m_model->generate_key_pair();
+      // Get the private key for storage
+      private_key_base64 = Base64Wrapper::encode(m_model->get_private_key());
+      public_key = m_model->get_public_key();
+    }
+
+    // The server assigns an id of its own shard
+    size_t shard = m_router.shard_for_name(username);
+    TcpClient& client = connection(worker, shard);
+    ProtocolMessage msg =
+        ProtocolMessage::create_register_request(username, public_key);
+    send_protocol_message(client, msg);
+
+    ProtocolServerResponse server_msg = recv_protocol_response(client);
+    if (server_msg.code() != RESPONSE_CODES::REGISTER_REPLY ||
+        server_msg.payload().size() != ProtocolMessage::CLIENT_ID_SIZE) {
+      throw std::runtime_error(
+          "Invalid register response from server. code: " +
+          std::to_string(server_msg.code()) + " payload size: " +
+          std::to_string(server_msg.payload().size()));
+    }
+    std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE> uuid;
+    std::copy(server_msg.payload().begin(), server_msg.payload().end(),
+              uuid.begin());
+    if (m_router.shard_of(uuid) != shard) {
+      throw std::runtime_error(
+          "Server of shard " + std::to_string(shard) +
+          " assigned an id of another shard; start it with --shard " +
+          std::to_string(shard) + "/" +
+          std::to_string(m_router.shard_count()));
+    }
+
+    {
+      MESSAGEU_ALLOC_SITE(Model);
+      std::lock_guard<std::mutex> lock(m_model_mutex);
+      m_model->set_my_uuid(uuid);
+      rebuild_identity_frames();
+      m_model->save_me_info(username, uuid, private_key_base64);
+      open_history();
+    }
+    return uuid;
+  });
+}
+
+std::future<std::vector<ClientListEntry>> MessageUClient::list_clients() {
+  return submit([this](Worker& worker) {
+    ProtocolMessage::EmptyRequestFrame frame;
+    {
+      std::lock_guard<std::mutex> lock(m_model_mutex);
+      frame = m_list_clients_frame;
+    }
+    // Fixed frame, pre-built for the current identity. Every shard is asked
+    // before any reply is read, so the shards build their lists in parallel.
+    size_t shards = m_router.shard_count();
+    std::vector<ClientListEntry> client_list;
+    // Shards [answered, asked) still owe a reply
+    size_t asked = 0;
+    size_t answered = 0;
+    try {
+      for (; asked < shards; ++asked)
+        connection(worker, asked).send(frame.data(), frame.size());
+
+      // Each shard's entries are appended as they arrive
+      for (; answered < shards; ++answered)
+        recv_client_list(connection(worker, answered), client_list);
+    } catch (...) {
+      // Their replies would be read by the next tasks instead of their own.
+      // The shard being sent to when the send failed may have part of the
+      // request, so it goes too.
+      for (size_t shard = answered; shard < std::min(asked + 1, shards);
+           ++shard)
+        drop_connection(worker, shard);
+      throw;
+    }
+
+    MESSAGEU_ALLOC_SITE(Model);
+    std::lock_guard<std::mutex> lock(m_model_mutex);
+    m_model->set_client_list(std::move(client_list));
+    return m_model->get_client_list();
+  });
+}
+
+std::future<void> MessageUClient::request_public_key(const std::string& name) {
+  return submit([this, name](Worker& worker) {
+    MESSAGEU_ALLOC_SITE(Protocol);
+    ClientListEntry entry = lookup_client(name);
+    TcpClient& client = connection_to(worker, entry.id);
+    ProtocolMessage msg =
+        ProtocolMessage::create_public_key_request(my_id(), entry.id);
+    send_protocol_message(client, msg);
+    ProtocolServerResponse server_msg = recv_protocol_response(client);
+    std::vector<uint8_t> pubkey = server_msg.parse_public_key_reply(entry.id);
+
+    std::lock_guard<std::mutex> lock(m_model_mutex);
+    m_model->update_client_public_key(entry.id, pubkey);
+  });
+}
+
+std::future<void> MessageUClient::request_symmetric_key(
+    const std::string& name) {
+  return submit([this, name](Worker& worker) {
+    MESSAGEU_ALLOC_SITE(Protocol);
+    ClientListEntry entry = lookup_client(name);
+    TcpClient& client = connection_to(worker, entry.id);
+    ProtocolMessage msg =
+        ProtocolMessage::create_symmetric_key_request(my_id(), entry.id);
+    send_protocol_message(client, msg);
+
+    ProtocolServerResponse server_msg = recv_protocol_response(client);
+    if (server_msg.code() != RESPONSE_CODES::SEND_MESSAGE_REPLY) {
+      throw std::runtime_error(
+          "Invalid server response after sending symmetric key request. "
+          "Code: " +
+          std::to_string(server_msg.code()));
+    }
+  });
+}
+
+std::future<void> MessageUClient::send_symmetric_key(const std::string& name) {
+  return submit([this, name](Worker& worker) {
+    MESSAGEU_ALLOC_SITE(Protocol);
+    ClientListEntry entry = lookup_client(name);
+    if (!entry.has_valid_public_key) {
+      throw std::runtime_error(
+          "No valid public key for this client. Please request a public key "
+          "first.");
+    }
+    std::string sym_key;
+    {
+      std::lock_guard<std::mutex> lock(m_model_mutex);
+      sym_key = m_model->get_symmetric_key();
+    }
+    // The key travels encrypted with the recipient's public key
+    std::string encrypted_key;
+    {
+      MESSAGEU_ALLOC_SITE(Crypto);
+      RSAPublicWrapper rsaPublic(
+          std::string(entry.public_key.begin(), entry.public_key.end()));
+      encrypted_key = rsaPublic.encrypt(sym_key.data(), sym_key.size());
+    }
+
+    auto msg = ProtocolMessage::create_send_sym_key_message_request(
+        my_id(), entry.id, encrypted_key);
+    TcpClient& client = connection_to(worker, entry.id);
+    send_protocol_message(client, msg);
+
+    ProtocolServerResponse server_msg = recv_protocol_response(client);
+    if (server_msg.code() != RESPONSE_CODES::SEND_MESSAGE_REPLY) {
+      throw std::runtime_error(
+          "Invalid server response after sending symmetric key. Code: " +
+          std::to_string(server_msg.code()));
+    }
+  });
+}
+
+std::future<MessageUClient::SymKeyBroadcast>
+MessageUClient::send_symmetric_key_to_all() {
+  return submit([this](Worker& worker) {
+    MESSAGEU_ALLOC_SITE(Protocol);
+    std::vector<ClientListEntry> peers;
+    std::string sym_key;
+    std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE> own_id;
+    {
+      MESSAGEU_ALLOC_SITE(Model);
+      std::lock_guard<std::mutex> lock(m_model_mutex);
+      for (const ClientListEntry& entry : m_model->get_client_list()) {
+        if (entry.has_valid_public_key)
+          peers.push_back(entry);
+      }
+      sym_key = m_model->get_symmetric_key();
+      own_id = m_model->get_my_id();
+    }
+    if (peers.empty()) {
+      throw std::runtime_error(
+          "No client has a valid public key. Please request public keys "
+          "first.");
+    }
+
+    // RSA encryption dominates, so it runs on all cores while the keys
+    // already encrypted are written and answered. A peer whose public key
+    // is unusable is skipped instead of failing the batch. Peers are
+    // grouped by shard, with a pipeline per shard connection.
+    if (m_router.shard_count() > 1) {
+      std::stable_sort(peers.begin(), peers.end(),
+                       [this](const ClientListEntry& a,
+                              const ClientListEntry& b) {
+                         return m_router.shard_of(a.id) <
+                                m_router.shard_of(b.id);
+                       });
+    }
+    std::vector<char> unusable(peers.size(), 0);
+    for (size_t begin = 0, end = 0; begin < peers.size(); begin = end) {
+      size_t shard = m_router.shard_of(peers[begin].id);
+      end = begin + 1;
+      while (end < peers.size() && m_router.shard_of(peers[end].id) == shard)
+        ++end;
+      SendPipeline pipeline(
+          connection(worker, shard), std::thread::hardware_concurrency(),
+          [](const ProtocolServerResponse& reply) {
+            if (reply.code() != RESPONSE_CODES::SEND_MESSAGE_REPLY) {
+              throw std::runtime_error(
+                  "Invalid server response after sending symmetric key. "
+                  "Code: " +
+                  std::to_string(reply.code()));
+            }
+          });
+      for (size_t i = begin; i < end; ++i) {
+        pipeline.submit([&, i] {
+          SendPipeline::Output output;
+          const auto& public_key = peers[i].public_key;
+          std::string encrypted_key;
+          try {
+            MESSAGEU_ALLOC_SITE(Crypto);
+            RSAPublicWrapper rsaPublic(
+                std::string(public_key.begin(), public_key.end()));
+            encrypted_key = rsaPublic.encrypt(sym_key.data(), sym_key.size());
+          } catch (const std::exception&) {
+            unusable[i] = 1;
+            return output;
+          }
+          output.request =
+              ProtocolMessage::create_send_sym_key_message_request(
+                  own_id, peers[i].id, encrypted_key);
+          output.answered = true;
+          return output;
+        });
+      }
+      pipeline.finish();
+    }
+
+    SymKeyBroadcast result;
+    for (size_t i = 0; i < peers.size(); ++i) {
+      if (unusable[i])
+        result.skipped.push_back(peers[i].name);
+    }
+    result.sent = peers.size() - result.skipped.size();
+    return result;
+  });
+}
+
+std::future<void> MessageUClient::send_text(const std::string& name,
+                                            const std::string& text) {
+  return submit([this, name, text](Worker& worker) {
+    MESSAGEU_ALLOC_SITE(Protocol);
+    ClientListEntry entry = lookup_client(name);
+    if (!entry.has_valid_symmetric_key) {
+      throw std::runtime_error(
+          "No valid symmetric key for this client. Please request a "
+          "symmetric key first.");
+    }
+    std::vector<uint8_t> content(text.begin(), text.end());
+
+    // Compress before encryption when it actually shrinks the content
+    auto msg_type = ProtocolMessage::MessageType::TEXT;
+    std::vector<uint8_t> compressed;
+    if (Compression::compress_if_smaller(content, compressed)) {
+      content = std::move(compressed);
+      msg_type = ProtocolMessage::MessageType::TEXT_COMPRESSED;
+    }
+
+    const std::string& sym_key = entry.symmetric_key;
+    AESWrapper aes(reinterpret_cast<const unsigned char*>(sym_key.data()),
+                   sym_key.size());
+    std::string encrypted = aes.encrypt(
+        reinterpret_cast<const char*>(content.data()), content.size());
+    content.assign(encrypted.begin(), encrypted.end());
+
+    ProtocolMessage msg = ProtocolMessage::create_send_message_request(
+        my_id(), entry.id, msg_type, content);
+    TcpClient& client = connection_to(worker, entry.id);
+    send_protocol_message(client, msg);
+
+    ProtocolServerResponse server_msg = recv_protocol_response(client);
+    if (server_msg.code() != RESPONSE_CODES::SEND_MESSAGE_REPLY) {
+      throw std::runtime_error(
+          "Invalid server response after sending text message. Code: " +
+          std::to_string(server_msg.code()));
+    }
+    record_sent(entry, server_msg.parse_send_message_reply(),
+                ProtocolMessage::MessageType::TEXT, text);
+  });
+}
+
+std::future<void> MessageUClient::send_file(const std::string& name,
+                                            const std::string& path) {
+  return submit([this, name, path](Worker& worker) {
+    MESSAGEU_ALLOC_SITE(Protocol);
+    ClientListEntry entry = lookup_client(name);
+    if (!entry.has_valid_symmetric_key) {
+      throw std::runtime_error(
+          "No valid symmetric key for this client. Please request a "
+          "symmetric key first.");
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("Cannot open file: " + path);
+    }
+    uint64_t file_size = std::filesystem::file_size(path);
+    uint64_t cipher_size = AESWrapper::cipherSize(file_size);
+    if (cipher_size > UINT32_MAX) {
+      throw std::runtime_error("File too large for a single message");
+    }
+
+    // The file is read here, encrypted on the pipeline's crypto worker and
+    // written by its writer, so disk, AES and socket work overlap. A single
+    // worker keeps the CBC chunks in order. The header goes out first, then
+    // the ciphertext chunk by chunk, so the file is never held in memory as
+    // a whole.
+    uint32_t message_id = 0;
+    size_t shard = m_router.shard_of(entry.id);
+    try {
+      SendPipeline pipeline(
+          connection(worker, shard), 1,
+          [&message_id](const ProtocolServerResponse& reply) {
+            if (reply.code() != RESPONSE_CODES::SEND_MESSAGE_REPLY) {
+              throw std::runtime_error(
+                  "Invalid server response after sending file. Code: " +
+                  std::to_string(reply.code()));
+            }
+            message_id = reply.parse_send_message_reply();
+          });
+      ProtocolMessage msg = ProtocolMessage::create_send_file_request(
+          my_id(), entry.id, static_cast<uint32_t>(cipher_size));
+      pipeline.submit([msg = std::move(msg)] {
+        SendPipeline::Output output;
+        output.request = msg;
+        return output;
+      });
+
+      const std::string& sym_key = entry.symmetric_key;
+      auto encryptor = std::make_shared<AESStreamCipher>(
+          reinterpret_cast<const unsigned char*>(sym_key.data()),
+          sym_key.size(), AESStreamCipher::Direction::Encrypt);
+      // Only touched by the crypto worker until finish() returns
+      uint64_t bytes_encrypted = 0;
+      uint64_t bytes_read = 0;
+      while (bytes_read < file_size) {
+        std::string chunk(
+            std::min<uint64_t>(FILE_CHUNK_SIZE, file_size - bytes_read), '\0');
+        file.read(chunk.data(), chunk.size());
+        std::streamsize n = file.gcount();
+        if (n <= 0) {
+          throw std::runtime_error("File shrank while it was being sent");
+        }
+        chunk.resize(n);
+        bytes_read += n;
+        pipeline.submit(
+            [&bytes_encrypted, encryptor, chunk = std::move(chunk)] {
+              MESSAGEU_ALLOC_SITE(Crypto);
+              SendPipeline::Output output;
+              output.raw = encryptor->update(chunk.data(), chunk.size());
+              bytes_encrypted += output.raw.size();
+              return output;
+            });
+      }
+      pipeline.submit([&bytes_encrypted, encryptor, cipher_size] {
+        MESSAGEU_ALLOC_SITE(Crypto);
+        SendPipeline::Output output;
+        output.raw = encryptor->finish();
+        bytes_encrypted += output.raw.size();
+        // Checked before the last bytes go out, so the request is never
+        // completed with content of the wrong size
+        if (bytes_encrypted != cipher_size) {
+          throw std::runtime_error("Encrypted file size mismatch");
+        }
+        output.answered = true;
+        return output;
+      });
+      pipeline.finish();
+    } catch (...) {
+      // Once the header is out the server reads cipher_size bytes of
+      // content, so a request cut short leaves the connection out of sync
+      drop_connection(worker, shard);
+      throw;
+    }
+
+    std::error_code ec;
+    std::filesystem::path absolute = std::filesystem::absolute(path, ec);
+    record_sent(entry, message_id, ProtocolMessage::MessageType::FILE,
+                ec ? path : absolute.string());
+  });
+}
+
+std::future<std::vector<PendingMessage>> MessageUClient::fetch_pending() {
+  return submit([this](Worker& worker) {
+    MESSAGEU_ALLOC_SITE(Protocol);
+    std::vector<PendingMessage> messages;
+    fetch_pending_pages(worker, [&messages](const PendingMessage& message) {
+      messages.push_back(message);
+    });
+    return messages;
+  });
+}
+
+std::future<size_t> MessageUClient::fetch_pending(MessageHandler handler) {
+  return submit([this, handler = std::move(handler)](Worker& worker) {
+    MESSAGEU_ALLOC_SITE(Protocol);
+    return fetch_pending_pages(worker, handler);
+  });
+}
+
+std::future<void> MessageUClient::subscribe(MessageHandler handler) {
+  return submit([this, handler = std::move(handler)](Worker&) mutable {
+    MESSAGEU_ALLOC_SITE(Protocol);
+    std::lock_guard<std::mutex> push_lock(m_push_mutex);
+    if (m_push_active)
+      return;
+    // Reap a listener whose connection was closed by the server
+    stop_push_listener();
+
+    // Pushes arrive on a dedicated connection so that replies to requests on
+    // the worker connections are never interleaved with them. Messages to us
+    // are stored, and pushed, by our own shard.
+    std::unique_ptr<TcpClient> push_client =
+        m_router
+            .connect(m_router.shard_of(my_id()), m_frame_limits,
+                     m_max_framing_version)
+            .client;
+    ProtocolMessage msg = ProtocolMessage::create_subscribe_request(my_id());
+    send_protocol_message(*push_client, msg);
+
+    ProtocolServerResponse server_msg = recv_protocol_response(*push_client);
+    if (server_msg.code() != RESPONSE_CODES::SUBSCRIBE_REPLY) {
+      throw std::runtime_error("Invalid subscribe response from server. Code: " +
+                               std::to_string(server_msg.code()));
+    }
+
+    m_push_client = std::move(push_client);
+    m_push_active = true;
+    m_push_thread =
+        std::thread(&MessageUClient::push_loop, this, std::move(handler));
+  });
+}
+
+void MessageUClient::start_polling(MessageHandler handler,
+                                   const PollOptions& options) {
+  if (options.min_interval.count() <= 0 ||
+      options.max_interval < options.min_interval) {
+    throw std::runtime_error(
+        "Poll intervals must be positive, the maximum at least the minimum");
+  }
+  std::lock_guard<std::mutex> lock(m_poll_mutex);
+  if (m_poll_thread.joinable())
+    throw std::runtime_error("Already polling");
+  m_poll_stopping = false;
+  m_poll_thread = std::thread(&MessageUClient::poll_loop, this,
+                              std::move(handler), options);
+}
+
+void MessageUClient::stop_polling() {
+  std::thread thread;
+  {
+    std::lock_guard<std::mutex> lock(m_poll_mutex);
+    m_poll_stopping = true;
+    thread = std::move(m_poll_thread);
+  }
+  m_poll_cv.notify_all();
+  if (thread.joinable())
+    thread.join();
+}
+
+bool MessageUClient::is_polling() const {
+  std::lock_guard<std::mutex> lock(m_poll_mutex);
+  return m_poll_thread.joinable();
+}
+
+void MessageUClient::poll_loop(MessageHandler handler, PollOptions options) {
+  std::chrono::milliseconds interval = options.min_interval;
+  std::unique_lock<std::mutex> lock(m_poll_mutex);
+  while (!m_poll_stopping) {
+    lock.unlock();
+    // The handler runs here rather than on a worker, so that it may wait
+    // for anything the caller does with this client meanwhile
+    size_t received = 0;
+    try {
+      std::vector<PendingMessage> messages = fetch_pending().get();
+      received = messages.size();
+      for (const PendingMessage& message : messages)
+        handler(message);
+    } catch (const std::exception& e) {
+      PendingMessage message{};
+      message.error = std::string("Polling failed: ") + e.what();
+      handler(message);
+    }
+    // Messages tend to come in bursts: poll again soon after one, and ever
+    // less often while the queue stays empty
+    interval = received > 0 ? options.min_interval
+                             : std::min(interval * 2, options.max_interval);
+    lock.lock();
+    m_poll_cv.wait_for(lock, interval, [this] { return m_poll_stopping; });
+  }
+}
+
+size_t MessageUClient::fetch_pending_pages(Worker& worker,
+                                           const MessageHandler& handler) {
+  if (m_pending_page_messages == 0 || !m_paging_supported)
+    return fetch_pending_whole(worker, handler);
+
+  size_t shard = m_router.shard_of(my_id());
+  TcpClient& client = connection(worker, shard);
+
+  ProtocolMessage::PendingPageRequestFrame frame;
+  {
+    std::lock_guard<std::mutex> lock(m_model_mutex);
+    frame = m_pending_page_frame;
+  }
+  client.send(frame.data(), frame.size());
+
+  // A throwing handler must not leave a requested page unread on the
+  // connection: its error is kept, no further page is asked for, and the
+  // pages already requested are drained
+  std::exception_ptr handler_error;
+  size_t delivered = 0;
+  auto deliver = [&](const std::vector<PendingMessage>& messages) {
+    record_received(messages);
+    for (const PendingMessage& message : messages) {
+      if (handler_error)
+        break;
+      try {
+        handler(message);
+        ++delivered;
+      } catch (...) {
+        handler_error = std::current_exception();
+      }
+    }
+  };
+
+  // A page with unknown senders waits here for their lookup, whose reply
+  // comes after that of the page requested before the lookup was sent
+  std::vector<PendingMessage> held;
+  std::vector<size_t> held_unresolved;
+  bool lookup_owed = false;
+  auto settle = [&] {
+    lookup_owed = false;
+    receive_sender_lookup(client);
+    m_pending_reader.resolve(held, held_unresolved);
+    PendingReader::reject(held, held_unresolved);
+    deliver(held);
+    held.clear();
+  };
+
+  bool first_page = true;
+  bool requested = true;
+  while (requested) {
+    ProtocolResponseHeader resp_header = recv_protocol_response_header(client);
+    if (first_page && resp_header.code == RESPONSE_CODES::ERROR_REPLY) {
+      client.skip_n_bytes(resp_header.payload_size);
+      m_paging_supported = false;
+      return fetch_pending_whole(worker, handler);
+    }
+    first_page = false;
+    if (resp_header.code != RESPONSE_CODES::PENDING_MESSAGES_PAGE_REPLY ||
+        resp_header.payload_size < schema::PendingPageReplyPrefix::size) {
+      client.skip_n_bytes(resp_header.payload_size);
+      throw std::runtime_error(
+          "Invalid pending messages page from server. Code: " +
+          std::to_string(resp_header.code));
+    }
+    std::array<uint8_t, schema::PendingPageReplyPrefix::size> prefix;
+    client.receive_into(prefix.data(), prefix.size());
+    bool more = schema::PendingPageReplyPrefix::get<0>(prefix.data()) != 0;
+
+    // The server builds the next page while this one is decrypted
+    requested = more && !handler_error;
+    if (requested)
+      client.send(frame.data(), frame.size());
+
+    std::vector<size_t> unresolved;
+    std::vector<PendingMessage> messages = m_pending_reader.read(
+        client, resp_header.payload_size - prefix.size(), &unresolved);
+    if (lookup_owed)
+      settle();
+    // The previous lookup may have found senders of this page too
+    m_pending_reader.resolve(messages, unresolved);
+    if (!unresolved.empty() &&
+        send_sender_lookup(worker, shard, messages, unresolved)) {
+      held = std::move(messages);
+      held_unresolved = std::move(unresolved);
+      lookup_owed = true;
+      continue;
+    }
+    // Senders of other shards were looked up already
+    m_pending_reader.resolve(messages, unresolved);
+    PendingReader::reject(messages, unresolved);
+    deliver(messages);
+  }
+  if (lookup_owed)
+    settle();
+  if (handler_error)
+    std::rethrow_exception(handler_error);
+  return delivered;
+}
+
+size_t MessageUClient::fetch_pending_whole(Worker& worker,
+                                           const MessageHandler& handler) {
+  TcpClient& client = connection(worker, m_router.shard_of(my_id()));
+  ProtocolMessage::EmptyRequestFrame frame;
+  {
+    std::lock_guard<std::mutex> lock(m_model_mutex);
+    frame = m_pending_messages_frame;
+  }
+  // Fixed frame, pre-built for the current identity
+  client.send(frame.data(), frame.size());
+
+  // Records are read straight off the socket so that FILE contents are
+  // never buffered whole
+  ProtocolResponseHeader resp_header = recv_protocol_response_header(client);
+  if (resp_header.code != RESPONSE_CODES::PENDING_MESSAGES_REPLY) {
+    client.skip_n_bytes(resp_header.payload_size);
+    throw std::runtime_error(
+        "Invalid pending messages response from server. Code: " +
+        std::to_string(resp_header.code));
+  }
+  std::vector<size_t> unresolved;
+  std::vector<PendingMessage> messages =
+      m_pending_reader.read(client, resp_header.payload_size, &unresolved);
+  resolve_senders(worker, messages, unresolved);
+  record_received(messages);
+  for (const PendingMessage& message : messages)
+    handler(message);
+  return messages.size();
+}
+
+bool MessageUClient::send_sender_lookup(
+    Worker& worker,
+    size_t shard,
+    const std::vector<PendingMessage>& messages,
+    const std::vector<size_t>& unresolved) {
+  std::vector<std::vector<std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>>>
+      ids(m_router.shard_count());
+  for (const auto& id : PendingReader::unknown_senders(messages, unresolved))
+    ids[m_router.shard_of(id)].push_back(id);
+  for (size_t other = 0; other < ids.size(); ++other) {
+    if (other == shard || ids[other].empty() || !m_lookup_supported)
+      continue;
+    TcpClient& client = connection(worker, other);
+    send_protocol_message(client, ProtocolMessage::create_client_lookup_request(
+                                      my_id(), ids[other]));
+    receive_sender_lookup(client);
+  }
+  if (ids[shard].empty() || !m_lookup_supported)
+    return false;
+  send_protocol_message(
+      connection(worker, shard),
+      ProtocolMessage::create_client_lookup_request(my_id(), ids[shard]));
+  return true;
+}
+
+void MessageUClient::receive_sender_lookup(TcpClient& client) {
+  ProtocolServerResponse server_msg = recv_protocol_response(client);
+  if (server_msg.code() == RESPONSE_CODES::ERROR_REPLY) {
+    // Older server; unknown senders are reported as before
+    m_lookup_supported = false;
+    return;
+  }
+  std::vector<ClientListEntry> entries = server_msg.parse_client_lookup();
+  MESSAGEU_ALLOC_SITE(Model);
+  std::lock_guard<std::mutex> lock(m_model_mutex);
+  m_model->merge_clients(std::move(entries));
+}
+
+void MessageUClient::resolve_senders(Worker& worker,
+                                     std::vector<PendingMessage>& messages,
+                                     std::vector<size_t>& unresolved) {
+  m_pending_reader.resolve(messages, unresolved);
+  size_t shard = m_router.shard_of(my_id());
+  if (!unresolved.empty() &&
+      send_sender_lookup(worker, shard, messages, unresolved))
+    receive_sender_lookup(connection(worker, shard));
+  m_pending_reader.resolve(messages, unresolved);
+  PendingReader::reject(messages, unresolved);
+}
+
+void MessageUClient::push_loop(MessageHandler handler) {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  auto report = [&handler](const std::string& error) {
+    PendingMessage message{};
+    message.error = error;
+    handler(message);
+  };
+  while (true) {
+    ProtocolResponseHeader resp_header;
+    try {
+      resp_header = recv_protocol_response_header(*m_push_client);
+    } catch (const std::exception&) {
+      // Connection closed, either by the server or by stop_push_listener
+      m_push_active = false;
+      return;
+    }
+
+    try {
+      if (resp_header.code != RESPONSE_CODES::PUSHED_MESSAGE) {
+        m_push_client->skip_n_bytes(resp_header.payload_size);
+        report("Unexpected frame on subscription. Code: " +
+               std::to_string(resp_header.code));
+        continue;
+      }
+      std::vector<size_t> unresolved;
+      std::vector<PendingMessage> messages = m_pending_reader.read(
+          *m_push_client, resp_header.payload_size, &unresolved);
+      if (!unresolved.empty()) {
+        // Requests never go out on the subscription, a worker looks the
+        // senders up
+        try {
+          submit([&](Worker& worker) {
+            resolve_senders(worker, messages, unresolved);
+          }).get();
+        } catch (const std::exception&) {
+          PendingReader::reject(messages, unresolved);
+        }
+      }
+      record_received(messages);
+      for (const PendingMessage& message : messages)
+        handler(message);
+    } catch (const std::exception& e) {
+      report(std::string("Subscription closed: ") + e.what());
+      m_push_active = false;
+      return;
+    }
+  }
+}
+
+void MessageUClient::stop_push_listener() {
+  if (!m_push_thread.joinable())
+    return;
+  // Unblocks the pending read in push_loop
+  m_push_client->shutdown();
+  m_push_thread.join();
+  m_push_client.reset();
+}
+
+void MessageUClient::rebuild_identity_frames() {
+  m_list_clients_frame =
+      ProtocolMessage::create_list_clients_frame(m_model->get_my_id());
+  m_pending_messages_frame =
+      ProtocolMessage::create_pending_messages_frame(m_model->get_my_id());
+  m_pending_page_frame = ProtocolMessage::create_pending_messages_page_frame(
+      m_model->get_my_id(), m_pending_page_messages, m_pending_page_bytes);
+}
+
+void MessageUClient::open_history() {
+  MESSAGEU_ALLOC_SITE(Model);
+  if (!m_keep_history || !m_model->me_info_exists())
+    return;
+  try {
+    m_model->open_history();
+    m_history_error.clear();
+  } catch (const std::exception& e) {
+    m_history_error = e.what();
+  }
+}
+
+std::vector<MessageHistory::Entry> MessageUClient::query_history(
+    const MessageHistory::Query& query) const {
+  MessageHistory* history = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(m_model_mutex);
+    history = m_model->history();
+    if (!history && !m_keep_history)
+      throw std::runtime_error("Message history is not kept.");
+    if (!history && !m_history_error.empty())
+      throw std::runtime_error("Message history unavailable: " +
+                               m_history_error);
+    if (!history)
+      throw std::runtime_error("me.info not found. Register first.");
+  }
+  // Queried outside the lock: a long history must not hold up the workers
+  return history->query(query);
+}
+
+void MessageUClient::record_received(
+    const std::vector<PendingMessage>& messages) {
+  MESSAGEU_ALLOC_SITE(Model);
+  using MessageType = ProtocolMessage::MessageType;
+  MessageHistory* history = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(m_model_mutex);
+    history = m_model->history();
+  }
+  if (!history)
+    return;
+  int64_t now = unix_time_ms();
+  std::vector<MessageHistory::Entry> entries;
+  for (const PendingMessage& message : messages) {
+    auto type = static_cast<MessageType>(message.type);
+    if (!message.error.empty() ||
+        (type != MessageType::TEXT && type != MessageType::TEXT_COMPRESSED &&
+         type != MessageType::FILE))
+      continue;
+    MessageHistory::Entry entry;
+    entry.time_ms = now;
+    entry.peer = message.from_id;
+    entry.peer_name = message.sender_name;
+    entry.message_id = message.message_id;
+    // Contents are kept decompressed
+    entry.type = static_cast<uint8_t>(
+        type == MessageType::FILE ? MessageType::FILE : MessageType::TEXT);
+    entry.content = message.content;
+    entries.push_back(std::move(entry));
+  }
+  try {
+    history->append(entries);
+  } catch (const std::exception&) {
+  }
+}
+
+void MessageUClient::record_sent(const ClientListEntry& recipient,
+                                 uint32_t message_id,
+                                 ProtocolMessage::MessageType type,
+                                 const std::string& content) {
+  MESSAGEU_ALLOC_SITE(Model);
+  MessageHistory* history = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(m_model_mutex);
+    history = m_model->history();
+  }
+  if (!history)
+    return;
+  MessageHistory::Entry entry;
+  entry.time_ms = unix_time_ms();
+  entry.peer = recipient.id;
+  entry.peer_name = recipient.name;
+  entry.message_id = message_id;
+  entry.type = static_cast<uint8_t>(type);
+  entry.outgoing = true;
+  entry.content = content;
+  try {
+    history->append({entry});
+  } catch (const std::exception&) {
+  }
+}
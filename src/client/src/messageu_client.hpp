@@ -0,0 +1,249 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "frame_limits.hpp"
+#include "framing.hpp"
+#include "model/client_model.hpp"
+#include "pending_reader.hpp"
+#include "shard_router.hpp"
+
+class TcpClient;
+
+// Embeddable MessageU client. Every protocol operation is non-blocking: it is
+// queued and its result, or the exception that ended it, is delivered through
+// the returned future.
+//
+// Operations run on `connections` worker threads, each with its own server
+// connection opened on first use. With one connection (the default) they run
+// one at a time in submission order; with more, independent operations run
+// concurrently. Client state (identity, client list, keys) lives in the
+// ClientModel and is safe to use from any thread through this class.
+//
+// When the model lists several shards (see ClientModel::get_servers), each
+// worker keeps a connection per shard and every request goes to the shard
+// of the client it concerns, see ShardRouter: sends and key requests to the
+// recipient's, registration, pending messages and the subscription to our
+// own. Client lists are merged across shards. A connection that breaks is
+// reopened by the next operation, to another replica if its own failed.
+class MessageUClient {
+ public:
+  struct Options {
+    size_t connections = 1;
+    // Applied to every connection, bounds the memory a reply can claim
+    FrameLimits frame_limits;
+    // fetch_pending() asks for pages of at most this many messages and
+    // record bytes. pending_page_messages = 0 fetches everything in a single
+    // reply, as servers without paging do anyway.
+    uint32_t pending_page_messages = 1024;
+    uint32_t pending_page_bytes = 1024 * 1024;
+    // Highest framing offered to the server, see framing.hpp. framing::V1
+    // keeps the 23-byte request headers without asking.
+    uint8_t max_framing_version = framing::MAX_VERSION;
+    // Records the texts and files sent and received in the identity's
+    // encrypted history (ClientModel::history_path), one batch per page,
+    // push or send
+    bool keep_history = false;
+  };
+  // Intervals between the fetches of start_polling()
+  struct PollOptions {
+    // Used after a fetch that delivered messages
+    std::chrono::milliseconds min_interval{100};
+    // Doubling stops here while nothing arrives
+    std::chrono::milliseconds max_interval{30000};
+  };
+  struct SymKeyBroadcast {
+    size_t sent = 0;
+    std::vector<std::string> skipped;  // clients whose public key is unusable
+  };
+  using MessageHandler = std::function<void(const PendingMessage&)>;
+
+  // Loads me.info, if present, into `model`
+  explicit MessageUClient(std::unique_ptr<ClientModel> model);
+  MessageUClient(std::unique_ptr<ClientModel> model, const Options& options);
+  // Finishes the queued operations, then closes every connection
+  ~MessageUClient();
+  MessageUClient(const MessageUClient& other) = delete;
+  MessageUClient& operator=(const MessageUClient& other) = delete;
+
+  // True when an identity is stored in me.info
+  bool is_registered() const;
+  // Snapshot of a client list entry, by name
+  std::optional<ClientListEntry> find_client(const std::string& name) const;
+
+  // Opens a connection to every shard now instead of on first use, so that
+  // an unreachable server is reported up front
+  std::future<void> connect();
+  // Registers `username` and saves the new identity to me.info
+  std::future<std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>>
+  register_user(const std::string& username);
+  // Refreshes and returns the client list, from every shard
+  std::future<std::vector<ClientListEntry>> list_clients();
+  std::future<void> request_public_key(const std::string& name);
+  std::future<void> request_symmetric_key(const std::string& name);
+  std::future<void> send_symmetric_key(const std::string& name);
+  // Sends our symmetric key to every client with a known public key
+  std::future<SymKeyBroadcast> send_symmetric_key_to_all();
+  std::future<void> send_text(const std::string& name, const std::string& text);
+  std::future<void> send_file(const std::string& name, const std::string& path);
+  std::future<std::vector<PendingMessage>> fetch_pending();
+  // Passes every pending message to `handler`, on a worker thread, as soon as
+  // its page has been read, so memory stays bounded by the page size however
+  // long the backlog. The next page is requested before the current one is
+  // handled. Senders missing from the client list are looked up with one
+  // request per page, whose reply is read after the next page's, so a page
+  // with new senders is handed over once the next one has been read. The
+  // future holds the number of messages delivered.
+  std::future<size_t> fetch_pending(MessageHandler handler);
+
+  // Opens a subscription connection; `handler` then runs on a listener thread
+  // for every pushed message until the client is destroyed or the server
+  // closes the subscription
+  std::future<void> subscribe(MessageHandler handler);
+  bool is_subscribed() const { return m_push_active; }
+
+  // Fetches the pending messages in the background, through fetch_pending()
+  // on the worker connections, until stop_polling() or the client is
+  // destroyed. The interval adapts: it drops to min_interval after a fetch
+  // that returned messages and doubles, up to max_interval, after every one
+  // that did not. `handler` runs on the polling thread for every message,
+  // and for every failed fetch with a message holding the error; failures
+  // back off like empty fetches. Throws if already polling.
+  void start_polling(MessageHandler handler, const PollOptions& options);
+  // Waits for a fetch in progress to end
+  void stop_polling();
+  bool is_polling() const;
+
+  // Messages in the history, read from disk without the server. Throws when
+  // the history is not kept, there is no identity yet, or it failed to open.
+  std::vector<MessageHistory::Entry> query_history(
+      const MessageHistory::Query& query) const;
+
+ private:
+  // Read/encrypt granularity for FILE messages sent
+  static constexpr size_t FILE_CHUNK_SIZE = 64 * 1024;
+
+  struct Worker {
+    // One per shard, opened on first use
+    std::vector<ShardRouter::Connection> connections;
+    std::thread thread;
+  };
+  using Task = std::function<void(Worker&)>;
+
+  // Queues fn(Worker&) for the next free worker and returns the future of
+  // its result. The task picks its connections with connection(worker, ...).
+  // Connection failures are delivered through the future too.
+  template <typename Fn>
+  auto submit(Fn fn) -> std::future<decltype(fn(std::declval<Worker&>()))>;
+  void worker_loop(Worker& worker);
+  TcpClient& connection(Worker& worker, size_t shard);
+  // Closes the connection to `shard`, for a task that leaves it out of sync
+  // (a request cut short or a reply left unread); the next task reconnects.
+  // The replica is only marked as failed if the connection itself broke.
+  void drop_connection(Worker& worker, size_t shard);
+  // Connection to the shard that stores `id`
+  TcpClient& connection_to(
+      Worker& worker,
+      const std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>& id);
+
+  std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE> my_id() const;
+  // Copy of a client list entry, throws if the name is not in the list
+  ClientListEntry lookup_client(const std::string& name) const;
+
+  // Fetches the pending messages page by page into `handler`. Falls back to
+  // a single PENDING_MESSAGE_REQUEST when the server rejects paging.
+  size_t fetch_pending_pages(Worker& worker, const MessageHandler& handler);
+  size_t fetch_pending_whole(Worker& worker, const MessageHandler& handler);
+
+  // Asks for the senders of the unresolved messages with one request per
+  // shard. Senders of other shards than `shard` are looked up right away on
+  // their own connections; for those of `shard`, the request is sent on its
+  // connection and true returned, the reply is left to
+  // receive_sender_lookup(). False when there is no such request, e.g.
+  // because the server does not support lookups.
+  bool send_sender_lookup(Worker& worker,
+                          size_t shard,
+                          const std::vector<PendingMessage>& messages,
+                          const std::vector<size_t>& unresolved);
+  // Reads the reply to a lookup request into the client list
+  void receive_sender_lookup(TcpClient& client);
+  // Looks the unresolved senders up and completes their messages; the rest
+  // are rejected. No other reply may be due on the worker's connections.
+  void resolve_senders(Worker& worker,
+                       std::vector<PendingMessage>& messages,
+                       std::vector<size_t>& unresolved);
+
+  // Body of the polling thread
+  void poll_loop(MessageHandler handler, PollOptions options);
+
+  // Body of the push listener thread
+  void push_loop(MessageHandler handler);
+  // Requires m_push_mutex
+  void stop_push_listener();
+
+  // Rebuilds the cached fixed frames after the identity (UUID) changes
+  void rebuild_identity_frames();
+
+  // Opens the history if it is kept and there is an identity; a failure is
+  // remembered for query_history(). Requires m_model_mutex.
+  void open_history();
+  // Appends the texts and files read without error as one batch. Recording
+  // is best effort, the messages are delivered all the same.
+  void record_received(const std::vector<PendingMessage>& messages);
+  void record_sent(const ClientListEntry& recipient,
+                   uint32_t message_id,
+                   ProtocolMessage::MessageType type,
+                   const std::string& content);
+
+  // m_model_mutex guards the model and the cached frames. It is never held
+  // during network I/O.
+  std::unique_ptr<ClientModel> m_model;
+  mutable std::mutex m_model_mutex;
+  PendingReader m_pending_reader;
+  ShardRouter m_router;
+  FrameLimits m_frame_limits;
+  uint8_t m_max_framing_version;
+  bool m_keep_history;
+  // Why the history could not be opened, guarded by m_model_mutex
+  std::string m_history_error;
+
+  // Pre-built frames for the fixed-size per-identity requests
+  ProtocolMessage::EmptyRequestFrame m_list_clients_frame{};
+  ProtocolMessage::EmptyRequestFrame m_pending_messages_frame{};
+  ProtocolMessage::PendingPageRequestFrame m_pending_page_frame{};
+  uint32_t m_pending_page_messages;
+  uint32_t m_pending_page_bytes;
+  // Cleared once the server answers a page request with an error
+  std::atomic<bool> m_paging_supported{true};
+  // Cleared once the server answers a client lookup with an error
+  std::atomic<bool> m_lookup_supported{true};
+
+  std::mutex m_queue_mutex;
+  std::condition_variable m_queue_cv;
+  std::deque<Task> m_tasks;
+  bool m_stopping = false;
+  std::vector<std::unique_ptr<Worker>> m_workers;
+
+  // Subscription connection and its reader thread
+  std::mutex m_push_mutex;
+  std::unique_ptr<TcpClient> m_push_client;
+  std::thread m_push_thread;
+  std::atomic<bool> m_push_active{false};
+
+  // Polling thread, woken early by stop_polling()
+  mutable std::mutex m_poll_mutex;
+  std::condition_variable m_poll_cv;
+  std::thread m_poll_thread;
+  bool m_poll_stopping = false;
+};
@@ -2,9 +2,10 @@
 #include <algorithm>
 #include <fstream>
 #include <iomanip>
-#include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <unordered_map>
+#include "../alloc_profile.hpp"
 #include "../protocol_message.hpp"
 
 std::unique_ptr<ClientModel> ClientModel::create_from_file(
@@ -13,26 +14,63 @@ std::unique_ptr<ClientModel> ClientModel::create_from_file(
   if (!infoFile) {
     throw std::runtime_error("server.info not found");
   }
-  std::string line, ip, port;
-  std::getline(infoFile, line);
-  std::istringstream iss(line);
-  std::getline(iss, ip, ':');
-  std::getline(iss, port);
-  return std::make_unique<ClientModel>(ip, port);
+  // One shard per line, its replicas separated by commas. Each is "ip:port",
+  // or "unix:/path" / "shm:/path" for a server on this host; the scheme then
+  // takes the place of the ip, see make_transport()
+  std::vector<std::vector<ServerEndpoint>> servers;
+  std::string line;
+  while (std::getline(infoFile, line)) {
+    std::vector<ServerEndpoint> replicas;
+    std::istringstream line_stream(line);
+    std::string address;
+    while (std::getline(line_stream, address, ',')) {
+      address.erase(0, address.find_first_not_of(" \t\r"));
+      address.erase(address.find_last_not_of(" \t\r") + 1);
+      if (address.empty())
+        continue;
+      ServerEndpoint endpoint;
+      std::istringstream iss(address);
+      std::getline(iss, endpoint.ip, ':');
+      std::getline(iss, endpoint.port);
+      replicas.push_back(std::move(endpoint));
+    }
+    if (!replicas.empty())
+      servers.push_back(std::move(replicas));
+  }
+  if (servers.empty()) {
+    throw std::runtime_error("server.info lists no server");
+  }
+  auto model = std::make_unique<ClientModel>(servers[0][0].ip,
+                                             servers[0][0].port);
+  model->set_servers(std::move(servers));
+  return model;
 }
 
 ClientModel::ClientModel(const std::string& ip, const std::string& port)
-    : m_ip(ip), m_port(port), m_has_valid_key(false) {
+    : m_ip(ip),
+      m_port(port),
+      m_servers{{ServerEndpoint{ip, port}}},
+      m_has_valid_key(false) {
   m_aes_wrapper = std::make_unique<AESWrapper>();
 }
 
+void ClientModel::set_servers(
+    std::vector<std::vector<ServerEndpoint>> servers) {
+  if (servers.empty() || servers[0].empty()) {
+    throw std::runtime_error("At least one server is required");
+  }
+  m_ip = servers[0][0].ip;
+  m_port = servers[0][0].port;
+  m_servers = std::move(servers);
+}
+
 ClientModel::~ClientModel() = default;
 
 ClientModel::ClientModel(ClientModel&& other) noexcept = default;
 ClientModel& ClientModel::operator=(ClientModel&& other) noexcept = default;
 
 bool ClientModel::me_info_exists() const {
-  std::ifstream meFile("me.info");
+  std::ifstream meFile(m_me_info_path);
   return meFile.good();
 }
 
@@ -40,15 +78,16 @@ void ClientModel::save_me_info(
     const std::string& username,
     const std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>& uuid,
     std::string private_key_base64) {
+  MESSAGEU_ALLOC_SITE(Model);
   private_key_base64.erase(
       std::remove(private_key_base64.begin(), private_key_base64.end(), '\n'),
       private_key_base64.end());
   private_key_base64.erase(
       std::remove(private_key_base64.begin(), private_key_base64.end(), '\r'),
       private_key_base64.end());  // For Windows-style newlines
-  std::ofstream out("me.info");
+  std::ofstream out(m_me_info_path);
   if (!out) {
-    throw std::runtime_error("Failed to write me.info.");
+    throw std::runtime_error("Failed to write " + m_me_info_path + ".");
   }
   // Write username and UUID as hex string for human readability
   out << username << std::endl;
@@ -63,31 +102,58 @@ void ClientModel::save_me_info(
 }
 
 void ClientModel::set_client_list(const std::vector<ClientListEntry>& list) {
-  // Preserve symmetric keys when updating the client list
-  std::vector<ClientListEntry> updated_list = list;
-
-  // Copy symmetric keys from old list to new list where client IDs match
-  for (auto& new_entry : updated_list) {
-    for (const auto& old_entry : m_client_list) {
-      if (new_entry.id == old_entry.id) {
-        new_entry.symmetric_key = old_entry.symmetric_key;
-        new_entry.has_valid_symmetric_key = old_entry.has_valid_symmetric_key;
-        new_entry.public_key = old_entry.public_key;
-        new_entry.has_valid_public_key = old_entry.has_valid_public_key;
-      }
-    }
+  set_client_list(std::vector<ClientListEntry>(list));
+}
+
+void ClientModel::set_client_list(std::vector<ClientListEntry>&& list) {
+  MESSAGEU_ALLOC_SITE(Model);
+  // Preserve keys when updating the client list. Index the old list once so
+  // the merge stays linear for large directories.
+  std::unordered_map<std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>,
+                     ClientListEntry*, ClientIdHash>
+      old_by_id;
+  old_by_id.reserve(m_client_list.size());
+  for (auto& old_entry : m_client_list)
+    old_by_id.emplace(old_entry.id, &old_entry);
+
+  // Move keys from old list to new list where client IDs match
+  for (auto& new_entry : list) {
+    auto it = old_by_id.find(new_entry.id);
+    if (it == old_by_id.end())
+      continue;
+    ClientListEntry& old_entry = *it->second;
+    new_entry.symmetric_key = std::move(old_entry.symmetric_key);
+    new_entry.has_valid_symmetric_key = old_entry.has_valid_symmetric_key;
+    new_entry.public_key = std::move(old_entry.public_key);
+    new_entry.has_valid_public_key = old_entry.has_valid_public_key;
   }
 
-  m_client_list = updated_list;
+  m_client_list = std::move(list);
 }
 
 const std::vector<ClientListEntry>& ClientModel::get_client_list() const {
   return m_client_list;
 }
 
+void ClientModel::merge_clients(std::vector<ClientListEntry>&& entries) {
+  MESSAGEU_ALLOC_SITE(Model);
+  for (auto& entry : entries) {
+    ClientListEntry* listed = get_client_by_id(entry.id);
+    if (!listed) {
+      m_client_list.push_back(std::move(entry));
+      continue;
+    }
+    if (entry.has_valid_public_key && !listed->has_valid_public_key) {
+      listed->public_key = std::move(entry.public_key);
+      listed->has_valid_public_key = true;
+    }
+  }
+}
+
 void ClientModel::update_client_public_key(
     const std::array<u_int8_t, 16>& id,
     const std::vector<uint8_t>& public_key) {
+  MESSAGEU_ALLOC_SITE(Model);
   for (auto& entry : m_client_list) {
     if (entry.id == id) {
       entry.public_key = public_key;
@@ -132,11 +198,10 @@ const ClientListEntry* ClientModel::get_client_by_name(
   return nullptr;
 }
 
-void ClientModel::load_my_info() {
-  std::ifstream meFile("me.info");
+MeInfo ClientModel::read_me_info(const std::string& filename) {
+  std::ifstream meFile(filename);
   if (!meFile) {
-    std::cout << "me.info not found, proceeding without loading user info.\n";
-    return;
+    throw std::runtime_error(filename + " not found");
   }
   std::string username, uuid_hex, private_key_base64;
   std::getline(meFile, username);
@@ -147,26 +212,35 @@ void ClientModel::load_my_info() {
   // Remove whitespace
   uuid_hex.erase(std::remove_if(uuid_hex.begin(), uuid_hex.end(), ::isspace),
                  uuid_hex.end());
-  if (uuid_hex.size() == ProtocolMessage::CLIENT_ID_SIZE * 2) {
-    // Hex string
-    std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE> arr;
-    for (size_t i = 0; i < ProtocolMessage::CLIENT_ID_SIZE; ++i) {
-      std::string byte_str = uuid_hex.substr(i * 2, 2);
-      arr[i] = static_cast<uint8_t>(std::stoul(byte_str, nullptr, 16));
-    }
-    m_my_id = arr;
-
-    // Store the private key in memory if it exists
-    if (private_key_base64.empty()) {
-      throw std::runtime_error("Invalid private key in me.info");
-    }
-    m_private_key = Base64Wrapper::decode(private_key_base64);
-    m_rsa_private_wrapper = std::make_unique<RSAPrivateWrapper>(m_private_key);
-    m_public_key = m_rsa_private_wrapper->getPublicKey();
+  if (uuid_hex.size() != ProtocolMessage::CLIENT_ID_SIZE * 2) {
+    throw std::runtime_error("Invalid UUID format in " + filename);
+  }
+  MeInfo info;
+  info.username = username;
+  // Hex string
+  for (size_t i = 0; i < ProtocolMessage::CLIENT_ID_SIZE; ++i) {
+    std::string byte_str = uuid_hex.substr(i * 2, 2);
+    info.id[i] = static_cast<uint8_t>(std::stoul(byte_str, nullptr, 16));
+  }
 
-  } else {
-    throw std::runtime_error("Invalid UUID format in me.info");
+  if (private_key_base64.empty()) {
+    throw std::runtime_error("Invalid private key in " + filename);
   }
+  info.private_key = Base64Wrapper::decode(private_key_base64);
+  return info;
+}
+
+void ClientModel::load_my_info() {
+  MESSAGEU_ALLOC_SITE(Model);
+  if (!me_info_exists())
+    return;
+  MeInfo info = read_me_info(m_me_info_path);
+  m_my_id = info.id;
+
+  // Store the private key in memory
+  m_private_key = std::move(info.private_key);
+  m_rsa_private_wrapper = std::make_unique<RSAPrivateWrapper>(m_private_key);
+  m_public_key = m_rsa_private_wrapper->getPublicKey();
 }
 
 std::string ClientModel::get_private_key() const {
@@ -1,6 +1,7 @@
 #pragma once
 #include <array>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -9,6 +10,7 @@
 #include "../cryptopp_wrapper/Base64Wrapper.h"
 #include "../cryptopp_wrapper/RSAWrapper.h"
 #include "../protocol_message.hpp"
+#include "message_history.hpp"
 
 struct ClientListEntry {
   std::array<u_int8_t, sizeof(ProtocolRequestHeader::client_id)> id;
@@ -19,8 +21,27 @@ struct ClientListEntry {
   bool has_valid_symmetric_key = false;
 };
 
+// One server address from server.info, as passed to make_transport()
+struct ServerEndpoint {
+  std::string ip;  // or the "unix"/"shm" scheme
+  std::string port;
+};
+
+// Contents of a me.info file
+struct MeInfo {
+  std::string username;
+  std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE> id;
+  std::string private_key;  // DER, decoded from the stored base64
+};
+
 class ClientModel {
  public:
+  // Parses a me.info style file. Throws if it is missing or malformed.
+  static MeInfo read_me_info(const std::string& filename);
+
+  // Reads server.info: a line per shard, the replicas of the shard
+  // separated by commas. Replicas must share their state (ShardRouter), so
+  // a line lists one server.py only. Throws if it lists no server.
   static std::unique_ptr<ClientModel> create_from_file(
       const std::string& filename);
 
@@ -31,22 +52,38 @@ class ClientModel {
   ClientModel(ClientModel&& other) noexcept;
   ClientModel& operator=(ClientModel&& other) noexcept;
 
+  // Where the identity is stored, me.info in the working directory unless
+  // set otherwise, e.g. for several identities in one process
+  const std::string& me_info_path() const { return m_me_info_path; }
+  void set_me_info_path(const std::string& path) { m_me_info_path = path; }
   bool me_info_exists() const;
   void save_me_info(
       const std::string& username,
       const std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>& uuid,
       std::string private_key_base64);
+  // Loads the identity file, if there is one
   void load_my_info();
 
+  // The first server listed
   const std::string& get_ip() const { return m_ip; }
   const std::string& get_port() const { return m_port; }
+  // Every server, as the replicas of each shard. A model built from an ip
+  // and port has that server as its only shard.
+  const std::vector<std::vector<ServerEndpoint>>& get_servers() const {
+    return m_servers;
+  }
+  void set_servers(std::vector<std::vector<ServerEndpoint>> servers);
 
   const std::array<uint8_t, 16>& get_my_id() const { return m_my_id; }
 
   // Returns the stored private key
   std::string get_private_key() const;
   void set_client_list(const std::vector<ClientListEntry>& list);
+  void set_client_list(std::vector<ClientListEntry>&& list);
   const std::vector<ClientListEntry>& get_client_list() const;
+  // Adds the entries not listed yet and fills in the public key of those
+  // that are, keeping every other list entry and key as it is
+  void merge_clients(std::vector<ClientListEntry>&& entries);
   void update_client_public_key(
       const std::array<u_int8_t, sizeof(ProtocolRequestHeader::client_id)>& id,
       const std::vector<uint8_t>& public_key);
@@ -114,15 +151,28 @@ class ClientModel {
     return m_aes_wrapper->decrypt(cipher, length);
   }
 
+  // Where the message history is kept: me.info's path with the extension
+  // .history, e.g. me.history
+  std::string history_path() const;
+  // Opens the history, creating it for the identity's key if there is none.
+  // Requires the identity. Does nothing when already open.
+  void open_history();
+  // Null until open_history(). The history is safe to use without the lock
+  // that guards the model.
+  MessageHistory* history() const { return m_history.get(); }
+
  private:
   std::string m_ip;
   std::string m_port;
+  std::vector<std::vector<ServerEndpoint>> m_servers;
+  std::string m_me_info_path = "me.info";
   std::vector<ClientListEntry> m_client_list;
   bool m_has_valid_key = false;
   std::string m_private_key;  // Stored in string format
   std::unique_ptr<AESWrapper> m_aes_wrapper;
   std::unique_ptr<RSAPrivateWrapper> m_rsa_private_wrapper;
   std::string m_public_key;
+  std::unique_ptr<MessageHistory> m_history;
 
   std::array<uint8_t, 16> m_my_id{};
 };
\ No newline at end of file
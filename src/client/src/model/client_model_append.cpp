@@ -0,0 +1,22 @@
+#include <filesystem>
+#include <stdexcept>
+#include "client_model.hpp"
+
+// The message history, appended to as messages are sent and received
+
+std::string ClientModel::history_path() const {
+  return std::filesystem::path(m_me_info_path)
+      .replace_extension(".history")
+      .string();
+}
+
+void ClientModel::open_history() {
+  if (m_history)
+    return;
+  if (m_rsa_private_wrapper == nullptr) {
+    throw std::runtime_error(
+        "No identity to open the message history with. Register first.");
+  }
+  m_history =
+      std::make_unique<MessageHistory>(history_path(), *m_rsa_private_wrapper);
+}
@@ -0,0 +1,56 @@
+#include "identity.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+
+Identity::Identity(MeInfo info)
+    : m_name(std::move(info.username)),
+      m_id(info.id),
+      m_private_key(std::move(info.private_key)),
+      m_pending_messages_frame(
+          ProtocolMessage::create_pending_messages_frame(info.id)) {}
+
+std::string Identity::get_symmetric_key() const {
+  return std::string(reinterpret_cast<const char*>(m_aes_wrapper.getKey()),
+                     AESWrapper::DEFAULT_KEYLENGTH);
+}
+
+std::string Identity::decrypt_with_aes(const char* cipher,
+                                       unsigned int length) {
+  return m_aes_wrapper.decrypt(cipher, length);
+}
+
+void Identity::set_and_decrypt_symmetric_key_for_peer(
+    const Id& peer,
+    const std::string& encrypted_key) {
+  m_peer_keys[peer] = rsa().decrypt(encrypted_key);
+}
+
+RSAPrivateWrapper& Identity::rsa() {
+  if (!m_rsa_private_wrapper)
+    m_rsa_private_wrapper = std::make_unique<RSAPrivateWrapper>(m_private_key);
+  return *m_rsa_private_wrapper;
+}
+
+std::vector<std::unique_ptr<Identity>> load_identities(
+    const std::string& dir,
+    std::vector<std::string>& errors) {
+  std::vector<std::filesystem::path> paths;
+  for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".info")
+      paths.push_back(entry.path());
+  }
+  std::sort(paths.begin(), paths.end());
+
+  std::vector<std::unique_ptr<Identity>> identities;
+  identities.reserve(paths.size());
+  for (const auto& path : paths) {
+    try {
+      identities.push_back(
+          std::make_unique<Identity>(ClientModel::read_me_info(path.string())));
+    } catch (const std::exception& e) {
+      errors.push_back(path.string() + ": " + e.what());
+    }
+  }
+  return identities;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "client_model.hpp"
+
+// One account hosted by a multi-identity process. Keeps only the per-account
+// state the bot loop needs, about a kilobyte; the RSA private key stays in
+// DER form until a symmetric key actually has to be decrypted.
+class Identity {
+ public:
+  using Id = std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>;
+
+  explicit Identity(MeInfo info);
+  Identity(const Identity& other) = delete;
+  Identity& operator=(const Identity& other) = delete;
+
+  const std::string& name() const { return m_name; }
+  const Id& id() const { return m_id; }
+
+  // Ready-to-send PENDING_MESSAGE_REQUEST frame for this identity
+  const ProtocolMessage::EmptyRequestFrame& pending_messages_frame() const {
+    return m_pending_messages_frame;
+  }
+
+  // This identity's symmetric key, the one peers encrypt to us with
+  std::string get_symmetric_key() const;
+  std::string decrypt_with_aes(const char* cipher, unsigned int length);
+
+  // Decrypts a key sent by `peer` with our private key and stores it
+  void set_and_decrypt_symmetric_key_for_peer(const Id& peer,
+                                              const std::string& encrypted_key);
+  bool has_symmetric_key_for_peer(const Id& peer) const {
+    return m_peer_keys.count(peer) != 0;
+  }
+
+ private:
+  RSAPrivateWrapper& rsa();
+
+  std::string m_name;
+  Id m_id;
+  std::string m_private_key;  // DER
+  std::unique_ptr<RSAPrivateWrapper> m_rsa_private_wrapper;
+  AESWrapper m_aes_wrapper;
+  ProtocolMessage::EmptyRequestFrame m_pending_messages_frame;
+  std::unordered_map<Id, std::string, ClientIdHash> m_peer_keys;
+};
+
+// Loads every *.info file in `dir` (me.info format), sorted by file name.
+// Files that fail to parse are skipped and described in `errors`.
+std::vector<std::unique_ptr<Identity>> load_identities(
+    const std::string& dir,
+    std::vector<std::string>& errors);
@@ -0,0 +1,372 @@
+#include "message_history.hpp"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include "../alloc_profile.hpp"
+#include "../crypto_backend/crypto_backend.hpp"
+#include "../cryptopp_wrapper/RSAWrapper.h"
+
+namespace {
+
+constexpr char LOG_MAGIC[4] = {'M', 'U', 'H', '2'};
+constexpr char INDEX_MAGIC[4] = {'M', 'U', 'X', '2'};
+
+int64_t to_signed(uint64_t value) {
+  return static_cast<int64_t>(value);
+}
+
+// Takes as long wherever the first difference is
+bool same_tag(const std::string& a, const char* b, size_t size) {
+  if (a.size() != size)
+    return false;
+  unsigned char diff = 0;
+  for (size_t i = 0; i < size; ++i)
+    diff |= static_cast<unsigned char>(a[i] ^ b[i]);
+  return diff == 0;
+}
+
+}  // namespace
+
+MessageHistory::MessageHistory(const std::string& path, RSAPrivateWrapper& key)
+    : m_path(path), m_index_path(path + ".idx") {
+  std::error_code ec;
+  uint64_t log_size = std::filesystem::file_size(m_path, ec);
+  uint64_t log_start = 0;
+  if (ec || log_size == 0) {
+    log_start = create(key);
+    log_size = log_start;
+  } else {
+    log_start = open_log(key);
+  }
+  uint64_t indexed = load_index(log_start, log_size);
+
+  m_index.open(m_index_path, std::ios::binary | std::ios::app);
+  if (!m_index)
+    throw std::runtime_error("Failed to open " + m_index_path + ".");
+  m_log_size = index_tail(indexed, log_size);
+  m_log.open(m_path, std::ios::binary | std::ios::app);
+  if (!m_log)
+    throw std::runtime_error("Failed to open " + m_path + ".");
+}
+
+uint64_t MessageHistory::create(RSAPrivateWrapper& key) {
+  crypto_backend().random_bytes(m_key.data(), m_key.size());
+  crypto_backend().random_bytes(m_mac_key.data(), m_mac_key.size());
+  // Both keys in one RSA block
+  std::string keys(reinterpret_cast<const char*>(m_key.data()), m_key.size());
+  keys.append(reinterpret_cast<const char*>(m_mac_key.data()),
+              m_mac_key.size());
+  RSAPublicWrapper public_key(key.getPublicKey());
+  std::string wrapped = public_key.encrypt(keys.data(), keys.size());
+
+  std::array<uint8_t, KeyHeader::size> header;
+  KeyHeader::pack(header.data(), static_cast<uint16_t>(wrapped.size()));
+  std::ofstream log(m_path, std::ios::binary | std::ios::trunc);
+  log.write(LOG_MAGIC, sizeof(LOG_MAGIC));
+  log.write(reinterpret_cast<const char*>(header.data()), header.size());
+  log.write(wrapped.data(), wrapped.size());
+  std::ofstream index(m_index_path, std::ios::binary | std::ios::trunc);
+  index.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  if (!log || !index)
+    throw std::runtime_error("Failed to create " + m_path + ".");
+  return sizeof(LOG_MAGIC) + header.size() + wrapped.size();
+}
+
+uint64_t MessageHistory::open_log(RSAPrivateWrapper& key) {
+  std::ifstream log(m_path, std::ios::binary);
+  char magic[sizeof(LOG_MAGIC)];
+  std::array<uint8_t, KeyHeader::size> header;
+  log.read(magic, sizeof(magic));
+  log.read(reinterpret_cast<char*>(header.data()), header.size());
+  std::string wrapped(KeyHeader::get<0>(header.data()), '\0');
+  log.read(wrapped.data(), wrapped.size());
+  if (!log || std::memcmp(magic, LOG_MAGIC, sizeof(magic)) != 0)
+    throw std::runtime_error(m_path + " is not a message history.");
+
+  std::string plain;
+  try {
+    plain = key.decrypt(wrapped);
+  } catch (const std::exception&) {
+  }
+  if (plain.size() != m_key.size() + m_mac_key.size()) {
+    throw std::runtime_error(m_path +
+                             " was written for another identity than me.info.");
+  }
+  std::memcpy(m_key.data(), plain.data(), m_key.size());
+  std::memcpy(m_mac_key.data(), plain.data() + m_key.size(), m_mac_key.size());
+  return sizeof(LOG_MAGIC) + header.size() + wrapped.size();
+}
+
+uint64_t MessageHistory::load_index(uint64_t log_start, uint64_t log_size) {
+  std::ifstream in(m_index_path, std::ios::binary);
+  char magic[sizeof(INDEX_MAGIC)];
+  uint64_t covered = log_start;
+  uint64_t good = 0;
+  if (in.read(magic, sizeof(magic)) &&
+      std::memcmp(magic, INDEX_MAGIC, sizeof(magic)) == 0) {
+    good = sizeof(magic);
+    std::string plain;
+    uint64_t end = 0;
+    while (read_block(in, good, plain, end)) {
+      if (plain.size() < IndexBlockPrefix::size ||
+          (plain.size() - IndexBlockPrefix::size) % IndexEntry::size != 0)
+        break;
+      const uint8_t* prefix = reinterpret_cast<const uint8_t*>(plain.data());
+      uint64_t block = IndexBlockPrefix::get<0>(prefix);
+      uint64_t block_end = IndexBlockPrefix::get<1>(prefix);
+      // A log truncated behind our back invalidates the rest
+      if (block != covered || block_end > log_size)
+        break;
+      add_positions(plain);
+      covered = block_end;
+      good = end;
+    }
+  }
+  in.close();
+
+  if (good == 0) {
+    std::ofstream index(m_index_path, std::ios::binary | std::ios::trunc);
+    index.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    if (!index)
+      throw std::runtime_error("Failed to create " + m_index_path + ".");
+  } else {
+    std::filesystem::resize_file(m_index_path, good);
+  }
+  return covered;
+}
+
+uint64_t MessageHistory::index_tail(uint64_t offset, uint64_t log_size) {
+  std::ifstream in(m_path, std::ios::binary);
+  std::string plain;
+  uint64_t end = 0;
+  while (offset < log_size && read_block(in, offset, plain, end)) {
+    std::string index = index_block(offset, end, plain);
+    std::string sealed = seal(index);
+    m_index.write(sealed.data(), sealed.size());
+    add_positions(index);
+    offset = end;
+  }
+  in.close();
+  m_index.flush();
+  if (!m_index)
+    throw std::runtime_error("Failed to write " + m_index_path + ".");
+  if (offset < log_size)
+    std::filesystem::resize_file(m_path, offset);
+  return offset;
+}
+
+std::string MessageHistory::seal(const std::string& plain) const {
+  std::array<uint8_t, 16> iv;
+  crypto_backend().random_bytes(iv.data(), iv.size());
+  std::string cipher = crypto_backend().aes_cbc_encrypt(
+      m_key.data(), m_key.size(), iv.data(),
+      reinterpret_cast<const uint8_t*>(plain.data()), plain.size());
+  std::string block(BlockHeader::size, '\0');
+  BlockHeader::pack(reinterpret_cast<uint8_t*>(block.data()), iv,
+                    static_cast<uint32_t>(cipher.size()));
+  block += cipher;
+  block += crypto_backend().hmac_sha256(
+      m_mac_key.data(), m_mac_key.size(),
+      reinterpret_cast<const uint8_t*>(block.data()), block.size());
+  return block;
+}
+
+bool MessageHistory::read_block(std::ifstream& in,
+                                uint64_t offset,
+                                std::string& plain,
+                                uint64_t& end) const {
+  // Header and cipher in one buffer, as the MAC covers both
+  std::string block(BlockHeader::size, '\0');
+  in.clear();
+  in.seekg(0, std::ios::end);
+  std::streamoff file_size = in.tellg();
+  in.seekg(offset);
+  if (file_size < 0 || !in.read(block.data(), block.size()))
+    return false;
+  const uint8_t* header = reinterpret_cast<const uint8_t*>(block.data());
+  std::array<uint8_t, 16> iv = BlockHeader::get<0>(header);
+  uint32_t cipher_size = BlockHeader::get<1>(header);
+  // The size is not authenticated yet; a corrupt one must not make us
+  // allocate more than the file could hold
+  uint64_t left = static_cast<uint64_t>(file_size) - offset - BlockHeader::size;
+  if (static_cast<uint64_t>(cipher_size) + MAC_SIZE > left)
+    return false;
+  block.resize(BlockHeader::size + cipher_size + MAC_SIZE);
+  if (!in.read(block.data() + BlockHeader::size, cipher_size + MAC_SIZE))
+    return false;
+  const uint8_t* cipher =
+      reinterpret_cast<const uint8_t*>(block.data()) + BlockHeader::size;
+  std::string tag = crypto_backend().hmac_sha256(
+      m_mac_key.data(), m_mac_key.size(),
+      reinterpret_cast<const uint8_t*>(block.data()),
+      BlockHeader::size + cipher_size);
+  if (!same_tag(tag, block.data() + BlockHeader::size + cipher_size,
+                MAC_SIZE))
+    return false;
+  try {
+    plain = crypto_backend().aes_cbc_decrypt(m_key.data(), m_key.size(),
+                                             iv.data(), cipher, cipher_size);
+  } catch (const std::exception&) {
+    return false;
+  }
+  end = offset + block.size();
+  return true;
+}
+
+std::string MessageHistory::index_block(uint64_t block,
+                                        uint64_t end,
+                                        const std::string& plain) {
+  std::string index(IndexBlockPrefix::size, '\0');
+  IndexBlockPrefix::pack(reinterpret_cast<uint8_t*>(index.data()), block, end);
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(plain.data());
+  size_t pos = 0;
+  while (plain.size() - pos >= Record::size) {
+    auto [time_ms, peer, message_id, type, outgoing, name_size, content_size] =
+        Record::unpack(data + pos);
+    (void)type;
+    (void)outgoing;
+    size_t next = pos + Record::size + name_size + content_size;
+    if (next > plain.size())
+      break;
+    std::array<uint8_t, IndexEntry::size> entry;
+    IndexEntry::pack(entry.data(), time_ms, peer, message_id,
+                     static_cast<uint32_t>(pos));
+    index.append(reinterpret_cast<const char*>(entry.data()), entry.size());
+    pos = next;
+  }
+  return index;
+}
+
+void MessageHistory::add_positions(const std::string& index_plain) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(index_plain.data());
+  uint64_t block = IndexBlockPrefix::get<0>(data);
+  for (size_t pos = IndexBlockPrefix::size; pos < index_plain.size();
+       pos += IndexEntry::size) {
+    auto [time_ms, peer, message_id, record] = IndexEntry::unpack(data + pos);
+    m_by_peer[peer].push_back(m_positions.size());
+    m_positions.push_back(
+        Position{to_signed(time_ms), peer, message_id, block, record});
+  }
+}
+
+size_t MessageHistory::size() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_positions.size();
+}
+
+void MessageHistory::append(const std::vector<Entry>& entries) {
+  MESSAGEU_ALLOC_SITE(Model);
+  if (entries.empty())
+    return;
+  std::string plain;
+  for (const Entry& entry : entries) {
+    size_t name_size = std::min<size_t>(entry.peer_name.size(), UINT8_MAX);
+    std::array<uint8_t, Record::size> record;
+    Record::pack(record.data(), static_cast<uint64_t>(entry.time_ms),
+                 entry.peer, entry.message_id, entry.type,
+                 entry.outgoing ? 1 : 0, static_cast<uint8_t>(name_size),
+                 static_cast<uint32_t>(entry.content.size()));
+    plain.append(reinterpret_cast<const char*>(record.data()), record.size());
+    plain.append(entry.peer_name, 0, name_size);
+    plain += entry.content;
+  }
+  std::string sealed = seal(plain);
+
+  // The index block names the log block's offset, known under the lock only
+  std::lock_guard<std::mutex> lock(m_mutex);
+  uint64_t block = m_log_size;
+  uint64_t end = block + sealed.size();
+  m_log.write(sealed.data(), sealed.size());
+  m_log.flush();
+  if (!m_log)
+    throw std::runtime_error("Failed to write " + m_path + ".");
+  std::string index = index_block(block, end, plain);
+  std::string sealed_index = seal(index);
+  m_index.write(sealed_index.data(), sealed_index.size());
+  m_index.flush();
+  if (!m_index)
+    throw std::runtime_error("Failed to write " + m_index_path + ".");
+  m_log_size = end;
+  add_positions(index);
+}
+
+std::vector<MessageHistory::Entry> MessageHistory::query(
+    const Query& query) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::vector<size_t> matches;
+  auto consider = [&](size_t index) {
+    const Position& position = m_positions[index];
+    if (position.time_ms >= query.from_ms && position.time_ms < query.to_ms)
+      matches.push_back(index);
+  };
+  if (query.peer) {
+    auto it = m_by_peer.find(*query.peer);
+    if (it != m_by_peer.end()) {
+      for (size_t index : it->second)
+        consider(index);
+    }
+  } else {
+    for (size_t index = 0; index < m_positions.size(); ++index)
+      consider(index);
+  }
+  if (query.limit > 0 && matches.size() > query.limit)
+    matches.erase(matches.begin(), matches.end() - query.limit);
+  return read_entries(matches);
+}
+
+std::optional<MessageHistory::Entry> MessageHistory::find(
+    const ClientId& peer,
+    uint32_t message_id) const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_by_peer.find(peer);
+  if (it == m_by_peer.end())
+    return std::nullopt;
+  // The latest, should a server have reused the id
+  for (auto index = it->second.rbegin(); index != it->second.rend(); ++index) {
+    if (m_positions[*index].message_id == message_id)
+      return read_entries({*index}).front();
+  }
+  return std::nullopt;
+}
+
+std::vector<MessageHistory::Entry> MessageHistory::read_entries(
+    const std::vector<size_t>& positions) const {
+  MESSAGEU_ALLOC_SITE(Model);
+  std::vector<Entry> entries;
+  if (positions.empty())
+    return entries;
+  entries.reserve(positions.size());
+  std::ifstream in(m_path, std::ios::binary);
+  // Messages of a batch are next to each other, each block is read once
+  uint64_t block = UINT64_MAX;
+  std::string plain;
+  for (size_t index : positions) {
+    const Position& position = m_positions[index];
+    uint64_t end = 0;
+    if (position.block != block) {
+      if (!read_block(in, position.block, plain, end))
+        throw std::runtime_error("Failed to read " + m_path + ".");
+      block = position.block;
+    }
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(plain.data());
+    if (position.record > plain.size() ||
+        plain.size() - position.record < Record::size)
+      throw std::runtime_error("Corrupt record in " + m_path + ".");
+    auto [time_ms, peer, message_id, type, outgoing, name_size, content_size] =
+        Record::unpack(data + position.record);
+    size_t name = position.record + Record::size;
+    if (plain.size() - name < static_cast<size_t>(name_size) + content_size)
+      throw std::runtime_error("Corrupt record in " + m_path + ".");
+    Entry entry;
+    entry.time_ms = to_signed(time_ms);
+    entry.peer = peer;
+    entry.peer_name.assign(plain, name, name_size);
+    entry.message_id = message_id;
+    entry.type = type;
+    entry.outgoing = outgoing != 0;
+    entry.content.assign(plain, name + name_size, content_size);
+    entries.push_back(std::move(entry));
+  }
+  return entries;
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../protocol_schema.hpp"
+
+class RSAPrivateWrapper;
+
+// Append-only log of the messages sent and received, encrypted at rest, with
+// an index that finds a conversation without decrypting the whole log.
+//
+//   <path>      MAGIC [WRAPPED_KEYS_SIZE:2][WRAPPED_KEYS], then blocks
+//   <path>.idx  MAGIC, then blocks
+//
+// A block is [IV:16][CIPHER_SIZE:4][CIPHER][MAC:32], AES-128-CBC of one
+// batch of messages: a Record, the peer's name and the content for each
+// message in a log block; the log block's offset and end, then an IndexEntry
+// per message in the index block that follows it. MAC is the HMAC-SHA-256 of
+// the rest of the block, so a block that was altered is never decrypted.
+// The AES and MAC keys are random per history and stored encrypted with the
+// identity's RSA key, so only the private key in me.info opens the history.
+//
+// Every append() writes a log block, then its index block. Opening truncates
+// a block cut short by a crash, or failing its MAC, and indexes log blocks
+// the index misses. The index is held in memory; a query decrypts only the
+// log blocks of the messages it returns. Safe to use from several threads.
+class MessageHistory {
+ public:
+  using ClientId = std::array<uint8_t, schema::UUID_SIZE>;
+
+  struct Entry {
+    int64_t time_ms = 0;  // unix time it was sent or received
+    ClientId peer{};      // the sender, or the recipient when outgoing
+    std::string peer_name;
+    uint32_t message_id = 0;  // assigned by the server
+    uint8_t type = 0;         // ProtocolMessage::MessageType
+    bool outgoing = false;
+    std::string content;  // text, or the path of a file
+  };
+
+  struct Query {
+    std::optional<ClientId> peer;  // any peer when unset
+    // Messages in [from_ms, to_ms)
+    int64_t from_ms = INT64_MIN;
+    int64_t to_ms = INT64_MAX;
+    // The most recent `limit` of them, 0 for all
+    size_t limit = 0;
+  };
+
+  // Opens the history at `path`, or creates it for `key`. Throws if the
+  // files cannot be written, or were created for another key.
+  MessageHistory(const std::string& path, RSAPrivateWrapper& key);
+  MessageHistory(const MessageHistory& other) = delete;
+  MessageHistory& operator=(const MessageHistory& other) = delete;
+
+  const std::string& path() const { return m_path; }
+  size_t size() const;
+
+  // Writes the entries as one batch
+  void append(const std::vector<Entry>& entries);
+  // Matching entries, in the order they were appended
+  std::vector<Entry> query(const Query& query) const;
+  std::optional<Entry> find(const ClientId& peer, uint32_t message_id) const;
+
+ private:
+  using Record = schema::Layout<schema::U64,
+                                schema::Bytes<schema::UUID_SIZE>,
+                                schema::U32,
+                                schema::U8,
+                                schema::U8,
+                                schema::U8,
+                                schema::U32>;
+  using IndexBlockPrefix = schema::Layout<schema::U64, schema::U64>;
+  using IndexEntry = schema::Layout<schema::U64,
+                                    schema::Bytes<schema::UUID_SIZE>,
+                                    schema::U32,
+                                    schema::U32>;
+  using BlockHeader =
+      schema::Layout<schema::Bytes<16>, schema::U32>;  // IV, cipher size
+  static constexpr size_t MAC_SIZE = 32;
+  using KeyHeader = schema::Layout<schema::U16>;
+
+  struct Position {
+    int64_t time_ms;
+    ClientId peer;
+    uint32_t message_id;
+    uint64_t block;   // offset of the log block
+    uint32_t record;  // offset of the Record in the block's plaintext
+  };
+
+  // Writes the headers of a new history, with a new key. Returns the size
+  // of the log header.
+  uint64_t create(RSAPrivateWrapper& key);
+  // Reads the key of an existing log. Returns the size of its header.
+  uint64_t open_log(RSAPrivateWrapper& key);
+  // Loads the index blocks, up to one cut short or past `log_size`, and
+  // returns the log offset they cover up to
+  uint64_t load_index(uint64_t log_start, uint64_t log_size);
+  // Indexes the log blocks from `offset` on, truncating one cut short, and
+  // returns the end of the last whole block
+  uint64_t index_tail(uint64_t offset, uint64_t log_size);
+
+  // The block holding `plain`, under a new IV
+  std::string seal(const std::string& plain) const;
+  // Reads and decrypts the block at `offset`, setting `end` past it. False if
+  // it is cut short, claims more bytes than the file has left, fails its MAC
+  // or does not decrypt.
+  bool read_block(std::ifstream& in,
+                  uint64_t offset,
+                  std::string& plain,
+                  uint64_t& end) const;
+  // Plaintext of the index block for the log block [block, end)
+  static std::string index_block(uint64_t block,
+                                 uint64_t end,
+                                 const std::string& plain);
+  // Requires m_mutex, or the constructor
+  void add_positions(const std::string& index_plain);
+  // Requires m_mutex
+  std::vector<Entry> read_entries(const std::vector<size_t>& positions) const;
+
+  std::string m_path;
+  std::string m_index_path;
+  std::array<uint8_t, 16> m_key{};
+  std::array<uint8_t, 32> m_mac_key{};
+
+  mutable std::mutex m_mutex;
+  std::ofstream m_log;
+  std::ofstream m_index;
+  uint64_t m_log_size = 0;
+  std::vector<Position> m_positions;  // in append order
+  std::unordered_map<ClientId, std::vector<size_t>, ClientIdHash> m_by_peer;
+};
@@ -0,0 +1,266 @@
+#include "pending_reader.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include "alloc_profile.hpp"
+#include "buffer_pool.hpp"
+#include "compression.hpp"
+#include "protocol_schema.hpp"
+#include "tcp_client.hpp"
+
+PendingReader::PendingReader(ClientModel& model, std::mutex& model_mutex)
+    : m_model(model), m_model_mutex(model_mutex) {}
+
+std::string PendingReader::receive_file_to_temp(TcpClient& client,
+                                                uint32_t cipher_size) {
+  // incoming files are encrypted with my symmetric key, like TEXT messages
+  std::string key;
+  {
+    std::lock_guard<std::mutex> lock(m_model_mutex);
+    key = m_model.get_symmetric_key();
+  }
+  AESStreamCipher decryptor(reinterpret_cast<const unsigned char*>(key.data()),
+                            key.size(), AESStreamCipher::Direction::Decrypt);
+
+  std::string path =
+      (std::filesystem::temp_directory_path() / "messageu_XXXXXX").string();
+  int fd = mkstemp(path.data());
+  if (fd < 0) {
+    client.skip_n_bytes(cipher_size);
+    throw std::runtime_error("Failed to create temp file for incoming file");
+  }
+  close(fd);
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+
+  // Always drain the whole content, even after a failure, so the socket stays
+  // in sync with the rest of the reply
+  std::vector<uint8_t> chunk(FILE_CHUNK_SIZE);
+  std::string error;
+  size_t remaining = cipher_size;
+  while (remaining > 0) {
+    size_t n = std::min(remaining, chunk.size());
+    client.receive_into(chunk.data(), n);
+    remaining -= n;
+    if (!error.empty())
+      continue;
+    try {
+      std::string plain =
+          decryptor.update(reinterpret_cast<const char*>(chunk.data()), n);
+      out.write(plain.data(), plain.size());
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+  }
+  if (error.empty()) {
+    try {
+      std::string plain = decryptor.finish();
+      out.write(plain.data(), plain.size());
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+  }
+  out.close();
+  if (error.empty() && !out)
+    error = "write to " + path + " failed";
+
+  if (!error.empty()) {
+    std::remove(path.c_str());
+    throw std::runtime_error("Failed to receive file: " + error);
+  }
+  return path;
+}
+
+std::vector<PendingMessage> PendingReader::read(
+    TcpClient& client,
+    size_t payload_size,
+    std::vector<size_t>* unresolved) {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  using MessageType = ProtocolMessage::MessageType;
+  using Record = schema::PendingMessageRecord;
+  std::vector<PendingMessage> messages;
+  auto add_error = [&messages](const std::string& error) {
+    PendingMessage message{};
+    message.error = error;
+    messages.push_back(std::move(message));
+  };
+
+  // Each message has:
+  // [CLIENT_ID][MSG_ID][MSG_TYPE][MSG_SIZE][CONTENT]
+  size_t remaining = payload_size;
+  while (remaining >= Record::size) {
+    std::array<uint8_t, Record::size> record;
+    client.receive_into(record.data(), record.size());
+    remaining -= record.size();
+
+    auto [from_id, msg_id, msg_type, msg_size] = Record::unpack(record.data());
+
+    // Validate message type before proceeding
+    if (msg_type < 1 || msg_type > static_cast<uint8_t>(MessageType::FILE)) {
+      add_error("Invalid message type: " + std::to_string(msg_type));
+      break;
+    }
+    if (msg_size > remaining) {
+      add_error("Message content exceeds payload bounds");
+      break;
+    }
+
+    PendingMessage message{};
+    message.from_id = from_id;
+    message.message_id = msg_id;
+    message.type = msg_type;
+    bool known_sender = false;
+    {
+      MESSAGEU_ALLOC_SITE(Model);
+      std::lock_guard<std::mutex> lock(m_model_mutex);
+      const ClientListEntry* sender = m_model.get_client_by_id(from_id);
+      if (sender) {
+        message.sender_name = sender->name;
+        known_sender = true;
+      }
+    }
+    if (!known_sender && unresolved) {
+      // Indexed before it is added, whatever branch below adds it
+      unresolved->push_back(messages.size());
+    } else if (!known_sender) {
+      // Skip messages from unknown senders
+      client.skip_n_bytes(msg_size);
+      remaining -= msg_size;
+      message.error =
+          "Sender ID not found in client list. Cannot display message.";
+      messages.push_back(std::move(message));
+      continue;
+    }
+
+    // Anything but a file is held in memory whole
+    uint32_t max_content = client.frame_limits().max_record_content();
+    if (msg_type != static_cast<uint8_t>(MessageType::FILE) &&
+        msg_size > max_content) {
+      client.skip_n_bytes(msg_size);
+      remaining -= msg_size;
+      message.error = "Message of " + std::to_string(msg_size) +
+                      " bytes exceeds the limit of " +
+                      std::to_string(max_content) + ", skipped.";
+      messages.push_back(std::move(message));
+      continue;
+    }
+
+    // Files are decrypted chunk by chunk into a temp file
+    if (msg_type == static_cast<uint8_t>(MessageType::FILE)) {
+      remaining -= msg_size;
+      try {
+        message.content = receive_file_to_temp(client, msg_size);
+      } catch (const std::exception& e) {
+        message.error = e.what();
+      }
+      messages.push_back(std::move(message));
+      continue;
+    }
+
+    PooledBuffer content_buf = client.receive_pooled(msg_size);
+    const std::vector<uint8_t>& content = content_buf.get();
+    remaining -= msg_size;
+
+    // Content is fully consumed, so a bad message must not abort the rest of
+    // the reply
+    try {
+      std::lock_guard<std::mutex> lock(m_model_mutex);
+      switch (static_cast<MessageType>(msg_type)) {
+        case MessageType::SYMMETRIC_KEY_SEND:
+          // Kept encrypted until resolve() adds the sender
+          if (!known_sender) {
+            message.content.assign(content.begin(), content.end());
+            break;
+          }
+          m_model.set_and_decrypt_symmetric_key_for_client(
+              from_id, std::string(content.begin(), content.end()));
+          break;
+        case MessageType::TEXT:
+        case MessageType::TEXT_COMPRESSED: {
+          if (content.empty()) {
+            message.error = "Received TEXT message with empty content. Skipping display.";
+            break;
+          }
+          // incoming messages are decrypted by my symmetric key
+          message.content = m_model.decrypt_with_aes(
+              reinterpret_cast<const char*>(content.data()), content.size());
+          if (msg_type == static_cast<uint8_t>(MessageType::TEXT_COMPRESSED)) {
+            auto plain = Compression::decompress(
+                reinterpret_cast<const uint8_t*>(message.content.data()),
+                message.content.size());
+            message.content.assign(plain.begin(), plain.end());
+          }
+          break;
+        }
+        default:
+          break;
+      }
+    } catch (const std::exception& e) {
+      message.content.clear();
+      message.error = e.what();
+    }
+    messages.push_back(std::move(message));
+  }
+  // Drop whatever is left after a malformed record so the next reply starts
+  // on a frame boundary
+  client.skip_n_bytes(remaining);
+  return messages;
+}
+
+std::vector<std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>>
+PendingReader::unknown_senders(const std::vector<PendingMessage>& messages,
+                               const std::vector<size_t>& unresolved) {
+  std::vector<std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>> ids;
+  for (size_t index : unresolved) {
+    const auto& id = messages[index].from_id;
+    if (std::find(ids.begin(), ids.end(), id) == ids.end())
+      ids.push_back(id);
+  }
+  return ids;
+}
+
+void PendingReader::resolve(std::vector<PendingMessage>& messages,
+                            std::vector<size_t>& unresolved) {
+  MESSAGEU_ALLOC_SITE(Model);
+  using MessageType = ProtocolMessage::MessageType;
+  std::lock_guard<std::mutex> lock(m_model_mutex);
+  auto still_unknown = std::remove_if(
+      unresolved.begin(), unresolved.end(), [&](size_t index) {
+        PendingMessage& message = messages[index];
+        const ClientListEntry* sender =
+            m_model.get_client_by_id(message.from_id);
+        if (!sender)
+          return false;
+        message.sender_name = sender->name;
+        if (message.type ==
+                static_cast<uint8_t>(MessageType::SYMMETRIC_KEY_SEND) &&
+            message.error.empty()) {
+          try {
+            m_model.set_and_decrypt_symmetric_key_for_client(message.from_id,
+                                                             message.content);
+          } catch (const std::exception& e) {
+            message.error = e.what();
+          }
+          message.content.clear();
+        }
+        return true;
+      });
+  unresolved.erase(still_unknown, unresolved.end());
+}
+
+void PendingReader::reject(std::vector<PendingMessage>& messages,
+                           std::vector<size_t>& unresolved) {
+  using MessageType = ProtocolMessage::MessageType;
+  for (size_t index : unresolved) {
+    PendingMessage& message = messages[index];
+    if (message.type == static_cast<uint8_t>(MessageType::FILE) &&
+        !message.content.empty())
+      std::remove(message.content.c_str());
+    message.content.clear();
+    message.error =
+        "Sender ID not found in client list. Cannot display message.";
+  }
+  unresolved.clear();
+}
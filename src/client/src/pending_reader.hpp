@@ -0,0 +1,71 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "model/client_model.hpp"
+
+class TcpClient;
+
+// A received message, as returned by fetch_pending() or passed to the
+// subscribe() handler. A record that could not be handled has `error` set
+// instead of `content`; the rest of its batch is still delivered.
+struct PendingMessage {
+  std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE> from_id;
+  std::string sender_name;
+  uint32_t message_id = 0;  // assigned by the server
+  uint8_t type = 0;       // ProtocolMessage::MessageType
+  std::string content;    // text, or the temp file path of a FILE
+  std::string error;
+};
+
+// Handles the records of a PENDING_MESSAGES_REPLY or PUSHED_MESSAGE payload
+// as they are read off the connection: resolves senders, stores received
+// symmetric keys, decrypts texts and streams files into temp files.
+//
+// Senders missing from the client list can be looked up afterwards: read()
+// then lists their messages as unresolved instead of dropping them, and
+// resolve() completes them once the model knows the senders.
+// Independent of MessageUClient so that captured traffic can be replayed
+// through it (see wire_capture.hpp).
+class PendingReader {
+ public:
+  // `model_mutex` guards `model`; it is never held during network I/O
+  PendingReader(ClientModel& model, std::mutex& model_mutex);
+
+  // Reads the records of a payload whose header was already consumed. Always
+  // consumes payload_size bytes.
+  // Without `unresolved`, messages from senders missing from the client list
+  // are skipped with an error. With it, they are processed all the same,
+  // short of their sender name and a received symmetric key, and their
+  // indexes are appended to `unresolved`.
+  std::vector<PendingMessage> read(TcpClient& client,
+                                   size_t payload_size,
+                                   std::vector<size_t>* unresolved = nullptr);
+
+  // Distinct senders of the unresolved messages, for a single lookup
+  static std::vector<std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>>
+  unknown_senders(const std::vector<PendingMessage>& messages,
+                  const std::vector<size_t>& unresolved);
+  // Completes the unresolved messages whose sender is now in the client list
+  // and removes them from `unresolved`
+  void resolve(std::vector<PendingMessage>& messages,
+               std::vector<size_t>& unresolved);
+  // Fails the remaining unresolved messages as read() without `unresolved`
+  // would have, deleting received files, and clears `unresolved`
+  static void reject(std::vector<PendingMessage>& messages,
+                     std::vector<size_t>& unresolved);
+
+ private:
+  // Read/decrypt granularity for FILE messages
+  static constexpr size_t FILE_CHUNK_SIZE = 64 * 1024;
+
+  // Decrypts a FILE message's content straight from the socket into a new
+  // temp file and returns its path. Always consumes cipher_size bytes.
+  std::string receive_file_to_temp(TcpClient& client, uint32_t cipher_size);
+
+  ClientModel& m_model;
+  std::mutex& m_model_mutex;
+};
@@ -1,89 +1,129 @@
 #include "protocol_message.hpp"
-#include <arpa/inet.h>
+#include <algorithm>
 #include <cstring>
 #include <stdexcept>
+#include "alloc_profile.hpp"
+#include "framing.hpp"
+#include "tcp_client.hpp"
+
+namespace {
+
+ProtocolRequestHeader make_header(const std::array<uint8_t, UUID_SIZE>& my_id,
+                                  uint16_t code) {
+  ProtocolRequestHeader header{};
+  header.client_id = my_id;
+  header.version = framing::V1;
+  header.code = code;
+  return header;
+}
+
+// Serializes the in-memory header in wire order
+std::array<uint8_t, schema::RequestHeader::size> pack_header(
+    const ProtocolRequestHeader& header) {
+  std::array<uint8_t, schema::RequestHeader::size> out;
+  schema::RequestHeader::pack(out.data(), header.client_id, header.version,
+                              header.code, header.payload_size);
+  return out;
+}
+
+// Fills the fixed [DST_ID][MSG_TYPE][CONTENT_SIZE] part of a send request
+// and returns where the content goes
+uint8_t* pack_send_prefix(uint8_t* out,
+                          const std::array<uint8_t, UUID_SIZE>& dst_id,
+                          ProtocolMessage::MessageType msg_type,
+                          uint32_t content_size) {
+  schema::SendMessagePrefix::pack(out, dst_id, static_cast<uint8_t>(msg_type),
+                                  content_size);
+  return out + schema::SendMessagePrefix::size;
+}
+
+void copy_content(uint8_t* out, const void* data, size_t size) {
+  if (size > 0)
+    std::memcpy(out, data, size);
+}
+
+}  // namespace
+
+ProtocolMessage::ProtocolMessage(const ProtocolRequestHeader& header,
+                                 size_t payload_size)
+    : m_header(header), m_payload_size(payload_size) {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  if (payload_size > INLINE_PAYLOAD_CAPACITY)
+    m_heap.resize(payload_size);
+  m_header.payload_size = payload_size;
+}
 
 ProtocolMessage::ProtocolMessage(const ProtocolRequestHeader& header,
                                  const std::vector<uint8_t>& payload)
-    : m_header(header), m_payload(payload) {}
+    : ProtocolMessage(header, payload.size()) {
+  copy_content(payload_data(), payload.data(), payload.size());
+}
 
 std::vector<uint8_t> ProtocolMessage::to_bytes() const {
-  ProtocolRequestHeader header_be = m_header;
-  header_be.code = htons(header_be.code);
-  header_be.payload_size = htonl(header_be.payload_size);
-
-  std::vector<uint8_t> buf(sizeof(ProtocolRequestHeader));
-  std::memcpy(buf.data(), &header_be, sizeof(ProtocolRequestHeader));
-  buf.insert(buf.end(), m_payload.begin(), m_payload.end());
+  MESSAGEU_ALLOC_SITE(Protocol);
+  auto header_bytes = pack_header(m_header);
+  std::vector<uint8_t> buf(header_bytes.size() + m_payload_size);
+  std::copy(header_bytes.begin(), header_bytes.end(), buf.begin());
+  copy_content(buf.data() + header_bytes.size(), payload_data(),
+               m_payload_size);
   return buf;
 }
 
 ProtocolMessage ProtocolMessage::from_bytes(const std::vector<uint8_t>& data) {
+  MESSAGEU_ALLOC_SITE(Protocol);
   if (data.size() < HEADER_SIZE)
     throw std::runtime_error("Message too short");
+  // Packed fields cannot be bound by reference, so unpack field by field
   ProtocolRequestHeader header;
-  std::memcpy(&header, data.data(), HEADER_SIZE);
-  header.code = ntohs(header.code);
-  header.payload_size = ntohl(header.payload_size);
+  header.client_id = schema::RequestHeader::get<0>(data.data());
+  header.version = schema::RequestHeader::get<1>(data.data());
+  header.code = schema::RequestHeader::get<2>(data.data());
+  header.payload_size = schema::RequestHeader::get<3>(data.data());
   if (data.size() < HEADER_SIZE + header.payload_size)
     throw std::runtime_error("Incomplete message");
-  std::vector<uint8_t> payload(
-      data.begin() + HEADER_SIZE,
-      data.begin() + HEADER_SIZE + header.payload_size);
-  return ProtocolMessage(header, payload);
+  ProtocolMessage msg(header, header.payload_size);
+  copy_content(msg.payload_data(), data.data() + HEADER_SIZE,
+               header.payload_size);
+  return msg;
 }
 
 // Helper for register request
 ProtocolMessage ProtocolMessage::create_register_request(
     const std::string& username,
     const std::string& public_key) {
-  ProtocolRequestHeader header{};
-  header.client_id.fill(0);  // UUID_SIZE bytes of 0 for registration
-  header.version = 1;
-  header.code = REQUEST_CODES::REGISTER;
-
-  std::vector<uint8_t> payload(
-      ProtocolMessage::CLIENT_NAME_SIZE + ProtocolMessage::PUBLIC_KEY_SIZE, 0);
-  std::memcpy(
-      payload.data(), username.c_str(),
-      std::min<size_t>(username.size(), ProtocolMessage::CLIENT_NAME_SIZE));
   if (public_key.size() != ProtocolMessage::PUBLIC_KEY_SIZE) {
     throw std::runtime_error("Public key must be exactly " +
                              std::to_string(ProtocolMessage::PUBLIC_KEY_SIZE) +
                              " bytes");
   }
+  // Name is null padded, longer names are truncated
+  std::array<uint8_t, CLIENT_NAME_SIZE> name{};
+  std::copy_n(username.begin(), std::min(username.size(), name.size()),
+              name.begin());
+  std::array<uint8_t, PUBLIC_KEY_SIZE> key;
+  std::copy_n(public_key.begin(), key.size(), key.begin());
 
-  std::memcpy(payload.data() + ProtocolMessage::CLIENT_NAME_SIZE,
-              public_key.data(), ProtocolMessage::PUBLIC_KEY_SIZE);
-
-  // else leave as zeros
-
-  header.payload_size = payload.size();
-
-  return ProtocolMessage(header, payload);
+  std::array<uint8_t, UUID_SIZE> no_id{};  // UUID_SIZE bytes of 0 for registration
+  ProtocolMessage msg(make_header(no_id, REQUEST_CODES::REGISTER),
+                      schema::RegisterRequest::size);
+  schema::RegisterRequest::pack(msg.payload_data(), name, key);
+  return msg;
 }
 
 ProtocolMessage ProtocolMessage::create_list_clients_request(
     const std::array<uint8_t, UUID_SIZE>& client_id) {
-  ProtocolRequestHeader header{};
-  header.client_id = client_id;
-  header.version = 1;
-  header.code = REQUEST_CODES::CLIENT_LIST;
-  header.payload_size = 0;
-  std::vector<uint8_t> payload;  // No payload
-  return ProtocolMessage(header, payload);
+  // No payload
+  return ProtocolMessage(make_header(client_id, REQUEST_CODES::CLIENT_LIST),
+                         0);
 }
 
 ProtocolMessage ProtocolMessage::create_public_key_request(
     const std::array<uint8_t, UUID_SIZE>& my_id,
     const std::array<uint8_t, CLIENT_ID_SIZE>& target_id) {
-  ProtocolRequestHeader header{};
-  header.client_id = my_id;
-  header.version = 1;
-  header.code = REQUEST_CODES::PUBLIC_KEY_REQUEST;
-  header.payload_size = CLIENT_ID_SIZE;
-  std::vector<uint8_t> payload(target_id.begin(), target_id.end());
-  return ProtocolMessage(header, payload);
+  ProtocolMessage msg(make_header(my_id, REQUEST_CODES::PUBLIC_KEY_REQUEST),
+                      schema::PublicKeyRequest::size);
+  schema::PublicKeyRequest::pack(msg.payload_data(), target_id);
+  return msg;
 }
 
 ProtocolMessage ProtocolMessage::create_send_message_request(
@@ -91,88 +131,129 @@ ProtocolMessage ProtocolMessage::create_send_message_request(
     const std::array<uint8_t, CLIENT_ID_SIZE>& dst_id,
     MessageType msg_type,
     const std::vector<uint8_t>& content) {
-  ProtocolRequestHeader header{};
-  header.client_id = my_id;
-  header.version = 1;
-  header.code = REQUEST_CODES::SEND_MESSAGE;
-
-  std::vector<uint8_t> payload;
-  // Append destination client ID
-  payload.insert(payload.end(), dst_id.begin(), dst_id.end());
-  // Append message type
-  payload.push_back(static_cast<uint8_t>(msg_type));
-  // Append content size (4 bytes, network order)
-  uint32_t content_size = content.size();
-  uint32_t content_size_n = htonl(content_size);
-  uint8_t* size_ptr = reinterpret_cast<uint8_t*>(&content_size_n);
-  payload.insert(payload.end(), size_ptr, size_ptr + 4);
-  // Append content
-  payload.insert(payload.end(), content.begin(), content.end());
-
-  header.payload_size = payload.size();
-  return ProtocolMessage(header, payload);
+  ProtocolMessage msg(make_header(my_id, REQUEST_CODES::SEND_MESSAGE),
+                      schema::SendMessagePrefix::size + content.size());
+  uint8_t* out =
+      pack_send_prefix(msg.payload_data(), dst_id, msg_type, content.size());
+  copy_content(out, content.data(), content.size());
+  return msg;
 }
 
 ProtocolMessage ProtocolMessage::create_symmetric_key_request(
     const std::array<uint8_t, UUID_SIZE>& my_id,
     const std::array<uint8_t, CLIENT_ID_SIZE>& dst_id) {
-  ProtocolRequestHeader header{};
-  header.client_id = my_id;
-  header.version = 1;
-  header.code = REQUEST_CODES::SEND_MESSAGE;
-
-  std::vector<uint8_t> payload;
-  // Append destination client ID
-  payload.insert(payload.end(), dst_id.begin(), dst_id.end());
-  // Append message type
-  payload.push_back(static_cast<uint8_t>(MessageType::SYMMETRIC_KEY_REQUEST));
-  // Append content size (4 bytes, network order) - zero
-  uint32_t content_size_n = 0;
-  uint8_t* size_ptr = reinterpret_cast<uint8_t*>(&content_size_n);
-  payload.insert(payload.end(), size_ptr, size_ptr + 4);
+  ProtocolMessage msg(make_header(my_id, REQUEST_CODES::SEND_MESSAGE),
+                      schema::SendMessagePrefix::size);
   // No content
-
-  header.payload_size = payload.size();
-  return ProtocolMessage(header, payload);
+  pack_send_prefix(msg.payload_data(), dst_id,
+                   MessageType::SYMMETRIC_KEY_REQUEST, 0);
+  return msg;
 }
 
 ProtocolMessage ProtocolMessage::create_send_sym_key_message_request(
     const std::array<uint8_t, UUID_SIZE>& my_id,
     const std::array<uint8_t, CLIENT_ID_SIZE>& dst_id,
     const std::string& encrypted_sym_key) {
-  ProtocolRequestHeader header{};
-  header.client_id = my_id;
-  header.version = 1;
-  header.code = REQUEST_CODES::SEND_MESSAGE;
-
-  std::vector<uint8_t> payload;
-  // Append destination client ID
-  payload.insert(payload.end(), dst_id.begin(), dst_id.end());
-  // Append message type
-  payload.push_back(static_cast<uint8_t>(MessageType::SYMMETRIC_KEY_SEND));
-  // Append content size (4 bytes, network order)
-  uint32_t content_size = encrypted_sym_key.size();
-  uint32_t content_size_n = htonl(content_size);
-  uint8_t* size_ptr = reinterpret_cast<uint8_t*>(&content_size_n);
-  payload.insert(payload.end(), size_ptr, size_ptr + 4);
-  // Append symmetric key content
-  payload.insert(payload.end(), encrypted_sym_key.begin(),
-                 encrypted_sym_key.end());
-
-  header.payload_size = payload.size();
-  return ProtocolMessage(header, payload);
+  ProtocolMessage msg(
+      make_header(my_id, REQUEST_CODES::SEND_MESSAGE),
+      schema::SendMessagePrefix::size + encrypted_sym_key.size());
+  uint8_t* out =
+      pack_send_prefix(msg.payload_data(), dst_id,
+                       MessageType::SYMMETRIC_KEY_SEND, encrypted_sym_key.size());
+  copy_content(out, encrypted_sym_key.data(), encrypted_sym_key.size());
+  return msg;
+}
+
+ProtocolMessage ProtocolMessage::create_send_file_request(
+    const std::array<uint8_t, UUID_SIZE>& my_id,
+    const std::array<uint8_t, CLIENT_ID_SIZE>& dst_id,
+    uint32_t content_size) {
+  // Content is streamed by the caller, but counts towards the payload size
+  if (content_size > UINT32_MAX - schema::SendMessagePrefix::size)
+    throw std::runtime_error("File too large for a single message");
+
+  ProtocolMessage msg(make_header(my_id, REQUEST_CODES::SEND_MESSAGE),
+                      schema::SendMessagePrefix::size);
+  pack_send_prefix(msg.payload_data(), dst_id, MessageType::FILE,
+                   content_size);
+  msg.m_header.payload_size = schema::SendMessagePrefix::size + content_size;
+  return msg;
 }
 
 ProtocolMessage ProtocolMessage::create_pending_messages_request(
     const std::array<uint8_t, UUID_SIZE>& my_id) {
-  ProtocolRequestHeader header{};
-  header.client_id = my_id;
-  header.version = 1;
-  header.code = REQUEST_CODES::PENDING_MESSAGE_REQUEST;
-  header.payload_size = 0;
-
   // No payload for pending messages request
-  std::vector<uint8_t> payload;
+  return ProtocolMessage(
+      make_header(my_id, REQUEST_CODES::PENDING_MESSAGE_REQUEST), 0);
+}
+
+ProtocolMessage::EmptyRequestFrame ProtocolMessage::create_list_clients_frame(
+    const std::array<uint8_t, UUID_SIZE>& my_id) {
+  return schema::make_request_frame<schema::EmptyPayload>(
+      my_id, framing::V1, REQUEST_CODES::CLIENT_LIST);
+}
+
+ProtocolMessage::EmptyRequestFrame
+ProtocolMessage::create_pending_messages_frame(
+    const std::array<uint8_t, UUID_SIZE>& my_id) {
+  return schema::make_request_frame<schema::EmptyPayload>(
+      my_id, framing::V1, REQUEST_CODES::PENDING_MESSAGE_REQUEST);
+}
 
-  return ProtocolMessage(header, payload);
-}
\ No newline at end of file
+ProtocolMessage::PendingPageRequestFrame
+ProtocolMessage::create_pending_messages_page_frame(
+    const std::array<uint8_t, UUID_SIZE>& my_id,
+    uint32_t max_messages,
+    uint32_t max_bytes) {
+  return schema::make_request_frame<schema::PendingPageRequest>(
+      my_id, framing::V1, REQUEST_CODES::PENDING_MESSAGE_PAGE_REQUEST, max_messages,
+      max_bytes);
+}
+
+ProtocolMessage ProtocolMessage::create_subscribe_request(
+    const std::array<uint8_t, UUID_SIZE>& my_id) {
+  // No payload, the connection itself becomes the subscription
+  return ProtocolMessage(make_header(my_id, REQUEST_CODES::SUBSCRIBE), 0);
+}
+
+ProtocolMessage ProtocolMessage::create_client_lookup_request(
+    const std::array<uint8_t, UUID_SIZE>& my_id,
+    const std::vector<std::array<uint8_t, CLIENT_ID_SIZE>>& ids) {
+  ProtocolMessage msg(make_header(my_id, REQUEST_CODES::CLIENT_LOOKUP_REQUEST),
+                      ids.size() * schema::ClientLookupId::size);
+  uint8_t* out = msg.payload_data();
+  for (const auto& id : ids) {
+    schema::ClientLookupId::pack(out, id);
+    out += schema::ClientLookupId::size;
+  }
+  return msg;
+}
+
+void send_protocol_message(TcpClient& client, const ProtocolMessage& msg) {
+  auto header_bytes = pack_header(msg.header());
+  client.send(header_bytes.data(), header_bytes.size(), msg.payload_data(),
+              msg.payload_size());
+}
+
+void send_protocol_messages(TcpClient& client,
+                            const ProtocolMessage* msgs,
+                            size_t count) {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i)
+    total += ProtocolMessage::HEADER_SIZE + msgs[i].payload_size();
+  std::vector<uint8_t> frames;
+  frames.reserve(total);
+  for (size_t i = 0; i < count; ++i)
+    append_protocol_message(frames, msgs[i]);
+  client.send(frames.data(), frames.size());
+}
+
+void append_protocol_message(std::vector<uint8_t>& out,
+                             const ProtocolMessage& msg) {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  auto header_bytes = pack_header(msg.header());
+  out.insert(out.end(), header_bytes.begin(), header_bytes.end());
+  out.insert(out.end(), msg.payload_data(),
+             msg.payload_data() + msg.payload_size());
+}
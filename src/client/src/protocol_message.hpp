@@ -1,8 +1,11 @@
 #pragma once
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
+#include <string>
 #include <vector>
+#include "protocol_schema.hpp"
 
 static constexpr size_t UUID_SIZE = 16;
 
@@ -12,6 +15,8 @@ struct ProtocolRequestHeader {
   uint16_t code;
   uint32_t payload_size;
 } __attribute__((packed));  // GCC/Clang: ensures no padding
+static_assert(sizeof(ProtocolRequestHeader) == schema::RequestHeader::size,
+              "ProtocolRequestHeader must match the wire schema");
 
 class ProtocolMessage {
  public:
@@ -20,6 +25,8 @@ class ProtocolMessage {
     SYMMETRIC_KEY_REQUEST = 1,
     SYMMETRIC_KEY_SEND = 2,
     TEXT = 3,
+    TEXT_COMPRESSED = 4,  // zlib-compressed, then AES-encrypted text
+    FILE = 5,             // AES-encrypted file, content streamed after header
     // Add more types as needed
   };
 
@@ -28,6 +35,10 @@ class ProtocolMessage {
   static constexpr size_t HEADER_SIZE = sizeof(ProtocolRequestHeader);
   static constexpr size_t CLIENT_NAME_SIZE = 255;
   static constexpr size_t PUBLIC_KEY_SIZE = 160;
+  // Payloads up to this size live inside the message instead of on the heap.
+  // Covers every fixed-size request, the largest being REGISTER.
+  static constexpr size_t INLINE_PAYLOAD_CAPACITY =
+      CLIENT_NAME_SIZE + PUBLIC_KEY_SIZE;
 
   ProtocolMessage(const ProtocolRequestHeader& header,
                   const std::vector<uint8_t>& payload);
@@ -59,21 +70,82 @@ class ProtocolMessage {
       const std::array<uint8_t, CLIENT_ID_SIZE>& dst_id,
       const std::string& encrypted_sym_key);
 
+  // Builds only the header and message prefix of a FILE send request. The
+  // caller must write exactly `content_size` content bytes right after it.
+  static ProtocolMessage create_send_file_request(
+      const std::array<uint8_t, UUID_SIZE>& my_id,
+      const std::array<uint8_t, CLIENT_ID_SIZE>& dst_id,
+      uint32_t content_size);
+
   static ProtocolMessage create_pending_messages_request(
       const std::array<uint8_t, UUID_SIZE>& my_id);
 
+  // Complete, ready-to-send frames for the fixed-size per-identity requests.
+  // Built once and resent as is while the identity does not change.
+  using EmptyRequestFrame = schema::RequestFrame<schema::EmptyPayload>;
+  static EmptyRequestFrame create_list_clients_frame(
+      const std::array<uint8_t, UUID_SIZE>& my_id);
+  static EmptyRequestFrame create_pending_messages_frame(
+      const std::array<uint8_t, UUID_SIZE>& my_id);
+  using PendingPageRequestFrame =
+      schema::RequestFrame<schema::PendingPageRequest>;
+  // Asks for at most max_messages records and max_bytes of them, 0 for no
+  // limit. The server always returns at least one queued message.
+  static PendingPageRequestFrame create_pending_messages_page_frame(
+      const std::array<uint8_t, UUID_SIZE>& my_id,
+      uint32_t max_messages,
+      uint32_t max_bytes);
+
+  static ProtocolMessage create_subscribe_request(
+      const std::array<uint8_t, UUID_SIZE>& my_id);
+
+  // Asks for the name and public key of every client in `ids` at once
+  static ProtocolMessage create_client_lookup_request(
+      const std::array<uint8_t, UUID_SIZE>& my_id,
+      const std::vector<std::array<uint8_t, CLIENT_ID_SIZE>>& ids);
+
   const ProtocolRequestHeader& header() const { return m_header; }
-  const std::vector<uint8_t>& payload() const { return m_payload; }
+  const uint8_t* payload_data() const {
+    return m_payload_size <= INLINE_PAYLOAD_CAPACITY ? m_inline.data()
+                                                     : m_heap.data();
+  }
+  size_t payload_size() const { return m_payload_size; }
 
  private:
+  // Sizes the payload storage; builders then fill it through payload_data()
+  ProtocolMessage(const ProtocolRequestHeader& header, size_t payload_size);
+  uint8_t* payload_data() {
+    return m_payload_size <= INLINE_PAYLOAD_CAPACITY ? m_inline.data()
+                                                     : m_heap.data();
+  }
+
   ProtocolRequestHeader m_header;
-  std::vector<uint8_t> m_payload;
+  size_t m_payload_size;
+  std::array<uint8_t, INLINE_PAYLOAD_CAPACITY> m_inline;
+  std::vector<uint8_t> m_heap;
 };
 
+class TcpClient;
+
+// Writes header and payload with a single gather write, no intermediate buffer
+void send_protocol_message(TcpClient& client, const ProtocolMessage& msg);
+// Writes several requests back to back with a single write, for pipelining
+void send_protocol_messages(TcpClient& client,
+                            const ProtocolMessage* msgs,
+                            size_t count);
+// Appends the wire bytes of msg (header, then payload) to out
+void append_protocol_message(std::vector<uint8_t>& out,
+                             const ProtocolMessage& msg);
+
 enum REQUEST_CODES {
   REGISTER = 600,
   CLIENT_LIST = 601,
   PUBLIC_KEY_REQUEST = 602,
   SEND_MESSAGE = 603,
   PENDING_MESSAGE_REQUEST = 604,
+  SUBSCRIBE = 605,
+  PENDING_MESSAGE_PAGE_REQUEST = 606,
+  CLIENT_LOOKUP_REQUEST = 607,
+  // Always in version 1 framing, see framing.hpp
+  FRAMING_REQUEST = 608,
 };
\ No newline at end of file
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Compile-time description of the wire layouts. Each layout is a list of
+// fixed-size fields; sizes and offsets are constexpr and the generated
+// pack/unpack routines handle byte order without htonl/ntohl.
+namespace schema {
+
+// Unsigned integer field, network (big-endian) byte order
+template <typename T>
+struct BigEndian {
+  static_assert(std::is_unsigned<T>::value, "wire integers are unsigned");
+  using value_type = T;
+  static constexpr size_t size = sizeof(T);
+
+  static constexpr void write(uint8_t* out, T value) {
+    for (size_t i = 0; i < size; ++i)
+      out[i] = static_cast<uint8_t>(value >> (8 * (size - 1 - i)));
+  }
+  static constexpr T read(const uint8_t* in) {
+    T value = 0;
+    for (size_t i = 0; i < size; ++i)
+      value = static_cast<T>((value << 8) | in[i]);
+    return value;
+  }
+};
+
+using U8 = BigEndian<uint8_t>;
+using U16 = BigEndian<uint16_t>;
+using U32 = BigEndian<uint32_t>;
+using U64 = BigEndian<uint64_t>;
+
+// Opaque fixed-size byte field (ids, keys, null padded names)
+template <size_t N>
+struct Bytes {
+  using value_type = std::array<uint8_t, N>;
+  static constexpr size_t size = N;
+
+  static constexpr void write(uint8_t* out, const value_type& value) {
+    for (size_t i = 0; i < N; ++i)
+      out[i] = value[i];
+  }
+  static constexpr value_type read(const uint8_t* in) {
+    value_type value{};
+    for (size_t i = 0; i < N; ++i)
+      value[i] = in[i];
+    return value;
+  }
+};
+
+template <typename... Fields>
+struct Layout {
+  static constexpr size_t size = (Fields::size + ... + 0);
+  static constexpr size_t field_count = sizeof...(Fields);
+
+  template <size_t I>
+  using field = std::tuple_element_t<I, std::tuple<Fields...>>;
+  using values = std::tuple<typename Fields::value_type...>;
+
+  template <size_t I>
+  static constexpr size_t offset() {
+    constexpr size_t sizes[] = {Fields::size..., 0};
+    size_t total = 0;
+    for (size_t i = 0; i < I; ++i)
+      total += sizes[i];
+    return total;
+  }
+
+  // Writes all fields in order, out must hold `size` bytes
+  static constexpr void pack(uint8_t* out,
+                             const typename Fields::value_type&... values) {
+    size_t pos = 0;
+    ((Fields::write(out + pos, values), pos += Fields::size), ...);
+    (void)out;
+    (void)pos;
+  }
+
+  static constexpr values unpack(const uint8_t* in) {
+    return unpack(in, std::index_sequence_for<Fields...>{});
+  }
+
+  template <size_t I>
+  static constexpr typename field<I>::value_type get(const uint8_t* in) {
+    return field<I>::read(in + offset<I>());
+  }
+
+  template <size_t I>
+  static constexpr void set(uint8_t* out,
+                            const typename field<I>::value_type& value) {
+    field<I>::write(out + offset<I>(), value);
+  }
+
+ private:
+  template <size_t... I>
+  static constexpr values unpack(const uint8_t* in,
+                                 std::index_sequence<I...>) {
+    return values(get<I>(in)...);
+  }
+};
+
+constexpr size_t UUID_SIZE = 16;
+constexpr size_t CLIENT_NAME_SIZE = 255;
+constexpr size_t PUBLIC_KEY_SIZE = 160;
+
+// [CLIENT_ID][VERSION][CODE][PAYLOAD_SIZE]
+using RequestHeader = Layout<Bytes<UUID_SIZE>, U8, U16, U32>;
+// [VERSION][CODE][PAYLOAD_SIZE]
+using ResponseHeader = Layout<U8, U16, U32>;
+
+// Request payloads
+using EmptyPayload = Layout<>;
+using RegisterRequest =
+    Layout<Bytes<CLIENT_NAME_SIZE>, Bytes<PUBLIC_KEY_SIZE>>;
+using PublicKeyRequest = Layout<Bytes<UUID_SIZE>>;
+// [DST_ID][MSG_TYPE][CONTENT_SIZE], followed by CONTENT_SIZE bytes
+using SendMessagePrefix = Layout<Bytes<UUID_SIZE>, U8, U32>;
+// [MAX_MESSAGES][MAX_BYTES], 0 leaves that limit off
+using PendingPageRequest = Layout<U32, U32>;
+// One per client looked up, as many as the payload holds
+using ClientLookupId = Layout<Bytes<UUID_SIZE>>;
+// [MAX_VERSION], the highest framing version the client speaks
+using FramingRequest = Layout<U8>;
+
+// Reply payloads and sub-records
+using RegisterReply = Layout<Bytes<UUID_SIZE>>;
+using ClientListEntry = Layout<Bytes<UUID_SIZE>, Bytes<CLIENT_NAME_SIZE>>;
+using PublicKeyReply = Layout<Bytes<UUID_SIZE>, Bytes<PUBLIC_KEY_SIZE>>;
+using SendMessageReply = Layout<Bytes<UUID_SIZE>, U32>;
+// [FROM_ID][MSG_ID][MSG_TYPE][MSG_SIZE], followed by MSG_SIZE bytes
+using PendingMessageRecord = Layout<Bytes<UUID_SIZE>, U32, U8, U32>;
+// [MORE], followed by PendingMessageRecords. MORE is 1 while messages are
+// left on the server after this page.
+using PendingPageReplyPrefix = Layout<U8>;
+// One per looked up client the server knows, in request order
+using ClientLookupEntry =
+    Layout<Bytes<UUID_SIZE>, Bytes<CLIENT_NAME_SIZE>, Bytes<PUBLIC_KEY_SIZE>>;
+// [VERSION], the framing of every later frame in both directions
+using FramingReply = Layout<U8>;
+
+// A complete request frame whose size is known at compile time
+template <typename Payload>
+using RequestFrame = std::array<uint8_t, RequestHeader::size + Payload::size>;
+
+template <typename Payload, typename... Args>
+constexpr RequestFrame<Payload> make_request_frame(
+    const std::array<uint8_t, UUID_SIZE>& client_id,
+    uint8_t version,
+    uint16_t code,
+    const Args&... payload_fields) {
+  RequestFrame<Payload> frame{};
+  RequestHeader::pack(frame.data(), client_id, version, code,
+                      static_cast<uint32_t>(Payload::size));
+  Payload::pack(frame.data() + RequestHeader::size, payload_fields...);
+  return frame;
+}
+
+static_assert(RequestHeader::size == 23, "request header is 23 bytes");
+static_assert(ResponseHeader::size == 7, "response header is 7 bytes");
+static_assert(PendingMessageRecord::offset<3>() == 21,
+              "message size follows id, msg id and type");
+
+}  // namespace schema
+
+// Hash for 16-byte client ids, which are random, so their leading bytes
+// spread well enough with no mixing
+struct ClientIdHash {
+  size_t operator()(const std::array<uint8_t, schema::UUID_SIZE>& id) const {
+    size_t h;
+    std::memcpy(&h, id.data(), sizeof(h));
+    return h;
+  }
+};
@@ -2,62 +2,174 @@
 #include "model/client_model.hpp"
 
 #include <arpa/inet.h>
+#include <algorithm>
+#include <array>
 #include <cstring>
 #include <stdexcept>
+#include "alloc_profile.hpp"
 #include "protocol_server_response.hpp"
 
+namespace {
+
+// Names are null padded on the wire, but may fill the whole field
+void assign_name(std::string& out, const uint8_t* field, size_t field_size) {
+  // memchr is vectorized (SSE2/AVX2 selected at runtime by glibc), so the
+  // terminator search runs over 16-32 bytes per step
+  const char* name = reinterpret_cast<const char*>(field);
+  const void* terminator = std::memchr(name, '\0', field_size);
+  size_t name_len = terminator ? static_cast<const char*>(terminator) - name
+                               : field_size;
+  out.assign(name, name_len);
+}
+
+// Fills `out` from `count` packed schema::ClientListEntry records
+void unpack_client_list(const uint8_t* packed,
+                        size_t count,
+                        ClientListEntry* out) {
+  using Entry = schema::ClientListEntry;
+  for (size_t i = 0; i < count; ++i, packed += Entry::size) {
+    ClientListEntry& entry = out[i];
+    std::memcpy(entry.id.data(), packed, entry.id.size());
+    assign_name(entry.name, packed + Entry::offset<1>(),
+                Entry::field<1>::size);
+  }
+}
+
+}  // namespace
+
 ProtocolServerResponse ProtocolServerResponse::from_bytes(
     const std::vector<uint8_t>& data) {
+  MESSAGEU_ALLOC_SITE(Protocol);
   if (data.size() < HEADER_SIZE)
     throw std::runtime_error("Response too short");
   ProtocolResponseHeader header;
-  std::memcpy(&header, data.data(), HEADER_SIZE);
-  header.code = ntohs(header.code);
-  header.payload_size = ntohl(header.payload_size);
+  header.version = schema::ResponseHeader::get<0>(data.data());
+  header.code = schema::ResponseHeader::get<1>(data.data());
+  header.payload_size = schema::ResponseHeader::get<2>(data.data());
   if (data.size() < HEADER_SIZE + header.payload_size)
     throw std::runtime_error("Incomplete response");
   std::vector<uint8_t> payload(
       data.begin() + HEADER_SIZE,
       data.begin() + HEADER_SIZE + header.payload_size);
-  return ProtocolServerResponse(header, payload);
+  return ProtocolServerResponse(header, std::move(payload));
 }
 
 std::vector<ClientListEntry> ProtocolServerResponse::parse_client_list() const {
   std::vector<ClientListEntry> client_list;
-  size_t entry_size = sizeof(PackedClientListEntry);
-  size_t count = m_payload.size() / entry_size;
-  for (size_t i = 0; i < count; ++i) {
-    const PackedClientListEntry* packed =
-        reinterpret_cast<const PackedClientListEntry*>(m_payload.data() +
-                                                       i * entry_size);
-    ClientListEntry entry;
-    for (size_t j = 0; j < UUID_SIZE; ++j)
-      entry.id[j] = packed->id[j];
-    std::string name_str(packed->name, ProtocolMessage::CLIENT_NAME_SIZE);
-    size_t null_pos = name_str.find('\0');
-    if (null_pos != std::string::npos)
-      name_str.resize(null_pos);
-    entry.name = name_str;
-    client_list.push_back(entry);
-  }
+  parse_client_list_into(client_list);
   return client_list;
 }
 
+void ProtocolServerResponse::parse_client_list_into(
+    std::vector<ClientListEntry>& out) const {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  using Entry = schema::ClientListEntry;
+  if (payload().size() % Entry::size != 0) {
+    throw std::runtime_error("Client list payload is not a whole number of "
+                             "entries");
+  }
+  size_t count = payload().size() / Entry::size;
+  out.clear();
+  out.resize(count);
+  unpack_client_list(payload().data(), count, out.data());
+}
+
+std::vector<ClientListEntry> ProtocolServerResponse::parse_client_lookup()
+    const {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  using Entry = schema::ClientLookupEntry;
+  if (code() != RESPONSE_CODES::CLIENT_LOOKUP_REPLY) {
+    throw std::runtime_error("Invalid client lookup response from server.");
+  }
+  if (payload().size() % Entry::size != 0) {
+    throw std::runtime_error("Client lookup payload is not a whole number of "
+                             "entries");
+  }
+  std::vector<ClientListEntry> entries(payload().size() / Entry::size);
+  const uint8_t* packed = payload().data();
+  for (ClientListEntry& entry : entries) {
+    entry.id = Entry::get<0>(packed);
+    assign_name(entry.name, packed + Entry::offset<1>(),
+                Entry::field<1>::size);
+    const uint8_t* key = packed + Entry::offset<2>();
+    entry.public_key.assign(key, key + Entry::field<2>::size);
+    entry.has_valid_public_key = true;
+    packed += Entry::size;
+  }
+  return entries;
+}
+
 std::vector<uint8_t> ProtocolServerResponse::parse_public_key_reply(
     const std::array<uint8_t, UUID_SIZE>& requested_id) const {
+  MESSAGEU_ALLOC_SITE(Protocol);
   if (code() != RESPONSE_CODES::PUBLIC_KEY_REPLY) {
     throw std::runtime_error("Invalid public key response from server.");
   }
-  if (m_payload.size() !=
-      ProtocolMessage::CLIENT_ID_SIZE + ProtocolMessage::PUBLIC_KEY_SIZE) {
+  if (payload().size() != schema::PublicKeyReply::size) {
     throw std::runtime_error("Invalid public key response payload size");
   }
   // Validate that the server id response is the same as the one we sent out
-  if (!std::equal(requested_id.begin(), requested_id.end(),
-                  m_payload.begin())) {
+  if (schema::PublicKeyReply::get<0>(payload().data()) != requested_id) {
     throw std::runtime_error(
         "Server response client ID does not match requested client ID");
   }
-  return std::vector<uint8_t>(
-      m_payload.begin() + ProtocolMessage::CLIENT_ID_SIZE, m_payload.end());
-}
\ No newline at end of file
+  const uint8_t* key =
+      payload().data() + schema::PublicKeyReply::offset<1>();
+  return std::vector<uint8_t>(key, key + schema::PublicKeyReply::field<1>::size);
+}
+
+uint32_t ProtocolServerResponse::parse_send_message_reply() const {
+  if (code() != RESPONSE_CODES::SEND_MESSAGE_REPLY ||
+      payload().size() != schema::SendMessageReply::size) {
+    throw std::runtime_error("Invalid send message response from server.");
+  }
+  return schema::SendMessageReply::get<1>(payload().data());
+}
+
+void recv_client_list(TcpClient& client, std::vector<ClientListEntry>& out) {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  using Entry = schema::ClientListEntry;
+  ProtocolResponseHeader header = recv_protocol_response_header(client);
+  if (header.code != RESPONSE_CODES::LIST_CLIENTS_REPLY ||
+      header.payload_size % Entry::size != 0) {
+    client.skip_n_bytes(header.payload_size);
+    throw std::runtime_error("Invalid client list response from server.");
+  }
+  // Grown a batch at a time as the entries arrive, so the list only takes
+  // the memory of what was actually received
+  constexpr size_t BATCH = 64;
+  std::array<uint8_t, BATCH * Entry::size> packed;
+  size_t left = header.payload_size / Entry::size;
+  while (left > 0) {
+    size_t count = std::min(left, BATCH);
+    client.receive_into(packed.data(), count * Entry::size);
+    size_t first = out.size();
+    out.resize(first + count);
+    unpack_client_list(packed.data(), count, out.data() + first);
+    left -= count;
+  }
+}
+
+uint8_t negotiate_framing(TcpClient& client, uint8_t max_version) {
+  if (max_version <= framing::V1)
+    return framing::V1;
+  auto frame = schema::make_request_frame<schema::FramingRequest>(
+      {}, framing::V1, REQUEST_CODES::FRAMING_REQUEST, max_version);
+  client.send(frame.data(), frame.size());
+
+  ProtocolServerResponse response = recv_protocol_response(client);
+  if (response.code() == RESPONSE_CODES::ERROR_REPLY)
+    return framing::V1;  // server from before version 2
+  if (response.code() != RESPONSE_CODES::FRAMING_REPLY ||
+      response.payload().size() != schema::FramingReply::size) {
+    throw std::runtime_error("Invalid framing response from server. Code: " +
+                             std::to_string(response.code()));
+  }
+  uint8_t version = schema::FramingReply::get<0>(response.payload().data());
+  if (version < framing::V1 || version > max_version) {
+    throw std::runtime_error("Server picked unsupported framing version " +
+                             std::to_string(version));
+  }
+  client.set_framing_version(version);
+  return version;
+}
@@ -1,45 +1,69 @@
 #pragma once
 #include <arpa/inet.h>
 #include <cstdint>
+#include <stdexcept>
+#include <string>
 #include <vector>
+#include "alloc_profile.hpp"
+#include "buffer_pool.hpp"
+#include "framing.hpp"
+#include "model/client_model.hpp"
 #include "tcp_client.hpp"
 
 struct PackedClientListEntry {
   uint8_t id[ProtocolMessage::CLIENT_ID_SIZE];
   char name[ProtocolMessage::CLIENT_NAME_SIZE];
 } __attribute__((packed));
+static_assert(sizeof(PackedClientListEntry) == schema::ClientListEntry::size,
+              "PackedClientListEntry must match the wire schema");
 
 struct ProtocolResponseHeader {
   uint8_t version;
   uint16_t code;
   uint32_t payload_size;
 } __attribute__((packed));
+static_assert(sizeof(ProtocolResponseHeader) == schema::ResponseHeader::size,
+              "ProtocolResponseHeader must match the wire schema");
 
 class ProtocolServerResponse {
  public:
   static constexpr size_t HEADER_SIZE = sizeof(ProtocolResponseHeader);
 
   ProtocolServerResponse(const ProtocolResponseHeader& header,
-                         const std::vector<uint8_t>& payload)
-      : m_header(header), m_payload(payload) {}
+                         std::vector<uint8_t> payload)
+      : m_header(header), m_payload(std::move(payload), nullptr) {}
+  ProtocolServerResponse(const ProtocolResponseHeader& header,
+                         PooledBuffer payload)
+      : m_header(header), m_payload(std::move(payload)) {}
 
   static ProtocolServerResponse from_bytes(const std::vector<uint8_t>& data);
 
   const ProtocolResponseHeader& header() const { return m_header; }
-  const std::vector<uint8_t>& payload() const { return m_payload; }
+  const std::vector<uint8_t>& payload() const { return m_payload.get(); }
 
   const uint16_t code() const { return m_header.code; }
 
   std::vector<ClientListEntry> parse_client_list() const;
+  // Bulk parse into an existing vector: sized once, names copied straight from
+  // the payload. Throws if the payload is not a whole number of entries.
+  void parse_client_list_into(std::vector<ClientListEntry>& out) const;
+
+  // Parses a CLIENT_LOOKUP_REPLY into entries with their public key set.
+  // Throws if the payload is not a whole number of entries.
+  std::vector<ClientListEntry> parse_client_lookup() const;
 
   // Parse and validate public key reply. Throws on error. Returns the public
   // key vector.
   std::vector<uint8_t> parse_public_key_reply(
       const std::array<uint8_t, UUID_SIZE>& requested_id) const;
 
+  // Id the server gave a sent message. Throws if this is no
+  // SEND_MESSAGE_REPLY.
+  uint32_t parse_send_message_reply() const;
+
  private:
   ProtocolResponseHeader m_header;
-  std::vector<uint8_t> m_payload;
+  PooledBuffer m_payload;
 };
 
 enum RESPONSE_CODES {
@@ -47,18 +71,72 @@ enum RESPONSE_CODES {
   LIST_CLIENTS_REPLY = 2101,
   PUBLIC_KEY_REPLY = 2102,
   SEND_MESSAGE_REPLY = 2103,
-  PENDING_MESSAGES_REPLY = 2104
+  PENDING_MESSAGES_REPLY = 2104,
+  SUBSCRIBE_REPLY = 2105,
+  // Unsolicited frame on a subscribed connection, payload is laid out like
+  // PENDING_MESSAGES_REPLY
+  PUSHED_MESSAGE = 2106,
+  // One page of pending messages, payload is a PendingPageReplyPrefix
+  // followed by records as in PENDING_MESSAGES_REPLY
+  PENDING_MESSAGES_PAGE_REPLY = 2107,
+  // Name and public key of each looked up client the server knows, as
+  // schema::ClientLookupEntry records
+  CLIENT_LOOKUP_REPLY = 2108,
+  // The framing version to switch to, as a schema::FramingReply
+  FRAMING_REPLY = 2109,
+  // Generic failure, empty payload
+  ERROR_REPLY = 9000
 };
 
-// Utility: receive and parse a ProtocolServerResponse from a TcpClient
-inline ProtocolServerResponse recv_protocol_response(TcpClient& client) {
-  auto resp_header_bytes =
-      client.receive_n_bytes(ProtocolServerResponse::HEADER_SIZE);
+// Utility: receive only the response header, leaving the payload on the
+// socket so large replies can be consumed incrementally
+inline ProtocolResponseHeader recv_protocol_response_header(TcpClient& client) {
+  if (client.framing_version() == framing::V2) {
+    ProtocolResponseHeader resp_header;
+    resp_header.version = framing::V2;
+    uint32_t code = client.receive_varint();
+    if (code > UINT16_MAX)
+      throw std::runtime_error("Invalid response code " + std::to_string(code));
+    resp_header.code = static_cast<uint16_t>(code);
+    resp_header.payload_size = client.receive_varint();
+    return resp_header;
+  }
+  std::array<uint8_t, schema::ResponseHeader::size> bytes;
+  client.receive_into(bytes.data(), bytes.size());
   ProtocolResponseHeader resp_header;
-  std::memcpy(&resp_header, resp_header_bytes.data(),
-              ProtocolServerResponse::HEADER_SIZE);
-  resp_header.code = ntohs(resp_header.code);
-  resp_header.payload_size = ntohl(resp_header.payload_size);
-  auto payload_bytes = client.receive_n_bytes(resp_header.payload_size);
-  return ProtocolServerResponse(resp_header, payload_bytes);
-}
\ No newline at end of file
+  resp_header.version = schema::ResponseHeader::get<0>(bytes.data());
+  resp_header.code = schema::ResponseHeader::get<1>(bytes.data());
+  resp_header.payload_size = schema::ResponseHeader::get<2>(bytes.data());
+  return resp_header;
+}
+
+// Utility: receive and parse a ProtocolServerResponse from a TcpClient. A
+// payload above the connection's FrameLimits for its code is drained without
+// being stored and reported as an error.
+inline ProtocolServerResponse recv_protocol_response(TcpClient& client) {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  ProtocolResponseHeader resp_header = recv_protocol_response_header(client);
+  uint32_t max_payload = client.frame_limits().max_payload(resp_header.code);
+  if (resp_header.payload_size > max_payload) {
+    client.skip_n_bytes(resp_header.payload_size);
+    throw std::runtime_error(
+        "Reply payload of " + std::to_string(resp_header.payload_size) +
+        " bytes exceeds the limit of " + std::to_string(max_payload) +
+        " for code " + std::to_string(resp_header.code));
+  }
+  PooledBuffer payload_bytes = client.receive_pooled(resp_header.payload_size);
+  return ProtocolServerResponse(resp_header, std::move(payload_bytes));
+}
+
+// Receives a LIST_CLIENTS_REPLY, header included, and appends its entries to
+// `out` as they are read off the connection. Unlike recv_protocol_response
+// the payload is never buffered whole, so lists of any size are accepted.
+// Throws on another code or a payload that is not a whole number of
+// entries, after consuming it.
+void recv_client_list(TcpClient& client, std::vector<ClientListEntry>& out);
+
+// Offers framing versions up to `max_version` to the server and switches the
+// connection to the one it picks, see framing.hpp. Stays in version 1,
+// without a round trip, for a max_version of 1, and when the server does not
+// know FRAMING_REQUEST. Returns the version in use.
+uint8_t negotiate_framing(TcpClient& client, uint8_t max_version);
@@ -0,0 +1,247 @@
+#include "send_pipeline.hpp"
+#include <algorithm>
+#include "alloc_profile.hpp"
+#include "protocol_server_response.hpp"
+#include "tcp_client.hpp"
+
+SendPipeline::SendPipeline(TcpClient& client,
+                           size_t crypto_workers,
+                           ReplyCheck check)
+    : m_client(client),
+      m_check(std::move(check)),
+      m_inline(std::thread::hardware_concurrency() <= 1),
+      m_writes(QUEUE_CAPACITY),
+      m_free_buffers(QUEUE_CAPACITY) {
+  m_reply_thread = std::thread(&SendPipeline::reply_loop, this);
+  if (m_inline)
+    return;
+  size_t workers = std::max<size_t>(1, crypto_workers);
+  for (size_t i = 0; i < workers; ++i) {
+    m_workers.push_back(std::make_unique<Worker>());
+    Worker& worker = *m_workers.back();
+    worker.thread =
+        std::thread(&SendPipeline::crypto_loop, this, std::ref(worker));
+  }
+  m_framing_thread = std::thread(&SendPipeline::framing_loop, this);
+  m_writer_thread = std::thread(&SendPipeline::writer_loop, this);
+}
+
+SendPipeline::~SendPipeline() {
+  if (!m_closed) {
+    m_cancelled = true;
+    close();
+  }
+}
+
+void SendPipeline::submit(Job job) {
+  if (m_inline) {
+    if (m_cancelled)
+      return;
+    try {
+      if (stage(m_inline_write, job()))
+        send(m_inline_write);
+    } catch (...) {
+      record_error(std::current_exception());
+      m_cancelled = true;
+    }
+    return;
+  }
+  // Round robin, so that the framing stage knows where the next result is
+  Worker& worker = *m_workers[m_next_worker++ % m_workers.size()];
+  push(worker.jobs, job);
+}
+
+void SendPipeline::finish() {
+  close();
+  std::lock_guard<std::mutex> lock(m_error_mutex);
+  if (m_error)
+    std::rethrow_exception(m_error);
+}
+
+template <typename T>
+bool SendPipeline::push(SpscQueue<T>& queue, T& value) {
+  Backoff backoff;
+  while (!queue.try_push(value)) {
+    if (m_cancelled)
+      return false;
+    backoff.pause();
+  }
+  return true;
+}
+
+template <typename T>
+bool SendPipeline::pop(SpscQueue<T>& queue, T& out) {
+  Backoff backoff;
+  while (!queue.try_pop(out)) {
+    if (m_cancelled)
+      return false;
+    backoff.pause();
+  }
+  return true;
+}
+
+bool SendPipeline::stage(Write& write, Output&& output) {
+  if (output.request)
+    append_protocol_message(write.frames, *output.request);
+  if (output.answered)
+    ++write.replies;
+  write.raw = std::move(output.raw);
+  return !write.raw.empty() || write.frames.size() >= WRITE_BATCH_SIZE;
+}
+
+void SendPipeline::send(Write& write) {
+  if (write.frames.empty()) {
+    m_client.send(reinterpret_cast<const uint8_t*>(write.raw.data()),
+                  write.raw.size());
+  } else {
+    m_client.send(write.frames.data(), write.frames.size(),
+                  reinterpret_cast<const uint8_t*>(write.raw.data()),
+                  write.raw.size());
+  }
+  m_replies_owed += write.replies;
+  write.frames.clear();
+  write.raw.clear();
+  write.replies = 0;
+}
+
+void SendPipeline::crypto_loop(Worker& worker) {
+  Job job;
+  while (pop(worker.jobs, job)) {
+    Result result;
+    if (!job) {
+      // End of input, passed on in this worker's turn
+      result.end = true;
+      push(worker.results, result);
+      return;
+    }
+    try {
+      result.output = job();
+    } catch (...) {
+      result.error = std::current_exception();
+    }
+    if (!push(worker.results, result))
+      return;
+  }
+}
+
+void SendPipeline::framing_loop() {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  Write write;
+  auto flush = [&] {
+    if (write.frames.empty() && write.raw.empty())
+      return true;
+    Write next;
+    m_free_buffers.try_pop(next.frames);
+    std::swap(write, next);
+    return push(m_writes, next);
+  };
+
+  for (size_t turn = 0;; ++turn) {
+    Worker& worker = *m_workers[turn % m_workers.size()];
+    Result result;
+    if (!worker.results.try_pop(result)) {
+      // Nothing ready: write what is batched instead of holding it back
+      if (!flush() || !pop(worker.results, result))
+        return;
+    }
+    if (result.end)
+      break;
+    if (result.error) {
+      record_error(result.error);
+      m_cancelled = true;
+      return;
+    }
+    if (stage(write, std::move(result.output)) && !flush())
+      return;
+  }
+  if (!flush())
+    return;
+  Write end;
+  end.end = true;
+  push(m_writes, end);
+}
+
+void SendPipeline::writer_loop() {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  Write write;
+  while (pop(m_writes, write) && !write.end && !m_cancelled) {
+    try {
+      send(write);
+    } catch (...) {
+      record_error(std::current_exception());
+      m_cancelled = true;
+      break;
+    }
+    // Back to the framing stage; dropped if it already holds enough
+    m_free_buffers.try_push(write.frames);
+  }
+  m_writer_done = true;
+}
+
+void SendPipeline::reply_loop() {
+  MESSAGEU_ALLOC_SITE(Protocol);
+  size_t replies = 0;
+  Backoff backoff;
+  while (true) {
+    // Read before the count, so that a finished writer's count is final
+    bool writer_done = m_writer_done;
+    if (replies < m_replies_owed) {
+      backoff.reset();
+      std::optional<ProtocolServerResponse> response;
+      try {
+        response.emplace(recv_protocol_response(m_client));
+      } catch (...) {
+        // The connection is out of step, nothing after this can be trusted
+        record_error(std::current_exception());
+        m_cancelled = true;
+        return;
+      }
+      ++replies;
+      try {
+        m_check(*response);
+      } catch (...) {
+        record_error(std::current_exception());
+      }
+      continue;
+    }
+    if (writer_done)
+      return;
+    backoff.pause();
+  }
+}
+
+void SendPipeline::record_error(std::exception_ptr error) {
+  std::lock_guard<std::mutex> lock(m_error_mutex);
+  if (!m_error)
+    m_error = error;
+}
+
+void SendPipeline::close() {
+  if (m_closed)
+    return;
+  m_closed = true;
+  if (m_inline) {
+    bool pending =
+        !m_inline_write.frames.empty() || !m_inline_write.raw.empty();
+    if (pending && !m_cancelled) {
+      try {
+        send(m_inline_write);
+      } catch (...) {
+        record_error(std::current_exception());
+        m_cancelled = true;
+      }
+    }
+    m_writer_done = true;
+    m_reply_thread.join();
+    return;
+  }
+  for (auto& worker : m_workers) {
+    Job end;
+    push(worker->jobs, end);
+  }
+  for (auto& worker : m_workers)
+    worker->thread.join();
+  m_framing_thread.join();
+  m_writer_thread.join();
+  m_reply_thread.join();
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "protocol_message.hpp"
+#include "spsc_queue.hpp"
+
+class ProtocolServerResponse;
+class TcpClient;
+
+// Staged sender for a burst of requests on one connection. Every stage runs
+// on its own threads and hands its output to the next through lock-free SPSC
+// queues, by move:
+//
+//   submit() -> crypto workers -> framing -> writer -> socket
+//                                                       |
+//                            reply reader <- replies <--+
+//
+// Jobs, typically encryption, run on `crypto_workers` threads and are dealt
+// out round robin, so the framing stage restores submission order by
+// collecting results in the same rotation. Framing serializes requests into
+// batched write buffers, which are recycled once written. The writer is the
+// only thread writing to the socket; the reply reader reads one reply per
+// answered output written and passes it to `check`. Encryption of later
+// requests therefore overlaps with writing and answering earlier ones.
+//
+// On a single core the stages could only take turns, so the jobs run, are
+// framed and are written on the submitting thread instead; only replies are
+// still read concurrently.
+//
+// The first error of any stage cancels the rest of the burst. Replies owed
+// for what was already written are still read, so a burst of whole requests
+// leaves the connection in sync.
+//
+// The connection must not be used by anyone else until finish() returns.
+class SendPipeline {
+ public:
+  // What one job produces. `request` is framed; `raw` bytes follow it on
+  // the wire as they are, e.g. file content. An empty Output sends nothing.
+  struct Output {
+    std::optional<ProtocolMessage> request;
+    std::string raw;
+    // Set when this output completes a request, so that the server answers
+    // once it is written: a plain request, or the last content of a request
+    // whose content comes in later outputs
+    bool answered = false;
+  };
+  using Job = std::function<Output()>;
+  // Runs on the reply reader thread. Throwing marks the burst as failed.
+  using ReplyCheck = std::function<void(const ProtocolServerResponse&)>;
+
+  SendPipeline(TcpClient& client, size_t crypto_workers, ReplyCheck check);
+  // Abandons jobs not started yet, but still reads the replies to the
+  // requests already written so the connection stays in sync
+  ~SendPipeline();
+  SendPipeline(const SendPipeline& other) = delete;
+  SendPipeline& operator=(const SendPipeline& other) = delete;
+
+  // Queues a job, waiting while the pipeline is full. Single producer.
+  void submit(Job job);
+  // Waits until every output is written and answered. Rethrows the first
+  // error of any stage.
+  void finish();
+
+ private:
+  // Frames batched into one write, unless a raw payload ends the batch
+  static constexpr size_t WRITE_BATCH_SIZE = 64 * 1024;
+  static constexpr size_t QUEUE_CAPACITY = 64;
+
+  struct Result {
+    Output output;
+    std::exception_ptr error;
+    bool end = false;
+  };
+  struct Write {
+    std::vector<uint8_t> frames;
+    std::string raw;
+    size_t replies = 0;
+    bool end = false;
+  };
+  struct Worker {
+    Worker() : jobs(QUEUE_CAPACITY), results(QUEUE_CAPACITY) {}
+    SpscQueue<Job> jobs;
+    SpscQueue<Result> results;
+    std::thread thread;
+  };
+
+  // Moves `value` into `queue`, waiting while it is full. False once the
+  // pipeline was cancelled.
+  template <typename T>
+  bool push(SpscQueue<T>& queue, T& value);
+  template <typename T>
+  bool pop(SpscQueue<T>& queue, T& out);
+
+  // Adds `output` to `write`. True when `write` is ready to go out.
+  static bool stage(Write& write, Output&& output);
+  // Writes `write` to the socket and counts the replies it is owed
+  void send(Write& write);
+
+  void crypto_loop(Worker& worker);
+  void framing_loop();
+  void writer_loop();
+  void reply_loop();
+  void record_error(std::exception_ptr error);
+  // Ends the input and joins every stage
+  void close();
+
+  TcpClient& m_client;
+  ReplyCheck m_check;
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  size_t m_next_worker = 0;
+  bool m_closed = false;
+  // Jobs run on the submitting thread, see above
+  bool m_inline;
+  Write m_inline_write;
+
+  SpscQueue<Write> m_writes;
+  SpscQueue<std::vector<uint8_t>> m_free_buffers;
+
+  // Replies due for the outputs written so far
+  std::atomic<size_t> m_replies_owed{0};
+  std::atomic<bool> m_writer_done{false};
+  std::atomic<bool> m_cancelled{false};
+
+  std::mutex m_error_mutex;
+  std::exception_ptr m_error;
+
+  std::thread m_framing_thread;
+  std::thread m_writer_thread;
+  std::thread m_reply_thread;
+};
@@ -0,0 +1,123 @@
+#include "shard_router.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include "protocol_schema.hpp"
+#include "protocol_server_response.hpp"
+#include "tcp_client.hpp"
+
+ShardRouter::ShardRouter(
+    const std::vector<std::vector<ServerEndpoint>>& servers) {
+  for (const auto& replicas : servers) {
+    if (replicas.empty())
+      continue;
+    std::vector<Replica> shard;
+    for (const ServerEndpoint& endpoint : replicas) {
+      Replica replica;
+      replica.endpoint = endpoint;
+      shard.push_back(std::move(replica));
+    }
+    m_shards.push_back(std::move(shard));
+  }
+  if (m_shards.empty()) {
+    throw std::runtime_error("At least one server is required");
+  }
+}
+
+ShardRouter::~ShardRouter() = default;
+
+size_t ShardRouter::shard_of(const ClientId& id) const {
+  return schema::U32::read(id.data()) % m_shards.size();
+}
+
+size_t ShardRouter::shard_for_name(const std::string& name) const {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (unsigned char c : name) {
+    hash ^= c;
+    hash *= 16777619u;
+  }
+  return hash % m_shards.size();
+}
+
+ShardRouter::Connection ShardRouter::connect(size_t shard,
+                                             const FrameLimits& limits,
+                                             uint8_t max_framing_version) {
+  bool probe = false;
+  std::vector<size_t> order = candidates(shard, probe);
+
+  Connection best;
+  double best_latency = 0;
+  std::string last_error;
+  for (size_t replica : order) {
+    ServerEndpoint endpoint;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      endpoint = m_shards[shard][replica].endpoint;
+    }
+    Clock::time_point start = Clock::now();
+    try {
+      auto client = std::make_unique<TcpClient>(endpoint.ip, endpoint.port);
+      client->set_frame_limits(limits);
+      client->connect();
+      negotiate_framing(*client, max_framing_version);
+      double latency_us =
+          std::chrono::duration<double, std::micro>(Clock::now() - start)
+              .count();
+      record_latency(shard, replica, latency_us);
+      if (!probe)
+        return Connection{std::move(client), shard, replica};
+      // Probing: keep the fastest, close the rest
+      if (!best.client || latency_us < best_latency) {
+        best = Connection{std::move(client), shard, replica};
+        best_latency = latency_us;
+      }
+    } catch (const std::exception& e) {
+      mark_down(shard, replica);
+      last_error = endpoint.ip + ":" + endpoint.port + ": " + e.what();
+    }
+  }
+  if (best.client)
+    return best;
+  throw std::runtime_error("No server of shard " + std::to_string(shard) +
+                           " is reachable (" + last_error + ")");
+}
+
+void ShardRouter::report_failure(const Connection& connection) {
+  mark_down(connection.shard, connection.replica);
+}
+
+std::vector<size_t> ShardRouter::candidates(size_t shard, bool& probe) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  const std::vector<Replica>& replicas = m_shards[shard];
+  Clock::time_point now = Clock::now();
+  std::vector<size_t> order(replicas.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  auto healthy = [&](size_t i) { return replicas[i].down_until <= now; };
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (healthy(a) != healthy(b))
+      return healthy(a);
+    return replicas[a].latency_us < replicas[b].latency_us;
+  });
+  probe = replicas.size() > 1 &&
+          std::any_of(order.begin(), order.end(), [&](size_t i) {
+            return healthy(i) && replicas[i].latency_us < 0;
+          });
+  return order;
+}
+
+void ShardRouter::record_latency(size_t shard,
+                                 size_t replica,
+                                 double latency_us) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  Replica& state = m_shards[shard][replica];
+  state.latency_us = state.latency_us < 0
+                         ? latency_us
+                         : 0.8 * state.latency_us + 0.2 * latency_us;
+  state.down_until = Clock::time_point{};
+}
+
+void ShardRouter::mark_down(size_t shard, size_t replica) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_shards[shard][replica].down_until = Clock::now() + RETRY_DELAY;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "frame_limits.hpp"
+#include "model/client_model.hpp"
+
+class TcpClient;
+
+// Maps clients to the servers of a sharded deployment and picks the replica
+// to talk to. Shared by every connection of a MessageUClient.
+//
+// A client's registration and the messages sent to it live on one shard,
+// chosen by the hash of its id, so a request for a recipient goes to the
+// recipient's shard. Servers hand out ids of their own shard when started
+// with --shard INDEX/COUNT.
+//
+// Replicas of a shard are interchangeable. The first connection to a shard
+// measures every replica and keeps the fastest; later ones go to the
+// replica with the lowest connect latency that has not failed recently.
+// A replica that fails is skipped for RETRY_DELAY, unless none is left.
+//
+// Replicas must therefore share their state, the registrations and queued
+// messages of the shard: any request may go to any of them. The bundled
+// server.py keeps its state in memory, so with it each shard must be a
+// single server.
+class ShardRouter {
+ public:
+  using ClientId = std::array<uint8_t, ProtocolMessage::CLIENT_ID_SIZE>;
+  // A failed replica is tried again after this long
+  static constexpr std::chrono::seconds RETRY_DELAY{30};
+
+  // An open connection and the replica it goes to
+  struct Connection {
+    std::unique_ptr<TcpClient> client;
+    size_t shard = 0;
+    size_t replica = 0;
+  };
+
+  // `servers` lists the replicas of each shard, see ClientModel::get_servers
+  explicit ShardRouter(const std::vector<std::vector<ServerEndpoint>>& servers);
+  ~ShardRouter();
+  ShardRouter(const ShardRouter& other) = delete;
+  ShardRouter& operator=(const ShardRouter& other) = delete;
+
+  size_t shard_count() const { return m_shards.size(); }
+  // The leading 32 bits of the id, big-endian, modulo the shard count. The
+  // server computes the same for --shard.
+  size_t shard_of(const ClientId& id) const;
+  // Shard a new registration goes to, spread by the hash of the name
+  size_t shard_for_name(const std::string& name) const;
+
+  // Connects to a replica of `shard`, as described above, and negotiates
+  // framing up to `max_framing_version`. Throws if no replica can be
+  // reached.
+  Connection connect(size_t shard,
+                     const FrameLimits& limits,
+                     uint8_t max_framing_version);
+  // Marks the replica of a connection that broke as failed
+  void report_failure(const Connection& connection);
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Replica {
+    ServerEndpoint endpoint;
+    // Smoothed connect latency, negative until measured
+    double latency_us = -1;
+    Clock::time_point down_until{};
+  };
+
+  // Replicas of `shard` in the order to try them: healthy ones by latency,
+  // then failed ones. Sets `probe` when a healthy one is not measured yet.
+  std::vector<size_t> candidates(size_t shard, bool& probe);
+  void record_latency(size_t shard, size_t replica, double latency_us);
+  void mark_down(size_t shard, size_t replica);
+
+  std::mutex m_mutex;  // guards the replica state
+  std::vector<std::vector<Replica>> m_shards;
+};
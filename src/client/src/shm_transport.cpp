@@ -0,0 +1,232 @@
+#include "shm_transport.hpp"
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace {
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "ring counters are shared between processes");
+
+constexpr size_t TX_HEAD_OFFSET = 64;
+constexpr size_t TX_TAIL_OFFSET = 128;
+constexpr size_t RX_HEAD_OFFSET = 192;
+constexpr size_t RX_TAIL_OFFSET = 256;
+
+[[noreturn]] void throw_errno(const char* what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+std::atomic<uint64_t>* counter_at(uint8_t* segment, size_t offset) {
+  return reinterpret_cast<std::atomic<uint64_t>*>(segment + offset);
+}
+
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+}  // namespace
+
+ShmTransport::ShmTransport(const std::string& path) : m_path(path) {}
+
+ShmTransport::~ShmTransport() {
+  close_all();
+}
+
+void ShmTransport::close_all() {
+  if (m_segment)
+    munmap(m_segment, SEGMENT_SIZE);
+  m_segment = nullptr;
+  for (int* fd : {&m_socket, &m_doorbell, &m_peer_doorbell, &m_space_doorbell,
+                  &m_peer_space_doorbell}) {
+    if (*fd >= 0)
+      ::close(*fd);
+    *fd = -1;
+  }
+}
+
+void ShmTransport::connect() {
+  close_all();
+  int memfd = memfd_create("messageu_shm", MFD_CLOEXEC);
+  if (memfd < 0)
+    throw_errno("memfd_create");
+  if (ftruncate(memfd, SEGMENT_SIZE) != 0) {
+    ::close(memfd);
+    throw_errno("ftruncate");
+  }
+  void* segment = mmap(nullptr, SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, memfd, 0);
+  if (segment == MAP_FAILED) {
+    ::close(memfd);
+    throw_errno("mmap");
+  }
+  m_segment = static_cast<uint8_t*>(segment);
+
+  // The fresh memfd is zeroed, so all ring counters start at 0
+  uint32_t magic = MAGIC;
+  uint32_t version = VERSION;
+  uint64_t capacity = RING_CAPACITY;
+  std::memcpy(m_segment, &magic, sizeof(magic));
+  std::memcpy(m_segment + 4, &version, sizeof(version));
+  std::memcpy(m_segment + 8, &capacity, sizeof(capacity));
+  m_tx = {counter_at(m_segment, TX_HEAD_OFFSET),
+          counter_at(m_segment, TX_TAIL_OFFSET), m_segment + DATA_OFFSET};
+  m_rx = {counter_at(m_segment, RX_HEAD_OFFSET),
+          counter_at(m_segment, RX_TAIL_OFFSET),
+          m_segment + DATA_OFFSET + RING_CAPACITY};
+
+  m_doorbell = eventfd(0, EFD_CLOEXEC);
+  m_peer_doorbell = eventfd(0, EFD_CLOEXEC);
+  m_space_doorbell = eventfd(0, EFD_CLOEXEC);
+  m_peer_space_doorbell = eventfd(0, EFD_CLOEXEC);
+  m_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (m_doorbell < 0 || m_peer_doorbell < 0 || m_space_doorbell < 0 ||
+      m_peer_space_doorbell < 0 || m_socket < 0) {
+    ::close(memfd);
+    throw_errno("shm transport setup");
+  }
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (m_path.size() >= sizeof(addr.sun_path)) {
+    ::close(memfd);
+    throw std::runtime_error("shm socket path too long: " + m_path);
+  }
+  std::memcpy(addr.sun_path, m_path.c_str(), m_path.size() + 1);
+  if (::connect(m_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) !=
+      0) {
+    ::close(memfd);
+    throw_errno("connect");
+  }
+
+  // Hand over [segment, client doorbell, server doorbell, client space
+  // doorbell, server space doorbell]
+  int fds[5] = {memfd, m_doorbell, m_peer_doorbell, m_space_doorbell,
+                m_peer_space_doorbell};
+  char tag = 'S';
+  iovec iov{&tag, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  ssize_t sent = sendmsg(m_socket, &msg, MSG_NOSIGNAL);
+  ::close(memfd);  // the mapping keeps the segment alive
+  if (sent != 1)
+    throw_errno("sendmsg");
+
+  char ack = 0;
+  if (recv(m_socket, &ack, 1, MSG_WAITALL) != 1 || ack != 'K')
+    throw std::runtime_error("Server refused the shared-memory transport");
+  m_shutdown = false;
+}
+
+void ShmTransport::shutdown() {
+  m_shutdown = true;
+  if (m_socket >= 0)
+    ::shutdown(m_socket, SHUT_RDWR);
+}
+
+void ShmTransport::notify_peer(int doorbell) {
+  uint64_t one = 1;
+  if (::write(doorbell, &one, sizeof(one)) != sizeof(one))
+    throw_errno("eventfd write");
+}
+
+bool ShmTransport::wait_doorbell(int doorbell) {
+  pollfd fds[2] = {{doorbell, POLLIN, 0}, {m_socket, POLLIN, 0}};
+  while (poll(fds, 2, -1) < 0) {
+    if (errno != EINTR)
+      throw_errno("poll");
+  }
+  if (fds[0].revents & POLLIN) {
+    uint64_t count;
+    if (::read(doorbell, &count, sizeof(count)) != sizeof(count))
+      throw_errno("eventfd read");
+    return true;
+  }
+  // Nothing is ever sent on the socket after setup, so readable means closed
+  return false;
+}
+
+void ShmTransport::write_ring(const uint8_t* data, size_t n) {
+  uint64_t tail = m_tx.tail->load(std::memory_order_relaxed);
+  while (n > 0) {
+    uint64_t head = m_tx.head->load(std::memory_order_acquire);
+    size_t space = RING_CAPACITY - static_cast<size_t>(tail - head);
+    if (space == 0) {
+      // Let the server drain what is already there, it rings the space
+      // doorbell after each read
+      notify_peer(m_peer_doorbell);
+      if (m_shutdown || !wait_doorbell(m_space_doorbell))
+        throw std::runtime_error("Connection closed by server");
+      continue;
+    }
+    size_t offset = static_cast<size_t>(tail % RING_CAPACITY);
+    size_t chunk = std::min({n, space, RING_CAPACITY - offset});
+    std::memcpy(m_tx.data + offset, data, chunk);
+    tail += chunk;
+    m_tx.tail->store(tail, std::memory_order_release);
+    data += chunk;
+    n -= chunk;
+  }
+}
+
+void ShmTransport::write(const uint8_t* head,
+                         size_t head_n,
+                         const uint8_t* body,
+                         size_t body_n) {
+  if (!m_segment || m_shutdown)
+    throw std::runtime_error("Not connected");
+  write_ring(head, head_n);
+  write_ring(body, body_n);
+  notify_peer(m_peer_doorbell);
+}
+
+size_t ShmTransport::read_some(uint8_t* buf, size_t n) {
+  if (!m_segment)
+    throw std::runtime_error("Not connected");
+  uint64_t head = m_rx.head->load(std::memory_order_relaxed);
+  int spins = 0;
+  while (true) {
+    uint64_t tail = m_rx.tail->load(std::memory_order_acquire);
+    size_t available = static_cast<size_t>(tail - head);
+    if (available > 0) {
+      size_t offset = static_cast<size_t>(head % RING_CAPACITY);
+      size_t chunk = std::min({n, available, RING_CAPACITY - offset});
+      std::memcpy(buf, m_rx.data + offset, chunk);
+      m_rx.head->store(head + chunk, std::memory_order_release);
+      // The server may be waiting on a full ring
+      notify_peer(m_peer_space_doorbell);
+      return chunk;
+    }
+    if (m_shutdown)
+      return 0;
+    if (spins < SPIN_ITERATIONS) {
+      ++spins;
+      cpu_relax();
+      continue;
+    }
+    // The server rings the doorbell after publishing, so a ring that is
+    // still empty after the wakeup just means a stale count
+    if (!wait_doorbell(m_doorbell) &&
+        m_rx.tail->load(std::memory_order_acquire) == head)
+      return 0;
+  }
+}
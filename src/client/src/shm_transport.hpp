@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "transport.hpp"
+
+// Same-host transport: two single-producer/single-consumer byte rings in a
+// memfd shared with the server, one per direction. Setup goes through the
+// server's shm Unix socket, which passes the memfd and four eventfd doorbells
+// (SCM_RIGHTS) and then stays open only to detect that either side went away.
+// Each side rings a data doorbell after publishing to its ring and a space
+// doorbell after consuming from the other, so neither side polls.
+//
+// Segment layout, all integers little-endian:
+//   0     magic "MUSH" (u32), version (u32), ring capacity (u64)
+//   64    client->server ring head (u64), 128 its tail (u64)
+//   192   server->client ring head (u64), 256 its tail (u64)
+//   4096  client->server data, then server->client data
+// head/tail are free-running byte counters; the producer only advances tail
+// and the consumer only advances head.
+class ShmTransport : public Transport {
+ public:
+  static constexpr uint32_t MAGIC = 0x4853554d;  // "MUSH"
+  static constexpr uint32_t VERSION = 2;
+  static constexpr size_t RING_CAPACITY = 1024 * 1024;
+  static constexpr size_t DATA_OFFSET = 4096;
+  static constexpr size_t SEGMENT_SIZE = DATA_OFFSET + 2 * RING_CAPACITY;
+  // Polls of an empty ring before sleeping on the doorbell
+  static constexpr int SPIN_ITERATIONS = 100;
+
+  explicit ShmTransport(const std::string& path);
+  ~ShmTransport() override;
+  ShmTransport(const ShmTransport& other) = delete;
+  ShmTransport& operator=(const ShmTransport& other) = delete;
+
+  void connect() override;
+  void shutdown() override;
+  void write(const uint8_t* head,
+             size_t head_n,
+             const uint8_t* body,
+             size_t body_n) override;
+  size_t read_some(uint8_t* buf, size_t n) override;
+
+ private:
+  struct Ring {
+    std::atomic<uint64_t>* head = nullptr;
+    std::atomic<uint64_t>* tail = nullptr;
+    uint8_t* data = nullptr;
+  };
+
+  void close_all();
+  // Copies into the tx ring, waiting for the server to make room if needed
+  void write_ring(const uint8_t* data, size_t n);
+  // Rings one of the server's doorbells
+  void notify_peer(int doorbell);
+  // Sleeps until `doorbell` rings or the connection closes. Returns false
+  // once the connection is closed.
+  bool wait_doorbell(int doorbell);
+
+  std::string m_path;
+  int m_socket = -1;
+  int m_doorbell = -1;             // rung by the server, data to read
+  int m_peer_doorbell = -1;        // rung by us
+  int m_space_doorbell = -1;       // rung by the server, room to write
+  int m_peer_space_doorbell = -1;  // rung by us
+  uint8_t* m_segment = nullptr;
+  Ring m_tx;
+  Ring m_rx;
+  std::atomic<bool> m_shutdown{false};
+};
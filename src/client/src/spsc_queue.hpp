@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bounded single-producer single-consumer ring. try_push and try_pop never
+// block, lock or allocate; elements are moved in and out of preallocated
+// slots. Exactly one thread may push and exactly one other thread may pop.
+template <typename T>
+class SpscQueue {
+ public:
+  // The capacity is rounded up to a power of two
+  explicit SpscQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity)
+      size *= 2;
+    m_slots.resize(size);
+    m_mask = size - 1;
+  }
+  SpscQueue(const SpscQueue& other) = delete;
+  SpscQueue& operator=(const SpscQueue& other) = delete;
+
+  // False, leaving `value` untouched, when the queue is full
+  bool try_push(T& value) {
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+      return false;
+    m_slots[tail & m_mask] = std::move(value);
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // False when the queue is empty
+  bool try_pop(T& out) {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire))
+      return false;
+    out = std::move(m_slots[head & m_mask]);
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  // Head and tail on separate cache lines, so producer and consumer do not
+  // invalidate each other's line on every operation
+  static constexpr size_t CACHE_LINE = 64;
+
+  std::vector<T> m_slots;
+  size_t m_mask;
+  alignas(CACHE_LINE) std::atomic<size_t> m_head{0};  // next slot to pop
+  alignas(CACHE_LINE) std::atomic<size_t> m_tail{0};  // next slot to push
+};
+
+// Waits between polls of an empty or full queue. Spins first, then yields,
+// then sleeps, so a stage stuck behind a slow socket does not hold a core.
+class Backoff {
+ public:
+  void pause() {
+    if (m_polls < SPIN_POLLS) {
+      ++m_polls;
+    } else if (m_polls < SPIN_POLLS + YIELD_POLLS) {
+      ++m_polls;
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+  }
+  void reset() { m_polls = 0; }
+
+ private:
+  static constexpr int SPIN_POLLS = 64;
+  static constexpr int YIELD_POLLS = 64;
+  int m_polls = 0;
+};
@@ -1,35 +1,54 @@
 #include "tcp_client.hpp"
-#include <boost/asio/connect.hpp>
-#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "wire_capture.hpp"
+
+namespace {
+
+// make_transport(), logged when MESSAGEU_CAPTURE is set
+std::unique_ptr<Transport> open_transport(const std::string& ip,
+                                          const std::string& port) {
+  std::unique_ptr<Transport> transport = make_transport(ip, port);
+  if (std::shared_ptr<WireCapture> capture = WireCapture::from_environment())
+    return capture->wrap(std::move(transport));
+  return transport;
+}
+
+}  // namespace
 
 TcpClient::TcpClient(const std::string& ip, const std::string& port)
     : m_ip(ip),
       m_port(port),
-      m_ioContext(std::make_unique<boost::asio::io_context>()),
-      m_socket(std::make_unique<boost::asio::ip::tcp::socket>(*m_ioContext)),
+      m_transport(open_transport(m_ip, m_port)),
+      m_pool(std::make_unique<BufferPool>()),
       m_connected(false) {}
 
-TcpClient::~TcpClient() {
-  if (m_socket && m_socket->is_open()) {
-    boost::system::error_code ec;
-    m_socket->close(ec);
-  }
-}
+TcpClient::TcpClient(std::unique_ptr<Transport> transport)
+    : m_transport(std::move(transport)),
+      m_pool(std::make_unique<BufferPool>()),
+      m_connected(false) {}
+
+TcpClient::~TcpClient() = default;
 
 TcpClient::TcpClient(const TcpClient& other)
     : m_ip(other.m_ip),
       m_port(other.m_port),
-      m_ioContext(std::make_unique<boost::asio::io_context>()),
-      m_socket(std::make_unique<boost::asio::ip::tcp::socket>(*m_ioContext)),
-      m_connected(other.m_connected) {}
+      m_transport(open_transport(m_ip, m_port)),
+      m_pool(std::make_unique<BufferPool>()),
+      m_frame_limits(other.m_frame_limits),
+      m_connected(other.m_connected.load()) {}
 
 TcpClient& TcpClient::operator=(const TcpClient& other) {
   if (this != &other) {
     m_ip = other.m_ip;
     m_port = other.m_port;
-    m_ioContext = std::make_unique<boost::asio::io_context>();
-    m_socket = std::make_unique<boost::asio::ip::tcp::socket>(*m_ioContext);
-    m_connected = other.m_connected;
+    m_transport = open_transport(m_ip, m_port);
+    m_pool = std::make_unique<BufferPool>();
+    m_frame_limits = other.m_frame_limits;
+    m_connected = other.m_connected.load();
+    set_framing_version(framing::V1);
+    m_read_begin = m_read_end = 0;
   }
   return *this;
 }
@@ -37,48 +56,179 @@ TcpClient& TcpClient::operator=(const TcpClient& other) {
 TcpClient::TcpClient(TcpClient&& other) noexcept
     : m_ip(std::move(other.m_ip)),
       m_port(std::move(other.m_port)),
-      m_ioContext(std::move(other.m_ioContext)),
-      m_socket(std::move(other.m_socket)),
-      m_connected(other.m_connected) {
+      m_transport(std::move(other.m_transport)),
+      m_pool(std::move(other.m_pool)),
+      m_frame_limits(std::move(other.m_frame_limits)),
+      m_connected(other.m_connected.load()),
+      m_framing_version(other.m_framing_version),
+      m_encoder(std::move(other.m_encoder)),
+      m_read_ahead(std::move(other.m_read_ahead)),
+      m_read_begin(other.m_read_begin),
+      m_read_end(other.m_read_end) {
   other.m_connected = false;
+  other.m_read_begin = other.m_read_end = 0;
 }
 
 TcpClient& TcpClient::operator=(TcpClient&& other) noexcept {
   if (this != &other) {
     m_ip = std::move(other.m_ip);
     m_port = std::move(other.m_port);
-    m_ioContext = std::move(other.m_ioContext);
-    m_socket = std::move(other.m_socket);
-    m_connected = other.m_connected;
+    m_transport = std::move(other.m_transport);
+    m_pool = std::move(other.m_pool);
+    m_frame_limits = std::move(other.m_frame_limits);
+    m_connected = other.m_connected.load();
+    m_framing_version = other.m_framing_version;
+    m_encoder = std::move(other.m_encoder);
+    m_read_ahead = std::move(other.m_read_ahead);
+    m_read_begin = other.m_read_begin;
+    m_read_end = other.m_read_end;
     other.m_connected = false;
+    other.m_read_begin = other.m_read_end = 0;
   }
   return *this;
 }
 
 void TcpClient::connect() {
-  boost::asio::ip::tcp::resolver resolver(*m_ioContext);
-  auto endpoints = resolver.resolve(m_ip, m_port);
-  boost::asio::connect(*m_socket, endpoints);
+  m_transport->connect();
   m_connected = true;
+  set_framing_version(framing::V1);
+  m_read_begin = m_read_end = 0;
+}
+
+void TcpClient::set_framing_version(uint8_t version) {
+  if (version < framing::V1 || version > framing::MAX_VERSION)
+    throw std::runtime_error("Unsupported framing version " +
+                             std::to_string(version));
+  m_framing_version = version;
+  if (version == framing::V1)
+    m_encoder.reset();
+  else
+    m_encoder = std::make_unique<framing::RequestEncoder>();
+}
+
+void TcpClient::shutdown() {
+  if (m_transport)
+    m_transport->shutdown();
 }
 
 void TcpClient::send(const std::vector<uint8_t>& data) {
+  send(data.data(), data.size());
+}
+
+void TcpClient::send(const uint8_t* data, size_t n) {
+  send(data, n, nullptr, 0);
+}
+
+void TcpClient::send(const uint8_t* head, size_t head_n, const uint8_t* body,
+                     size_t body_n) {
   if (!m_connected)
     throw std::runtime_error("Not connected");
-  boost::asio::write(*m_socket, boost::asio::buffer(data.data(), data.size()));
+  try {
+    if (!m_encoder) {
+      m_transport->write(head, head_n, body, body_n);
+      return;
+    }
+    const auto& segments = m_encoder->encode(head, head_n, body, body_n);
+    if (segments.size() == 1) {
+      m_transport->write(segments[0].data, segments[0].size, nullptr, 0);
+    } else if (segments.size() == 2) {
+      m_transport->write(segments[0].data, segments[0].size, segments[1].data,
+                         segments[1].size);
+    } else if (!segments.empty()) {
+      // Pipelined frames: several small headers and payloads
+      m_joined.clear();
+      for (const auto& segment : segments)
+        m_joined.insert(m_joined.end(), segment.data,
+                        segment.data + segment.size);
+      m_transport->write(m_joined.data(), m_joined.size(), nullptr, 0);
+    }
+  } catch (...) {
+    m_connected = false;
+    throw;
+  }
 }
 
 std::vector<uint8_t> TcpClient::receive_n_bytes(size_t n) {
-  if (!m_connected)
-    throw std::runtime_error("Not connected");
-  std::vector<uint8_t> buf(n);
+  std::vector<uint8_t> buf;
+  receive_growing(buf, n);
+  return buf;
+}
+
+PooledBuffer TcpClient::receive_pooled(size_t n) {
+  std::vector<uint8_t> buf =
+      m_pool->acquire(std::min(n, BufferPool::MAX_POOLED_CAPACITY));
+  receive_growing(buf, n);
+  return PooledBuffer(std::move(buf), m_pool.get());
+}
+
+void TcpClient::receive_growing(std::vector<uint8_t>& buf, size_t n) {
+  // Capacity left from the pool is used as is; past it the buffer at most
+  // doubles per step, so memory tracks the bytes received while the number of
+  // reallocations stays logarithmic
   size_t received = 0;
+  size_t target = std::max(buf.capacity(), RECEIVE_CHUNK_SIZE);
   while (received < n) {
-    size_t n_read = m_socket->read_some(
-        boost::asio::buffer(buf.data() + received, n - received));
-    if (n_read == 0)
-      throw std::runtime_error("Connection closed by server");
-    received += n_read;
+    size_t end = std::min(n, target);
+    buf.resize(end);
+    receive_into(buf.data() + received, end - received);
+    received = end;
+    target = received * 2;
+  }
+}
+
+void TcpClient::receive_into(uint8_t* buf, size_t n) {
+  if (!m_connected)
+    throw std::runtime_error("Not connected");
+  size_t received = std::min(n, m_read_end - m_read_begin);
+  if (received > 0) {
+    std::memcpy(buf, m_read_ahead.data() + m_read_begin, received);
+    m_read_begin += received;
+  }
+  try {
+    while (received < n) {
+      size_t left = n - received;
+      if (left >= READ_AHEAD_SIZE) {
+        size_t n_read = m_transport->read_some(buf + received, left);
+        if (n_read == 0)
+          throw std::runtime_error("Connection closed by server");
+        received += n_read;
+        continue;
+      }
+      if (m_read_ahead.empty())
+        m_read_ahead.resize(READ_AHEAD_SIZE);
+      size_t n_read = m_transport->read_some(m_read_ahead.data(),
+                                             m_read_ahead.size());
+      if (n_read == 0)
+        throw std::runtime_error("Connection closed by server");
+      size_t take = std::min(left, n_read);
+      std::memcpy(buf + received, m_read_ahead.data(), take);
+      received += take;
+      m_read_begin = take;
+      m_read_end = n_read;
+    }
+  } catch (...) {
+    m_connected = false;
+    throw;
+  }
+}
+
+uint32_t TcpClient::receive_varint_slow() {
+  uint8_t bytes[framing::MAX_VARINT_SIZE];
+  for (size_t n = 1; n <= sizeof(bytes); ++n) {
+    receive_into(bytes + n - 1, 1);
+    uint32_t value;
+    if (framing::get_varint(bytes, n, value))
+      return value;
+  }
+  // get_varint throws once MAX_VARINT_SIZE bytes did not end the varint
+  throw std::runtime_error("Invalid varint");
+}
+
+void TcpClient::skip_n_bytes(size_t n) {
+  uint8_t scratch[4096];
+  while (n > 0) {
+    size_t chunk = std::min(n, sizeof(scratch));
+    receive_into(scratch, chunk);
+    n -= chunk;
   }
-  return buf;
 }
\ No newline at end of file
@@ -1,26 +1,104 @@
 #pragma once
 
-#include <boost/asio.hpp>
+#include <atomic>
 #include <memory>
 #include <string>
+#include <vector>
+#include "buffer_pool.hpp"
+#include "frame_limits.hpp"
+#include "framing.hpp"
+#include "transport.hpp"
 
+// Connection to the server. Despite the name, the byte stream can be TCP, a
+// Unix domain socket or shared memory, see make_transport(). With
+// MESSAGEU_CAPTURE set, the traffic is also logged, see WireCapture.
+//
+// Requests are always written as version 1 frames. Once the connection has
+// switched to version 2 framing, see framing.hpp, they are re-encoded on
+// the way out; replies are decoded by recv_protocol_response_header().
+// Reads go through a small read-ahead buffer, so that a run of small replies
+// costs one read from the transport, not two per reply.
 class TcpClient {
  public:
   TcpClient(const std::string& ip, const std::string& port);
+  // Runs over a caller-built transport, e.g. an in-memory one replaying a
+  // capture. Such a client has no endpoint, so its copies cannot connect.
+  explicit TcpClient(std::unique_ptr<Transport> transport);
   ~TcpClient();
   TcpClient(const TcpClient& other);
   TcpClient& operator=(const TcpClient& other);
   TcpClient(TcpClient&& other) noexcept;
   TcpClient& operator=(TcpClient&& other) noexcept;
 
+  // Connects, in version 1 framing
   void connect();
+  // False until connect() succeeds, and again once a read or write failed or
+  // the server closed the connection
+  bool is_connected() const { return m_connected; }
+  // Shuts the socket down, unblocking a read pending on another thread
+  void shutdown();
   void send(const std::vector<uint8_t>& data);
+  void send(const uint8_t* data, size_t n);
+  // Gather write of two buffers, e.g. a header and its payload
+  void send(const uint8_t* head, size_t head_n, const uint8_t* body,
+            size_t body_n);
+  // The buffer grows in chunks as the data arrives, so a size announced by
+  // the peer is only ever backed by bytes that were actually received
   std::vector<uint8_t> receive_n_bytes(size_t n);
+  // Like receive_n_bytes, but the buffer comes from and returns to the
+  // connection's pool. Must not outlive this TcpClient.
+  PooledBuffer receive_pooled(size_t n);
+  // Reads exactly n bytes into a caller-owned buffer
+  void receive_into(uint8_t* buf, size_t n);
+  // Reads and discards n bytes, used to stay in sync after a bad record
+  void skip_n_bytes(size_t n);
+  // Reads a varint, see framing::put_varint
+  uint32_t receive_varint() {
+    // Usually whole in the read-ahead buffer
+    uint32_t value;
+    if (size_t n = framing::get_varint(m_read_ahead.data() + m_read_begin,
+                                       m_read_end - m_read_begin, value)) {
+      m_read_begin += n;
+      return value;
+    }
+    return receive_varint_slow();
+  }
+
+  // framing::V1 or V2, for the frames after the one last written and read
+  uint8_t framing_version() const { return m_framing_version; }
+  void set_framing_version(uint8_t version);
+
+  // Per-code bounds on replies buffered whole, see FrameLimits
+  const FrameLimits& frame_limits() const { return m_frame_limits; }
+  void set_frame_limits(const FrameLimits& limits) { m_frame_limits = limits; }
 
  private:
+  // First allocation of a growing receive buffer
+  static constexpr size_t RECEIVE_CHUNK_SIZE = 64 * 1024;
+  // Reads of at least this much bypass the read-ahead buffer
+  static constexpr size_t READ_AHEAD_SIZE = 16 * 1024;
+
+  // Reads n bytes into the empty buf, growing it as they arrive
+  void receive_growing(std::vector<uint8_t>& buf, size_t n);
+  // receive_varint() of a varint not yet whole in the read-ahead buffer
+  uint32_t receive_varint_slow();
+
   std::string m_ip;
   std::string m_port;
-  std::unique_ptr<boost::asio::io_context> m_ioContext;
-  std::unique_ptr<boost::asio::ip::tcp::socket> m_socket;
-  bool m_connected;
+  std::unique_ptr<Transport> m_transport;
+  std::unique_ptr<BufferPool> m_pool;
+  FrameLimits m_frame_limits;
+  // Cleared by a failed send() and a failed read, which may run on two
+  // threads at once, and read by is_connected() from yet another
+  std::atomic<bool> m_connected;
+
+  uint8_t m_framing_version = framing::V1;
+  // Set in version 2 only
+  std::unique_ptr<framing::RequestEncoder> m_encoder;
+  // Encoded frames written in more than two pieces are joined here
+  std::vector<uint8_t> m_joined;
+  // Bytes read from the transport but not consumed yet, [begin, end)
+  std::vector<uint8_t> m_read_ahead;
+  size_t m_read_begin = 0;
+  size_t m_read_end = 0;
 };
\ No newline at end of file
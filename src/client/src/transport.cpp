@@ -0,0 +1,216 @@
+#include "transport.hpp"
+#include <array>
+#include <boost/asio.hpp>
+#include <boost/asio/connect.hpp>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include "address_cache.hpp"
+#include "shm_transport.hpp"
+
+namespace {
+
+// TCP and Unix domain sockets differ only in how they connect
+template <typename Protocol>
+class AsioStreamTransport : public Transport {
+ public:
+  AsioStreamTransport() : m_socket(m_ioContext) {}
+
+  ~AsioStreamTransport() override {
+    boost::system::error_code ec;
+    m_socket.close(ec);
+  }
+
+  void shutdown() override {
+    if (m_socket.is_open()) {
+      boost::system::error_code ec;
+      m_socket.shutdown(Protocol::socket::shutdown_both, ec);
+    }
+  }
+
+  void write(const uint8_t* head,
+             size_t head_n,
+             const uint8_t* body,
+             size_t body_n) override {
+    std::array<boost::asio::const_buffer, 2> buffers = {
+        boost::asio::buffer(head, head_n), boost::asio::buffer(body, body_n)};
+    boost::asio::write(m_socket, buffers);
+  }
+
+  size_t read_some(uint8_t* buf, size_t n) override {
+    boost::system::error_code ec;
+    size_t n_read = m_socket.read_some(boost::asio::buffer(buf, n), ec);
+    if (ec == boost::asio::error::eof)
+      return 0;
+    if (ec)
+      throw boost::system::system_error(ec);
+    return n_read;
+  }
+
+ protected:
+  boost::asio::io_context m_ioContext;
+  typename Protocol::socket m_socket;
+};
+
+class TcpTransport : public AsioStreamTransport<boost::asio::ip::tcp> {
+ public:
+  using tcp = boost::asio::ip::tcp;
+
+  TcpTransport(const std::string& ip, const std::string& port)
+      : m_ip(ip), m_port(port) {}
+
+  // Host names are resolved through AddressCache; if none of the cached
+  // addresses answers, they are resolved again. Requests are small and
+  // latency bound, so Nagle's algorithm is off.
+  void connect() override {
+    boost::system::error_code ec;
+    boost::asio::ip::address numeric = boost::asio::ip::make_address(m_ip, ec);
+    if (!ec) {
+      connect_any({tcp::endpoint(
+          numeric, static_cast<unsigned short>(std::stoi(m_port)))});
+    } else if (!connect_cached()) {
+      tcp::resolver resolver(m_ioContext);
+      std::vector<tcp::endpoint> endpoints;
+      for (const auto& entry : resolver.resolve(m_ip, m_port))
+        endpoints.push_back(entry.endpoint());
+      remember(endpoints, connect_any(endpoints));
+    }
+    m_socket.set_option(tcp::no_delay(true));
+  }
+
+ private:
+  // A connection attempt gets this long before the next address is tried
+  // alongside it, as in RFC 8305
+  static constexpr std::chrono::milliseconds ATTEMPT_DELAY{100};
+
+  // "address/port", as stored in the cache
+  static std::string to_string(const tcp::endpoint& endpoint) {
+    return endpoint.address().to_string() + "/" +
+           std::to_string(endpoint.port());
+  }
+
+  // Caches the endpoints, the one that answered first so it is tried first
+  // next time
+  void remember(const std::vector<tcp::endpoint>& endpoints,
+                const tcp::endpoint& winner) {
+    std::vector<std::string> addresses = {to_string(winner)};
+    for (const tcp::endpoint& endpoint : endpoints) {
+      if (endpoint != winner)
+        addresses.push_back(to_string(endpoint));
+    }
+    AddressCache::shared().store(m_ip, m_port, addresses);
+  }
+
+  bool connect_cached() {
+    std::vector<tcp::endpoint> endpoints;
+    for (const std::string& cached :
+         AddressCache::shared().lookup(m_ip, m_port)) {
+      size_t slash = cached.rfind('/');
+      boost::system::error_code ec;
+      auto address = boost::asio::ip::make_address(cached.substr(0, slash), ec);
+      if (ec || slash == std::string::npos)
+        return false;
+      endpoints.emplace_back(address, static_cast<unsigned short>(std::stoi(
+                                          cached.substr(slash + 1))));
+    }
+    if (endpoints.empty())
+      return false;
+    try {
+      tcp::endpoint winner = connect_any(endpoints);
+      if (winner != endpoints.front())
+        remember(endpoints, winner);
+      return true;
+    } catch (const boost::system::system_error&) {
+      return false;  // stale, resolve again
+    }
+  }
+
+  // Races the endpoints: each attempt starts once the previous one failed or
+  // ATTEMPT_DELAY passed, and the first to connect becomes m_socket. An
+  // unreachable first address therefore costs ATTEMPT_DELAY, not a connect
+  // timeout. Returns the endpoint connected to.
+  tcp::endpoint connect_any(const std::vector<tcp::endpoint>& endpoints) {
+    if (endpoints.size() == 1) {
+      m_socket.connect(endpoints[0]);
+      return endpoints[0];
+    }
+    std::vector<std::unique_ptr<tcp::socket>> attempts;
+    boost::asio::steady_timer timer(m_ioContext);
+    boost::system::error_code last_error = boost::asio::error::host_not_found;
+    size_t next = 0;
+    size_t pending = 0;
+    size_t winner = endpoints.size();
+
+    std::function<void()> start_next = [&] {
+      if (winner < endpoints.size())
+        return;
+      if (next == endpoints.size()) {
+        if (pending == 0)
+          timer.cancel();
+        return;
+      }
+      size_t index = next++;
+      attempts.push_back(std::make_unique<tcp::socket>(m_ioContext));
+      tcp::socket& socket = *attempts.back();
+      ++pending;
+      socket.async_connect(endpoints[index], [&, index](
+                                                 const boost::system::error_code&
+                                                     error) {
+        --pending;
+        if (winner < endpoints.size())
+          return;
+        if (error) {
+          last_error = error;
+          start_next();
+          return;
+        }
+        winner = index;
+        m_socket = std::move(socket);
+        timer.cancel();
+        for (auto& attempt : attempts) {
+          boost::system::error_code ignored;
+          attempt->close(ignored);
+        }
+      });
+      timer.expires_after(ATTEMPT_DELAY);
+      timer.async_wait([&](const boost::system::error_code& error) {
+        if (!error)
+          start_next();
+      });
+    };
+
+    m_ioContext.restart();
+    start_next();
+    m_ioContext.run();
+    if (winner == endpoints.size())
+      throw boost::system::system_error(last_error);
+    return endpoints[winner];
+  }
+
+  std::string m_ip;
+  std::string m_port;
+};
+
+class UnixTransport
+    : public AsioStreamTransport<boost::asio::local::stream_protocol> {
+ public:
+  explicit UnixTransport(const std::string& path) : m_path(path) {}
+
+  void connect() override {
+    m_socket.connect(boost::asio::local::stream_protocol::endpoint(m_path));
+  }
+
+ private:
+  std::string m_path;
+};
+
+}  // namespace
+
+std::unique_ptr<Transport> make_transport(const std::string& host,
+                                          const std::string& port) {
+  if (host == "unix")
+    return std::make_unique<UnixTransport>(port);
+  if (host == "shm")
+    return std::make_unique<ShmTransport>(port);
+  return std::make_unique<TcpTransport>(host, port);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Byte stream underneath TcpClient. Framing lives above this interface, so
+// every transport carries exactly the same protocol bytes.
+class Transport {
+ public:
+  virtual ~Transport() = default;
+
+  virtual void connect() = 0;
+  // Unblocks a read pending on another thread; later reads return 0
+  virtual void shutdown() = 0;
+  // Writes both buffers completely, in order
+  virtual void write(const uint8_t* head,
+                     size_t head_n,
+                     const uint8_t* body,
+                     size_t body_n) = 0;
+  // Reads at least one byte, or returns 0 once the peer closed
+  virtual size_t read_some(uint8_t* buf, size_t n) = 0;
+};
+
+// Picks the transport from a server.info endpoint split at its first ':'.
+//   <ip>:<port>   TCP
+//   unix:<path>   Unix domain stream socket
+//   shm:<path>    shared-memory rings, set up through the Unix socket <path>
+std::unique_ptr<Transport> make_transport(const std::string& host,
+                                          const std::string& port);
@@ -3,42 +3,86 @@
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include "record_writer.hpp"
 
 void ClientView::show_message(const std::string& msg) const {
-  std::cout << msg << std::endl;
+  m_out << msg << '\n';
 }
 
 void ClientView::show_hexify(const unsigned char* buffer,
                              unsigned int length) const {
-  std::ios::fmtflags f(std::cout.flags());
-  std::cout << std::hex;
+  std::ios::fmtflags f(m_out.flags());
+  m_out << std::hex;
   for (size_t i = 0; i < length; i++)
-    std::cout << std::setfill('0') << std::setw(2) << (0xFF & buffer[i])
+    m_out << std::setfill('0') << std::setw(2) << (0xFF & buffer[i])
               << (((i + 1) % 16 == 0) ? "\n" : " ");
-  std::cout << std::endl;
-  std::cout.flags(f);
+  m_out << std::endl;
+  m_out.flags(f);
 }
 
 void ClientView::show_error(const std::string& msg) const {
-  std::cout << "Error: " << msg << std::endl;
+  m_out << "Error: " << msg << '\n';
 }
 
 std::string ClientView::prompt_username() const {
-  std::cout << "Enter username: ";
+  m_out << "Enter username: ";
   std::string username;
   std::getline(std::cin, username);
   return username;
 }
 
+const char* command_name(ClientCommand command) {
+  switch (command) {
+    case ClientCommand::Register:
+      return "Register";
+    case ClientCommand::ListClients:
+      return "ListClients";
+    case ClientCommand::PublicKey:
+      return "PublicKey";
+    case ClientCommand::WaitingMessages:
+      return "WaitingMessages";
+    case ClientCommand::Subscribe:
+      return "Subscribe";
+    case ClientCommand::Poll:
+      return "Poll";
+    case ClientCommand::SendText:
+      return "SendText";
+    case ClientCommand::RequestSymKey:
+      return "RequestSymKey";
+    case ClientCommand::SendSymKey:
+      return "SendSymKey";
+    case ClientCommand::SendFile:
+      return "SendFile";
+    case ClientCommand::SendSymKeyAll:
+      return "SendSymKeyAll";
+    case ClientCommand::HistoryByClient:
+      return "HistoryByClient";
+    case ClientCommand::HistoryByTime:
+      return "HistoryByTime";
+    case ClientCommand::Exit:
+      return "Exit";
+    case ClientCommand::Invalid:
+      break;
+  }
+  return "Invalid";
+}
+
 ClientCommand ClientView::prompt_command() const {
-  std::cout << "MessageU client at your service.\n\n"
+  m_out << "MessageU client at your service.\n\n"
                "110) Register\n"
                "120) Request for clients list\n"
                "130) Request for public key\n"
                "140) Request for waiting messages\n"
+               "141) Subscribe to incoming messages\n"
+               "142) Poll for incoming messages in the background\n"
                "150) Send a text message\n"
                "151) Send a request for symmetric key\n"
                "152) Send your symmetric key\n"
+               "153) Send a file\n"
+               "154) Send your symmetric key to all clients with a known "
+               "public key\n"
+               "160) Show the message history with a client\n"
+               "161) Show the message history in a time range\n"
                " 0) Exit client\n"
                "? ";
   std::string input;
@@ -47,7 +91,7 @@ ClientCommand ClientView::prompt_command() const {
   std::istringstream iss(input);
   iss >> code;
   if (iss.fail() || !iss.eof()) {
-    std::cout << "input invalid " << input << std::endl;
+    m_out << "input invalid " << input << std::endl;
     return ClientCommand::Invalid;
   }
   switch (code) {
@@ -59,16 +103,28 @@ ClientCommand ClientView::prompt_command() const {
       return ClientCommand::PublicKey;
     case 140:
       return ClientCommand::WaitingMessages;
+    case 141:
+      return ClientCommand::Subscribe;
+    case 142:
+      return ClientCommand::Poll;
     case 150:
       return ClientCommand::SendText;
     case 151:
       return ClientCommand::RequestSymKey;
     case 152:
       return ClientCommand::SendSymKey;
+    case 153:
+      return ClientCommand::SendFile;
+    case 154:
+      return ClientCommand::SendSymKeyAll;
+    case 160:
+      return ClientCommand::HistoryByClient;
+    case 161:
+      return ClientCommand::HistoryByTime;
     case 0:
       return ClientCommand::Exit;
     default:
-      std::cout << "input invalid 2 " << input << std::endl;
+      m_out << "input invalid 2 " << input << std::endl;
 
       return ClientCommand::Invalid;
   }
@@ -76,39 +132,41 @@ ClientCommand ClientView::prompt_command() const {
 
 void ClientView::show_all_clients(
     const std::vector<ClientListEntry>& clients) const {
-  std::cout << "Client List:" << std::endl;
+  // One string per entry instead of an iostream call per id byte
+  std::string line;
+  m_out << "Client List:\n";
   for (const auto& entry : clients) {
-    std::cout << "ID: ";
-    for (size_t i = 0; i < entry.id.size(); ++i) {
-      std::cout << std::hex << std::setw(2) << std::setfill('0')
-                << (int)entry.id[i];
-    }
-    std::cout << "  Name: " << entry.name << std::endl;
+    line = "ID: ";
+    line += hex_encode(entry.id.data(), entry.id.size());
+    line += "  Name: ";
+    line += entry.name;
+    line += '\n';
+    m_out.write(line.data(), line.size());
   }
   if (clients.empty()) {
-    std::cout << "(No clients in list)" << std::endl;
+    m_out << "(No clients in list)\n";
   }
 }
 
-void ClientView::show_pending_message(const std::string& sender_name,
-                                      uint8_t msg_type,
-                                      const std::string& content) const {
-  std::cout << "From: " << sender_name << std::endl;
-  std::cout << "Content:" << std::endl;
-  switch (static_cast<ProtocolMessage::MessageType>(msg_type)) {
+void ClientView::show_pending_message(const PendingMessage& message) const {
+  m_out << "From: " << message.sender_name << "\nContent:\n";
+  switch (static_cast<ProtocolMessage::MessageType>(message.type)) {
     case ProtocolMessage::MessageType::SYMMETRIC_KEY_REQUEST:
-      std::cout << "Request for symmetric key" << std::endl;
+      m_out << "Request for symmetric key\n";
       break;
     case ProtocolMessage::MessageType::SYMMETRIC_KEY_SEND:
-      std::cout << "Received symmetric key" << std::endl;
+      m_out << "Received symmetric key\n";
+      break;
+    case ProtocolMessage::MessageType::TEXT:
+    case ProtocolMessage::MessageType::TEXT_COMPRESSED:
+      m_out << message.content << '\n';
       break;
-    case ProtocolMessage::MessageType::TEXT: {
-      std::cout << content << std::endl;
+    case ProtocolMessage::MessageType::FILE:
+      m_out << "File saved to: " << message.content << '\n';
       break;
-    }
     default:
-      std::cout << "Unknown message type" << std::endl;
+      m_out << "Unknown message type\n";
       break;
   }
-  std::cout << std::endl;
-}
\ No newline at end of file
+  m_out << '\n';
+}
@@ -1,6 +1,8 @@
 #pragma once
+#include <iostream>
 #include <string>
 #include <vector>
+#include "../messageu_client.hpp"
 #include "../model/client_model.hpp"
 
 enum class ClientCommand {
@@ -8,24 +10,46 @@ enum class ClientCommand {
   ListClients = 120,
   PublicKey = 130,
   WaitingMessages = 140,
+  Subscribe = 141,
+  Poll = 142,
   SendText = 150,
   RequestSymKey = 151,
   SendSymKey = 152,
+  SendFile = 153,
+  SendSymKeyAll = 154,
+  HistoryByClient = 160,
+  HistoryByTime = 161,
   Exit = 0,
   Invalid
 };
 
+// Short name of a command, e.g. "ListClients"; a string literal
+const char* command_name(ClientCommand command);
+
+// Human-oriented console rendering. Output is not flushed per line: std::cin
+// is tied to std::cout, so everything written is flushed before the next
+// prompt reads, and flush() covers output that no read follows.
 class ClientView {
  public:
-  void show_message(const std::string& msg) const;
+  // Menus, prompts and results go to `out`
+  explicit ClientView(std::ostream& out = std::cout) : m_out(out) {}
+  virtual ~ClientView() = default;
+
+  virtual void show_message(const std::string& msg) const;
   void show_hexify(const unsigned char* buffer, unsigned int length) const;
-  void show_error(const std::string& msg) const;
+  virtual void show_error(const std::string& msg) const;
   std::string prompt_username() const;
   ClientCommand prompt_command() const;
 
   // Print all clients' IDs and names
-  void show_all_clients(const std::vector<ClientListEntry>& clients) const;
-  void show_pending_message(const std::string& sender_name,
-                            uint8_t msg_type,
-                            const std::string& content) const;
-};
\ No newline at end of file
+  virtual void show_all_clients(
+      const std::vector<ClientListEntry>& clients) const;
+  virtual void show_pending_message(const PendingMessage& message) const;
+  // Messages from the history, with their time and direction
+  virtual void show_history(
+      const std::vector<MessageHistory::Entry>& entries) const;
+  virtual void flush() const { m_out.flush(); }
+
+ protected:
+  std::ostream& m_out;
+};
@@ -0,0 +1,25 @@
+#include <ctime>
+#include <iomanip>
+#include "client_view.hpp"
+
+// Rendering of the message history, see MessageHistory
+
+void ClientView::show_history(
+    const std::vector<MessageHistory::Entry>& entries) const {
+  m_out << "History:\n";
+  for (const MessageHistory::Entry& entry : entries) {
+    std::time_t seconds = static_cast<std::time_t>(entry.time_ms / 1000);
+    std::tm local{};
+    localtime_r(&seconds, &local);
+    m_out << '[' << std::put_time(&local, "%Y-%m-%d %H:%M:%S") << "] "
+          << (entry.outgoing ? "To " : "From ") << entry.peer_name << " (#"
+          << entry.message_id << "):\n";
+    if (entry.type == static_cast<uint8_t>(ProtocolMessage::MessageType::FILE))
+      m_out << "File: " << entry.content << '\n';
+    else
+      m_out << entry.content << '\n';
+  }
+  if (entries.empty()) {
+    m_out << "(No messages in history)\n";
+  }
+}
@@ -0,0 +1,227 @@
+#include "record_writer.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include "../protocol_schema.hpp"
+
+namespace {
+
+constexpr char HEX_DIGITS[] = "0123456789abcdef";
+
+void write_fully(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = ::write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error(std::string("Output write failed: ") +
+                               std::strerror(errno));
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+// Length of the well-formed UTF-8 sequence that starts at text[i], 0 if there
+// is none (stray continuation byte, overlong form, surrogate, cut short)
+size_t utf8_sequence_length(const std::string& text, size_t i) {
+  unsigned char lead = text[i];
+  size_t length;
+  unsigned char low = 0x80;
+  unsigned char high = 0xbf;
+  if (lead >= 0xc2 && lead <= 0xdf) {
+    length = 2;
+  } else if (lead >= 0xe0 && lead <= 0xef) {
+    length = 3;
+    if (lead == 0xe0)
+      low = 0xa0;
+    else if (lead == 0xed)
+      high = 0x9f;
+  } else if (lead >= 0xf0 && lead <= 0xf4) {
+    length = 4;
+    if (lead == 0xf0)
+      low = 0x90;
+    else if (lead == 0xf4)
+      high = 0x8f;
+  } else {
+    return 0;
+  }
+  if (text.size() - i < length)
+    return 0;
+  for (size_t k = 1; k < length; ++k) {
+    unsigned char c = text[i + k];
+    if (c < low || c > high)
+      return 0;
+    low = 0x80;
+    high = 0xbf;
+  }
+  return length;
+}
+
+}  // namespace
+
+std::string hex_encode(const uint8_t* data, size_t size) {
+  std::string hex(size * 2, '\0');
+  for (size_t i = 0; i < size; ++i) {
+    hex[2 * i] = HEX_DIGITS[data[i] >> 4];
+    hex[2 * i + 1] = HEX_DIGITS[data[i] & 0xf];
+  }
+  return hex;
+}
+
+RecordWriter::RecordWriter(Format format, const std::string& path)
+    : m_format(format), m_fd(STDOUT_FILENO), m_owns_fd(false) {
+  if (!path.empty()) {
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (m_fd < 0) {
+      throw std::runtime_error("Cannot open output file " + path + ": " +
+                               std::strerror(errno));
+    }
+    m_owns_fd = true;
+  }
+  m_buffer.reserve(BUFFER_SIZE);
+}
+
+RecordWriter::~RecordWriter() {
+  try {
+    flush();
+  } catch (const std::exception&) {
+    // Nowhere left to report it
+  }
+  if (m_owns_fd)
+    ::close(m_fd);
+}
+
+RecordWriter::Format RecordWriter::parse_format(const std::string& name) {
+  if (name == "jsonl")
+    return Format::JsonLines;
+  if (name == "binary")
+    return Format::Binary;
+  throw std::runtime_error("Unknown output format: " + name);
+}
+
+void RecordWriter::write_client(const ClientListEntry& entry) {
+  if (m_format == Format::Binary) {
+    append("C", 1);
+    append(entry.id.data(), entry.id.size());
+    append_big_endian(static_cast<uint16_t>(entry.name.size()));
+    append(entry.name);
+    return;
+  }
+  append("{\"type\":\"client\",\"id\":\"");
+  append(hex_encode(entry.id.data(), entry.id.size()));
+  append("\",\"name\":");
+  append_json_string(entry.name);
+  append("}\n");
+}
+
+void RecordWriter::write_message(const PendingMessage& message) {
+  if (m_format == Format::Binary) {
+    append("M", 1);
+    append(message.from_id.data(), message.from_id.size());
+    append(&message.type, 1);
+    append_big_endian(static_cast<uint16_t>(message.sender_name.size()));
+    append(message.sender_name);
+    append_big_endian(static_cast<uint32_t>(message.content.size()));
+    append(message.content);
+    return;
+  }
+  append("{\"type\":\"message\",\"from\":\"");
+  append(hex_encode(message.from_id.data(), message.from_id.size()));
+  append("\",\"sender\":");
+  append_json_string(message.sender_name);
+  append(",\"message_type\":" + std::to_string(message.type) +
+         ",\"content\":");
+  append_json_string(message.content);
+  append("}\n");
+}
+
+void RecordWriter::write_error(const std::string& error) {
+  if (m_format == Format::Binary) {
+    append("E", 1);
+    append_big_endian(static_cast<uint32_t>(error.size()));
+    append(error);
+    return;
+  }
+  append("{\"type\":\"error\",\"message\":");
+  append_json_string(error);
+  append("}\n");
+}
+
+void RecordWriter::flush() {
+  if (m_buffer.empty())
+    return;
+  write_fully(m_fd, m_buffer.data(), m_buffer.size());
+  m_buffer.clear();
+}
+
+void RecordWriter::append(const void* data, size_t size) {
+  if (m_buffer.size() + size > BUFFER_SIZE) {
+    flush();
+    // Too big to be worth copying
+    if (size >= BUFFER_SIZE) {
+      write_fully(m_fd, static_cast<const uint8_t*>(data), size);
+      return;
+    }
+  }
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+}
+
+void RecordWriter::append_json_string(const std::string& text) {
+  append("\"", 1);
+  // Copies runs of plain characters at once, only the few characters JSON
+  // requires are escaped. Well-formed UTF-8 is passed through; any other byte
+  // above 0x7f is escaped as the code point of the same value, so the line
+  // stays valid JSON.
+  size_t run = 0;
+  for (size_t i = 0; i < text.size(); ++i) {
+    unsigned char c = text[i];
+    if (c >= 0x80) {
+      size_t length = utf8_sequence_length(text, i);
+      if (length > 0) {
+        i += length - 1;
+        continue;
+      }
+    } else if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    append(text.data() + run, i - run);
+    run = i + 1;
+    switch (c) {
+      case '"':
+        append("\\\"", 2);
+        break;
+      case '\\':
+        append("\\\\", 2);
+        break;
+      case '\n':
+        append("\\n", 2);
+        break;
+      case '\r':
+        append("\\r", 2);
+        break;
+      case '\t':
+        append("\\t", 2);
+        break;
+      default: {
+        char escape[6] = {'\\', 'u', '0', '0', HEX_DIGITS[c >> 4],
+                          HEX_DIGITS[c & 0xf]};
+        append(escape, sizeof(escape));
+        break;
+      }
+    }
+  }
+  append(text.data() + run, text.size() - run);
+  append("\"", 1);
+}
+
+template <typename T>
+void RecordWriter::append_big_endian(T value) {
+  uint8_t bytes[sizeof(T)];
+  schema::BigEndian<T>::write(bytes, value);
+  append(bytes, sizeof(bytes));
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "../messageu_client.hpp"
+
+// Lowercase hex of `size` bytes
+std::string hex_encode(const uint8_t* data, size_t size);
+
+// Machine-readable output: clients, messages and errors as JSON Lines or as
+// compact binary records, collected in one large buffer and written with a
+// single write(2) whenever it fills up. Nothing is flushed per record.
+//
+// JSON Lines, one object per line:
+//   {"type":"client","id":"<hex>","name":"..."}
+//   {"type":"message","from":"<hex>","sender":"...","message_type":N,
+//    "content":"..."}                    content is the path for files
+//   {"type":"error","message":"..."}
+// Strings are passed through when they are valid UTF-8; bytes that are not
+// part of a valid sequence are written as \u0080-\u00ff escapes.
+//
+// Binary records start with a tag byte; integers are big-endian, like the
+// wire protocol:
+//   'C' id[16] name_len:u16 name
+//   'M' from[16] message_type:u8 sender_len:u16 sender content_len:u32 content
+//   'E' len:u32 message
+class RecordWriter {
+ public:
+  enum class Format { JsonLines, Binary };
+
+  static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+
+  // Writes to stdout when `path` is empty. Throws if the file cannot be
+  // created.
+  RecordWriter(Format format, const std::string& path);
+  // Flushes what is left
+  ~RecordWriter();
+  RecordWriter(const RecordWriter& other) = delete;
+  RecordWriter& operator=(const RecordWriter& other) = delete;
+
+  // "jsonl" or "binary", throws otherwise
+  static Format parse_format(const std::string& name);
+
+  void write_client(const ClientListEntry& entry);
+  void write_message(const PendingMessage& message);
+  void write_error(const std::string& error);
+  void flush();
+
+ private:
+  void append(const void* data, size_t size);
+  void append(const std::string& text) { append(text.data(), text.size()); }
+  void append_json_string(const std::string& text);
+  template <typename T>
+  void append_big_endian(T value);
+
+  Format m_format;
+  int m_fd;
+  bool m_owns_fd;
+  std::vector<uint8_t> m_buffer;
+};
@@ -0,0 +1,22 @@
+#include "structured_view.hpp"
+
+void StructuredView::show_error(const std::string& msg) const {
+  // Recorded with the data, and shown to whoever runs the client
+  m_writer->write_error(msg);
+  ClientView::show_error(msg);
+}
+
+void StructuredView::show_all_clients(
+    const std::vector<ClientListEntry>& clients) const {
+  for (const ClientListEntry& entry : clients)
+    m_writer->write_client(entry);
+}
+
+void StructuredView::show_pending_message(
+    const PendingMessage& message) const {
+  m_writer->write_message(message);
+}
+
+void StructuredView::flush() const {
+  m_writer->flush();
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <memory>
+#include "client_view.hpp"
+#include "record_writer.hpp"
+
+// View for automated runs: clients, messages and errors become records of a
+// RecordWriter, while menus, prompts and status messages go to stderr so the
+// record stream stays clean.
+class StructuredView : public ClientView {
+ public:
+  explicit StructuredView(std::unique_ptr<RecordWriter> writer)
+      : ClientView(std::cerr), m_writer(std::move(writer)) {}
+
+  void show_error(const std::string& msg) const override;
+  void show_all_clients(
+      const std::vector<ClientListEntry>& clients) const override;
+  void show_pending_message(const PendingMessage& message) const override;
+  void flush() const override;
+
+ private:
+  std::unique_ptr<RecordWriter> m_writer;
+};
@@ -0,0 +1,175 @@
+#include "wire_capture.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace {
+
+void write_fully(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = ::write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error(std::string("Capture write failed: ") +
+                               std::strerror(errno));
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+// Logs everything that passes through the wrapped transport
+class CaptureTransport : public Transport {
+ public:
+  CaptureTransport(std::unique_ptr<Transport> inner,
+                   std::shared_ptr<WireCapture> capture,
+                   uint32_t connection)
+      : m_inner(std::move(inner)),
+        m_capture(std::move(capture)),
+        m_connection(connection) {}
+
+  void connect() override { m_inner->connect(); }
+  void shutdown() override { m_inner->shutdown(); }
+
+  void write(const uint8_t* head,
+             size_t head_n,
+             const uint8_t* body,
+             size_t body_n) override {
+    m_inner->write(head, head_n, body, body_n);
+    m_capture->append(m_connection, WireCapture::Direction::Sent, head, head_n,
+                      body, body_n);
+  }
+
+  size_t read_some(uint8_t* buf, size_t n) override {
+    size_t n_read = m_inner->read_some(buf, n);
+    if (n_read > 0) {
+      m_capture->append(m_connection, WireCapture::Direction::Received, buf,
+                        n_read);
+    }
+    return n_read;
+  }
+
+ private:
+  std::unique_ptr<Transport> m_inner;
+  std::shared_ptr<WireCapture> m_capture;
+  uint32_t m_connection;
+};
+
+}  // namespace
+
+constexpr char WireCapture::MAGIC[8];
+
+WireCapture::WireCapture(const std::string& path)
+    : m_start(std::chrono::steady_clock::now()) {
+  m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (m_fd < 0) {
+    throw std::runtime_error("Cannot open capture file " + path + ": " +
+                             std::strerror(errno));
+  }
+  m_buffer.reserve(BUFFER_SIZE);
+  m_buffer.insert(m_buffer.end(), MAGIC, MAGIC + sizeof(MAGIC));
+}
+
+WireCapture::~WireCapture() {
+  try {
+    flush();
+  } catch (const std::exception&) {
+    // Nowhere left to report it
+  }
+  ::close(m_fd);
+}
+
+std::shared_ptr<WireCapture> WireCapture::from_environment() {
+  static const std::shared_ptr<WireCapture> capture = [] {
+    const char* path = std::getenv("MESSAGEU_CAPTURE");
+    return path && *path ? std::make_shared<WireCapture>(path) : nullptr;
+  }();
+  return capture;
+}
+
+std::vector<WireCapture::Record> WireCapture::load(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in)
+    throw std::runtime_error("Cannot open capture file " + path);
+  std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)),
+                             std::istreambuf_iterator<char>());
+  if (bytes.size() < sizeof(MAGIC) ||
+      std::memcmp(bytes.data(), MAGIC, sizeof(MAGIC)) != 0) {
+    throw std::runtime_error(path + " is not a wire capture");
+  }
+
+  std::vector<Record> records;
+  size_t pos = sizeof(MAGIC);
+  while (bytes.size() - pos >= RecordHeader::size) {
+    auto [timestamp_ns, connection, direction, size] =
+        RecordHeader::unpack(bytes.data() + pos);
+    pos += RecordHeader::size;
+    if (bytes.size() - pos < size)
+      break;
+    if (direction != static_cast<uint8_t>(Direction::Sent) &&
+        direction != static_cast<uint8_t>(Direction::Received)) {
+      throw std::runtime_error("Corrupt capture record at offset " +
+                               std::to_string(pos - RecordHeader::size));
+    }
+    records.push_back(Record{timestamp_ns, connection,
+                             static_cast<Direction>(direction),
+                             std::vector<uint8_t>(bytes.data() + pos,
+                                                  bytes.data() + pos + size)});
+    pos += size;
+  }
+  return records;
+}
+
+std::unique_ptr<Transport> WireCapture::wrap(
+    std::unique_ptr<Transport> transport) {
+  return std::make_unique<CaptureTransport>(
+      std::move(transport), shared_from_this(), m_next_connection++);
+}
+
+void WireCapture::append(uint32_t connection,
+                         Direction direction,
+                         const uint8_t* head,
+                         size_t head_n,
+                         const uint8_t* body,
+                         size_t body_n) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  uint64_t timestamp_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - m_start)
+          .count();
+  size_t pos = m_buffer.size();
+  m_buffer.resize(pos + RecordHeader::size);
+  RecordHeader::pack(m_buffer.data() + pos, timestamp_ns, connection,
+                     static_cast<uint8_t>(direction),
+                     static_cast<uint32_t>(head_n + body_n));
+
+  // Large writes, e.g. file chunks, skip the buffer
+  if (head_n + body_n >= BUFFER_SIZE) {
+    write_buffer();
+    write_fully(m_fd, head, head_n);
+    if (body_n)
+      write_fully(m_fd, body, body_n);
+    return;
+  }
+  m_buffer.insert(m_buffer.end(), head, head + head_n);
+  if (body_n)
+    m_buffer.insert(m_buffer.end(), body, body + body_n);
+  if (m_buffer.size() >= BUFFER_SIZE)
+    write_buffer();
+}
+
+void WireCapture::flush() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  write_buffer();
+}
+
+void WireCapture::write_buffer() {
+  write_fully(m_fd, m_buffer.data(), m_buffer.size());
+  m_buffer.clear();
+}
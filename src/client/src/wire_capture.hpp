@@ -0,0 +1,82 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "protocol_schema.hpp"
+#include "transport.hpp"
+
+// Binary log of the bytes exchanged on every connection of a process, for
+// replaying production-shaped traffic offline (bench/wire_replay.cpp).
+//
+// Set MESSAGEU_CAPTURE=<file> and every TcpClient created afterwards logs to
+// that file; connections are told apart by a per-process id. Each write and
+// each read is one record, so sent records are whole frames (or a pipelined
+// batch of them) while received frames may span several records and are
+// reassembled by reading the connection's records in order.
+//
+// File layout, integers big-endian:
+//   MAGIC
+//   [TIMESTAMP_NS:8][CONNECTION:4][DIRECTION:1][SIZE:4], then SIZE bytes
+// Timestamps are steady-clock nanoseconds since the capture was opened.
+//
+// Records are buffered in memory and written out in large blocks, so a
+// process that dies without unwinding loses the tail of its capture.
+class WireCapture : public std::enable_shared_from_this<WireCapture> {
+ public:
+  enum class Direction : uint8_t { Sent = 'S', Received = 'R' };
+  struct Record {
+    uint64_t timestamp_ns;
+    uint32_t connection;
+    Direction direction;
+    std::vector<uint8_t> data;
+  };
+  using RecordHeader = schema::Layout<schema::U64, schema::U32, schema::U8,
+                                      schema::U32>;
+  static constexpr char MAGIC[8] = {'M', 'U', 'W', 'I', 'R', 'E', '0', '1'};
+
+  // Truncates or creates `path`. Throws if it cannot be opened.
+  explicit WireCapture(const std::string& path);
+  // Writes out whatever is still buffered
+  ~WireCapture();
+  WireCapture(const WireCapture& other) = delete;
+  WireCapture& operator=(const WireCapture& other) = delete;
+
+  // The capture named by MESSAGEU_CAPTURE, opened on first use and shared by
+  // the whole process. Null when the variable is not set.
+  static std::shared_ptr<WireCapture> from_environment();
+
+  // Reads every record of a capture file. Throws if it is not one; a record
+  // cut short at the end of the file is dropped.
+  static std::vector<Record> load(const std::string& path);
+
+  // Returns `transport` wrapped so that everything written to and read from
+  // it is logged under a new connection id. The capture must be owned by a
+  // shared_ptr, which the wrapper keeps alive.
+  std::unique_ptr<Transport> wrap(std::unique_ptr<Transport> transport);
+
+  // Logs head followed by body as one record. Thread safe.
+  void append(uint32_t connection,
+              Direction direction,
+              const uint8_t* head,
+              size_t head_n,
+              const uint8_t* body = nullptr,
+              size_t body_n = 0);
+  void flush();
+
+ private:
+  static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+  void write_buffer();
+
+  int m_fd = -1;
+  std::chrono::steady_clock::time_point m_start;
+  std::atomic<uint32_t> m_next_connection{1};
+  std::mutex m_mutex;
+  std::vector<uint8_t> m_buffer;
+};
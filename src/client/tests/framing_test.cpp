@@ -0,0 +1,186 @@
+// Unit tests of the version 2 framing: varints and RequestEncoder.
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "framing.hpp"
+#include "protocol_schema.hpp"
+
+namespace {
+
+using ClientId = std::array<uint8_t, schema::UUID_SIZE>;
+
+void check(bool condition, const std::string& what) {
+  if (!condition)
+    throw std::runtime_error(what);
+}
+
+bool throws(const std::vector<uint8_t>& bytes) {
+  uint32_t value;
+  try {
+    framing::get_varint(bytes.data(), bytes.size(), value);
+  } catch (const std::runtime_error&) {
+    return true;
+  }
+  return false;
+}
+
+void test_varint_round_trip() {
+  const uint32_t values[] = {0,          1,          0x7f,       0x80,
+                             0x3fff,     0x4000,     0x1fffff,   0x200000,
+                             0xfffffff,  0x10000000, UINT32_MAX};
+  for (uint32_t value : values) {
+    uint8_t buf[framing::MAX_VARINT_SIZE];
+    size_t size = framing::put_varint(buf, value);
+    uint32_t decoded = 0;
+    check(framing::get_varint(buf, size, decoded) == size,
+          "size of " + std::to_string(value));
+    check(decoded == value, "value of " + std::to_string(value));
+    // Cut short, it is not decoded yet
+    check(framing::get_varint(buf, size - 1, decoded) == 0,
+          "partial " + std::to_string(value));
+  }
+}
+
+void test_varint_rejects() {
+  check(throws({0x80, 0x80, 0x80, 0x80, 0x80}), "5 continuation bytes");
+  check(throws({0x80, 0x80, 0x80, 0x80, 0x80, 0x00}), "6 byte varint");
+  // 2^32, one past UINT32_MAX
+  check(throws({0x80, 0x80, 0x80, 0x80, 0x10}), "33 bit value");
+  check(!throws({0xff, 0xff, 0xff, 0xff, 0x0f}), "UINT32_MAX");
+}
+
+struct Frame {
+  ClientId id;
+  uint16_t code;
+  std::vector<uint8_t> payload;
+};
+
+std::vector<uint8_t> v1_stream(const std::vector<Frame>& frames) {
+  std::vector<uint8_t> stream;
+  for (const Frame& frame : frames) {
+    size_t pos = stream.size();
+    stream.resize(pos + schema::RequestHeader::size);
+    schema::RequestHeader::pack(stream.data() + pos, frame.id, framing::V1,
+                                frame.code,
+                                static_cast<uint32_t>(frame.payload.size()));
+    stream.insert(stream.end(), frame.payload.begin(), frame.payload.end());
+  }
+  return stream;
+}
+
+std::vector<uint8_t> join(
+    const std::vector<framing::RequestEncoder::Segment>& segments) {
+  std::vector<uint8_t> out;
+  for (const auto& segment : segments)
+    out.insert(out.end(), segment.data, segment.data + segment.size);
+  return out;
+}
+
+ClientId make_id(uint8_t seed) {
+  ClientId id;
+  for (size_t i = 0; i < id.size(); ++i)
+    id[i] = static_cast<uint8_t>(seed + i);
+  return id;
+}
+
+std::vector<Frame> sample_frames() {
+  return {{make_id(1), 601, {}},
+          {make_id(1), 603, std::vector<uint8_t>(300, 0xab)},
+          {make_id(2), 602, std::vector<uint8_t>(16, 0x01)},
+          {make_id(1), 604, {}}};
+}
+
+void test_split_headers() {
+  std::vector<uint8_t> stream = v1_stream(sample_frames());
+  framing::RequestEncoder whole;
+  std::vector<uint8_t> expected = join(whole.encode(stream.data(),
+                                                    stream.size(), nullptr, 0));
+
+  // Every split point, as head and body of one call and as two calls
+  for (size_t split = 0; split <= stream.size(); ++split) {
+    framing::RequestEncoder one_call;
+    check(join(one_call.encode(stream.data(), split, stream.data() + split,
+                               stream.size() - split)) == expected,
+          "head/body split at " + std::to_string(split));
+
+    framing::RequestEncoder two_calls;
+    std::vector<uint8_t> out =
+        join(two_calls.encode(stream.data(), split, nullptr, 0));
+    std::vector<uint8_t> rest = join(two_calls.encode(
+        nullptr, 0, stream.data() + split, stream.size() - split));
+    out.insert(out.end(), rest.begin(), rest.end());
+    check(out == expected, "two calls split at " + std::to_string(split));
+  }
+
+  // A byte at a time
+  framing::RequestEncoder bytewise;
+  std::vector<uint8_t> out;
+  for (uint8_t byte : stream) {
+    std::vector<uint8_t> piece = join(bytewise.encode(&byte, 1, nullptr, 0));
+    out.insert(out.end(), piece.begin(), piece.end());
+  }
+  check(out == expected, "byte at a time");
+}
+
+void test_token_bind_and_reuse() {
+  std::vector<Frame> frames = sample_frames();
+  std::vector<uint8_t> stream = v1_stream(frames);
+  framing::RequestEncoder encoder;
+  std::vector<uint8_t> out =
+      join(encoder.encode(stream.data(), stream.size(), nullptr, 0));
+
+  // The first frame of an id binds the next token, later ones reuse it
+  const uint32_t tokens[] = {0, 0, 1, 0};
+  const bool binds[] = {true, false, true, false};
+  size_t pos = 0;
+  for (size_t i = 0; i < frames.size(); ++i) {
+    std::string frame = "frame " + std::to_string(i);
+    uint32_t session, code, payload_size;
+    pos += framing::get_varint(out.data() + pos, out.size() - pos, session);
+    check(session >> 1 == tokens[i], frame + " token");
+    check((session & 1) == binds[i], frame + " bind");
+    if (binds[i]) {
+      check(std::equal(frames[i].id.begin(), frames[i].id.end(),
+                       out.begin() + pos),
+            frame + " bound id");
+      pos += schema::UUID_SIZE;
+    }
+    pos += framing::get_varint(out.data() + pos, out.size() - pos, code);
+    pos += framing::get_varint(out.data() + pos, out.size() - pos,
+                               payload_size);
+    check(code == frames[i].code, frame + " code");
+    check(payload_size == frames[i].payload.size(), frame + " payload size");
+    check(std::equal(frames[i].payload.begin(), frames[i].payload.end(),
+                     out.begin() + pos),
+          frame + " payload");
+    pos += payload_size;
+  }
+  check(pos == out.size(), "trailing bytes");
+}
+
+}  // namespace
+
+int main() {
+  const std::pair<const char*, void (*)()> tests[] = {
+      {"varint_round_trip", test_varint_round_trip},
+      {"varint_rejects", test_varint_rejects},
+      {"split_headers", test_split_headers},
+      {"token_bind_and_reuse", test_token_bind_and_reuse},
+  };
+  int failed = 0;
+  for (const auto& [name, test] : tests) {
+    try {
+      test();
+      std::cout << "ok    " << name << "\n";
+    } catch (const std::exception& e) {
+      std::cout << "FAIL  " << name << ": " << e.what() << "\n";
+      ++failed;
+    }
+  }
+  return failed ? 1 : 0;
+}
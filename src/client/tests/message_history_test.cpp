@@ -0,0 +1,289 @@
+// Unit tests of MessageHistory: reopening, and recovering from a log or
+// index cut short, a corrupt block size, an altered block or the wrong
+// identity.
+#include <unistd.h>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "crypto_backend/crypto_backend.hpp"
+#include "cryptopp_wrapper/RSAWrapper.h"
+#include "model/message_history.hpp"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+void check(bool condition, const std::string& what) {
+  if (!condition)
+    throw std::runtime_error(what);
+}
+
+// A fresh directory per test, removed afterwards
+class TempDir {
+ public:
+  explicit TempDir(const std::string& name)
+      : m_path(fs::temp_directory_path() /
+               ("messageu_history_test_" + std::to_string(getpid()) + "_" +
+                name)) {
+    fs::remove_all(m_path);
+    fs::create_directories(m_path);
+  }
+  ~TempDir() {
+    std::error_code ec;
+    fs::remove_all(m_path, ec);
+  }
+  std::string file(const std::string& name) const {
+    return (m_path / name).string();
+  }
+
+ private:
+  fs::path m_path;
+};
+
+MessageHistory::ClientId peer_id(uint8_t seed) {
+  MessageHistory::ClientId id{};
+  id.fill(seed);
+  return id;
+}
+
+// `count` messages with `peer`, their contents tagged with `batch`
+std::vector<MessageHistory::Entry> make_batch(int batch, int count,
+                                              uint8_t peer) {
+  std::vector<MessageHistory::Entry> entries;
+  for (int i = 0; i < count; ++i) {
+    MessageHistory::Entry entry;
+    entry.time_ms = 1000 * batch + i;
+    entry.peer = peer_id(peer);
+    entry.peer_name = "peer" + std::to_string(peer);
+    entry.message_id = static_cast<uint32_t>(100 * batch + i);
+    entry.type = 3;
+    entry.outgoing = i % 2 == 0;
+    entry.content = "batch " + std::to_string(batch) + " message " +
+                    std::to_string(i);
+    entries.push_back(std::move(entry));
+  }
+  return entries;
+}
+
+std::vector<std::string> contents(
+    const std::vector<MessageHistory::Entry>& entries) {
+  std::vector<std::string> out;
+  for (const auto& entry : entries)
+    out.push_back(entry.content);
+  return out;
+}
+
+std::vector<std::string> expected_contents(int batches, int count) {
+  std::vector<std::string> out;
+  for (int batch = 0; batch < batches; ++batch) {
+    for (const auto& entry : make_batch(batch, count, 1))
+      out.push_back(entry.content);
+  }
+  return out;
+}
+
+struct Sizes {
+  uint64_t log;
+  uint64_t index;
+};
+
+// Appends `batches` batches of 3 messages, returning the file sizes after
+// each one
+std::vector<Sizes> write_batches(const std::string& path,
+                                 RSAPrivateWrapper& key,
+                                 int batches) {
+  MessageHistory history(path, key);
+  std::vector<Sizes> sizes;
+  for (int batch = 0; batch < batches; ++batch) {
+    history.append(make_batch(batch, 3, 1));
+    sizes.push_back({fs::file_size(path), fs::file_size(path + ".idx")});
+  }
+  return sizes;
+}
+
+void flip_byte(const std::string& path, uint64_t offset) {
+  std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+  file.seekg(offset);
+  char byte = 0;
+  file.read(&byte, 1);
+  byte ^= 0x40;
+  file.seekp(offset);
+  file.write(&byte, 1);
+}
+
+RSAPrivateWrapper& identity() {
+  static RSAPrivateWrapper key;
+  return key;
+}
+
+void test_reopen() {
+  TempDir dir("reopen");
+  std::string path = dir.file("history");
+  write_batches(path, identity(), 2);
+
+  MessageHistory history(path, identity());
+  history.append(make_batch(2, 3, 1));
+  history.append(make_batch(3, 1, 2));
+  check(contents(history.query({})) ==
+            [] {
+              std::vector<std::string> all = expected_contents(3, 3);
+              all.push_back(make_batch(3, 1, 2)[0].content);
+              return all;
+            }(),
+        "all entries after reopening");
+  MessageHistory::Query by_peer;
+  by_peer.peer = peer_id(2);
+  check(history.query(by_peer).size() == 1, "query by peer");
+  auto found = history.find(peer_id(1), 201);
+  check(found && found->content == "batch 2 message 1", "find");
+}
+
+void test_truncated_log_tail() {
+  TempDir dir("truncated_log");
+  std::string path = dir.file("history");
+  std::vector<Sizes> sizes = write_batches(path, identity(), 3);
+  // A crash in the middle of the last block
+  fs::resize_file(path, sizes[2].log - 5);
+
+  {
+    MessageHistory history(path, identity());
+    check(history.size() == 6, "the cut batch is dropped");
+    check(contents(history.query({})) == expected_contents(2, 3),
+          "the whole batches are kept");
+    check(fs::file_size(path) == sizes[1].log, "log truncated to whole blocks");
+    history.append(make_batch(2, 3, 1));
+  }
+  MessageHistory history(path, identity());
+  check(contents(history.query({})) == expected_contents(3, 3),
+        "appending after recovery");
+}
+
+void test_corrupt_block_size() {
+  TempDir dir("corrupt_size");
+  std::string path = dir.file("history");
+  std::vector<Sizes> sizes = write_batches(path, identity(), 3);
+  // The last block was not indexed yet, and the cipher size right after its
+  // IV now says close to 4 GiB
+  fs::resize_file(path + ".idx", sizes[1].index);
+  {
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(sizes[1].log + 16);
+    file.write("\xff\xff\xff\xf0", 4);
+  }
+
+  MessageHistory history(path, identity());
+  check(contents(history.query({})) == expected_contents(2, 3),
+        "the block is dropped like one cut short");
+  check(fs::file_size(path) == sizes[1].log, "log truncated to whole blocks");
+}
+
+void test_index_missing_last_block() {
+  TempDir dir("index_missing");
+  std::string path = dir.file("history");
+  std::vector<Sizes> sizes = write_batches(path, identity(), 3);
+  // The crash came between the log block and its index block
+  fs::resize_file(path + ".idx", sizes[1].index);
+
+  {
+    MessageHistory history(path, identity());
+    check(history.size() == 9, "the log block is indexed again");
+    check(contents(history.query({})) == expected_contents(3, 3),
+          "entries of the reindexed block");
+    check(fs::file_size(path + ".idx") == sizes[2].index,
+          "index block rewritten");
+  }
+  // Cut inside the index block instead
+  fs::resize_file(path + ".idx", sizes[2].index - 3);
+  MessageHistory history(path, identity());
+  check(contents(history.query({})) == expected_contents(3, 3),
+        "index block cut short");
+}
+
+void test_altered_block() {
+  TempDir dir("altered");
+  std::string path = dir.file("history");
+  std::vector<Sizes> sizes = write_batches(path, identity(), 3);
+  // Inside the cipher of the second log block
+  flip_byte(path, sizes[0].log + 24);
+
+  MessageHistory history(path, identity());
+  MessageHistory::Query first;
+  first.to_ms = 1000;
+  check(history.query(first).size() == 3, "other blocks still read");
+  bool rejected = false;
+  try {
+    history.query({});
+  } catch (const std::runtime_error&) {
+    rejected = true;
+  }
+  check(rejected, "the altered block fails its MAC");
+}
+
+void test_other_identity() {
+  TempDir dir("other_identity");
+  std::string path = dir.file("history");
+  write_batches(path, identity(), 1);
+
+  RSAPrivateWrapper other;
+  std::string error;
+  try {
+    MessageHistory history(path, other);
+  } catch (const std::runtime_error& e) {
+    error = e.what();
+  }
+  check(error.find("another identity") != std::string::npos,
+        "opening with another key fails: " + error);
+  // Untouched, the right key still opens it
+  MessageHistory history(path, identity());
+  check(history.size() == 3, "history kept");
+}
+
+void test_hmac_backends() {
+  // RFC 4231, test case 2
+  const std::string key = "Jefe";
+  const std::string data = "what do ya want for nothing?";
+  const std::string expected =
+      "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843";
+  for (const std::string& name : available_crypto_backends()) {
+    std::string tag = make_crypto_backend(name)->hmac_sha256(
+        reinterpret_cast<const unsigned char*>(key.data()), key.size(),
+        reinterpret_cast<const unsigned char*>(data.data()), data.size());
+    std::string hex;
+    for (unsigned char c : tag) {
+      const char digits[] = "0123456789abcdef";
+      hex += digits[c >> 4];
+      hex += digits[c & 0xf];
+    }
+    check(hex == expected, name + " HMAC-SHA-256");
+  }
+}
+
+}  // namespace
+
+int main() {
+  const std::pair<const char*, void (*)()> tests[] = {
+      {"reopen", test_reopen},
+      {"truncated_log_tail", test_truncated_log_tail},
+      {"corrupt_block_size", test_corrupt_block_size},
+      {"index_missing_last_block", test_index_missing_last_block},
+      {"altered_block", test_altered_block},
+      {"other_identity", test_other_identity},
+      {"hmac_backends", test_hmac_backends},
+  };
+  int failed = 0;
+  for (const auto& [name, test] : tests) {
+    try {
+      test();
+      std::cout << "ok    " << name << "\n";
+    } catch (const std::exception& e) {
+      std::cout << "FAIL  " << name << ": " << e.what() << "\n";
+      ++failed;
+    }
+  }
+  return failed ? 1 : 0;
+}
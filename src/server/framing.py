@@ -0,0 +1,121 @@
+import struct
+from protocol_constants import UUID_SIZE
+
+# Request and reply headers of a connection, version 1 until the client asks
+# for more with FRAMING_REQUEST. Version 2 headers are varints (unsigned
+# LEB128):
+#   request  [SESSION][CLIENT_ID if bound][CODE][PAYLOAD_SIZE]
+#   reply    [CODE][PAYLOAD_SIZE]
+# SESSION is token << 1 | bind; the client numbers the ids it uses on the
+# connection from 0 and sends an id once, with bind set, then only its token.
+V1 = 1
+V2 = 2
+MAX_VERSION = V2
+
+V1_HEADER_FORMAT = f'!{UUID_SIZE}sBHI'
+V1_HEADER_SIZE = struct.calcsize(V1_HEADER_FORMAT)
+MAX_VARINT_SIZE = 5
+READ_SIZE = 1 << 16
+
+
+def encode_varint(value):
+    out = bytearray()
+    while value >= 0x80:
+        out.append(value & 0x7f | 0x80)
+        value >>= 7
+    out.append(value)
+    return bytes(out)
+
+
+class ConnectionClosed(Exception):
+    pass
+
+
+class Framing:
+    """Reads the requests of one connection and builds its reply headers.
+
+    Reads are buffered, so pipelined small requests cost one recv for many
+    frames."""
+
+    def __init__(self, conn):
+        self.conn = conn
+        self.version = V1
+        self.tokens = {}  # token -> client id, version 2 only
+        self.buffer = bytearray()
+        self.pos = 0
+
+    def _fill(self):
+        del self.buffer[:self.pos]
+        self.pos = 0
+        chunk = self.conn.recv(READ_SIZE)
+        if not chunk:
+            raise ConnectionClosed()
+        self.buffer += chunk
+
+    def read_exact(self, n):
+        while len(self.buffer) - self.pos < n:
+            self._fill()
+        data = bytes(self.buffer[self.pos:self.pos + n])
+        self.pos += n
+        return data
+
+    def read_into(self, view):
+        """Fills the memoryview, buffered bytes first, then straight from
+        the connection so that large payloads are not copied twice."""
+        buffered = min(len(view), len(self.buffer) - self.pos)
+        view[:buffered] = self.buffer[self.pos:self.pos + buffered]
+        self.pos += buffered
+        received = buffered
+        while received < len(view):
+            n = self.conn.recv_into(view[received:],
+                                    min(len(view) - received, READ_SIZE))
+            if not n:
+                raise ConnectionClosed()
+            received += n
+
+    def copy_to(self, out, n):
+        """Moves the next n bytes into the file `out`, or drops them when
+        `out` is None, a chunk at a time."""
+        chunk = memoryview(bytearray(min(n, READ_SIZE)))
+        while n:
+            size = min(n, len(chunk))
+            self.read_into(chunk[:size])
+            if out is not None:
+                out.write(chunk[:size])
+            n -= size
+
+    def read_varint(self):
+        value = 0
+        for i in range(MAX_VARINT_SIZE):
+            if self.pos == len(self.buffer):
+                self._fill()
+            byte = self.buffer[self.pos]
+            self.pos += 1
+            value |= (byte & 0x7f) << (7 * i)
+            if not byte & 0x80:
+                if value > 0xffffffff:
+                    raise ValueError("Varint does not fit 32 bits")
+                return value
+        raise ValueError("Varint longer than 5 bytes")
+
+    def read_header(self):
+        """(client_id, version, code, payload_size) of the next request.
+        Raises ConnectionClosed when the client is gone."""
+        if self.version == V1:
+            return struct.unpack(V1_HEADER_FORMAT,
+                                 self.read_exact(V1_HEADER_SIZE))
+        session = self.read_varint()
+        token = session >> 1
+        if session & 1:
+            self.tokens[token] = self.read_exact(UUID_SIZE)
+        client_id = self.tokens.get(token)
+        if client_id is None:
+            raise ValueError(f"Unknown session token {token}")
+        code = self.read_varint()
+        payload_size = self.read_varint()
+        return client_id, self.version, code, payload_size
+
+    def reply_header(self, code, payload_size):
+        if self.version == V1:
+            return struct.pack('!BHI', V1, code, payload_size)
+        return encode_varint(code) + encode_varint(payload_size)
@@ -3,8 +3,14 @@ UUID_SIZE = 16
 PUBLIC_KEY_SIZE = 160
 CLIENT_NAME_SIZE = 255
 PACKED_CLIENT_ENTRY_SIZE = UUID_SIZE + CLIENT_NAME_SIZE
+# client id, name, public key
+LOOKUP_ENTRY_SIZE = UUID_SIZE + CLIENT_NAME_SIZE + PUBLIC_KEY_SIZE
 REGISTER_REPLY_SIZE = UUID_SIZE + 7  # header + uuid
 RESPONSE_HEADER_SIZE = 7
+# client id, message id, message type, message size
+PENDING_RECORD_HEADER_SIZE = UUID_SIZE + 9
+# Message type whose content is a file, spooled to disk rather than memory
+FILE_MESSAGE_TYPE = 5
 
 
 class Code:
@@ -13,10 +19,19 @@ class Code:
     PUBLIC_KEY_REQUEST = 602
     SEND_MESSAGE_REQUEST = 603
     PENDING_MESSAGE_REQUEST = 604
+    SUBSCRIBE = 605
+    PENDING_MESSAGE_PAGE_REQUEST = 606
+    CLIENT_LOOKUP_REQUEST = 607
+    FRAMING_REQUEST = 608
 
     REGISTER_REPLY = 2100
     CLIENT_LIST_REPLY = 2101
     PUBLIC_KEY_REPLY = 2102
     SEND_MESSAGE_REPLY = 2103
     PENDING_MESSAGE_REPLY = 2104
+    SUBSCRIBE_REPLY = 2105
+    PUSHED_MESSAGE = 2106
+    PENDING_MESSAGE_PAGE_REPLY = 2107
+    CLIENT_LOOKUP_REPLY = 2108
+    FRAMING_REPLY = 2109
     ERROR = 9000
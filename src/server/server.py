@@ -1,28 +1,96 @@
+import argparse
+import os
 import socket
 import threading
 from server_model import ServerModel
 from server_view import ServerView
 from server_controller import ServerController
+from shm_connection import ShmConnection, shm_supported
+from framing import V1, MAX_VERSION as MAX_FRAMING
 
 HOST = '0.0.0.0'
 
 
+def listen_unix(path):
+    # A stale socket file from a previous run would make bind fail
+    if os.path.exists(path):
+        os.unlink(path)
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.bind(path)
+    s.listen()
+    return s
+
+
+def serve_shm(controller, conn):
+    shm_conn = ShmConnection.accept(conn)
+    if shm_conn is not None:
+        controller.handle_client(shm_conn)
+
+
+def accept_loop(s, target):
+    while True:
+        conn, addr = s.accept()
+        threading.Thread(target=target,
+                         args=(conn,), daemon=True).start()
+
+
 def main():
+    parser = argparse.ArgumentParser(description="MessageU server")
+    parser.add_argument('--unix', metavar='PATH',
+                        help="also listen on a Unix domain socket "
+                             "(clients use unix:PATH in server.info)")
+    parser.add_argument('--shm', metavar='PATH',
+                        help="also accept shared-memory clients, set up "
+                             "through this Unix socket (shm:PATH)")
+    parser.add_argument('--shard', metavar='INDEX/COUNT',
+                        help="serve shard INDEX of COUNT: registrations get "
+                             "ids that clients route to this shard. State is "
+                             "in memory, so run one server per shard")
+    parser.add_argument('--max-framing', metavar='VERSION', type=int,
+                        default=MAX_FRAMING,
+                        help="highest framing version to agree on; 1 "
+                             "refuses negotiation like older servers")
+    args = parser.parse_args()
+    if not V1 <= args.max_framing <= MAX_FRAMING:
+        parser.error(f"--max-framing must be {V1} to {MAX_FRAMING}")
+
+    shard = (0, 1)
+    if args.shard:
+        try:
+            index, count = (int(n) for n in args.shard.split('/'))
+        except ValueError:
+            parser.error("--shard takes INDEX/COUNT, e.g. 0/2")
+        if count < 1 or not 0 <= index < count:
+            parser.error("--shard INDEX must be below COUNT")
+        shard = (index, count)
+
     model = ServerModel()
     view = ServerView()
-    controller = ServerController(model, view)
+    controller = ServerController(model, view, shard, args.max_framing)
 
     port = model.get_port_from_file()
 
+    if args.unix:
+        s = listen_unix(args.unix)
+        view.log(f"Server listening on unix:{args.unix}")
+        threading.Thread(target=accept_loop,
+                         args=(s, controller.handle_client),
+                         daemon=True).start()
+    if args.shm:
+        if not shm_supported():
+            parser.error("--shm is only supported on x86 hosts")
+        s = listen_unix(args.shm)
+        view.log(f"Server accepting shared-memory clients on shm:{args.shm}")
+        threading.Thread(target=accept_loop,
+                         args=(s, lambda conn: serve_shm(controller, conn)),
+                         daemon=True).start()
+
     with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
         s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
         s.bind((HOST, port))
         s.listen()
         view.log(f"Server listening on {HOST}:{port}")
-        while True:
-            conn, addr = s.accept()
-            threading.Thread(target=controller.handle_client,
-                             args=(conn,), daemon=True).start()
+        accept_loop(s, controller.handle_client)
 
 
 if __name__ == "__main__":
@@ -1,46 +1,183 @@
 
 import struct
 import os
-from server_model import Client, ServerModel, Message
+import tempfile
+from server_model import Client, ServerModel, Message, CONTENT_CHUNK_SIZE
 from server_view import ServerView
-from protocol_constants import UUID_SIZE, PUBLIC_KEY_SIZE, CLIENT_NAME_SIZE, PACKED_CLIENT_ENTRY_SIZE, REGISTER_REPLY_SIZE, RESPONSE_HEADER_SIZE, Code
+from framing import Framing, ConnectionClosed, V1 as MIN_FRAMING, MAX_VERSION as MAX_FRAMING
+from protocol_constants import UUID_SIZE, PUBLIC_KEY_SIZE, CLIENT_NAME_SIZE, PACKED_CLIENT_ENTRY_SIZE, REGISTER_REPLY_SIZE, RESPONSE_HEADER_SIZE, PENDING_RECORD_HEADER_SIZE, FILE_MESSAGE_TYPE, Code
 
-HEADER_FORMAT = f'!{UUID_SIZE}sBHI'
-HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
 REGISTER_PAYLOAD_FORMAT = f'!{CLIENT_NAME_SIZE}s{PUBLIC_KEY_SIZE}s'
 REGISTER_PAYLOAD_SIZE = struct.calcsize(REGISTER_PAYLOAD_FORMAT)
-
-ERROR_RESPONSE_BYTES = struct.pack('!BHI', 1, Code.ERROR, 0)
+PAGE_REQUEST_FORMAT = '!II'
+PAGE_REQUEST_SIZE = struct.calcsize(PAGE_REQUEST_FORMAT)
+# dst_id (16s), msg_type (B), content_size (I), then the content
+MSG_HEADER_FORMAT = f'!{UUID_SIZE}sBI'
+MSG_HEADER_SIZE = struct.calcsize(MSG_HEADER_FORMAT)
+# client id (16s), message id (I), message type (B), message size (I)
+RECORD_FORMAT = f'!{UUID_SIZE}sIBI'
 
 
 class ServerController:
-    def __init__(self, model: ServerModel, view: ServerView):
+    def __init__(self, model: ServerModel, view: ServerView, shard=(0, 1),
+                 max_framing=MAX_FRAMING):
         self.model = model
         self.view = view
+        self.shard_index, self.shard_count = shard
+        self.max_framing = max_framing
+
+    def new_client_id(self):
+        """Random id of this server's shard, as clients route them: the
+        leading 32 bits, big-endian, modulo the shard count."""
+        while True:
+            client_id = os.urandom(UUID_SIZE)
+            if int.from_bytes(client_id[:4], 'big') % self.shard_count == \
+                    self.shard_index:
+                return client_id
 
     def handle_client(self, conn):
+        try:
+            self.serve_client(conn)
+        finally:
+            self.model.unsubscribe(conn)
+            conn.close()
+
+    @staticmethod
+    def records_size(msgs):
+        return sum(PENDING_RECORD_HEADER_SIZE + msg.size for msg in msgs)
+
+    @staticmethod
+    def send_messages(sendall, prefix, msgs):
+        """Sends `prefix`, then a record per message. Small contents are
+        batched with the record headers; large and spooled ones go out on
+        their own, without being copied."""
+        out = bytearray(prefix)
+        for msg in msgs:
+            out += struct.pack(RECORD_FORMAT, msg.from_client, msg.msg_id,
+                               msg.msg_type, msg.size)
+            if msg.spooled or msg.size > CONTENT_CHUNK_SIZE:
+                sendall(out)
+                out = bytearray()
+                msg.write_content(sendall)
+            else:
+                out += msg.content
+        if out:
+            sendall(out)
+
+    def deliver(self, framing, code, prefix, msgs):
+        """Sends taken messages as one reply, then frees them."""
+        header = framing.reply_header(
+            code, len(prefix) + self.records_size(msgs))
+        try:
+            self.send_messages(framing.conn.sendall, header + prefix, msgs)
+        finally:
+            for msg in msgs:
+                msg.discard()
+
+    def push_message(self, subscriber, msg: Message):
+        """Delivers a queued message over a subscription, True on success."""
+        if not self.model.take_message(msg):
+            return True  # already fetched through PENDING_MESSAGE_REQUEST
+        header = subscriber.framing.reply_header(
+            Code.PUSHED_MESSAGE, self.records_size([msg]))
+        try:
+            with subscriber.send_lock:
+                self.send_messages(subscriber.conn.sendall, header, [msg])
+        except OSError as e:
+            self.view.log(f"Push failed, message stays queued: {e}")
+            self.model.unsubscribe(subscriber.conn)
+            self.model.requeue_message(msg)
+            return False
+        msg.discard()
+        return True
+
+    def receive_message(self, framing, client_id, payload_size):
+        """Reads a SEND_MESSAGE_REQUEST payload into a queued Message, or
+        returns None if it is malformed. Files are spooled to a temporary
+        file a chunk at a time, other contents read into one buffer."""
+        if payload_size < MSG_HEADER_SIZE:
+            return None
+        dst_id, msg_type, content_size = struct.unpack(
+            MSG_HEADER_FORMAT, framing.read_exact(MSG_HEADER_SIZE))
+        remaining = payload_size - MSG_HEADER_SIZE
+        content_size = min(content_size, remaining)
+        if msg_type == FILE_MESSAGE_TYPE:
+            content = tempfile.TemporaryFile()
+            framing.copy_to(content, content_size)
+            size = content_size
+        else:
+            content = bytearray(content_size)
+            framing.read_into(memoryview(content))
+            size = None
+        # Bytes past the declared content are dropped
+        framing.copy_to(None, remaining - content_size)
+        msg = Message(
+            msg_id=0,  # will be set by add_message
+            to_client=dst_id,
+            from_client=client_id,
+            msg_type=msg_type,
+            content=content,
+            size=size
+        )
+        self.model.add_message(msg)
+        return msg
+
+    def serve_client(self, conn):
         self.view.log("Handling new client connection")
+        framing = Framing(conn)
         while True:
             try:
-                header_bytes = conn.recv(HEADER_SIZE)
-                if not header_bytes or len(header_bytes) < HEADER_SIZE:
+                try:
+                    client_id, version, code, payload_size = \
+                        framing.read_header()
+                except ConnectionClosed:
                     self.view.log(
                         "Received incomplete header, closing connection")
                     return
-
-                client_id, version, code, payload_size = struct.unpack(
-                    HEADER_FORMAT, header_bytes)
                 self.view.log(
                     f"Header: client_id={client_id.hex()}, version={version}, code={code}, payload_size={payload_size}")
 
-                payload = b''
-                while len(payload) < payload_size:
-                    chunk = conn.recv(payload_size - len(payload))
-                    if not chunk:
-                        raise Exception("Incomplete payload")
-                    payload += chunk
+                if code == Code.SEND_MESSAGE_REQUEST:
+                    # Streamed, a file may not fit in memory
+                    msg = self.receive_message(
+                        framing, client_id, payload_size)
+                    if msg is None:
+                        self.view.log("Invalid send message payload size")
+                        conn.sendall(framing.reply_header(Code.ERROR, 0))
+                        return
+                    # Build response: header, then dst_id (16s), msg_id (I)
+                    reply_payload = struct.pack(
+                        f'!{UUID_SIZE}sI', msg.to_client, msg.msg_id)
+                    reply_header = framing.reply_header(
+                        Code.SEND_MESSAGE_REPLY, len(reply_payload))
+                    self.view.log(
+                        f"Send message: saved msg_id={msg.msg_id} for dst={msg.to_client.hex()}")
+                    conn.sendall(reply_header + reply_payload)
+                    # Deliver right away if the recipient is subscribed
+                    subscriber = self.model.get_subscriber(msg.to_client)
+                    if subscriber is not None:
+                        self.push_message(subscriber, msg)
+                    continue
+
+                # The other requests are small
+                payload = framing.read_exact(payload_size)
 
-                if code == Code.REGISTER:
+                if code == Code.FRAMING_REQUEST:
+                    # Answered in the current framing, the new one applies
+                    # from the next frame on
+                    # A client that speaks no version we know stays on the
+                    # current framing, as does any client when limited to
+                    # version 1, like a server that predates negotiation
+                    if payload_size != 1 or payload[0] < MIN_FRAMING or \
+                            self.max_framing <= MIN_FRAMING:
+                        conn.sendall(framing.reply_header(Code.ERROR, 0))
+                        continue
+                    chosen = min(payload[0], self.max_framing)
+                    conn.sendall(framing.reply_header(Code.FRAMING_REPLY, 1) +
+                                 bytes([chosen]))
+                    framing.version = chosen
+                    self.view.log(f"Switched to framing version {chosen}")
+                elif code == Code.REGISTER:
                     if len(payload) != REGISTER_PAYLOAD_SIZE:
                         self.view.log("Invalid register payload size")
                         raise Exception("Invalid register payload size")
@@ -51,13 +188,13 @@ class ServerController:
                     self.view.log(
                         f"Register request: username={username}, public_key={public_key_bytes.hex()[:16]}...")
 
-                    client_uuid = os.urandom(UUID_SIZE)
+                    client_uuid = self.new_client_id()
                     client = Client(client_uuid, username, public_key_bytes)
                     self.model.register_client(client)
 
-                    # Build response: 1 byte version, 2 bytes code (2100), 4 bytes payload_size (UUID_SIZE), UUID_SIZE bytes UUID
-                    resp_header = struct.pack(
-                        '!BHI', 1, Code.REGISTER_REPLY, UUID_SIZE)
+                    # Build response: header (2100, payload_size UUID_SIZE), UUID_SIZE bytes UUID
+                    resp_header = framing.reply_header(
+                        Code.REGISTER_REPLY, UUID_SIZE)
                     resp = resp_header + client_uuid
                     self.view.log("Sending response: " + resp.hex())
                     conn.sendall(resp)
@@ -79,8 +216,8 @@ class ServerController:
                             CLIENT_NAME_SIZE, b'\x00')
                         payload += name_bytes
                     payload_size = len(payload)
-                    resp_header = struct.pack(
-                        '!BHI', 1, Code.CLIENT_LIST_REPLY, payload_size)
+                    resp_header = framing.reply_header(
+                        Code.CLIENT_LIST_REPLY, payload_size)
                     resp = resp_header + payload
                     self.view.log(
                         f"Sending client list response: {len(clients)} clients, payload_size={payload_size}")
@@ -90,18 +227,18 @@ class ServerController:
                     if payload_size != UUID_SIZE:
                         self.view.log(
                             "Invalid public key request payload size")
-                        conn.sendall(ERROR_RESPONSE_BYTES)
+                        conn.sendall(framing.reply_header(Code.ERROR, 0))
                         return
                     requested_id = payload
                     client = self.model.get_client(requested_id)
                     if client is None:
                         self.view.log("Requested client not found")
-                        conn.sendall(ERROR_RESPONSE_BYTES)
+                        conn.sendall(framing.reply_header(Code.ERROR, 0))
                         return
-                    # Build response: 1 byte version, 2 bytes code (2102), 4 bytes payload_size (UUID_SIZE+PUBLIC_KEY_SIZE), UUID_SIZE bytes id, PUBLIC_KEY_SIZE bytes pubkey
+                    # Build response: header (2102, payload_size UUID_SIZE+PUBLIC_KEY_SIZE), UUID_SIZE bytes id, PUBLIC_KEY_SIZE bytes pubkey
                     resp_payload = client.client_id + client.public_key
-                    resp_header = struct.pack(
-                        '!BHI', 1, Code.PUBLIC_KEY_REPLY, len(resp_payload))
+                    resp_header = framing.reply_header(
+                        Code.PUBLIC_KEY_REPLY, len(resp_payload))
                     resp = resp_header + resp_payload
                     self.view.log(
                         f"Sending public key response for client {client.client_id.hex()}")
@@ -109,54 +246,67 @@ class ServerController:
                 elif code == Code.PENDING_MESSAGE_REQUEST:
                     # Gather all pending messages for this client
                     pending = self.model.get_messages_for(client_id)
-                    payload = b''
-                    for msg in pending:
-                        # client id (16s), message id (I), message type (B), message size (I), content
-                        part = struct.pack(
-                            f'!{UUID_SIZE}sIBI', msg.from_client, msg.msg_id, msg.msg_type, len(msg.content))
-                        part += msg.content
-                        payload += part
-                    resp_header = struct.pack(
-                        '!BHI', 1, Code.PENDING_MESSAGE_REPLY, len(payload))
-                    resp = resp_header + payload
                     self.view.log(
-                        f"Sending {len(pending)} pending messages, total payload size={len(payload)}")
-                    conn.sendall(resp)
-                elif code == Code.SEND_MESSAGE_REQUEST:
-                    # Payload struct: dst_id (16s), msg_type (B), content_size (I), content (content_size)s
-                    MSG_HEADER_FORMAT = f'!{UUID_SIZE}sBI'
-                    MSG_HEADER_SIZE = struct.calcsize(MSG_HEADER_FORMAT)
-                    if payload_size < MSG_HEADER_SIZE:
-                        self.view.log("Invalid send message payload size")
-                        conn.sendall(ERROR_RESPONSE_BYTES)
+                        f"Sending {len(pending)} pending messages, total payload size={self.records_size(pending)}")
+                    self.deliver(framing, Code.PENDING_MESSAGE_REPLY, b'',
+                                 pending)
+                elif code == Code.PENDING_MESSAGE_PAGE_REQUEST:
+                    # Payload: max messages (I), max record bytes (I)
+                    if payload_size != PAGE_REQUEST_SIZE:
+                        self.view.log("Invalid pending page request size")
+                        conn.sendall(framing.reply_header(Code.ERROR, 0))
                         return
-                    dst_id, msg_type, content_size = struct.unpack(
-                        MSG_HEADER_FORMAT, payload[:MSG_HEADER_SIZE])
-                    content = payload[MSG_HEADER_SIZE:MSG_HEADER_SIZE+content_size]
-                    # Save message in model
-                    msg = Message(
-                        msg_id=0,  # will be set by add_message
-                        to_client=dst_id,
-                        from_client=client_id,
-                        msg_type=msg_type,
-                        content=content
-                    )
-                    self.model.add_message(msg)
-                    # Build response struct: version (B), code (H), payload_size (I), dst_id (16s), msg_id (I)
-                    REPLY_FORMAT = f'!BHI{UUID_SIZE}sI'
-                    reply_payload = struct.pack(
-                        f'!{UUID_SIZE}sI', dst_id, msg.msg_id)
-                    reply_header = struct.pack(
-                        '!BHI', 1, Code.SEND_MESSAGE_REPLY, struct.calcsize(f'!{UUID_SIZE}sI'))
-                    resp = reply_header + reply_payload
+                    max_count, max_bytes = struct.unpack(
+                        PAGE_REQUEST_FORMAT, payload)
+                    page, more = self.model.take_messages_page(
+                        client_id, max_count, max_bytes)
                     self.view.log(
-                        f"Send message: saved msg_id={msg.msg_id} for dst={dst_id.hex()}")
-                    conn.sendall(resp)
+                        f"Sending page of {len(page)} pending messages, more={more}")
+                    # More-available flag (B), then records as in 2104
+                    self.deliver(framing, Code.PENDING_MESSAGE_PAGE_REPLY,
+                                 struct.pack('!B', more), page)
+                elif code == Code.CLIENT_LOOKUP_REQUEST:
+                    # Payload: client ids (16s each). Reply: id, name and
+                    # public key of those that are registered, in order
+                    if payload_size % UUID_SIZE != 0:
+                        self.view.log("Invalid client lookup request size")
+                        conn.sendall(framing.reply_header(Code.ERROR, 0))
+                        return
+                    payload_out = b''
+                    found = 0
+                    for i in range(0, payload_size, UUID_SIZE):
+                        client = self.model.get_client(
+                            payload[i:i + UUID_SIZE])
+                        if client is None:
+                            continue
+                        name_bytes = client.username.encode(errors='ignore')[
+                            :CLIENT_NAME_SIZE].ljust(CLIENT_NAME_SIZE, b'\x00')
+                        payload_out += client.client_id + name_bytes + \
+                            client.public_key
+                        found += 1
+                    resp_header = framing.reply_header(
+                        Code.CLIENT_LOOKUP_REPLY, len(payload_out))
+                    self.view.log(
+                        f"Sending client lookup response: {found} of {payload_size // UUID_SIZE} clients")
+                    conn.sendall(resp_header + payload_out)
+                elif code == Code.SUBSCRIBE:
+                    if self.model.get_client(client_id) is None:
+                        self.view.log("Subscribe from unknown client")
+                        conn.sendall(framing.reply_header(Code.ERROR, 0))
+                        return
+                    subscriber = self.model.subscribe(client_id, conn, framing)
+                    with subscriber.send_lock:
+                        conn.sendall(framing.reply_header(
+                            Code.SUBSCRIBE_REPLY, 0))
+                    self.view.log(f"Client {client_id.hex()} subscribed")
+                    # Flush whatever was queued before the subscription
+                    for msg in self.model.peek_messages_for(client_id):
+                        if not self.push_message(subscriber, msg):
+                            break
                 else:
                     # Unknown command, send error code with empty payload
-                    self.view.log("Sending error response: " +
-                                  ERROR_RESPONSE_BYTES.hex())
-                    conn.sendall(ERROR_RESPONSE_BYTES)
+                    self.view.log(f"Sending error response to code {code}")
+                    conn.sendall(framing.reply_header(Code.ERROR, 0))
             except Exception as e:
                 self.view.log(f"Exception: {e}")
                 conn.close()
@@ -1,5 +1,9 @@
+import bisect
 import threading
 import time
+from protocol_constants import PENDING_RECORD_HEADER_SIZE
+
+CONTENT_CHUNK_SIZE = 1 << 16
 
 DEFAULT_PORT = 1357
 
@@ -13,18 +17,47 @@ class Client:
 
 
 class Message:
-    def __init__(self, msg_id: int, to_client: bytes, from_client: bytes, msg_type: int, content: bytes):
+    def __init__(self, msg_id: int, to_client: bytes, from_client: bytes, msg_type: int, content, size=None):
         self.msg_id = msg_id
         self.to_client = to_client
         self.from_client = from_client
         self.msg_type = msg_type
+        # Bytes-like, or a temporary file of `size` bytes when spooled
         self.content = content
+        self.spooled = size is not None
+        self.size = size if self.spooled else len(content)
+
+    def write_content(self, sendall):
+        """Sends the content, a chunk at a time when it is spooled."""
+        if not self.spooled:
+            sendall(self.content)
+            return
+        self.content.seek(0)
+        chunk = memoryview(bytearray(CONTENT_CHUNK_SIZE))
+        while True:
+            n = self.content.readinto(chunk)
+            if not n:
+                return
+            sendall(chunk[:n])
+
+    def discard(self):
+        """Frees the content once the message is delivered."""
+        if self.spooled:
+            self.content.close()
+
+
+class Subscriber:
+    def __init__(self, conn, framing):
+        self.conn = conn
+        self.framing = framing  # builds the headers of pushed frames
+        self.send_lock = threading.Lock()  # pushes come from sender threads
 
 
 class ServerModel:
     def __init__(self):
         self.clients = {}  # client_id (bytes) -> Client
         self.messages = []
+        self.subscribers = {}  # client_id (bytes) -> Subscriber
         self.lock = threading.Lock()
         self.next_msg_id = 1
 
@@ -54,6 +87,65 @@ class ServerModel:
                 self.messages.remove(m)
             return msgs_clone
 
+    def take_messages_page(self, client_id: bytes, max_count: int, max_bytes: int):
+        """Removes the oldest queued messages for a client, up to max_count
+        records and max_bytes of packed records (0 means no limit). At least
+        one message is taken so that a large one cannot stall the queue.
+        Returns the page and whether more messages are left."""
+        with self.lock:
+            page = []
+            rest = []
+            size = 0
+            more = False
+            for m in self.messages:
+                if m.to_client != client_id:
+                    rest.append(m)
+                    continue
+                record_size = PENDING_RECORD_HEADER_SIZE + m.size
+                if page and ((max_count and len(page) >= max_count) or
+                             (max_bytes and size + record_size > max_bytes)):
+                    more = True
+                    rest.append(m)
+                    continue
+                page.append(m)
+                size += record_size
+            self.messages = rest
+            return page, more
+
+    def peek_messages_for(self, client_id: bytes):
+        with self.lock:
+            return [m for m in self.messages if m.to_client == client_id]
+
+    def take_message(self, msg: Message):
+        """Removes a queued message, returns False if already delivered."""
+        with self.lock:
+            try:
+                self.messages.remove(msg)
+                return True
+            except ValueError:
+                return False
+
+    def requeue_message(self, msg: Message):
+        """Puts a taken message back in its place, queued by msg_id."""
+        with self.lock:
+            bisect.insort(self.messages, msg, key=lambda m: m.msg_id)
+
+    def subscribe(self, client_id: bytes, conn, framing):
+        with self.lock:
+            subscriber = Subscriber(conn, framing)
+            self.subscribers[client_id] = subscriber
+            return subscriber
+
+    def get_subscriber(self, client_id: bytes):
+        with self.lock:
+            return self.subscribers.get(client_id)
+
+    def unsubscribe(self, conn):
+        with self.lock:
+            for client_id, subscriber in list(self.subscribers.items()):
+                if subscriber.conn is conn:
+                    del self.subscribers[client_id]
+
     @staticmethod
     def get_port_from_file():
         try:
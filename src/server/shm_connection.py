@@ -0,0 +1,148 @@
+import os
+import mmap
+import platform
+import select
+import socket
+import struct
+
+# Must match ShmTransport in the client (shm_transport.hpp)
+MAGIC = 0x4853554d  # "MUSH"
+VERSION = 2
+SEGMENT_HEADER_FORMAT = '<IIQ'
+DATA_OFFSET = 4096
+C2S_HEAD, C2S_TAIL = 64, 128
+S2C_HEAD, S2C_TAIL = 192, 256
+
+COUNTER = struct.Struct('<Q')
+DOORBELL = (1).to_bytes(8, 'little')
+
+
+def shm_supported():
+    # Ring updates below are plain stores, which is only safe on a
+    # total-store-order CPU
+    return platform.machine().lower() in ('x86_64', 'amd64', 'i386', 'i686')
+
+
+class ShmConnection:
+    """Socket-like view of a client's shared-memory rings.
+
+    Implements the subset of the socket API that ServerController uses, so
+    the request handling code is the same for every transport.
+    """
+
+    def __init__(self, sock, segment, doorbells, capacity):
+        self.sock = sock
+        self.segment = segment
+        # Data doorbells are rung after publishing to a ring, space doorbells
+        # after consuming from one, so a full writer sleeps until there is room
+        (self.doorbell,  # rung by the client, data to read
+         self.peer_doorbell,  # rung by us
+         self.space_doorbell,  # rung by the client, room to write
+         self.peer_space_doorbell) = doorbells  # rung by us
+        # Non-blocking: a wakeup for a ring that was already read is dropped
+        for fd in (self.doorbell, self.space_doorbell):
+            os.set_blocking(fd, False)
+        self.capacity = capacity
+        self.rx_data = DATA_OFFSET
+        self.tx_data = DATA_OFFSET + capacity
+
+    @classmethod
+    def accept(cls, sock):
+        """Completes the client's setup handshake, None if it is invalid."""
+        try:
+            _, fds, _, _ = socket.recv_fds(sock, 1, 5)
+            if len(fds) != 5:
+                raise ValueError("expected a segment and four doorbells")
+            (memfd, client_doorbell, server_doorbell, client_space_doorbell,
+             server_space_doorbell) = fds
+            segment = mmap.mmap(memfd, 0)
+            os.close(memfd)
+            magic, version, capacity = struct.unpack_from(
+                SEGMENT_HEADER_FORMAT, segment, 0)
+            if (magic != MAGIC or version != VERSION or
+                    len(segment) < DATA_OFFSET + 2 * capacity):
+                raise ValueError("unsupported segment layout")
+        except (OSError, ValueError):
+            sock.close()
+            return None
+        sock.sendall(b'K')
+        return cls(sock, segment,
+                   (server_doorbell, client_doorbell, server_space_doorbell,
+                    client_space_doorbell), capacity)
+
+    def _load(self, offset):
+        return COUNTER.unpack_from(self.segment, offset)[0]
+
+    def _store(self, offset, value):
+        COUNTER.pack_into(self.segment, offset, value)
+
+    def _wait(self, doorbell):
+        """Sleeps until `doorbell` rings; False once the client is gone."""
+        readable, _, _ = select.select([doorbell, self.sock], [], [])
+        if doorbell in readable:
+            try:
+                os.read(doorbell, 8)
+            except BlockingIOError:
+                pass
+            return True
+        # Nothing is sent on the socket after setup, readable means closed
+        return False
+
+    def recv_into(self, view, nbytes=0):
+        nbytes = nbytes or len(view)
+        head = self._load(C2S_HEAD)
+        while True:
+            available = self._load(C2S_TAIL) - head
+            if available:
+                break
+            if not self._wait(self.doorbell) and \
+                    self._load(C2S_TAIL) == head:
+                return 0
+        offset = head % self.capacity
+        n = min(nbytes, available, self.capacity - offset)
+        start = self.rx_data + offset
+        view[:n] = self.segment[start:start + n]
+        self._store(C2S_HEAD, head + n)
+        # The client may be waiting on a full ring
+        os.write(self.peer_space_doorbell, DOORBELL)
+        return n
+
+    def recv(self, bufsize, flags=0):
+        buf = bytearray(bufsize)
+        view = memoryview(buf)
+        received = self.recv_into(view, bufsize)
+        while flags & socket.MSG_WAITALL and 0 < received < bufsize:
+            n = self.recv_into(view[received:], bufsize - received)
+            if not n:
+                break
+            received += n
+        return bytes(buf[:received])
+
+    def sendall(self, data):
+        data = memoryview(data)
+        tail = self._load(S2C_TAIL)
+        while data:
+            space = self.capacity - (tail - self._load(S2C_HEAD))
+            if not space:
+                os.write(self.peer_doorbell, DOORBELL)
+                if not self._wait(self.space_doorbell):
+                    raise OSError("shm client disconnected")
+                continue
+            offset = tail % self.capacity
+            n = min(len(data), space, self.capacity - offset)
+            start = self.tx_data + offset
+            self.segment[start:start + n] = data[:n]
+            tail += n
+            self._store(S2C_TAIL, tail)
+            data = data[n:]
+        os.write(self.peer_doorbell, DOORBELL)
+
+    def close(self):
+        for fd in (self.doorbell, self.peer_doorbell, self.space_doorbell,
+                   self.peer_space_doorbell):
+            try:
+                os.close(fd)
+            except OSError:
+                pass
+        self.segment.close()
+        self.sock.close()
@@ -0,0 +1,111 @@
+import os
+import struct
+import sys
+import pytest
+
+sys.path.insert(0, os.path.abspath(os.path.join(
+    os.path.dirname(__file__), '../server')))
+
+from framing import Framing, ConnectionClosed, encode_varint, V1, V2  # noqa: E402
+
+CLIENT_A = bytes(range(16))
+CLIENT_B = bytes(range(16, 32))
+
+
+class FakeConn:
+    """Hands out the given chunks, one per recv, like a socket would."""
+
+    def __init__(self, *chunks):
+        self.chunks = [bytes(c) for c in chunks]
+
+    def recv(self, bufsize):
+        if not self.chunks:
+            return b''
+        chunk = self.chunks.pop(0)
+        if len(chunk) > bufsize:
+            self.chunks.insert(0, chunk[bufsize:])
+            chunk = chunk[:bufsize]
+        return chunk
+
+    def recv_into(self, view, nbytes=0):
+        chunk = self.recv(nbytes or len(view))
+        view[:len(chunk)] = chunk
+        return len(chunk)
+
+
+def bytewise(data):
+    return [data[i:i + 1] for i in range(len(data))]
+
+
+def v2_request(token, code, payload_size, bind=None):
+    header = encode_varint(token << 1 | (bind is not None))
+    if bind is not None:
+        header += bind
+    return header + encode_varint(code) + encode_varint(payload_size)
+
+
+@pytest.mark.parametrize('value', [
+    0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 0x1fffff, 0x200000, 0xfffffff,
+    0x10000000, 0xffffffff])
+def test_varint_round_trip(value):
+    encoded = encode_varint(value)
+    assert len(encoded) <= 5
+    assert Framing(FakeConn(encoded)).read_varint() == value
+    # The same split across reads
+    assert Framing(FakeConn(*bytewise(encoded))).read_varint() == value
+
+
+@pytest.mark.parametrize('encoded', [
+    b'\x80\x80\x80\x80\x80',  # no end within 5 bytes
+    b'\x80\x80\x80\x80\x80\x00',
+    b'\x80\x80\x80\x80\x10',  # 2^32
+    b'\xff\xff\xff\xff\x7f',
+])
+def test_varint_rejected(encoded):
+    with pytest.raises(ValueError):
+        Framing(FakeConn(encoded)).read_varint()
+
+
+def test_read_header_v1():
+    framing = Framing(FakeConn(struct.pack('!16sBHI', CLIENT_A, V1, 601, 7)))
+    assert framing.read_header() == (CLIENT_A, V1, 601, 7)
+
+
+def test_read_header_v2_binds_and_reuses_tokens():
+    stream = (v2_request(0, 601, 0, bind=CLIENT_A) +
+              v2_request(1, 603, 300, bind=CLIENT_B) +
+              v2_request(0, 604, 0) +
+              v2_request(1, 602, 16))
+    framing = Framing(FakeConn(stream))
+    framing.version = V2
+    assert framing.read_header() == (CLIENT_A, V2, 601, 0)
+    assert framing.read_header() == (CLIENT_B, V2, 603, 300)
+    assert framing.read_header() == (CLIENT_A, V2, 604, 0)
+    assert framing.read_header() == (CLIENT_B, V2, 602, 16)
+
+
+def test_read_header_v2_split_across_reads():
+    stream = (v2_request(0, 603, 0x12345, bind=CLIENT_A) +
+              v2_request(0, 604, 0))
+    framing = Framing(FakeConn(*bytewise(stream)))
+    framing.version = V2
+    assert framing.read_header() == (CLIENT_A, V2, 603, 0x12345)
+    assert framing.read_header() == (CLIENT_A, V2, 604, 0)
+    with pytest.raises(ConnectionClosed):
+        framing.read_header()
+
+
+def test_read_header_v2_unknown_token():
+    framing = Framing(FakeConn(v2_request(3, 601, 0)))
+    framing.version = V2
+    with pytest.raises(ValueError):
+        framing.read_header()
+
+
+def test_reply_header():
+    framing = Framing(FakeConn())
+    assert framing.reply_header(2101, 300) == struct.pack('!BHI', V1, 2101,
+                                                          300)
+    framing.version = V2
+    assert framing.reply_header(2101, 300) == \
+        encode_varint(2101) + encode_varint(300)
@@ -1,24 +1,46 @@
 import subprocess
 import time
 import os
-import signal
-import tempfile
 import shutil
+import socket
+import struct
 import pytest
 
 SERVER_PATH = os.path.abspath(os.path.join(
-    os.path.dirname(__file__), '../server/simple_server.py'))
-CLIENT_BIN = os.path.abspath(os.path.join(
-    os.path.dirname(__file__), '../client/build/tcp_client'))
+    os.path.dirname(__file__), '../server/server.py'))
+CLIENT_BIN = os.environ.get('MESSAGEU_CLIENT', os.path.abspath(os.path.join(
+    os.path.dirname(__file__), '../client/build/tcp_client')))
+PORT = 12345
+V1_ONLY_PORT = 12346
 
+UUID_SIZE = 16
+CLIENT_NAME_SIZE = 255
+PUBLIC_KEY_SIZE = 160
+ERROR = 9000
 
-@pytest.fixture(scope="module")
-def server():
-    # Start the server as a subprocess
-    proc = subprocess.Popen(
-        ['python3', SERVER_PATH], stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
-    time.sleep(1)  # Give server time to start
-    yield proc
+
+def start_server(directory, port, *args):
+    # The server reads its port from myport.info in its working directory
+    directory.mkdir()
+    (directory / 'myport.info').write_text(f'{port}\n')
+    log = open(directory / 'server.log', 'w')
+    proc = subprocess.Popen(['python3', '-u', SERVER_PATH, *args],
+                            cwd=directory, stdout=log,
+                            stderr=subprocess.STDOUT, text=True)
+    deadline = time.time() + 5
+    while True:
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=1).close()
+            break
+        except OSError:
+            if time.time() > deadline or proc.poll() is not None:
+                proc.kill()
+                raise
+            time.sleep(0.05)
+    return proc, directory / 'server.log'
+
+
+def stop_server(proc):
     proc.terminate()
     try:
         proc.wait(timeout=2)
@@ -26,6 +48,22 @@ def server():
         proc.kill()
 
 
+@pytest.fixture(scope="module")
+def server(tmp_path_factory):
+    proc, log = start_server(tmp_path_factory.mktemp('server') / 'run', PORT)
+    yield log
+    stop_server(proc)
+
+
+@pytest.fixture(scope="module")
+def v1_only_server(tmp_path_factory):
+    # Refuses FRAMING_REQUEST like a server that predates it
+    proc, log = start_server(tmp_path_factory.mktemp('v1_server') / 'run',
+                             V1_ONLY_PORT, '--max-framing', '1')
+    yield log
+    stop_server(proc)
+
+
 @pytest.fixture
 def temp_dir(tmp_path):
     cwd = os.getcwd()
@@ -38,18 +76,124 @@ def temp_dir(tmp_path):
 def server_info_file(temp_dir):
     # Write server.info file for the client
     with open('server.info', 'w') as f:
-        f.write('127.0.0.1:12345\n')
+        f.write(f'127.0.0.1:{PORT}\n')
     return 'server.info'
 
 
 def run_client(commands, cwd):
     # Run the client binary, send commands via stdin, capture stdout
+    if not os.path.exists(CLIENT_BIN):
+        pytest.skip(f"client not built: {CLIENT_BIN} (set MESSAGEU_CLIENT)")
     proc = subprocess.Popen([CLIENT_BIN], stdin=subprocess.PIPE,
                             stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True, cwd=cwd)
     out, _ = proc.communicate('\n'.join(commands) + '\n', timeout=10)
     return out
 
 
+def encode_varint(value):
+    out = bytearray()
+    while value >= 0x80:
+        out.append(value & 0x7f | 0x80)
+        value >>= 7
+    out.append(value)
+    return bytes(out)
+
+
+class RawClient:
+    """Speaks the wire protocol directly, in version 1 framing until
+    negotiate() agrees on another."""
+
+    def __init__(self, port=PORT):
+        self.sock = socket.create_connection(('127.0.0.1', port), timeout=5)
+        self.version = 1
+        self.client_id = bytes(UUID_SIZE)
+        self.bound = False
+
+    def close(self):
+        self.sock.close()
+
+    def recv_exact(self, n):
+        data = b''
+        while len(data) < n:
+            chunk = self.sock.recv(n - len(data))
+            assert chunk, "server closed the connection"
+            data += chunk
+        return data
+
+    def recv_varint(self):
+        value = 0
+        shift = 0
+        while True:
+            byte = self.recv_exact(1)[0]
+            value |= (byte & 0x7f) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    def send(self, code, payload=b''):
+        if self.version == 1:
+            header = struct.pack(f'!{UUID_SIZE}sBHI', self.client_id, 1, code,
+                                 len(payload))
+        else:
+            # Token 0 stands for our id once bound
+            header = encode_varint(0 if self.bound else 1)
+            if not self.bound:
+                header += self.client_id
+                self.bound = True
+            header += encode_varint(code) + encode_varint(len(payload))
+        self.sock.sendall(header + payload)
+
+    def reply(self):
+        """(code, payload) of the next reply."""
+        if self.version == 1:
+            _, code, size = struct.unpack('!BHI', self.recv_exact(7))
+        else:
+            code = self.recv_varint()
+            size = self.recv_varint()
+        return code, self.recv_exact(size)
+
+    def request(self, code, payload=b''):
+        self.send(code, payload)
+        return self.reply()
+
+    def register(self, name):
+        code, payload = self.request(
+            600, name.encode().ljust(CLIENT_NAME_SIZE, b'\0') +
+            public_key(name))
+        assert code == 2100
+        self.client_id = payload
+        return payload
+
+    def negotiate(self, version):
+        code, payload = self.request(608, bytes([version]))
+        if code == 2109:
+            self.version = payload[0]
+        return code, payload
+
+    def send_message(self, dst, content, msg_type=3):
+        code, payload = self.request(
+            603, struct.pack(f'!{UUID_SIZE}sBI', dst, msg_type, len(content)) +
+            content)
+        assert code == 2103
+        return struct.unpack(f'!{UUID_SIZE}sI', payload)[1]
+
+
+def public_key(name):
+    return name.encode().ljust(PUBLIC_KEY_SIZE, b'k')
+
+
+def parse_records(data):
+    """(from, msg_id, type, content) of each pending message record."""
+    records = []
+    header = struct.Struct(f'!{UUID_SIZE}sIBI')
+    while data:
+        from_id, msg_id, msg_type, size = header.unpack_from(data)
+        content = data[header.size:header.size + size]
+        records.append((from_id, msg_id, msg_type, content))
+        data = data[header.size + size:]
+    return records
+
+
 def test_register_and_client_list(server, server_info_file, temp_dir):
     # Register first client in its own dir, then get list
     client1_dir = temp_dir / "client1"
@@ -57,7 +201,7 @@ def test_register_and_client_list(server, server_info_file, temp_dir):
     shutil.copy(server_info_file, client1_dir / "server.info")
     out1 = run_client(['110', 'alice', '120', '0'], client1_dir)
     assert 'Registration successful' in out1
-    assert 'Client list received and saved.' in out1
+    assert 'Client List:' in out1
 
     # Register second client in its own dir, then get list
     client2_dir = temp_dir / "client2"
@@ -65,5 +209,106 @@ def test_register_and_client_list(server, server_info_file, temp_dir):
     shutil.copy(server_info_file, client2_dir / "server.info")
     out2 = run_client(['110', 'bob', '120', '0'], client2_dir)
     assert 'Registration successful' in out2
-    assert 'Client list received and saved.' in out2
+    assert 'Client List:' in out2
     assert "alice" in out2
+
+    # The client asked for version 2 framing and got it
+    assert 'Switched to framing version 2' in server.read_text()
+
+
+def test_client_falls_back_to_v1(v1_only_server, temp_dir):
+    (temp_dir / 'server.info').write_text(f'127.0.0.1:{V1_ONLY_PORT}\n')
+    out = run_client(['110', 'carol', '120', '0'], temp_dir)
+    assert 'Registration successful' in out
+    assert 'Client List:' in out
+    assert 'Switched to framing' not in v1_only_server.read_text()
+
+
+def test_framing_negotiation(server):
+    client = RawClient()
+    client.register('frank')
+    assert client.negotiate(2) == (2109, bytes([2]))
+    assert client.version == 2
+    # First request binds the id, the next ones send the token only
+    for _ in range(2):
+        code, _ = client.request(601)
+        assert code == 2101
+    client.close()
+
+
+def test_framing_v1_only_server(v1_only_server):
+    client = RawClient(V1_ONLY_PORT)
+    client.register('gina')
+    assert client.negotiate(2) == (ERROR, b'')
+    code, _ = client.request(601)
+    assert code == 2101
+    client.close()
+
+
+@pytest.mark.parametrize('version', [0, 1])
+def test_framing_request_below_v2(server, version):
+    client = RawClient()
+    client.register(f'henry{version}')
+    code, payload = client.negotiate(version)
+    if version == 0:
+        assert code == ERROR
+    else:
+        assert (code, payload) == (2109, bytes([1]))
+    # Still in version 1 framing
+    assert client.version == 1
+    code, _ = client.request(601)
+    assert code == 2101
+    client.close()
+
+
+def test_subscribe_and_push(server):
+    sender = RawClient()
+    sender.register('ivan')
+    receiver = RawClient()
+    receiver_id = receiver.register('judy')
+    assert receiver.request(605) == (2105, b'')
+
+    msg_id = sender.send_message(receiver_id, b'hello')
+    code, payload = receiver.reply()
+    assert code == 2106
+    assert parse_records(payload) == [(sender.client_id, msg_id, 3,
+                                       b'hello')]
+    # Delivered, so no longer pending
+    assert receiver.request(604) == (2104, b'')
+    sender.close()
+    receiver.close()
+
+
+def test_pending_pages(server):
+    sender = RawClient()
+    sender.register('karl')
+    receiver = RawClient()
+    receiver_id = receiver.register('lena')
+    ids = [sender.send_message(receiver_id, f'm{i}'.encode())
+           for i in range(3)]
+
+    code, payload = receiver.request(606, struct.pack('!II', 2, 0))
+    assert code == 2107 and payload[0] == 1
+    assert [r[1] for r in parse_records(payload[1:])] == ids[:2]
+    code, payload = receiver.request(606, struct.pack('!II', 2, 0))
+    assert code == 2107 and payload[0] == 0
+    assert [r[1] for r in parse_records(payload[1:])] == ids[2:]
+    sender.close()
+    receiver.close()
+
+
+def test_client_lookup(server):
+    client = RawClient()
+    client.register('mona')
+    other = RawClient()
+    other_id = other.register('nick')
+
+    unknown = bytes([0xff] * UUID_SIZE)
+    code, payload = client.request(607, other_id + unknown)
+    assert code == 2108
+    assert payload == (other_id + b'nick'.ljust(CLIENT_NAME_SIZE, b'\0') +
+                       public_key('nick'))
+    # Malformed: not a whole number of ids
+    assert client.request(607, b'\0')[0] == ERROR
+    client.close()
+    other.close()